@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <vector>
+
+namespace flash {
+
+// Page-aligned heap buffer, suitable for O_DIRECT I/O.
+class AlignedBuffer {
+public:
+    AlignedBuffer() = default;
+    explicit AlignedBuffer(size_t size);
+    ~AlignedBuffer();
+
+    AlignedBuffer(const AlignedBuffer&) = delete;
+    AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+    AlignedBuffer(AlignedBuffer&& other) noexcept;
+    AlignedBuffer& operator=(AlignedBuffer&& other) noexcept;
+
+    std::uint8_t* data() { return data_; }
+    const std::uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    std::span<std::uint8_t> span() { return {data_, size_}; }
+
+    static size_t PageSize();
+
+private:
+    std::uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Keeps released buffers around so back-to-back components reuse the same
+// memory instead of faulting in fresh pages each time. Thread-safe.
+class AlignedBufferPool {
+public:
+    explicit AlignedBufferPool(size_t max_cached = 16) : max_cached_(max_cached) {}
+
+    AlignedBuffer Acquire(size_t size);
+    void Release(AlignedBuffer buf);
+
+    static AlignedBufferPool& Shared();
+
+private:
+    std::mutex mu_;
+    std::vector<AlignedBuffer> cache_;
+    size_t max_cached_;
+};
+
+} // namespace flash
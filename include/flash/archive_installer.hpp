@@ -10,16 +10,34 @@
 
 namespace flash {
 
+class DurabilityPolicy;
+class TreeSink;
+
 class ArchiveInstaller {
 public:
     struct Options {
         bool progress = true;
         std::uint64_t progress_interval_bytes = 4 * 1024 * 1024ULL;
+        // Unsafe paths ("..", absolute after normalising) fail the install;
+        // when false they are skipped with a warning.
         bool safe_paths_only = true;
+        // Threads creating and writing small files while this thread parses
+        // the archive; 0 => one per online CPU, 1 => no pool.
+        unsigned extract_workers = 0;
+        // Reserve extents of regular files from their tar header size.
+        bool preallocate = true;
+        // Flushes the extracted tree as the policy asks (one syncfs, or a
+        // deferred one); null => no explicit flush.
+        DurabilityPolicy* durability = nullptr;
 
         std::string mount_base_dir = "/mnt";
         std::string mount_prefix = "ota-";
         std::string fs_type = "ext4";
+        // "ext4": build a fresh filesystem on the target from the archive
+        // (see Ext4Builder) instead of mounting it and extracting into what
+        // is there. Everything on the target is replaced. The target may
+        // also be an image file. Empty => mount and extract.
+        std::string mkfs;
 
         // Keep header portable: do NOT reference MS_* macros here.
         unsigned long mount_flags = 0;
@@ -34,6 +52,8 @@ private:
     Options opt_{};
 
     Result ExtractTarStreamToDir(IReader& tar_stream, const std::string& dst_dir, std::string_view tag);
+    Result BuildFilesystem(IReader& tar_stream, const std::string& target, std::string_view tag);
+    Result ExtractTarStream(IReader& tar_stream, TreeSink& sink, const std::string& where, std::string_view tag);
 };
 
 } // namespace flash
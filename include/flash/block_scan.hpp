@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+
+namespace flash {
+
+// True when every byte in `data` is zero. SSE2 on x86-64, NEON on aarch64,
+// word-at-a-time otherwise.
+bool IsAllZero(std::span<const std::uint8_t> data);
+
+// True when `a` and `b` have the same size and contents. Same vector paths as
+// IsAllZero().
+bool IsEqual(std::span<const std::uint8_t> a, std::span<const std::uint8_t> b);
+
+} // namespace flash
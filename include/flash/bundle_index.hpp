@@ -0,0 +1,78 @@
+#pragma once
+
+#include "flash/fd.hpp"
+#include "flash/io.hpp"
+#include "flash/result.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <expected>
+#include <string>
+#include <vector>
+
+namespace flash {
+
+// Optional bundle index: a tar entry named kBundleIndexName placed right
+// after manifest.json. It records where each entry's data starts in the
+// bundle file, so a file bundle can be installed in any order, partially,
+// or with per-component retries. Readers that don't know it just see one
+// more unmatched entry; plain tar bundles stay fully supported.
+//
+//   {"format": "flash-bundle-index-1",
+//    "entries": [{"name": "rootfs.img.zst", "offset": 2048, "size": 123,
+//                 "compression": "zstd", "sha256": "..."}]}
+inline constexpr const char* kBundleIndexName = "bundle.index.json";
+
+struct BundleIndexEntry {
+    std::string name;
+    std::uint64_t offset = 0;  // first data byte within the bundle file
+    std::uint64_t size = 0;    // stored (entry) bytes
+    std::string compression;   // as sniffed when the bundle was written
+    std::string sha256;        // of the stored bytes; may be empty
+};
+
+struct BundleIndex {
+    std::vector<BundleIndexEntry> entries;
+
+    const BundleIndexEntry* Find(const std::string& name) const;
+
+    static std::expected<BundleIndex, std::string> Parse(const std::string& json);
+    std::string ToJson() const;
+};
+
+// Checks that `e` really points at the data of a tar entry with that name
+// and size in the bundle open as `fd`, so a stale index cannot install
+// the wrong bytes.
+Result VerifyIndexEntry(int fd, const BundleIndexEntry& e);
+
+// Indexes a bundle without bundle.index.json by walking its tar headers
+// (ustar, pax and GNU long names). Entries carry no sha256/compression.
+// Fails with EBADMSG if `fd` is not an uncompressed tar.
+Result ScanTarIndex(int fd, BundleIndex& out);
+
+// Writes a ustar bundle: manifest.json, the index, then `files` (stored
+// under their base names) in order.
+Result WriteIndexedBundle(const std::string& out_path, const std::string& manifest_path,
+                          const std::vector<std::string>& files);
+
+// Reads [offset, offset + size) of a file with pread; seekable within
+// the range.
+class RangeReader final : public IReader {
+public:
+    static Result Open(const std::string& path, std::uint64_t offset, std::uint64_t size, RangeReader& out);
+
+    ssize_t Read(std::span<std::uint8_t> out) override;
+    std::optional<std::uint64_t> TotalSize() const override { return size_; }
+    bool Seekable() const override { return true; }
+    std::int64_t Seek(std::int64_t offset, int whence) override;
+    bool KernelSource(FdSource& out) override;
+    void Consumed(std::uint64_t n) override { pos_ = std::min(size_, pos_ + n); }
+
+private:
+    Fd fd_;
+    std::uint64_t base_ = 0;
+    std::uint64_t size_ = 0;
+    std::uint64_t pos_ = 0;
+};
+
+} // namespace flash
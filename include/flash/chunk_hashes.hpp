@@ -0,0 +1,86 @@
+#pragma once
+
+#include "flash/io.hpp"
+#include "flash/result.hpp"
+#include "flash/sha256.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace flash {
+
+struct Component;
+
+// SHA-256 of each fixed-size chunk of the image a raw component installs,
+// from the manifest's "chunks": {"size": <bytes>, "sha256": ["<hex>", ...]}.
+// Chunk i covers [i * size, (i + 1) * size) of the image; the last one may
+// be short. The manifest is verified as a whole, so a flat list needs no
+// Merkle tree on top.
+struct ChunkHashes {
+    std::uint64_t chunk_bytes = 0;
+    std::vector<Sha256Digest> digests;
+
+    bool Empty() const { return digests.empty(); }
+
+    // [begin, end) of chunk `i` in an image of `image_bytes`.
+    std::uint64_t Begin(std::size_t i) const { return std::uint64_t{i} * chunk_bytes; }
+    std::uint64_t End(std::size_t i, std::uint64_t image_bytes) const;
+
+    // Fails (EBADMSG) unless the list fits an image of `image_bytes`.
+    Result CheckLength(std::uint64_t image_bytes) const;
+
+    // Parses the component's list; none declared gives Empty().
+    static Result FromComponent(const Component& comp, ChunkHashes& out);
+};
+
+// Reads [0, image_bytes) of `path` back and hashes its chunks on `threads`
+// threads (0 => one per CPU). The indices of the chunks that differ go to
+// `bad`, in order; the result fails (EIO) when there are any.
+Result VerifyChunks(const std::string& path, const ChunkHashes& hashes, std::uint64_t image_bytes,
+                    unsigned threads, std::vector<std::size_t>* bad = nullptr);
+
+// Writer adapter that hashes the image as it passes and checks every chunk
+// as soon as its last byte arrives, before handing that byte on, so a
+// corrupt payload stops the install at the first bad chunk instead of after
+// the whole image. Skipped ranges (a resumed image, sparse "don't care"
+// chunks) are not seen; the chunks they touch are left to VerifyChunks().
+class ChunkVerifyWriter final : public IWriter {
+public:
+    // `offset`: where in the image the writes start (a resumed image); the
+    // chunks before it count as unchecked.
+    ChunkVerifyWriter(IWriter& inner, const ChunkHashes& hashes, std::uint64_t offset = 0);
+
+    Result WriteAll(std::span<const std::uint8_t> in) override;
+    Result WriteZeroes(std::uint64_t len) override;
+    Result Skip(std::uint64_t len) override;
+    Result FsyncNow() override { return inner_.FsyncNow(); }
+    Result FsyncAsync() override { return inner_.FsyncAsync(); }
+
+    // End of the image: checks the last chunk and the image length.
+    Result Finish();
+
+    std::uint64_t ImageBytes() const { return offset_; }
+    std::size_t ChunksVerified() const { return verified_; }
+    std::size_t ChunksUnchecked() const { return unchecked_; }
+
+private:
+    // Bytes left in the current chunk.
+    std::uint64_t Room() const { return hashes_.chunk_bytes - offset_ % hashes_.chunk_bytes; }
+    // Hashes `in`, which does not cross a chunk boundary; checks the chunk
+    // when it ends exactly with `in` or `last` is set.
+    Result Hash(std::span<const std::uint8_t> in, bool last = false);
+    Result EndChunk();
+
+    IWriter& inner_;
+    const ChunkHashes& hashes_;
+    Sha256 ctx_;
+    std::uint64_t offset_ = 0;
+    bool skipped_ = false;  // part of the current chunk was skipped
+    std::size_t verified_ = 0;
+    std::size_t unchecked_ = 0;
+};
+
+} // namespace flash
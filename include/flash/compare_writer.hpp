@@ -0,0 +1,109 @@
+#pragma once
+
+#include "flash/aligned_buffer.hpp"
+#include "flash/fd.hpp"
+#include "flash/io.hpp"
+#include "flash/result.hpp"
+#include "flash/sha256.hpp"
+#include "flash/spsc_ring.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace flash {
+
+// Writer adapter for reinstalling a mostly unchanged image. A read-ahead
+// thread streams the current contents of the target; blocks that already
+// match are passed to the inner writer as Skip() and only differing blocks
+// are written. The inner writer must open the target without truncating it.
+//
+// The adapter also hashes the intended image so VerifyTarget() can read the
+// target back after the final flush and confirm it matches.
+class CompareWriter final : public IWriter {
+public:
+    struct Options {
+        // Compare/skip granularity; must be a multiple of the inner writer's
+        // alignment so skips never fall back to writing.
+        std::size_t block_bytes = 4096;
+        std::size_t readahead_bytes = 4 * 1024 * 1024;
+        std::size_t readahead_depth = 4;
+    };
+
+    explicit CompareWriter(IWriter& inner) : CompareWriter(inner, Options{}) {}
+    CompareWriter(IWriter& inner, Options opt);
+    ~CompareWriter() override;
+
+    CompareWriter(const CompareWriter&) = delete;
+    CompareWriter& operator=(const CompareWriter&) = delete;
+
+    // Starts reading the current contents of `path` ahead of the writer.
+    Result Open(const std::string& path);
+
+    Result WriteAll(std::span<const std::uint8_t> in) override;
+    Result WriteZeroes(std::uint64_t len) override;
+    Result Skip(std::uint64_t len) override;
+    Result FsyncNow() override;
+    Result FsyncAsync() override;
+
+    // The target was opened without truncation: a regular file that is
+    // longer than the image written through this adapter is cut back to the
+    // image's length (and fsynced). Call after the final FsyncNow().
+    Result TrimTarget();
+
+    // Reads the target back (bypassing cached pages where the kernel allows)
+    // and compares it with the image written through this adapter; a regular
+    // file must also be exactly as long. Call after the final FsyncNow().
+    Result VerifyTarget();
+
+    std::uint64_t BlocksTotal() const { return blocks_total_; }
+    std::uint64_t BlocksSkipped() const { return blocks_skipped_; }
+    std::size_t BlockBytes() const { return opt_.block_bytes; }
+
+private:
+    struct Chunk {
+        AlignedBuffer buf;
+        std::size_t n = 0;
+        int err = 0;
+    };
+
+    enum class Pending { None, Skip, Zero };
+
+    void Prefetch();
+    void Stop();
+    // Consumes `len` bytes of old contents; true if they equal `expect`
+    // (nullptr => zeros). Missing or unreadable old bytes never match.
+    bool ConsumeOld(std::size_t len, const std::uint8_t* expect, bool hash);
+    Result Process(std::span<const std::uint8_t> in, bool zeros);
+    Result Queue(Pending kind, std::uint64_t len);
+    Result FlushPending();
+    Result FlushCarry();
+
+    IWriter& inner_;
+    Options opt_;
+    std::string path_;
+    Fd fd_;
+
+    std::vector<Chunk> chunks_;
+    std::unique_ptr<SpscRing<Chunk*>> free_;
+    std::unique_ptr<SpscRing<Chunk*>> filled_;
+    std::thread prefetch_;
+    Chunk* cur_ = nullptr;
+    std::size_t cur_pos_ = 0;
+    bool old_eof_ = false;
+
+    std::uint64_t offset_ = 0;
+    std::vector<std::uint8_t> carry_;  // partial block waiting for more input
+    Pending pending_ = Pending::None;
+    std::uint64_t pending_len_ = 0;
+
+    std::unique_ptr<AsyncSha256> image_hash_;
+    std::uint64_t blocks_total_ = 0;
+    std::uint64_t blocks_skipped_ = 0;
+};
+
+} // namespace flash
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+
+namespace flash {
+
+// gzip/zlib CRC-32: Crc32(Crc32(0, a), b) == crc32 of a followed by b, same
+// values as zlib's crc32(). PCLMULQDQ folding on x86-64, the ARMv8 CRC32
+// instructions on aarch64, zlib otherwise; picked once at runtime.
+std::uint32_t Crc32(std::uint32_t crc, std::span<const std::uint8_t> data);
+
+const char* Crc32Backend();
+
+} // namespace flash
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "flash/inflater.hpp"
+#include "flash/io.hpp"
+#include "flash/result.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string_view>
+
+namespace flash {
+
+enum class Compression { None, Gzip, Zstd, Xz, Lz4 };
+
+struct DecompressOptions {
+    // Workers for payloads that can be decoded in parallel (BGZF gzip,
+    // multi-block xz);
+    // 0 => one per CPU, 1 => always decode on the reading thread.
+    unsigned threads = 0;
+    // Upper bound on compressed input plus decoded output a parallel decoder
+    // keeps in flight.
+    std::size_t window_bytes = 32 * 1024 * 1024;
+    // Deflate implementation for gzip payloads.
+    InflateBackend inflate_backend = InflateBackend::Auto;
+    // xz decoder memory: above this it uses fewer threads (0 => a quarter of
+    // RAM); decoding fails past xz_memlimit_stop (0 => no limit).
+    std::uint64_t xz_memlimit_threading = 0;
+    std::uint64_t xz_memlimit_stop = 0;
+};
+
+const char* CompressionName(Compression c);
+
+// Manifest spelling ("gzip", "zstd", "xz", "lz4", "none"); false if unknown.
+bool ParseCompression(std::string_view name, Compression& out);
+
+// Identifies the container from the first bytes of a stream. Anything that
+// does not carry a known magic is treated as uncompressed.
+Compression SniffCompression(std::span<const std::uint8_t> head);
+
+// Wraps `reader` in the matching decompressor. With `forced` unset the format
+// is sniffed from the stream (the sniffed bytes are not lost). Fails with
+// ENOTSUP for formats this build cannot decode.
+Result OpenDecompressor(std::unique_ptr<IReader>& reader, const DecompressOptions& opt = {},
+                        const Compression* forced = nullptr, Compression* detected = nullptr);
+
+} // namespace flash
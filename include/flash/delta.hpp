@@ -0,0 +1,85 @@
+#pragma once
+
+#include "flash/fd.hpp"
+#include "flash/io.hpp"
+#include "flash/result.hpp"
+#include "flash/sha256.hpp"
+
+#include <cstdint>
+#include <span>
+#include <string>
+
+namespace flash {
+
+// Block delta payload ("delta" components). Integers are little-endian.
+//
+//   header  "FLDELTA1" | u64 target_size | u8[32] sha256 of the target image
+//   ops     0x01 COPY  u64 src_offset u64 len   bytes from the delta source
+//           0x02 DATA  u64 len, then len bytes  literal bytes
+//           0x03 ZERO  u64 len                  zero bytes
+//           0x00 END                            after exactly target_size bytes
+//
+// Ops produce the target image front to back, so it can be written
+// sequentially to the inactive slot while COPY reads from the active one.
+namespace delta {
+constexpr char kMagic[8] = {'F', 'L', 'D', 'E', 'L', 'T', 'A', '1'};
+constexpr std::size_t kHeaderBytes = 8 + 8 + 32;
+constexpr std::uint8_t kOpEnd = 0x00;
+constexpr std::uint8_t kOpCopy = 0x01;
+constexpr std::uint8_t kOpData = 0x02;
+constexpr std::uint8_t kOpZero = 0x03;
+} // namespace delta
+
+struct DeltaStats {
+    std::uint64_t copy_bytes = 0;
+    std::uint64_t data_bytes = 0;
+    std::uint64_t zero_bytes = 0;
+    std::uint64_t ops = 0;
+};
+
+// Decodes a delta payload against `source_path` into the target image stream.
+// Memory use is bounded by the caller's buffers. At the END op the image's
+// sha256 is checked against the header; any failure makes Read() return -1
+// with errno set and the reason in Error().
+class DeltaReader final : public IReader {
+public:
+    static Result Open(IReader& payload, std::string source_path, DeltaReader& out);
+
+    ssize_t Read(std::span<std::uint8_t> out) override;
+    std::optional<std::uint64_t> TotalSize() const override;
+
+    const std::string& Error() const { return error_; }
+    const DeltaStats& Stats() const { return stats_; }
+
+private:
+    bool ReadExact(std::uint8_t* p, std::size_t len);
+    bool ReadHeader();
+    bool NextOp();
+    ssize_t Fail(int err, std::string msg);
+
+    IReader* payload_ = nullptr;
+    std::string source_path_;
+    Fd source_;
+
+    bool have_header_ = false;
+    bool done_ = false;
+    std::uint64_t target_size_ = 0;
+    Sha256Digest expected_{};
+    Sha256 hash_;
+    std::uint64_t produced_ = 0;
+
+    std::uint8_t op_ = delta::kOpEnd;
+    std::uint64_t op_left_ = 0;
+    std::uint64_t src_off_ = 0;
+
+    std::string error_;
+    DeltaStats stats_;
+};
+
+// Builds a delta that turns `source_path` into `target_path`, working in
+// `block_bytes` blocks: zero blocks become ZERO, blocks found anywhere in the
+// source become COPY, the rest DATA. Adjacent ops are merged.
+Result BuildDelta(const std::string& source_path, const std::string& target_path, IWriter& out,
+                  DeltaStats* stats = nullptr, std::size_t block_bytes = 4096);
+
+} // namespace flash
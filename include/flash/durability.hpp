@@ -0,0 +1,82 @@
+#pragma once
+
+#include "flash/result.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace flash {
+
+// When installed data is forced to stable storage.
+//
+//   Interval   fsync every fsync_interval_bytes and at the end of each raw or
+//              file component; one syncfs per archive component (default).
+//   Component  one fsync per raw/file component, one syncfs per archive.
+//   Final      no flushes while installing, except the fdatasync a file
+//              component's new file gets before it is renamed over the old
+//              one; one syncfs per target filesystem and one fsync per
+//              target block device right before the install is reported
+//              as done.
+enum class DurabilityMode { Interval, Component, Final };
+
+const char* DurabilityModeName(DurabilityMode mode);
+bool ParseDurabilityMode(std::string_view name, DurabilityMode& out);
+
+// Shared by every component of one install (and by their threads): decides
+// which flushes happen, collects the targets Final mode flushes at the end,
+// and accounts the wall time spent blocked in flushes.
+class DurabilityPolicy {
+public:
+    struct Stats {
+        std::uint64_t flushes = 0;
+        std::uint64_t flush_ns = 0;
+    };
+
+    explicit DurabilityPolicy(DurabilityMode mode = DurabilityMode::Interval) : mode_(mode) {}
+
+    DurabilityPolicy(const DurabilityPolicy&) = delete;
+    DurabilityPolicy& operator=(const DurabilityPolicy&) = delete;
+
+    DurabilityMode Mode() const { return mode_; }
+    bool IntervalFlushes() const { return mode_ == DurabilityMode::Interval; }
+    bool ComponentFlushes() const { return mode_ != DurabilityMode::Final; }
+
+    // Runs `flush` and charges its wall time to the stats.
+    Result Timed(const std::function<Result()>& flush);
+
+    // syncfs() of the filesystem holding `path`.
+    Result SyncFilesystem(const std::string& path);
+
+    // Final mode: remembers `path` for FlushAll(). Block devices get an fsync
+    // of their own; anything else a syncfs of its filesystem, once per
+    // filesystem.
+    Result Defer(const std::string& path);
+    Result FlushAll();
+
+    Stats GetStats() const {
+        return {flushes_.load(std::memory_order_relaxed), flush_ns_.load(std::memory_order_relaxed)};
+    }
+
+private:
+    struct Target {
+        std::string path;
+        bool block_device = false;
+        dev_t dev = 0;
+    };
+
+    DurabilityMode mode_;
+    std::atomic<std::uint64_t> flushes_{0};
+    std::atomic<std::uint64_t> flush_ns_{0};
+
+    std::mutex mu_;
+    std::vector<Target> deferred_;
+};
+
+} // namespace flash
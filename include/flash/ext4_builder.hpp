@@ -0,0 +1,175 @@
+#pragma once
+
+#include "flash/fd.hpp"
+#include "flash/result.hpp"
+#include "flash/tree_writer.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace flash {
+
+// Builds a fresh ext4 filesystem on a block device (or image file) straight
+// from archive entries, the way `mke2fs -d` populates one, without mounting
+// anything. File data is laid out in arrival order and goes out as large
+// sequential writes; inodes, directories and allocation bitmaps are kept in
+// memory and written in Finish(), the primary superblock last.
+//
+// Layout: 4 KiB blocks, 256-byte inodes, flex_bg with all bitmaps and inode
+// tables packed behind the primary group descriptors, extents, an internal
+// journal, sparse superblock backups and uninit_bg (unused inode table
+// blocks are left to the kernel's lazy init). No resize inode, no xattrs.
+//
+// Owners, modes (set-id bits included) and times come from the archive.
+// Parent directories missing from the archive are created 0755 root:root.
+// A later entry for an existing path replaces it, except that a directory
+// is only merged with another directory.
+class Ext4Builder final : public TreeSink {
+public:
+    struct Options {
+        // Bytes of filesystem per inode (mke2fs -i).
+        std::uint64_t inode_ratio = 16384;
+        // Blocks reserved for root, in percent (mke2fs -m).
+        unsigned reserved_percent = 5;
+        bool journal = true;
+        std::string label;
+        // Consecutive data blocks are collected up to this size per write.
+        std::size_t write_buffer_bytes = 4 * 1024 * 1024;
+    };
+
+    // Takes the whole of `target`: a block device (opened O_EXCL, so one
+    // that is mounted is refused) or an existing regular file of the
+    // intended image size.
+    static Result Open(const std::string& target, Options opt, std::unique_ptr<Ext4Builder>& out);
+    ~Ext4Builder() override;
+
+    Ext4Builder(const Ext4Builder&) = delete;
+    Ext4Builder& operator=(const Ext4Builder&) = delete;
+
+    Result Directory(const std::string& rel, const TreeEntryMeta& m) override;
+    Result Symlink(const std::string& rel, const std::string& target, const TreeEntryMeta& m) override;
+    Result Hardlink(const std::string& rel, const std::string& target_rel) override;
+    Result Special(const std::string& rel, const TreeEntryMeta& m) override;
+
+    Result BeginFile(const std::string& rel, const TreeEntryMeta& m) override;
+    Result FileData(std::span<const std::uint8_t> data, std::int64_t offset) override;
+    Result EndFile() override;
+
+    // Writes directories and all metadata. Syncs once, before the primary
+    // superblock and descriptors go out; the final flush is Sync().
+    Result Finish() override;
+    // fsync of the target.
+    Result Sync();
+
+    std::uint64_t FilesWritten() const override { return files_; }
+    std::uint64_t BlocksCount() const { return blocks_; }
+
+private:
+    struct Extent {
+        std::uint32_t logical;
+        std::uint32_t physical;
+        std::uint32_t len;
+    };
+    struct DirEntry {
+        std::string name;
+        std::uint32_t ino;
+        std::uint8_t type;
+    };
+    struct Inode {
+        std::uint16_t mode = 0;
+        std::uint32_t uid = 0;
+        std::uint32_t gid = 0;
+        std::uint64_t size = 0;
+        std::uint32_t links = 0;
+        std::uint32_t flags = 0;
+        std::uint64_t blocks = 0;  // 4 KiB blocks, extent tree included
+        timespec atime{};
+        timespec mtime{};
+        std::uint8_t iblock[60] = {};
+        std::vector<Extent> extents;
+        std::vector<std::uint32_t> tree_blocks;  // extent index/leaf blocks
+    };
+    struct Dir {
+        std::uint32_t parent = 0;
+        std::vector<DirEntry> entries;  // ino 0 => removed
+        std::unordered_map<std::string, std::size_t> names;
+    };
+    struct OpenFile {
+        std::uint32_t ino = 0;
+        std::uint64_t size = 0;  // from the header
+        std::uint64_t end = 0;
+        std::int64_t partial_block = -1;
+        std::vector<std::uint8_t> partial;
+    };
+
+    Ext4Builder() = default;
+
+    Result Layout(std::uint64_t bytes);
+    bool HasSuper(std::uint32_t group) const;
+    std::uint32_t ReservedEnd(std::uint32_t block) const;
+    std::uint32_t NextReserved(std::uint32_t block) const;
+    Result AllocRun(std::uint32_t want, std::uint32_t& start, std::uint32_t& got);
+    Result AllocContiguous(std::uint32_t count, std::uint32_t& start);
+    void MarkBlocks(std::uint32_t start, std::uint32_t count, bool used);
+
+    Result NewInode(std::uint16_t mode, const TreeEntryMeta& m, std::uint32_t& ino);
+    Inode& Node(std::uint32_t ino) { return inodes_[ino - 1]; }
+    Result LookupDir(const std::string& rel, std::uint32_t& ino);
+    Result Link(const std::string& rel, std::uint32_t ino);
+    void Unlink(std::uint32_t ino);
+
+    Result WriteBlocks(std::uint32_t start, const std::uint8_t* data, std::uint32_t count);
+    Result FlushWrites();
+    Result PWrite(const void* data, std::size_t len, std::uint64_t off);
+    Result ZeroBlocks(std::uint32_t start, std::uint32_t count);
+
+    void AddExtent(Inode& node, std::uint32_t logical, std::uint32_t physical, std::uint32_t count);
+    Result AppendData(Inode& node, std::uint32_t logical, const std::uint8_t* data, std::uint32_t count);
+    Result FlushPartial();
+    Result BuildExtentTree(Inode& node);
+    Result WriteDirectory(std::uint32_t ino);
+    Result CreateJournal();
+    void EncodeInode(std::uint32_t ino, std::uint8_t* out) const;
+    void EncodeSuper(std::uint8_t* out, std::uint32_t group, std::uint32_t free_blocks,
+                     std::uint32_t free_inodes) const;
+    Result WriteMetadata();
+
+    Options opt_;
+    std::string path_;
+    Fd fd_;
+
+    // Geometry.
+    std::uint32_t blocks_ = 0;
+    std::uint32_t groups_ = 0;
+    std::uint32_t inodes_per_group_ = 0;
+    std::uint32_t itable_blocks_ = 0;
+    std::uint32_t gdt_blocks_ = 0;
+    std::vector<std::uint32_t> block_bitmap_at_;  // per group
+    std::vector<std::uint32_t> inode_bitmap_at_;
+    std::vector<std::uint32_t> inode_table_at_;
+    bool journal_ = false;
+    std::uint8_t uuid_[16] = {};
+    std::uint32_t hash_seed_[4] = {};
+    std::uint32_t now_ = 0;
+
+    // Allocation: one bit per block, the on-disk bitmaps back to back.
+    std::vector<std::uint8_t> block_bitmap_;
+    std::uint32_t cursor_ = 0;
+    std::vector<Inode> inodes_;  // inode n at [n - 1]
+    std::unordered_map<std::uint32_t, Dir> dirs_;
+    std::unordered_map<std::string, std::uint32_t> paths_;
+    OpenFile cur_;
+    bool in_file_ = false;
+    std::uint64_t files_ = 0;
+
+    // Write combining for the data stream.
+    std::vector<std::uint8_t> wbuf_;
+    std::uint32_t wbuf_start_ = 0;
+    std::uint32_t wbuf_blocks_ = 0;
+};
+
+} // namespace flash
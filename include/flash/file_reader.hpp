@@ -18,10 +18,20 @@ public:
     std::optional<std::uint64_t> TotalSize() const override;
     ssize_t Read(std::span<std::uint8_t> out) override;
 
+    // True for regular files, including stdin redirected from one.
+    bool Seekable() const override { return seekable_; }
+    std::int64_t Seek(std::int64_t offset, int whence) override;
+
+    // Regular files and pipes.
+    bool KernelSource(FdSource& out) override;
+    void Consumed(std::uint64_t n) override;
+
 private:
     std::string path_;
     Fd fd_;
     std::optional<std::uint64_t> size_;
+    bool seekable_ = false;
+    bool pipe_ = false;
 };
 
 } // namespace flash
@@ -1,26 +1,123 @@
 #pragma once
 
+#include "flash/inflater.hpp"
 #include "flash/io.hpp"
-#include <zlib.h>
+#include "flash/result.hpp"
+
+#include <cstdint>
 #include <memory>
+#include <mutex>
+#include <span>
+#include <string>
 #include <vector>
 
 namespace flash {
 
+// A place in a gzip stream where decoding can start again (zlib's zran):
+// a deflate block boundary, with what the decoder needs to continue.
+struct GzipAccessPoint {
+    std::uint64_t out = 0;      // uncompressed offset
+    std::uint64_t in = 0;       // compressed bytes before the point, the partial byte included
+    int bits = 0;               // bits of the byte at in - 1 that belong to the next block
+    std::uint8_t byte = 0;      // that byte
+    std::uint64_t members = 0;  // complete members before the point
+    std::uint32_t crc = 0;      // CRC32 and ISIZE of the current member so far
+    std::uint32_t size = 0;
+    std::vector<std::uint8_t> window;  // up to 32 KiB of the member's preceding output
+};
+
+// Access points in stream order. On disk: a magic, then one record per
+// point with its own CRC32, so the file can be appended to as points are
+// found and a torn last record is simply dropped.
+struct GzipIndex {
+    std::vector<GzipAccessPoint> points;
+
+    // Last point at or before uncompressed offset `out`; null if none.
+    const GzipAccessPoint* Before(std::uint64_t out) const;
+
+    static Result Load(const std::string& path, GzipIndex& out);
+    // Appends `points` to `path` (created when missing) and fsyncs it.
+    static Result Append(const std::string& path, std::span<const GzipAccessPoint> points);
+};
+
+// Streaming gzip decoder. Parses the gzip framing itself, so concatenated
+// members are decoded back to back and every member's CRC32 (hardware where
+// available) and ISIZE are checked; the deflate data goes through the chosen
+// Inflater backend. The input buffer starts at 64 KiB and doubles up to
+// 1 MiB while the source keeps filling it.
+//
+// Optionally records access points while decoding and, given an index,
+// seeks: the compressed input up to the nearest point is seeked over (or
+// read and dropped when the source cannot seek), so only the bytes between
+// that point and the target are inflated.
 class GzipReader final : public IReader {
 public:
-    explicit GzipReader(std::unique_ptr<IReader> source);
+    explicit GzipReader(std::unique_ptr<IReader> source, InflateBackend backend = InflateBackend::Auto);
     ~GzipReader() override;
 
     // Implementation of IReader
     ssize_t Read(std::span<std::uint8_t> out) override;
     std::optional<std::uint64_t> TotalSize() const override { return std::nullopt; }
 
+    const char* Backend() const { return inflater_->Name(); }
+    std::uint64_t Members() const { return members_; }
+
+    // Records an access point at the first block boundary after every
+    // `spacing` bytes of output. Switches to the zlib backend if needed;
+    // call before the first Read().
+    void RecordAccessPoints(std::uint64_t spacing);
+    // Points known so far (handed in and recorded), from the `from`-th on.
+    // Safe to call while another thread reads.
+    std::vector<GzipAccessPoint> AccessPoints(std::size_t from = 0) const;
+    std::size_t AccessPointCount() const;
+
+    // Points to seek with (see Seek()); recording continues after the last.
+    // Call before the first Read().
+    void UseIndex(GzipIndex index);
+
+    // Uncompressed offsets. Forward seeks always work (without points they
+    // inflate everything in between); backward ones need a point at or
+    // before the target and a seekable source.
+    bool Seekable() const override { return true; }
+    std::int64_t Seek(std::int64_t offset, int whence) override;
+
 private:
+    enum class State { Header, Body, Trailer, Done };
+
+    // Makes at least `need` unconsumed bytes available; false at EOF or on a
+    // read error (read_err_ set).
+    bool Fill(std::size_t need);
+    // 1 => header parsed, 0 => clean end of stream, -1 => error.
+    int ParseHeader();
+    ssize_t Fail(int err, const char* msg);
+    // Puts the decoder at `p`; false on error (error_ set).
+    bool StartAt(const GzipAccessPoint& p);
+    void AddPoint(int bits, std::uint64_t at);
+
     std::unique_ptr<IReader> source_;
-    z_stream strm_{};
+    std::unique_ptr<Inflater> inflater_;
     std::vector<std::uint8_t> in_buffer_;
-    bool eof_reached_ = false;
+    std::size_t in_pos_ = 0;
+    std::size_t in_len_ = 0;
+    bool source_eof_ = false;
+    int read_err_ = 0;
+
+    State state_ = State::Header;
+    std::uint32_t crc_ = 0;
+    std::uint32_t size_ = 0;  // ISIZE is the length mod 2^32
+    std::uint64_t members_ = 0;
+    int error_ = 0;
+
+    // Positions, for access points and seeks.
+    std::int64_t base_ = -1;          // source offset of the stream start, -1 if not seekable
+    std::uint64_t source_read_ = 0;   // bytes taken from the source since the stream start
+    std::uint64_t out_ = 0;           // uncompressed bytes returned
+    std::uint8_t last_byte_ = 0;      // last compressed byte consumed
+
+    std::uint64_t spacing_ = 0;       // 0 => not recording
+    std::uint64_t next_point_ = 0;
+    mutable std::mutex points_mu_;    // points_ is read by other threads
+    std::vector<GzipAccessPoint> points_;
 };
 
-} // namespace flash
\ No newline at end of file
+} // namespace flash
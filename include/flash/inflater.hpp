@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace flash {
+
+// Raw deflate decoder used by the gzip readers, which parse gzip framing and
+// check the CRC themselves. Backends: stock zlib (always built) and ISA-L
+// igzip (FLASH_TOOL_WITH_ISAL), selectable per reader.
+enum class InflateBackend { Auto, Zlib, Isal };
+
+class Inflater {
+public:
+    enum class Status { Ok, StreamEnd, Error };
+
+    virtual ~Inflater() = default;
+
+    // Starts a new deflate stream.
+    virtual void Reset() = 0;
+
+    // Decodes from [in, in + in_len) into [out, out + out_len), advancing all
+    // four by what was consumed/produced. StreamEnd leaves `in` on the first
+    // byte after the stream.
+    virtual Status Inflate(const std::uint8_t*& in, std::size_t& in_len, std::uint8_t*& out,
+                           std::size_t& out_len) = 0;
+
+    virtual const char* Name() const = 0;
+
+    // zran-style access points: places between two deflate blocks where
+    // decoding can start again given the bit position and the last 32 KiB
+    // of output. Only the zlib backend can stop there.
+    virtual bool SupportsAccessPoints() const { return false; }
+
+    // Like Inflate(), but also returns at the end of each deflate block
+    // (except the last), with `bits` set to the bits of the last input byte
+    // consumed that belong to the next block; -1 anywhere else.
+    virtual Status InflateToBlock(const std::uint8_t*& in, std::size_t& in_len, std::uint8_t*& out,
+                                  std::size_t& out_len, int& bits) {
+        bits = -1;
+        return Inflate(in, in_len, out, out_len);
+    }
+
+    // The current history window (up to 32 KiB of the latest output).
+    virtual bool Window(std::vector<std::uint8_t>& out) {
+        out.clear();
+        return false;
+    }
+
+    // Restarts in the middle of a deflate stream at a block boundary: the
+    // top `bits` bits of `byte` come first, `window` is the preceding output.
+    virtual bool ResumeAt(int bits, std::uint8_t byte, std::span<const std::uint8_t> window) {
+        (void)bits;
+        (void)byte;
+        (void)window;
+        return false;
+    }
+};
+
+// Auto => the fastest backend compiled in. Throws std::runtime_error if the
+// backend is unavailable or fails to initialise.
+std::unique_ptr<Inflater> MakeInflater(InflateBackend backend = InflateBackend::Auto);
+
+const char* InflateBackendName(InflateBackend backend);
+bool ParseInflateBackend(std::string_view name, InflateBackend& out);
+
+// Concrete backends built into this binary, fastest first.
+std::vector<InflateBackend> AvailableInflateBackends();
+
+} // namespace flash
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "flash/result.hpp"
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+
+namespace flash {
+
+// Progress of an install, kept on stable storage so a run that was killed
+// (power loss, SIGKILL, SIGTERM) can be resumed by running the same bundle
+// again. Every change rewrites the whole file atomically (temporary file,
+// fsync, rename, fsync of the directory):
+//
+//   {"format": "flash-install-journal-1",
+//    "bundle": "<sha256 of manifest.json>",
+//    "done": ["boot", "rootfs"],
+//    "raw": {"data": 268435456}}
+//
+// "done" lists components that are installed and flushed; "raw" maps a raw
+// component in progress to the image offset up to which its target is known
+// to hold the image on stable storage. A gzip-compressed image also keeps
+// its access points in a sidecar file (see SidecarPath()).
+//
+// Thread-safe: concurrent component installs share one journal.
+class InstallJournal {
+public:
+    // Identifies a bundle by its manifest, which pins every payload through
+    // its sha256 fields.
+    static std::string BundleId(const std::string& manifest_json);
+
+    // Loads `path` when it belongs to `bundle_id`. A missing journal, or
+    // one of another bundle, starts empty and is replaced on the first
+    // change; an unreadable one is an error.
+    static Result Open(const std::string& path, const std::string& bundle_id, InstallJournal& out);
+
+    // Something was recorded by an earlier run.
+    bool Resuming() const;
+
+    bool Done(const std::string& component) const;
+    // 0 => start from the beginning.
+    std::uint64_t RawOffset(const std::string& component) const;
+
+    // The component is installed and flushed; forgets its raw offset.
+    Result MarkDone(const std::string& component);
+    // [0, offset) of the component's target is flushed.
+    Result RecordRawOffset(const std::string& component, std::uint64_t offset);
+
+    // The install completed; deletes the journal.
+    Result Remove();
+
+    // Per-component state kept next to the journal (the gzip index of a
+    // compressed raw image); deleted along with the component's entry.
+    std::string SidecarPath(const std::string& component) const { return path_ + "." + component; }
+
+private:
+    Result Save();  // mu_ held
+
+    std::string path_;
+    std::string bundle_;
+    mutable std::mutex mu_;
+    std::set<std::string> done_;
+    std::map<std::string, std::uint64_t> raw_;
+};
+
+} // namespace flash
@@ -2,6 +2,8 @@
 
 #include "flash/result.hpp"
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdint>
 #include <optional>
 #include <span>
@@ -9,11 +11,56 @@
 
 namespace flash {
 
+// Where a reader's bytes can be copied from inside the kernel
+// (copy_file_range, sendfile, splice); see IReader::KernelSource().
+struct FdSource {
+    int fd = -1;
+    std::int64_t offset = -1;              // -1: at the fd's own position (a pipe)
+    std::optional<std::uint64_t> length;   // bytes after `buffered` that belong to the reader
+    std::uint64_t buffered = 0;            // bytes Read() still returns first
+};
+
 class IReader {
 public:
     virtual ~IReader() = default;
     virtual ssize_t Read(std::span<std::uint8_t> out) = 0;
     virtual std::optional<std::uint64_t> TotalSize() const { return std::nullopt; }
+
+    // Optional random access. Readers over seekable inputs (regular files)
+    // override both; everyone else reads and discards to move forward.
+    virtual bool Seekable() const { return false; }
+
+    // lseek(2) semantics: returns the new offset, or -1 with errno set
+    // (ESPIPE when the reader cannot seek).
+    virtual std::int64_t Seek(std::int64_t offset, int whence) {
+        (void)offset;
+        (void)whence;
+        errno = ESPIPE;
+        return -1;
+    }
+
+    // Zero-copy read: points `out` at up to `max` bytes held by the reader,
+    // valid until its next call. Returns the byte count, 0 at EOF, or -1 with
+    // errno set; ENOTSUP means the reader has no such bytes (use Read()).
+    virtual ssize_t ReadView(std::size_t max, std::span<const std::uint8_t>& out) {
+        (void)max;
+        out = {};
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    // Kernel-side copies. True when the reader's bytes, after the `buffered`
+    // ones Read() still returns, can be taken straight from `out.fd`. A taker
+    // reports what it copied itself with Consumed() and does not call Read()
+    // for those bytes. Wrappers that need to see the data either return
+    // false or forward to their inner reader and give the taker another way
+    // in: Sha256Reader takes the copied bytes through Update(), which
+    // UpdateModule's kernel copy feeds from the page cache as it goes.
+    virtual bool KernelSource(FdSource& out) {
+        (void)out;
+        return false;
+    }
+    virtual void Consumed(std::uint64_t n) { (void)n; }
 };
 
 class IWriter {
@@ -21,6 +68,29 @@ public:
     virtual ~IWriter() = default;
     virtual Result WriteAll(std::span<const std::uint8_t> in) = 0;
     virtual Result FsyncNow() = 0;
+
+    // Periodic durability point during a long write. Writers that can queue the
+    // flush behind their in-flight writes override this; the final flush of a
+    // component still goes through FsyncNow().
+    virtual Result FsyncAsync() { return FsyncNow(); }
+
+    // Appends `len` zero bytes. Writers that can zero a range without copying
+    // (hole punch, BLKZEROOUT) override this; the default writes real zeros.
+    virtual Result WriteZeroes(std::uint64_t len) {
+        static const std::uint8_t kZeros[64 * 1024] = {};
+        while (len > 0) {
+            const auto n = static_cast<std::size_t>(std::min<std::uint64_t>(len, sizeof(kZeros)));
+            auto r = WriteAll({kZeros, n});
+            if (!r.is_ok()) return r;
+            len -= n;
+        }
+        return Result::Ok();
+    }
+
+    // Advances past `len` bytes whose contents do not matter (left as they
+    // are on a device, a hole in a fresh file). Writers that cannot seek
+    // zero them instead.
+    virtual Result Skip(std::uint64_t len) { return WriteZeroes(len); }
 };
 
 
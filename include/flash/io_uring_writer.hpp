@@ -0,0 +1,64 @@
+#pragma once
+
+#include "flash/fd.hpp"
+#include "flash/io.hpp"
+#include "flash/result.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+
+struct io_uring_sqe;
+
+namespace flash {
+
+// Writer that keeps up to `queue_depth` writes in flight through io_uring.
+// Data is staged in buffers registered with the ring (IORING_OP_WRITE_FIXED);
+// fsync/fdatasync are queued behind the writes instead of blocking the caller.
+//
+// Talks to the kernel with raw syscalls so no liburing is needed. Open() fails
+// when the kernel (or a seccomp policy) does not allow io_uring; callers are
+// expected to fall back to PartitionWriter.
+class IoUringWriter final : public IWriter {
+public:
+    struct Options {
+        unsigned queue_depth = 8;
+        std::size_t buffer_bytes = 1024 * 1024;
+        // Keep the existing contents of a regular file (read-compare-write).
+        bool truncate = true;
+        // false => FsyncNow()/FsyncAsync() only complete the queued writes;
+        // the device flush is left to the caller (DurabilityMode::Final).
+        bool sync = true;
+    };
+
+    IoUringWriter();
+    ~IoUringWriter() override;
+
+    IoUringWriter(const IoUringWriter&) = delete;
+    IoUringWriter& operator=(const IoUringWriter&) = delete;
+
+    static Result Open(std::string path, IoUringWriter &out);
+    static Result Open(std::string path, const Options& opt, IoUringWriter &out);
+
+    Result WriteAll(std::span<const std::uint8_t> in) override;
+    Result FsyncNow() override;
+    Result FsyncAsync() override;
+    Result WriteZeroes(std::uint64_t len) override;
+    Result Skip(std::uint64_t len) override;
+
+private:
+    struct Ring;
+
+    Result GetSqe(io_uring_sqe*& out);
+    Result SubmitFill();
+    Result SubmitFsync(bool datasync);
+    Result WaitForSlot();
+    Result Drain();
+
+    std::string path_;
+    Fd fd_;
+    std::unique_ptr<Ring> ring_;
+};
+
+} // namespace flash
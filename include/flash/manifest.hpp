@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <expected>
@@ -18,6 +19,34 @@ struct Component {
     std::string path;         
     std::string permissions = "0644";
     bool create_destination = false;
+
+    // "delta" components: partition the COPY ops read from (the active slot).
+    std::string delta_source;
+
+    // "archive" components: build this filesystem ("ext4") on install_to
+    // from the archive instead of extracting into the mounted target.
+    std::string mkfs;
+
+    // Payload compression: empty/"auto" sniffs the entry's magic bytes;
+    // "none", "gzip", "zstd", ... force a decoder.
+    std::string compression;
+
+    // "raw" components: payload format. Empty/"auto" expands an Android
+    // sparse image and writes anything else as is; "raw" always writes the
+    // payload as is, for images that merely start like a sparse image.
+    std::string format;
+
+    // Declared sizes, 0 => not declared. `size` is the bundle entry as
+    // stored (what overall progress counts); `installed_size` is what
+    // the component writes to its target once decompressed.
+    std::uint64_t size = 0;
+    std::uint64_t installed_size = 0;
+
+    // "raw" components: sha256 of every chunk_bytes of the installed image
+    // ("chunks": {"size": ..., "sha256": [...]}), checked as the image is
+    // written; empty => none.
+    std::uint64_t chunk_bytes = 0;
+    std::vector<std::string> chunk_sha256;
 };
 
 struct Manifest {
@@ -34,6 +63,10 @@ public:
     static bool ShouldUpdate(const Component& comp, const Manifest& manifest, const std::string& currentVersion);
     
     static int CompareVersions(const std::string& v1, const std::string& v2);
+
+    // Sum of the declared entry sizes, or 0 unless every component that
+    // names a bundle entry declares one.
+    static std::uint64_t DeclaredBundleBytes(const Manifest& manifest);
 };
 
 } // namespace flash
\ No newline at end of file
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "flash/fd.hpp"
+#include "flash/io.hpp"
+#include "flash/result.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+
+namespace flash {
+
+// Reads a regular file through a read-only mapping. ReadView() hands out
+// pointers straight into the mapping, so a tar reader on top copies entry
+// data once (mapping -> caller) instead of twice. Pages behind the cursor
+// are dropped with MADV_DONTNEED to keep the resident set small.
+//
+// A file truncated while mapped would raise SIGBUS on access; a process-wide
+// handler replaces the faulting page with zeros and the next Read()/ReadView()
+// fails with EIO, so the install fails cleanly instead of crashing.
+class MappedFileReader final : public IReader {
+public:
+    MappedFileReader() = default;
+    ~MappedFileReader() override;
+
+    MappedFileReader(const MappedFileReader&) = delete;
+    MappedFileReader& operator=(const MappedFileReader&) = delete;
+
+    // Fails (ENODEV/ENOMEM/...) when `path` is not a mappable regular file;
+    // callers fall back to FileOrStdinReader.
+    static Result Open(const std::string& path, MappedFileReader& out);
+
+    ssize_t Read(std::span<std::uint8_t> out) override;
+    ssize_t ReadView(std::size_t max, std::span<const std::uint8_t>& out) override;
+    std::optional<std::uint64_t> TotalSize() const override { return size_; }
+    bool Seekable() const override { return true; }
+    std::int64_t Seek(std::int64_t offset, int whence) override;
+    bool KernelSource(FdSource& out) override;
+    void Consumed(std::uint64_t n) override;
+
+private:
+    // False (errno = EIO) once the file shrank below the mapping.
+    bool Intact();
+    void Release();
+    void Unmap();
+
+    Fd fd_;
+    std::uint8_t* base_ = nullptr;
+    std::uint64_t size_ = 0;
+    std::uint64_t pos_ = 0;
+    std::uint64_t released_ = 0;    // pages below this were dropped
+    std::atomic_bool faulted_{false};
+    int slot_ = -1;                 // SIGBUS registry slot
+};
+
+} // namespace flash
@@ -47,19 +47,39 @@ public:
 private:
     static Result FailMsg(const std::string& msg) { return Result::Fail(-1, msg); }
 
+    // libarchive client state; owned by ar_ (freed by its close callback).
+    struct Ctx;
+
     bool opened_ = false;
     struct archive* ar_ = nullptr;
     struct archive_entry* cur_entry_ = nullptr;
     bool in_entry_ = false;
+    Ctx* ctx_ = nullptr;
 
+    // Serves entry data block by block. For a stored entry whose remaining
+    // bytes sit untouched in the bundle file or pipe, KernelSource() points
+    // at them so they can be copied in-kernel.
     class EntryReader final : public IReader {
     public:
         explicit EntryReader(OtaTarBundleReader* parent) : parent_(parent) {}
         ssize_t Read(std::span<std::uint8_t> out) override;
         std::optional<std::uint64_t> TotalSize() const override;
+        bool KernelSource(FdSource& out) override;
+        void Consumed(std::uint64_t n) override;
 
     private:
+        int FetchBlock();  // 1 => block ready, 0 => end of entry, -1 => error
+        ssize_t Finish();
+
         OtaTarBundleReader* parent_ = nullptr;
+        const std::uint8_t* block_ = nullptr;
+        std::size_t block_len_ = 0;
+        std::size_t block_pos_ = 0;
+        std::uint64_t zeros_ = 0;    // hole before the current block (sparse entries)
+        std::uint64_t fetched_ = 0;  // entry bytes libarchive has handed out
+        std::uint64_t taken_ = 0;    // entry bytes copied in-kernel
+        bool pipe_source_ = false;
+        bool done_ = false;
     };
 };
 
@@ -1,14 +1,93 @@
 #pragma once
 
+#include "flash/durability.hpp"
+#include "flash/inflater.hpp"
+#include "flash/install_journal.hpp"
 #include "flash/result.hpp"
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace flash {
 
+struct BundleIndex;
+struct Component;
+struct Manifest;
+
 class OtaInstaller {
 public:
+    struct Options {
+        // Writes kept in flight for raw components; 0 => synchronous writes.
+        unsigned io_uring_queue_depth = 8;
+        // Write raw components with O_DIRECT to keep them out of the page cache.
+        bool direct_io = false;
+        // Zero all-zero blocks of raw components in place instead of writing
+        // them. Keeps raw components off the kernel copy (see kernel_copy).
+        bool skip_zero_blocks = true;
+        // Only write blocks of raw components that differ from the slot's current contents.
+        bool compare_before_write = false;
+        // Threads decoding BGZF gzip / multi-block xz payloads; 0 => one per CPU.
+        unsigned decompress_threads = 0;
+        // Threads writing small files of archive components; 0 => one per CPU.
+        unsigned extract_workers = 0;
+        // Reserve extents of file components and extracted files whose
+        // size is known before writing them.
+        bool preallocate = true;
+        // Deflate implementation for gzip payloads.
+        InflateBackend inflate_backend = InflateBackend::Auto;
+        // Install only these components (by name); empty => all.
+        std::vector<std::string> only_components;
+        // Extra attempts for a failed component. Needs a bundle file; a
+        // streamed bundle cannot rewind.
+        unsigned component_retries = 0;
+        // Components installed at once from a bundle file (indexed, or a
+        // plain uncompressed tar). Components whose targets overlap (the
+        // same file or device, or one inside another's folder) always run
+        // one after another in manifest order.
+        unsigned component_jobs = 1;
+        // Read bundle files through a memory mapping (one copy less for
+        // stored entries); stdin and unmappable files use read().
+        bool mmap_input = true;
+        // Move stored payloads in-kernel where possible (see
+        // UpdateModule::Options::kernel_copy); raw components only with
+        // skip_zero_blocks off.
+        bool kernel_copy = true;
+        // When installed data is flushed to stable storage; the flush time
+        // is reported at the end.
+        DurabilityMode durability = DurabilityMode::Interval;
+        // Progress journal; empty => none. A rerun of the same bundle skips
+        // the components a killed run finished and continues stored or
+        // gzip raw images from their last checkpoint, taken every
+        // journal_interval_bytes. Components only count as finished once
+        // flushed, so DurabilityMode::Final gets no resume.
+        std::string journal_path;
+        std::uint64_t journal_interval_bytes = 64 * 1024 * 1024ULL;
+        // Read raw components with chunk hashes back after writing them and
+        // check every chunk (see UpdateModule::Options::verify_chunks).
+        bool verify_chunks = false;
+    };
+
+    OtaInstaller() = default;
+    explicit OtaInstaller(Options opt) : opt_(std::move(opt)) {}
+
     Result Run(const std::string& input_path);
 
+private:
+    Result Install(const std::string& input_path);
+    // Random-access install through a bundle index; `check_offsets` checks
+    // each entry against its tar header (an index read from the bundle).
+    Result RunIndexed(const std::string& input_path, const Manifest& manifest, const BundleIndex& index,
+                      bool check_offsets);
+    bool Selected(const std::string& component_name) const;
+    // Installed by an earlier run, according to the journal.
+    bool AlreadyDone(const Component& comp) const;
+    // Records an installed component in the journal once it is durable.
+    Result Completed(const Component& comp);
+
+    Options opt_{};
+    DurabilityPolicy* durability_ = nullptr;  // set while Run() is active
+    std::unique_ptr<InstallJournal> journal_;  // opened once the manifest is read
 };
 
 } // namespace flash
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "flash/inflater.hpp"
+#include "flash/io.hpp"
+#include "flash/thread_pool.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace flash {
+
+class PeekReader;
+
+// Multi-member gzip whose members carry their own compressed size in the
+// BGZF "BC" extra subfield (bgzip, or any packer writing that field). Each
+// member is read whole on the caller's thread, inflated on a thread pool and
+// returned in order; at most `window_bytes` of compressed input plus decoded
+// output are held at once. Ordinary gzip stays with GzipReader.
+class ParallelGzipReader final : public IReader {
+public:
+    struct Options {
+        unsigned threads = 0;  // 0 => one per CPU
+        std::size_t window_bytes = 32 * 1024 * 1024;
+        InflateBackend backend = InflateBackend::Auto;
+    };
+
+    ParallelGzipReader(std::unique_ptr<IReader> source, Options opt);
+    ~ParallelGzipReader() override;
+
+    ParallelGzipReader(const ParallelGzipReader&) = delete;
+    ParallelGzipReader& operator=(const ParallelGzipReader&) = delete;
+
+    // Peeks at the first member header; true if it carries a block size.
+    static bool Detect(PeekReader& in);
+
+    ssize_t Read(std::span<std::uint8_t> out) override;
+    std::optional<std::uint64_t> TotalSize() const override { return std::nullopt; }
+
+    unsigned Threads() const { return static_cast<unsigned>(pool_->Size()); }
+
+private:
+    struct Member {
+        std::vector<std::uint8_t> in;   // whole member, header to trailer
+        std::vector<std::uint8_t> out;  // sized from ISIZE before inflating
+        std::size_t cost = 0;           // bytes charged against the window
+        std::size_t pos = 0;            // consumed from `out`
+        bool done = false;
+        int err = 0;
+        std::string msg;
+    };
+
+    // 1 => a member was queued, 0 => clean end of input, -1 => error_/msg_ set.
+    int QueueNext();
+    bool ReadExact(std::uint8_t* p, std::size_t len, bool allow_eof, bool& eof);
+    // Zeros up to the end of input after the last member: 0, else -1.
+    int SkipPadding();
+    static void Inflate(Member& m, InflateBackend backend);
+    ssize_t Fail(int err, std::string msg);
+
+    std::unique_ptr<IReader> source_;
+    Options opt_;
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<std::unique_ptr<Member>> members_;
+    std::size_t inflight_ = 0;
+    std::uint64_t queued_ = 0;  // members read from the source so far
+    bool source_done_ = false;
+    int source_err_ = 0;  // delivered once the members before it are drained
+    std::string source_msg_;
+    int error_ = 0;
+
+    std::unique_ptr<ThreadPool> pool_;  // declared last: drained before members_ go away
+};
+
+} // namespace flash
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "flash/aligned_buffer.hpp"
 #include "flash/fd.hpp"
 #include "flash/io.hpp"
 #include "flash/result.hpp"
@@ -11,14 +12,92 @@ namespace flash {
 
 class PartitionWriter final : public IWriter {
 public:
+    struct Options {
+        // Bypass the page cache (O_DIRECT). Falls back to buffered writes when
+        // the target filesystem rejects it.
+        bool direct = false;
+        // Staging buffer for direct mode; rounded up to the logical block size.
+        std::size_t direct_buffer_bytes = 1024 * 1024;
+        // Keep the existing contents of a regular file (read-compare-write).
+        bool truncate = true;
+        // false => FsyncNow() writes out what is staged but skips the fsync;
+        // the device flush is left to the caller (DurabilityMode::Final).
+        bool sync = true;
+        // Expected final size of a regular file target, 0 => unknown. Its
+        // extents are reserved up front (fallocate, FALLOC_FL_KEEP_SIZE) so a
+        // large file is not grown one delayed-allocation batch at a time.
+        std::uint64_t preallocate_bytes = 0;
+    };
+
+    PartitionWriter() = default;
+    ~PartitionWriter() override;
+
     static Result Open(std::string path, PartitionWriter &out);
+    static Result Open(std::string path, const Options &opt, PartitionWriter &out);
 
     Result WriteAll(std::span<const std::uint8_t> in) override;
     Result FsyncNow() override;
+    Result WriteZeroes(std::uint64_t len) override;
+    Result Skip(std::uint64_t len) override;
+
+    // Zeroes [off, off+len) of `fd` without transferring data: BLKDISCARD (when
+    // the device guarantees discarded blocks read back as zero) or BLKZEROOUT on
+    // block devices, a punched hole on regular files. Fails with EOPNOTSUPP when
+    // the target has no such shortcut.
+    static Result ZeroRange(int fd, std::uint64_t off, std::uint64_t len);
+
+    // Reserves [0, len) of regular file `fd` without changing its size.
+    // Filesystems without fallocate are not an error; running out of space
+    // is (ENOSPC), so a file that cannot fit fails before it is written.
+    static Result Preallocate(int fd, std::uint64_t len);
+
+    // fdatasync() of the target whatever Options::sync says, for data that
+    // must be durable before a rename publishes it. Call after FsyncNow().
+    Result DataSync();
+
+    // Releases blocks reserved past the end of what was written, for a
+    // payload that came out shorter than its declared size. Call after the
+    // final FsyncNow().
+    Result TrimPreallocation();
+
+    // Appends up to `len` bytes taken in-kernel from `fd`: copy_file_range,
+    // then sendfile, from a file at `*offset` (advanced); splice from a pipe
+    // when `offset` is null. Returns the count (0 at EOF) or -1 with errno;
+    // EXDEV/EINVAL/ENOSYS/EOPNOTSUPP mean "copy through user space instead".
+    // Not available in direct mode.
+    ssize_t CopyFromFd(int fd, std::int64_t* offset, std::size_t len);
+
+    bool Direct() const { return direct_; }
+    std::size_t DirectAlignment() const { return align_; }
 
 private:
+    Result WriteFd(int fd, const std::uint8_t* p, size_t len, std::uint64_t off);
+    Result WriteDirect(const std::uint8_t* p, size_t len);
+    Result FallBackToBuffered(int err);
+    Result Advance(std::uint64_t len, bool zero);
+    Result KeepOld(std::size_t len);
+
     std::string path_;
     Fd fd_;
+
+    // Direct mode state: fd_ has O_DIRECT; buffered_fd_ is a second plain
+    // descriptor used for the sub-block tail when a flush is requested, and
+    // to read the old bytes of a partly skipped block.
+    bool direct_ = false;
+    Fd buffered_fd_;
+    std::size_t align_ = 0;
+    AlignedBuffer stage_;
+    std::size_t staged_ = 0;
+    std::uint64_t offset_ = 0;  // bytes committed with O_DIRECT (always aligned)
+
+    // End of the last zeroed or skipped range; a trailing hole does not extend
+    // the file.
+    std::uint64_t hole_end_ = 0;
+
+    std::uint64_t preallocated_ = 0;
+
+    bool no_copy_file_range_ = false;  // e.g. a block device target
+    bool sync_ = true;
 };
 
 } // namespace flash
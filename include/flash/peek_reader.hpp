@@ -0,0 +1,39 @@
+#pragma once
+
+#include "flash/io.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+namespace flash {
+
+// Lets a caller look at the first bytes of a stream (format sniffing) without
+// consuming them: Read() returns the peeked bytes before the rest.
+class PeekReader final : public IReader {
+public:
+    explicit PeekReader(std::unique_ptr<IReader> source) : source_(std::move(source)) {}
+
+    // Buffers up to `n` bytes from the start of the stream; fewer only at EOF.
+    // Returns -1 on a read error.
+    ssize_t Peek(std::size_t n, std::span<const std::uint8_t>& out);
+
+    ssize_t Read(std::span<std::uint8_t> out) override;
+    std::optional<std::uint64_t> TotalSize() const override { return source_->TotalSize(); }
+
+    // Seeks within the peeked bytes, or drops them and seeks the source.
+    bool Seekable() const override { return source_->Seekable(); }
+    std::int64_t Seek(std::int64_t offset, int whence) override;
+
+    // Peeked bytes count as buffered.
+    bool KernelSource(FdSource& out) override;
+    void Consumed(std::uint64_t n) override { source_->Consumed(n); }
+
+private:
+    std::unique_ptr<IReader> source_;
+    std::vector<std::uint8_t> head_;
+    std::size_t head_pos_ = 0;
+};
+
+} // namespace flash
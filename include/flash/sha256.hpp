@@ -0,0 +1,110 @@
+#pragma once
+
+#include "flash/io.hpp"
+#include "flash/result.hpp"
+
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace flash {
+
+using Sha256Digest = std::array<std::uint8_t, 32>;
+
+// Incremental SHA-256. The block function is picked once at runtime:
+// SHA-NI on x86-64, ARMv8 crypto extensions on aarch64, portable C++ otherwise.
+class Sha256 {
+public:
+    Sha256();
+
+    // Always uses the portable block function, whatever the CPU supports.
+    static Sha256 Portable();
+
+    void Update(std::span<const std::uint8_t> in);
+    Sha256Digest Final();
+
+    // "sha-ni", "armv8-ce" or "portable"
+    static const char* Backend();
+
+    static std::string ToHex(const Sha256Digest& d);
+    static bool ParseHex(std::string_view hex, Sha256Digest& out);
+
+private:
+    std::uint32_t state_[8];
+    std::uint8_t buf_[64];
+    size_t buf_len_ = 0;
+    std::uint64_t total_ = 0;
+    bool portable_ = false;
+};
+
+// Hashes on its own thread. Update() copies into one of a few fixed slots and
+// returns immediately; it only blocks when every slot is still waiting to be hashed.
+class AsyncSha256 {
+public:
+    explicit AsyncSha256(size_t slot_bytes = 1024 * 1024, size_t slots = 4);
+    ~AsyncSha256();
+
+    AsyncSha256(const AsyncSha256&) = delete;
+    AsyncSha256& operator=(const AsyncSha256&) = delete;
+
+    void Update(std::span<const std::uint8_t> in);
+
+    // Flushes the pending slot, waits for the worker and returns the digest.
+    Sha256Digest Finish();
+
+private:
+    struct Slot {
+        std::vector<std::uint8_t> data;
+        size_t len = 0;
+    };
+
+    void Worker();
+    void Submit();
+
+    std::vector<Slot> slots_;
+    std::deque<size_t> free_;
+    std::deque<size_t> queued_;
+    size_t cur_ = 0;
+    bool have_cur_ = false;
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    bool done_ = false;
+
+    Sha256 ctx_;
+    std::thread worker_;
+};
+
+// IReader decorator that feeds every byte it passes through to an AsyncSha256.
+class Sha256Reader final : public IReader {
+public:
+    Sha256Reader(std::unique_ptr<IReader> inner, Sha256Digest expected);
+
+    ssize_t Read(std::span<std::uint8_t> out) override;
+    std::optional<std::uint64_t> TotalSize() const override;
+
+    // Bytes taken in-kernel bypass Read(); the taker passes a copy of them
+    // to Update() so the digest still covers the whole stream.
+    bool KernelSource(FdSource& out) override { return inner_->KernelSource(out); }
+    void Consumed(std::uint64_t n) override { inner_->Consumed(n); }
+    void Update(std::span<const std::uint8_t> in) { hasher_.Update(in); }
+
+    // Drains whatever the consumer left unread (tar padding, gzip trailer...),
+    // then compares the digest of the whole stream with the expected one.
+    Result Verify();
+
+private:
+    std::unique_ptr<IReader> inner_;
+    Sha256Digest expected_{};
+    AsyncSha256 hasher_;
+};
+
+} // namespace flash
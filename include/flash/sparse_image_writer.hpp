@@ -0,0 +1,90 @@
+#pragma once
+
+#include "flash/io.hpp"
+#include "flash/result.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace flash {
+
+// Writer adapter that decodes an Android sparse image (simg) on the fly.
+//
+// The first bytes of the stream decide the mode: with the sparse magic, RAW
+// chunks are written through, FILL chunks are expanded (zero fills become
+// WriteZeroes()), DONT_CARE chunks become Skip() on the inner writer and
+// CRC32 chunks are checked against the output so far. Anything else passes
+// through unchanged.
+class SparseImageWriter final : public IWriter {
+public:
+    static constexpr std::uint32_t kMagic = 0xED26FF3A;
+
+    explicit SparseImageWriter(IWriter& inner) : inner_(inner) {}
+
+    Result WriteAll(std::span<const std::uint8_t> in) override;
+    Result FsyncNow() override;
+    Result FsyncAsync() override;
+
+    // Call once the input is exhausted; fails if a sparse image was cut short.
+    Result Finish();
+
+    bool IsSparse() const { return state_ != State::Detect && state_ != State::Passthrough; }
+    // Decided the stream is not a sparse image; bytes now pass unchanged.
+    bool Passthrough() const { return state_ == State::Passthrough; }
+    std::uint32_t BlockSize() const { return blk_sz_; }
+    std::uint32_t TotalBlocks() const { return total_blks_; }
+    std::uint32_t TotalChunks() const { return total_chunks_; }
+    std::uint64_t SkippedBytes() const { return skipped_; }
+
+private:
+    enum class State {
+        Detect,        // collecting the file header
+        Passthrough,   // not a sparse image
+        SkipHeader,    // extra file/chunk header bytes
+        ChunkHeader,
+        RawData,
+        FillValue,
+        Crc,
+        Done,
+    };
+
+    Result Dispatch();
+    Result StartPassthrough();
+    void Enter(State s, std::size_t need = 0);
+    Result OnFileHeader();
+    Result OnChunkHeader();
+    Result OnFillValue();
+    Result OnCrc();
+    Result EndChunk();
+    void CrcZeros(std::uint64_t len);
+
+    IWriter& inner_;
+    State state_ = State::Detect;
+
+    // Fixed-size records are gathered here until complete.
+    std::array<std::uint8_t, 64> acc_{};
+    std::size_t acc_len_ = 0;
+    std::size_t acc_need_ = 0;
+    std::uint64_t skip_in_ = 0;
+    State next_ = State::Done;        // entered once skip_in_ is consumed
+
+    std::uint32_t blk_sz_ = 0;
+    std::uint32_t total_blks_ = 0;
+    std::uint32_t total_chunks_ = 0;
+    std::uint16_t chunk_hdr_sz_ = 0;
+
+    std::uint32_t chunks_done_ = 0;
+    std::uint64_t blks_done_ = 0;
+    std::uint16_t chunk_type_ = 0;
+    std::uint64_t chunk_bytes_ = 0;   // output bytes of the current chunk
+    std::uint64_t raw_left_ = 0;
+
+    std::uint32_t crc_ = 0;
+    std::uint64_t skipped_ = 0;
+    std::vector<std::uint8_t> fill_;
+};
+
+} // namespace flash
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace flash {
+
+// Bounded single-producer/single-consumer ring. Push/Pop are lock-free on the
+// fast path and only park (futex via std::atomic::wait) when the ring is full
+// or empty. Close() wakes both sides; after it, Push fails and Pop drains
+// what is left before failing.
+template <typename T>
+class SpscRing {
+public:
+    explicit SpscRing(size_t capacity) : slots_(capacity ? capacity : 1) {}
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    size_t Capacity() const { return slots_.size(); }
+
+    bool TryPush(const T& v) {
+        const std::uint64_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) >= slots_.size()) return false;
+        slots_[tail % slots_.size()] = v;
+        tail_.store(tail + 1, std::memory_order_release);
+        Wake();
+        return true;
+    }
+
+    bool TryPop(T& out) {
+        const std::uint64_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) return false;
+        out = slots_[head % slots_.size()];
+        head_.store(head + 1, std::memory_order_release);
+        Wake();
+        return true;
+    }
+
+    // Blocks while full. Returns false once the ring is closed.
+    bool Push(const T& v) {
+        while (true) {
+            if (closed_.load(std::memory_order_acquire)) return false;
+            const std::uint32_t seq = seq_.load(std::memory_order_acquire);
+            if (TryPush(v)) return true;
+            if (closed_.load(std::memory_order_acquire)) return false;
+            seq_.wait(seq, std::memory_order_acquire);
+        }
+    }
+
+    // Blocks while empty. Returns false once the ring is closed and drained.
+    bool Pop(T& out) {
+        while (true) {
+            const std::uint32_t seq = seq_.load(std::memory_order_acquire);
+            if (TryPop(out)) return true;
+            if (closed_.load(std::memory_order_acquire)) return false;
+            seq_.wait(seq, std::memory_order_acquire);
+        }
+    }
+
+    void Close() {
+        closed_.store(true, std::memory_order_release);
+        Wake();
+    }
+
+private:
+    void Wake() {
+        seq_.fetch_add(1, std::memory_order_release);
+        seq_.notify_all();
+    }
+
+    std::vector<T> slots_;
+    alignas(64) std::atomic<std::uint64_t> head_{0};
+    alignas(64) std::atomic<std::uint64_t> tail_{0};
+    alignas(64) std::atomic<std::uint32_t> seq_{0};
+    std::atomic_bool closed_{false};
+};
+
+} // namespace flash
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace flash {
+
+// Fixed set of worker threads running submitted tasks in FIFO order. The
+// destructor runs every task already submitted before joining.
+class ThreadPool {
+public:
+    // `threads` == 0 => one per online CPU.
+    explicit ThreadPool(unsigned threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void Submit(std::function<void()> task);
+    std::size_t Size() const { return workers_.size(); }
+
+    static unsigned DefaultThreads();
+
+private:
+    void Worker();
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> tasks_;
+    bool stop_ = false;
+    std::vector<std::thread> workers_;
+};
+
+} // namespace flash
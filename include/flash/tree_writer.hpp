@@ -0,0 +1,167 @@
+#pragma once
+
+#include "flash/fd.hpp"
+#include "flash/result.hpp"
+#include "flash/thread_pool.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <sys/stat.h>
+#include <time.h>
+
+namespace flash {
+
+// Metadata of one extracted entry. `mode` includes the file type bits.
+struct TreeEntryMeta {
+    mode_t mode = 0;
+    std::int64_t uid = 0;
+    std::int64_t gid = 0;
+    dev_t rdev = 0;
+    std::int64_t size = -1;  // -1 => unknown
+    bool sparse = false;     // data arrives in pieces with holes between
+    bool has_atime = false;
+    bool has_mtime = false;
+    timespec atime{};
+    timespec mtime{};
+};
+
+// Receives the entries of an archive in order. Paths are normalised and
+// relative, without ".." components; hardlink targets likewise.
+class TreeSink {
+public:
+    virtual ~TreeSink() = default;
+
+    virtual Result Directory(const std::string& rel, const TreeEntryMeta& m) = 0;
+    virtual Result Symlink(const std::string& rel, const std::string& target, const TreeEntryMeta& m) = 0;
+    virtual Result Hardlink(const std::string& rel, const std::string& target_rel) = 0;
+    // FIFOs and device nodes.
+    virtual Result Special(const std::string& rel, const TreeEntryMeta& m) = 0;
+
+    // A regular file: BeginFile, any number of FileData (offsets as given
+    // by the archive, so sparse files keep their holes), EndFile.
+    virtual Result BeginFile(const std::string& rel, const TreeEntryMeta& m) = 0;
+    virtual Result FileData(std::span<const std::uint8_t> data, std::int64_t offset) = 0;
+    virtual Result EndFile() = 0;
+
+    virtual Result Finish() = 0;
+    virtual std::uint64_t FilesWritten() const = 0;
+};
+
+// Creates an extracted tree below a root directory using only dirfd-relative
+// calls, so no process-wide cwd is involved and no symlink on disk is ever
+// followed. Directories are created by the calling (parsing) thread; small
+// regular files are buffered and created, written, chmod'ed and timestamped
+// by a worker pool, symlinks and device nodes likewise. Large files are
+// written on the calling thread as their data arrives.
+//
+// Ordering: an entry never starts while an earlier entry for the same path
+// (or a parent path component) is still queued, hardlinks wait for their
+// target, and directory modes and times are applied in Finish(), deepest
+// first, so restrictive modes and child creation do not interfere.
+//
+// Existing objects are replaced like ARCHIVE_EXTRACT_UNLINK does; symlinks
+// met in a parent position are replaced by directories.
+class TreeWriter final : public TreeSink {
+public:
+    struct Options {
+        // 0 => one per online CPU; 1 => everything on the calling thread.
+        unsigned workers = 0;
+        // Files up to this size are buffered and handed to the pool.
+        std::size_t small_file_bytes = 1024 * 1024;
+        // Upper bound for buffered file data waiting for a worker.
+        std::size_t max_buffered_bytes = 64 * 1024 * 1024;
+        // Reserve the extents of files bigger than small_file_bytes before
+        // writing them (small ones go out in one write anyway). Sparse
+        // entries keep their holes.
+        bool preallocate = true;
+    };
+
+    static Result Open(const std::string& root, Options opt, std::unique_ptr<TreeWriter>& out);
+    ~TreeWriter() override;
+
+    TreeWriter(const TreeWriter&) = delete;
+    TreeWriter& operator=(const TreeWriter&) = delete;
+
+    Result Directory(const std::string& rel, const TreeEntryMeta& m) override;
+    Result Symlink(const std::string& rel, const std::string& target, const TreeEntryMeta& m) override;
+    Result Hardlink(const std::string& rel, const std::string& target_rel) override;
+    Result Special(const std::string& rel, const TreeEntryMeta& m) override;
+
+    Result BeginFile(const std::string& rel, const TreeEntryMeta& m) override;
+    Result FileData(std::span<const std::uint8_t> data, std::int64_t offset) override;
+    Result EndFile() override;
+
+    // Waits for the pool, then applies directory metadata.
+    Result Finish() override;
+
+    std::uint64_t FilesWritten() const override { return files_.load(std::memory_order_relaxed); }
+
+private:
+    struct Segment {
+        std::int64_t offset;
+        std::size_t pos;
+        std::size_t len;
+    };
+    struct FileJob {
+        std::string rel;
+        std::shared_ptr<Fd> dir;
+        std::string name;
+        TreeEntryMeta meta;
+        std::vector<std::uint8_t> data;
+        std::vector<Segment> segments;
+        std::int64_t end = 0;
+        mode_t perm = 0;
+        Fd fd;  // open while written on the calling thread
+    };
+    struct DirMeta {
+        std::string rel;
+        TreeEntryMeta meta;
+    };
+
+    TreeWriter() = default;
+
+    Result ParentDir(const std::string& rel, std::shared_ptr<Fd>& dir, std::string& name);
+    Result OpenDir(const std::string& rel, std::shared_ptr<Fd>& out);
+    void WaitFor(const std::string& rel);
+    void Drain();
+    void PrepareReplace(const std::string& rel);
+    void Submit(const std::string& rel, std::size_t bytes, std::function<Result()> work);
+    Result Failed();
+    void Fail(Result r);
+
+    Options opt_;
+    std::shared_ptr<Fd> root_;
+    mode_t umask_ = 022;
+    uid_t euid_ = 0;
+    gid_t egid_ = 0;
+
+    // Calling thread only.
+    std::unordered_map<std::string, std::shared_ptr<Fd>> dirs_;
+    std::unordered_set<std::string> made_dirs_;
+    std::vector<DirMeta> dir_meta_;
+    std::unique_ptr<FileJob> cur_;
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::unordered_multiset<std::string> pending_;
+    std::size_t queued_ = 0;
+    std::size_t buffered_bytes_ = 0;
+    Result error_ = Result::Ok();
+    std::atomic_bool failed_{false};
+    std::atomic<std::uint64_t> files_{0};
+
+    std::unique_ptr<ThreadPool> pool_;  // last: its jobs use the members above
+};
+
+} // namespace flash
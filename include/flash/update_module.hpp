@@ -1,25 +1,106 @@
 #pragma once
 
+#include "flash/inflater.hpp"
 #include "flash/io.hpp"
 #include "flash/result.hpp"
 #include "flash/manifest.hpp"
 
+#include <atomic>
 #include <cstdint>
+#include <functional>
 #include <memory>
 
 namespace flash {
 
+class DurabilityPolicy;
+class GzipReader;
+class InstallJournal;
+class PartitionWriter;
+class Sha256Reader;
+class SparseImageWriter;
+
 class UpdateModule {
 public:
     struct Options {
+        // Periodic fsync distance, used when `durability` asks for interval
+        // flushes. A null `durability` means DurabilityMode::Interval.
         std::uint64_t fsync_interval_bytes = 1024 * 1024ULL;
+        DurabilityPolicy* durability = nullptr;
         bool progress = true;
         std::uint64_t progress_interval_bytes = 4 * 1024 * 1024ULL;
 
+        // raw/file installs read (and decompress) on one thread and write on another;
+        // this many buffers of pipeline_buffer_bytes circulate between them (min 2).
+        std::size_t pipeline_depth = 4;
+        std::size_t pipeline_buffer_bytes = 1024 * 1024;
+
+        // raw installs keep this many writes in flight through io_uring when the
+        // kernel allows it; 0 forces the synchronous PartitionWriter.
+        unsigned io_uring_queue_depth = 8;
+
+        // raw installs bypass the page cache (O_DIRECT through PartitionWriter,
+        // takes precedence over io_uring). Falls back to buffered writes when the
+        // target rejects O_DIRECT.
+        bool direct_io = false;
+
+        // raw installs detect all-zero blocks and zero them on the target
+        // (hole punch / BLKZEROOUT) instead of writing them. Wins over
+        // kernel_copy for raw installs: the scan needs the bytes in user space.
+        bool skip_zero_blocks = true;
+
+        // raw installs read the current contents of install_to ahead of the
+        // writer and only write blocks that differ, then read the result back
+        // to verify it. install_to is not truncated in this mode.
+        bool compare_before_write = false;
+
+        // Uncompressed payloads read from a bundle file or pipe are moved
+        // in-kernel (copy_file_range / sendfile / splice) instead of through
+        // the pipeline buffers. file components always qualify; raw ones only
+        // without zero-block skipping, compare mode or O_DIRECT, which all
+        // need the bytes in user space.
+        bool kernel_copy = true;
+
+        // BGZF gzip and multi-block xz payloads are decoded on this many
+        // threads (0 => one per CPU, 1 => single-threaded). gzip holds at most
+        // decompress_window_bytes; xz drops threads above xz_memlimit_bytes
+        // (0 => a quarter of RAM).
+        unsigned decompress_threads = 0;
+        std::size_t decompress_window_bytes = 32 * 1024 * 1024;
+        std::uint64_t xz_memlimit_bytes = 0;
+
+        // archive components: threads creating and writing small files
+        // while the tar stream is parsed (0 => one per CPU, 1 => none).
+        unsigned extract_workers = 0;
+        // file components and extracted archive files reserve their extents
+        // up front when the final size is known (installed-size, the stored
+        // payload's size, or the tar header).
+        bool preallocate = true;
+        InflateBackend inflate_backend = InflateBackend::Auto;
+
+        // Raw payloads that are stored or plain gzip (not sparse images)
+        // record in `journal` how much of the image is on stable storage,
+        // every journal_interval_bytes under DurabilityMode::Interval, and
+        // continue from the recorded offset. gzip payloads also keep access
+        // points every journal_interval_bytes, so a resume inflates from the
+        // one before the offset instead of from the start. Compare mode
+        // always starts over; it already skips the blocks a killed run wrote.
+        InstallJournal* journal = nullptr;
+        std::uint64_t journal_interval_bytes = 64 * 1024 * 1024ULL;
+
+        // raw components with chunk hashes have each chunk checked as it is
+        // written (which keeps their bytes out of the kernel copy path);
+        // this also reads the whole image back afterwards and hashes its
+        // chunks on verify_threads threads (0 => one per CPU).
+        bool verify_chunks = false;
+        unsigned verify_threads = 0;
+
         // For percent reporting (based on bundle entry bytes)
         std::uint64_t component_total_bytes = 0;     // set to BundleEntryInfo.size
         std::uint64_t overall_total_bytes = 0;       // 0 => unknown
         std::uint64_t overall_done_base_bytes = 0;   // sum completed entry sizes before current component
+        // Bundle bytes consumed by all components when several install at
+        // once; replaces overall_done_base_bytes + this component's bytes.
+        const std::atomic<std::uint64_t>* overall_done_bytes = nullptr;
     };
 
     static Result Execute(const Component& comp, std::unique_ptr<IReader> source) {
@@ -29,15 +110,37 @@ public:
     static Result Execute(const Component& comp, std::unique_ptr<IReader> source, const Options& opt);
 
 private:
+    // Called by the pipes with the bytes written so far, right after a
+    // FsyncNow() made all of them durable.
+    using Checkpoint = std::function<Result(std::uint64_t written)>;
+
+    // `digest` is null when the component carries no sha256; otherwise it must be
+    // verified before the component is reported as installed. `gzip` is the
+    // decoder at the top of `reader` when a journaled payload is gzip.
     static Result InstallRaw(const Component& comp, IReader& reader, const Options& opt,
-                             const char* tag, const std::uint64_t* in_read);
+                             const char* tag, const std::uint64_t* in_read, Sha256Reader* digest,
+                             GzipReader* gzip = nullptr);
+    static Result InstallDelta(const Component& comp, IReader& reader, const Options& opt,
+                               const char* tag, const std::uint64_t* in_read, Sha256Reader* digest);
     static Result InstallArchive(const Component& comp, IReader& reader, const Options& opt,
-                                 const char* tag, const std::uint64_t* in_read);
+                                 const char* tag, const std::uint64_t* in_read, Sha256Reader* digest);
     static Result InstallAtomicFile(const Component& comp, IReader& reader, const Options& opt,
-                                    const char* tag, const std::uint64_t* in_read);
+                                    const char* tag, const std::uint64_t* in_read, Sha256Reader* digest);
 
     static Result InternalPipe(IReader& r, IWriter& w, const Options& opt,
-                              const char* tag, const std::uint64_t* in_read);
+                              const char* tag, const std::uint64_t* in_read,
+                              const Checkpoint& checkpoint = {});
+
+    // Like InternalPipe, but once the reader's buffered bytes went through
+    // `w`, the rest moves in-kernel into `out` (the writer at the bottom of
+    // `w`). Falls back to InternalPipe when the reader has no kernel source
+    // or `sparse` turned out to be decoding, and to a plain copy loop when
+    // the kernel refuses. `bypassed_bytes` receives the bytes written into
+    // `out` directly, in-kernel or by that loop, that `w` never saw.
+    static Result KernelPipe(IReader& r, IWriter& w, PartitionWriter& out, const SparseImageWriter* sparse,
+                             const Options& opt, const char* tag, const std::uint64_t* in_read,
+                             Sha256Reader* digest, std::uint64_t* bypassed_bytes,
+                             const Checkpoint& checkpoint = {});
 };
 
 } // namespace flash
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "flash/io.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace flash {
+
+// Streaming xz decoder on liblzma. With more than one thread it uses the
+// multi-threaded decoder, which decodes independent blocks in parallel when
+// the encoder recorded their sizes (xz -T0 / --block-size); single-block
+// streams decode on one thread. Concatenated streams and trailing padding
+// are accepted.
+class XzReader final : public IReader {
+public:
+    struct Options {
+        unsigned threads = 0;  // 0 => one per CPU, 1 => single-threaded decoder
+        // Soft cap: above it the decoder drops to fewer threads rather than
+        // buffer more. 0 => a quarter of physical RAM.
+        std::uint64_t memlimit_threading = 0;
+        // Hard cap: decoding fails with ENOMEM instead. 0 => none.
+        std::uint64_t memlimit_stop = 0;
+    };
+
+    explicit XzReader(std::unique_ptr<IReader> source) : XzReader(std::move(source), Options{}) {}
+    // Throws std::runtime_error if the decoder cannot be set up.
+    XzReader(std::unique_ptr<IReader> source, Options opt);
+    ~XzReader() override;
+
+    XzReader(const XzReader&) = delete;
+    XzReader& operator=(const XzReader&) = delete;
+
+    ssize_t Read(std::span<std::uint8_t> out) override;
+    std::optional<std::uint64_t> TotalSize() const override { return std::nullopt; }
+
+    unsigned Threads() const { return threads_; }
+    std::uint64_t MemoryLimit() const { return memlimit_; }
+    std::uint64_t PeakMemory() const { return peak_mem_; }
+
+private:
+    struct State;
+
+    std::unique_ptr<IReader> source_;
+    std::unique_ptr<State> st_;
+    std::vector<std::uint8_t> in_buffer_;
+    unsigned threads_ = 1;
+    std::uint64_t memlimit_ = 0;
+    std::uint64_t peak_mem_ = 0;
+    bool source_eof_ = false;
+    bool eof_reached_ = false;
+    int error_ = 0;
+};
+
+} // namespace flash
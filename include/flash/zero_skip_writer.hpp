@@ -0,0 +1,52 @@
+#pragma once
+
+#include "flash/io.hpp"
+#include "flash/result.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace flash {
+
+// Writer adapter that scans the stream for all-zero blocks and hands runs of
+// them to the inner writer's WriteZeroes() instead of writing them. Blocks are
+// aligned to the output offset, so a run always starts and ends on a block
+// boundary of the target.
+class ZeroSkipWriter final : public IWriter {
+public:
+    struct Options {
+        std::size_t block_bytes = 4096;
+        // Shorter zero runs are written as data; punching a hole per 4 KiB
+        // block costs about as much as writing it.
+        std::uint64_t min_run_bytes = 64 * 1024;
+    };
+
+    explicit ZeroSkipWriter(IWriter& inner) : ZeroSkipWriter(inner, Options{}) {}
+    ZeroSkipWriter(IWriter& inner, Options opt);
+
+    Result WriteAll(std::span<const std::uint8_t> in) override;
+    Result WriteZeroes(std::uint64_t len) override;
+    Result Skip(std::uint64_t len) override;
+    Result FsyncNow() override;
+    Result FsyncAsync() override;
+
+    // Zero bytes that reached the target without being written.
+    std::uint64_t SkippedBytes() const { return skipped_; }
+
+private:
+    Result FlushZeroes();
+    Result FlushCarry();
+    Result WriteData(std::span<const std::uint8_t> in);
+    Result WriteBlocks(std::span<const std::uint8_t> in);
+
+    IWriter& inner_;
+    Options opt_;
+    std::uint64_t offset_ = 0;   // output bytes passed on (or queued as zeros)
+    std::vector<std::uint8_t> carry_;  // partial block waiting for more input
+    std::uint64_t pending_ = 0;  // zero run not yet handed to inner_
+    std::uint64_t skipped_ = 0;
+};
+
+} // namespace flash
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "flash/io.hpp"
+
+#include <memory>
+#include <vector>
+
+struct ZSTD_DCtx_s;
+
+namespace flash {
+
+// Streaming zstd decoder. Accepts concatenated frames and frames written with
+// long-distance matching (`zstd --long=N`): the window limit is raised to the
+// library maximum, memory is only committed for the window a frame declares.
+class ZstdReader final : public IReader {
+public:
+    // `max_window_log` == 0 => the largest window the library supports.
+    explicit ZstdReader(std::unique_ptr<IReader> source, int max_window_log = 0);
+    ~ZstdReader() override;
+
+    ZstdReader(const ZstdReader&) = delete;
+    ZstdReader& operator=(const ZstdReader&) = delete;
+
+    ssize_t Read(std::span<std::uint8_t> out) override;
+    std::optional<std::uint64_t> TotalSize() const override { return std::nullopt; }
+
+private:
+    std::unique_ptr<IReader> source_;
+    ZSTD_DCtx_s* dctx_ = nullptr;
+    std::vector<std::uint8_t> in_buffer_;
+    std::size_t in_pos_ = 0;
+    std::size_t in_len_ = 0;
+    bool in_frame_ = false;   // a frame was started and not yet finished
+    bool eof_reached_ = false;
+};
+
+} // namespace flash
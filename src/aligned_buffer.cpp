@@ -0,0 +1,69 @@
+#include "flash/aligned_buffer.hpp"
+
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+#include <unistd.h>
+
+namespace flash {
+
+AlignedBuffer::AlignedBuffer(size_t size) {
+    if (size == 0) return;
+    void* p = nullptr;
+    if (::posix_memalign(&p, PageSize(), size) != 0) throw std::bad_alloc();
+    data_ = static_cast<std::uint8_t*>(p);
+    size_ = size;
+}
+
+AlignedBuffer::~AlignedBuffer() {
+    std::free(data_);
+}
+
+AlignedBuffer::AlignedBuffer(AlignedBuffer&& other) noexcept
+    : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+
+AlignedBuffer& AlignedBuffer::operator=(AlignedBuffer&& other) noexcept {
+    if (this != &other) {
+        std::free(data_);
+        data_ = std::exchange(other.data_, nullptr);
+        size_ = std::exchange(other.size_, 0);
+    }
+    return *this;
+}
+
+size_t AlignedBuffer::PageSize() {
+    static const size_t page = [] {
+        const long v = ::sysconf(_SC_PAGESIZE);
+        return v > 0 ? static_cast<size_t>(v) : size_t{4096};
+    }();
+    return page;
+}
+
+AlignedBuffer AlignedBufferPool::Acquire(size_t size) {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        for (size_t i = 0; i < cache_.size(); ++i) {
+            if (cache_[i].size() == size) {
+                AlignedBuffer b = std::move(cache_[i]);
+                cache_.erase(cache_.begin() + static_cast<std::ptrdiff_t>(i));
+                return b;
+            }
+        }
+    }
+    return AlignedBuffer(size);
+}
+
+void AlignedBufferPool::Release(AlignedBuffer buf) {
+    if (buf.empty()) return;
+    std::lock_guard<std::mutex> lk(mu_);
+    if (cache_.size() >= max_cached_) cache_.erase(cache_.begin());
+    cache_.push_back(std::move(buf));
+}
+
+AlignedBufferPool& AlignedBufferPool::Shared() {
+    static AlignedBufferPool pool;
+    return pool;
+}
+
+} // namespace flash
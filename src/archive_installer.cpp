@@ -1,6 +1,9 @@
 #include "flash/archive_installer.hpp"
+#include "flash/durability.hpp"
+#include "flash/ext4_builder.hpp"
 #include "flash/logger.hpp"
 #include "flash/signals.hpp"
+#include "flash/tree_writer.hpp"
 
 #include <archive.h>
 #include <archive_entry.h>
@@ -24,11 +27,6 @@ struct ArchiveReadDeleter {
         if (a) archive_read_free(a);
     }
 };
-struct ArchiveWriteDeleter {
-    void operator()(archive* a) const {
-        if (a) archive_write_free(a);
-    }
-};
 
 class MountGuard {
 public:
@@ -63,35 +61,6 @@ private:
     bool mounted_ = false;
 };
 
-#include <fcntl.h>
-#include <unistd.h>
-
-class ChdirGuard {
-public:
-    explicit ChdirGuard(const std::string& new_dir) {
-        old_fd_ = ::open(".", O_RDONLY | O_DIRECTORY);
-        if (old_fd_ < 0) return;
-
-        if (::chdir(new_dir.c_str()) != 0) {
-            ::close(old_fd_);
-            old_fd_ = -1;
-        }
-    }
-
-    ~ChdirGuard() {
-        if (old_fd_ >= 0) {
-            (void)::fchdir(old_fd_);
-            ::close(old_fd_);
-        }
-    }
-
-    bool ok() const { return old_fd_ >= 0; }
-
-private:
-    int old_fd_ = -1;
-};
-
-
 static bool IsDevPath(std::string_view s) {
     return s.rfind("/dev/", 0) == 0;
 }
@@ -133,15 +102,6 @@ static std::string NormalizeTarPath(std::string s) {
     return out;
 }
 
-static std::string JoinPath(const std::string& base, const std::string& rel) {
-    if (base.empty()) return rel;
-    if (rel.empty()) return base;
-    std::string full = base;
-    if (full.back() != '/') full.push_back('/');
-    full += rel;
-    return full;
-}
-
 struct ReaderCtx {
     IReader* r = nullptr;
     std::vector<std::uint8_t> buf;
@@ -170,6 +130,21 @@ static std::string ArchiveErr(archive* a) {
     return s ? std::string(s) : std::string("unknown");
 }
 
+static TreeEntryMeta MetaOf(archive_entry* e) {
+    TreeEntryMeta m;
+    m.mode = archive_entry_mode(e);
+    m.uid = archive_entry_uid(e);
+    m.gid = archive_entry_gid(e);
+    m.rdev = archive_entry_rdev(e);
+    if (archive_entry_size_is_set(e)) m.size = archive_entry_size(e);
+    m.sparse = archive_entry_sparse_count(e) > 0;
+    m.has_atime = archive_entry_atime_is_set(e) != 0;
+    m.atime = {static_cast<time_t>(archive_entry_atime(e)), archive_entry_atime_nsec(e)};
+    m.has_mtime = archive_entry_mtime_is_set(e) != 0;
+    m.mtime = {static_cast<time_t>(archive_entry_mtime(e)), archive_entry_mtime_nsec(e)};
+    return m;
+}
+
 } // namespace
 
 ArchiveInstaller::ArchiveInstaller() : opt_() {
@@ -183,6 +158,8 @@ ArchiveInstaller::ArchiveInstaller(Options opt) : opt_(std::move(opt)) {
 Result ArchiveInstaller::InstallTarStreamToTarget(IReader& tar_stream, std::string_view install_to, std::string_view tag) {
     if (install_to.empty()) return Result::Fail(-1, "install_to is empty");
 
+    if (!opt_.mkfs.empty()) return BuildFilesystem(tar_stream, std::string(install_to), tag);
+
     if (IsDevPath(install_to)) {
         fs::path base = opt_.mount_base_dir.empty() ? "/mnt" : opt_.mount_base_dir;
         std::error_code ec;
@@ -218,6 +195,13 @@ Result ArchiveInstaller::InstallTarStreamToTarget(IReader& tar_stream, std::stri
         auto r = ExtractTarStreamToDir(tar_stream, mg.Dir(), tag);
         if (!r.is_ok()) return r;
 
+        // Under DurabilityMode::Final the unmount is what writes the
+        // filesystem back.
+        if (opt_.durability && opt_.durability->ComponentFlushes()) {
+            r = opt_.durability->SyncFilesystem(mg.Dir());
+            if (!r.is_ok()) return r;
+        }
+
         if (::umount2(mg.Dir().c_str(), 0) != 0) {
             const int err = errno;
             return Result::Fail(err, "umount failed: " + std::string(std::strerror(err)));
@@ -241,12 +225,54 @@ Result ArchiveInstaller::InstallTarStreamToTarget(IReader& tar_stream, std::stri
         auto r = ExtractTarStreamToDir(tar_stream, dst.string(), tag);
         if (!r.is_ok()) return r;
 
+        if (opt_.durability) {
+            r = opt_.durability->ComponentFlushes() ? opt_.durability->SyncFilesystem(dst.string())
+                                                    : opt_.durability->Defer(dst.string());
+            if (!r.is_ok()) return r;
+        }
+
         LogInfo("[%.*s] archive install done", (int)tag.size(), tag.data());
         return Result::Ok();
     }
 }
 
+Result ArchiveInstaller::BuildFilesystem(IReader& tar_stream, const std::string& target, std::string_view tag) {
+    if (opt_.mkfs != "ext4") return Result::Fail(EINVAL, "Unsupported mkfs filesystem: " + opt_.mkfs);
+
+    std::unique_ptr<Ext4Builder> fs;
+    auto r = Ext4Builder::Open(target, Ext4Builder::Options{}, fs);
+    if (!r.is_ok()) return r;
+    LogInfo("[%.*s] build ext4 -> %s (%llu MiB)", (int)tag.size(), tag.data(), target.c_str(),
+            (unsigned long long)(fs->BlocksCount() * 4096 / (1024 * 1024)));
+
+    r = ExtractTarStream(tar_stream, *fs, target, tag);
+    if (!r.is_ok()) return r;
+
+    if (!opt_.durability || opt_.durability->ComponentFlushes()) {
+        r = opt_.durability ? opt_.durability->Timed([&] { return fs->Sync(); }) : fs->Sync();
+    } else {
+        r = opt_.durability->Defer(target);
+    }
+    if (!r.is_ok()) return r;
+
+    LogInfo("[%.*s] archive install done", (int)tag.size(), tag.data());
+    return Result::Ok();
+}
+
 Result ArchiveInstaller::ExtractTarStreamToDir(IReader& tar_stream, const std::string& dst_dir, std::string_view tag) {
+    // Parsing and decompression stay on this thread; file creation, writes
+    // and metadata calls for small files run on the writer's pool.
+    TreeWriter::Options topt;
+    topt.workers = opt_.extract_workers;
+    topt.preallocate = opt_.preallocate;
+    std::unique_ptr<TreeWriter> tree;
+    auto res = TreeWriter::Open(dst_dir, topt, tree);
+    if (!res.is_ok()) return res;
+    return ExtractTarStream(tar_stream, *tree, dst_dir, tag);
+}
+
+Result ArchiveInstaller::ExtractTarStream(IReader& tar_stream, TreeSink& tree, const std::string& where,
+                                          std::string_view tag) {
     std::unique_ptr<archive, ArchiveReadDeleter> ar(archive_read_new());
     if (!ar) return Result::Fail(-1, "archive_read_new failed");
 
@@ -259,29 +285,7 @@ Result ArchiveInstaller::ExtractTarStreamToDir(IReader& tar_stream, const std::s
         return Result::Fail(-1, "archive_read_open2: " + ArchiveErr(ar.get()));
     }
 
-    std::unique_ptr<archive, ArchiveWriteDeleter> aw(archive_write_disk_new());
-    if (!aw) return Result::Fail(-1, "archive_write_disk_new failed");
-
-    int flags = 0;
-    flags |= ARCHIVE_EXTRACT_UNLINK;
-    flags |= ARCHIVE_EXTRACT_PERM;
-    flags |= ARCHIVE_EXTRACT_TIME;
-
-    flags |= ARCHIVE_EXTRACT_SECURE_NODOTDOT;
-    flags |= ARCHIVE_EXTRACT_SECURE_SYMLINKS;
-#if defined(ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS)
-    flags |= ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS;  // now OK because we keep relative paths
-#endif
-
-    archive_write_disk_set_options(aw.get(), flags);
-    archive_write_disk_set_standard_lookup(aw.get());
-
-    // IMPORTANT: extract relative paths into dst_dir
-    ChdirGuard cd(dst_dir);
-    if (!cd.ok()) {
-        return Result::Fail(errno, "chdir(dst_dir) failed: " + std::string(std::strerror(errno)));
-    }
-
+    Result res = Result::Ok();
     std::uint64_t extracted = 0;
     std::uint64_t next_progress =
         (opt_.progress_interval_bytes ? opt_.progress_interval_bytes : (4ULL * 1024 * 1024));
@@ -295,33 +299,61 @@ Result ArchiveInstaller::ExtractTarStreamToDir(IReader& tar_stream, const std::s
 
         const char* p0 = archive_entry_pathname(entry);
         std::string rel = NormalizeTarPath(p0 ? std::string(p0) : std::string());
+        while (!rel.empty() && rel.back() == '/') rel.pop_back();
 
         if (rel.empty() || rel == ".") {
             (void)archive_read_data_skip(ar.get());
             continue;
         }
-        if (opt_.safe_paths_only && !IsSafeRelativePath(rel)) {
-            return Result::Fail(-1, "Unsafe path in archive: " + rel);
+        // The tree writer only takes paths below the root.
+        if (!IsSafeRelativePath(rel)) {
+            if (opt_.safe_paths_only) return Result::Fail(-1, "Unsafe path in archive: " + rel);
+            LogWarn("[%.*s] skipping unsafe path: %s", (int)tag.size(), tag.data(), rel.c_str());
+            (void)archive_read_data_skip(ar.get());
+            continue;
         }
 
-        // Keep RELATIVE path (critical fix)
-        archive_entry_set_pathname(entry, rel.c_str());
+        LogDebug("[%.*s] entry: %s/%s", (int)tag.size(), tag.data(), where.c_str(), rel.c_str());
+
+        const TreeEntryMeta meta = MetaOf(entry);
 
-        // Hardlink target should also be relative
         if (const char* hl0 = archive_entry_hardlink(entry); hl0 && *hl0) {
             std::string rel_hl = NormalizeTarPath(std::string(hl0));
-            if (!rel_hl.empty() && rel_hl != ".") {
-                if (opt_.safe_paths_only && !IsSafeRelativePath(rel_hl)) {
-                    return Result::Fail(-1, "Unsafe hardlink target in archive: " + rel_hl);
-                }
-                archive_entry_set_hardlink(entry, rel_hl.c_str());
+            if (!IsSafeRelativePath(rel_hl)) {
+                return Result::Fail(-1, "Unsafe hardlink target in archive: " + rel_hl);
             }
+            res = tree.Hardlink(rel, rel_hl);
+            if (!res.is_ok()) return res;
+            (void)archive_read_data_skip(ar.get());
+            continue;
         }
 
-        LogDebug("[%.*s] entry: %s/%s", (int)tag.size(), tag.data(), dst_dir.c_str(), rel.c_str());
-
-        const int wh = archive_write_header(aw.get(), entry);
-        if (wh != ARCHIVE_OK) return Result::Fail(-1, "archive_write_header: " + ArchiveErr(aw.get()));
+        switch (archive_entry_filetype(entry)) {
+        case AE_IFDIR:
+            res = tree.Directory(rel, meta);
+            break;
+        case AE_IFLNK: {
+            const char* target = archive_entry_symlink(entry);
+            res = tree.Symlink(rel, target ? target : "", meta);
+            break;
+        }
+        case AE_IFIFO:
+        case AE_IFCHR:
+        case AE_IFBLK:
+            res = tree.Special(rel, meta);
+            break;
+        case AE_IFREG:
+            res = tree.BeginFile(rel, meta);
+            break;
+        default:
+            LogWarn("[%.*s] skipping unsupported entry type: %s", (int)tag.size(), tag.data(), rel.c_str());
+            break;
+        }
+        if (!res.is_ok()) return res;
+        if (archive_entry_filetype(entry) != AE_IFREG) {
+            (void)archive_read_data_skip(ar.get());
+            continue;
+        }
 
         const void* buff = nullptr;
         size_t size = 0;
@@ -332,8 +364,8 @@ Result ArchiveInstaller::ExtractTarStreamToDir(IReader& tar_stream, const std::s
             if (rr == ARCHIVE_EOF) break;
             if (rr != ARCHIVE_OK) return Result::Fail(-1, "archive_read_data_block: " + ArchiveErr(ar.get()));
 
-            const int ww = archive_write_data_block(aw.get(), buff, size, offset);
-            if (ww != ARCHIVE_OK) return Result::Fail(-1, "archive_write_data_block: " + ArchiveErr(aw.get()));
+            res = tree.FileData({static_cast<const std::uint8_t*>(buff), size}, offset);
+            if (!res.is_ok()) return res;
 
             extracted += (std::uint64_t)size;
             if (opt_.progress && opt_.progress_interval_bytes > 0 && extracted >= next_progress) {
@@ -343,10 +375,13 @@ Result ArchiveInstaller::ExtractTarStreamToDir(IReader& tar_stream, const std::s
             }
         }
 
-        const int wf = archive_write_finish_entry(aw.get());
-        if (wf != ARCHIVE_OK) return Result::Fail(-1, "archive_write_finish_entry: " + ArchiveErr(aw.get()));
+        res = tree.EndFile();
+        if (!res.is_ok()) return res;
     }
 
+    res = tree.Finish();
+    if (!res.is_ok()) return res;
+    LogDebug("[%.*s] %llu files written", (int)tag.size(), tag.data(), (unsigned long long)tree.FilesWritten());
     return Result::Ok();
 }
 
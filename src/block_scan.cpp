@@ -0,0 +1,92 @@
+#include "flash/block_scan.hpp"
+
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define FLASH_SCAN_NEON 1
+#endif
+
+namespace flash {
+
+namespace {
+
+bool IsAllZeroScalar(const std::uint8_t* p, size_t n) {
+    std::uint64_t acc = 0;
+    while (n >= 8) {
+        std::uint64_t w;
+        std::memcpy(&w, p, 8);
+        acc |= w;
+        p += 8;
+        n -= 8;
+    }
+    while (n--) acc |= *p++;
+    return acc == 0;
+}
+
+} // namespace
+
+bool IsAllZero(std::span<const std::uint8_t> data) {
+    const std::uint8_t* p = data.data();
+    size_t n = data.size();
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    while (n >= 256) {
+        __m128i acc = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        for (size_t off = 16; off < 256; off += 16) {
+            acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + off)));
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF) return false;
+        p += 256;
+        n -= 256;
+    }
+#elif defined(FLASH_SCAN_NEON)
+    while (n >= 256) {
+        uint8x16_t acc = vld1q_u8(p);
+        for (size_t off = 16; off < 256; off += 16) acc = vorrq_u8(acc, vld1q_u8(p + off));
+        if (vmaxvq_u8(acc) != 0) return false;
+        p += 256;
+        n -= 256;
+    }
+#endif
+
+    return IsAllZeroScalar(p, n);
+}
+
+bool IsEqual(std::span<const std::uint8_t> a, std::span<const std::uint8_t> b) {
+    if (a.size() != b.size()) return false;
+    const std::uint8_t* p = a.data();
+    const std::uint8_t* q = b.data();
+    size_t n = a.size();
+
+#if defined(__SSE2__)
+    while (n >= 256) {
+        __m128i acc = _mm_setzero_si128();
+        for (size_t off = 0; off < 256; off += 16) {
+            const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + off));
+            const __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(q + off));
+            acc = _mm_or_si128(acc, _mm_xor_si128(x, y));
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF) return false;
+        p += 256;
+        q += 256;
+        n -= 256;
+    }
+#elif defined(FLASH_SCAN_NEON)
+    while (n >= 256) {
+        uint8x16_t acc = vdupq_n_u8(0);
+        for (size_t off = 0; off < 256; off += 16) acc = vorrq_u8(acc, veorq_u8(vld1q_u8(p + off), vld1q_u8(q + off)));
+        if (vmaxvq_u8(acc) != 0) return false;
+        p += 256;
+        q += 256;
+        n -= 256;
+    }
+#endif
+
+    return std::memcmp(p, q, n) == 0;
+}
+
+} // namespace flash
@@ -0,0 +1,441 @@
+// bundle_index.cpp - Bundle index entry, indexed bundle writer and RangeReader.
+
+#include "flash/bundle_index.hpp"
+
+#include "flash/decompress.hpp"
+#include "flash/sha256.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using json = nlohmann::json;
+
+namespace flash {
+
+namespace {
+
+constexpr std::size_t kBlock = 512;
+constexpr std::size_t kRecord = 20 * kBlock;  // tar's default record size
+constexpr const char* kFormat = "flash-bundle-index-1";
+
+std::uint64_t Pad(std::uint64_t n) {
+    return (n + kBlock - 1) / kBlock * kBlock;
+}
+
+std::string Errno(const std::string& what) {
+    return what + " (" + std::strerror(errno) + ")";
+}
+
+bool PreadExact(int fd, std::uint8_t* p, std::size_t len, std::uint64_t off) {
+    while (len > 0) {
+        const ssize_t n = ::pread(fd, p, len, static_cast<off_t>(off));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= static_cast<std::size_t>(n);
+        off += static_cast<std::uint64_t>(n);
+    }
+    return true;
+}
+
+Result WriteFull(int fd, const std::uint8_t* p, std::size_t len) {
+    while (len > 0) {
+        const ssize_t n = ::write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return Result::Fail(errno, Errno("bundle write failed"));
+        p += n;
+        len -= static_cast<std::size_t>(n);
+    }
+    return Result::Ok();
+}
+
+// ustar size field: octal below 8 GiB, GNU base-256 above.
+void PutSize(std::uint8_t* f, std::uint64_t size) {
+    if (size < (1ULL << 33)) {
+        std::snprintf(reinterpret_cast<char*>(f), 12, "%011llo", static_cast<unsigned long long>(size));
+        return;
+    }
+    f[0] = 0x80;
+    for (int i = 11; i >= 1; --i) {
+        f[i] = static_cast<std::uint8_t>(size);
+        size >>= 8;
+    }
+}
+
+bool GetSize(const std::uint8_t* f, std::uint64_t& out) {
+    out = 0;
+    if (f[0] & 0x80) {
+        for (int i = 1; i < 12; ++i) out = (out << 8) | f[i];
+        return true;
+    }
+    int i = 0;
+    while (i < 12 && f[i] == ' ') ++i;
+    bool any = false;
+    for (; i < 12 && f[i] >= '0' && f[i] <= '7'; ++i) {
+        out = out * 8 + static_cast<std::uint64_t>(f[i] - '0');
+        any = true;
+    }
+    return any;
+}
+
+void UstarHeader(std::uint8_t* h, const std::string& name, std::uint64_t size) {
+    std::memset(h, 0, kBlock);
+    std::memcpy(h, name.data(), name.size());
+    std::memcpy(h + 100, "0000644", 7);
+    std::memcpy(h + 108, "0000000", 7);
+    std::memcpy(h + 116, "0000000", 7);
+    PutSize(h + 124, size);
+    std::memcpy(h + 136, "00000000000", 11);
+    h[156] = '0';
+    std::memcpy(h + 257, "ustar", 6);
+    std::memcpy(h + 263, "00", 2);
+
+    std::memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (std::size_t i = 0; i < kBlock; ++i) sum += h[i];
+    std::snprintf(reinterpret_cast<char*>(h + 148), 8, "%06o", sum);
+    h[155] = ' ';
+}
+
+Result WriteEntry(int out, const std::string& name, const std::uint8_t* data, std::size_t len) {
+    std::uint8_t h[kBlock];
+    UstarHeader(h, name, len);
+    auto r = WriteFull(out, h, sizeof(h));
+    if (r.is_ok()) r = WriteFull(out, data, len);
+    static const std::uint8_t kZeros[kBlock] = {};
+    if (r.is_ok()) r = WriteFull(out, kZeros, static_cast<std::size_t>(Pad(len) - len));
+    return r;
+}
+
+Result CopyEntry(int out, const std::string& name, const std::string& path, std::uint64_t size) {
+    Fd in(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (in.Get() < 0) return Result::Fail(errno, Errno("Failed to open " + path));
+
+    std::uint8_t h[kBlock];
+    UstarHeader(h, name, size);
+    auto r = WriteFull(out, h, sizeof(h));
+    std::vector<std::uint8_t> buf(1024 * 1024);
+    std::uint64_t left = size;
+    while (r.is_ok() && left > 0) {
+        const ssize_t n = ::read(in.Get(), buf.data(), std::min<std::uint64_t>(buf.size(), left));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return Result::Fail(n < 0 ? errno : EIO, path + " changed while writing the bundle");
+        r = WriteFull(out, buf.data(), static_cast<std::size_t>(n));
+        left -= static_cast<std::uint64_t>(n);
+    }
+    std::fill_n(buf.begin(), kBlock, 0);
+    if (r.is_ok()) r = WriteFull(out, buf.data(), static_cast<std::size_t>(Pad(size) - size));
+    return r;
+}
+
+bool ChecksumOk(const std::uint8_t* h) {
+    unsigned sum = 0;
+    for (std::size_t i = 0; i < kBlock; ++i) sum += (i >= 148 && i < 156) ? ' ' : h[i];
+    std::uint64_t want = 0;
+    return GetSize(h + 148, want) && want == sum;
+}
+
+// Value of `key` in a pax extended header ("<len> key=value\n" records).
+std::string PaxValue(const std::string& pax, const std::string& key) {
+    std::size_t pos = 0;
+    while (pos < pax.size()) {
+        const std::size_t sp = pax.find(' ', pos);
+        if (sp == std::string::npos) break;
+        const std::size_t len = std::strtoull(pax.c_str() + pos, nullptr, 10);
+        if (len == 0 || pos + len > pax.size()) break;
+        const std::string rec = pax.substr(sp + 1, pos + len - sp - 2);  // drop trailing '\n'
+        if (rec.rfind(key + "=", 0) == 0) return rec.substr(key.size() + 1);
+        pos += len;
+    }
+    return {};
+}
+
+// Size, sha256 and sniffed compression of a payload file.
+Result Describe(const std::string& path, BundleIndexEntry& e) {
+    Fd fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd.Get() < 0) return Result::Fail(errno, Errno("Failed to open " + path));
+    (void)::posix_fadvise(fd.Get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    Sha256 h;
+    std::vector<std::uint8_t> buf(1024 * 1024);
+    std::uint8_t head[8] = {};
+    std::size_t head_len = 0;
+    e.size = 0;
+    while (true) {
+        const ssize_t n = ::read(fd.Get(), buf.data(), buf.size());
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return Result::Fail(errno, Errno("Failed to read " + path));
+        if (n == 0) break;
+        if (head_len < sizeof(head)) {
+            const std::size_t take = std::min(sizeof(head) - head_len, static_cast<std::size_t>(n));
+            std::memcpy(head + head_len, buf.data(), take);
+            head_len += take;
+        }
+        h.Update({buf.data(), static_cast<std::size_t>(n)});
+        e.size += static_cast<std::uint64_t>(n);
+    }
+    e.sha256 = Sha256::ToHex(h.Final());
+    e.compression = CompressionName(SniffCompression({head, head_len}));
+    return Result::Ok();
+}
+
+} // namespace
+
+const BundleIndexEntry* BundleIndex::Find(const std::string& name) const {
+    for (const auto& e : entries) {
+        if (e.name == name) return &e;
+    }
+    return nullptr;
+}
+
+std::expected<BundleIndex, std::string> BundleIndex::Parse(const std::string& text) {
+    try {
+        auto j = json::parse(text);
+        if (!j.is_object() || j.value("format", "") != kFormat) {
+            return std::unexpected(std::string("not a ") + kFormat + " index");
+        }
+        BundleIndex idx;
+        for (const auto& item : j.at("entries")) {
+            BundleIndexEntry e;
+            e.name = item.at("name").get<std::string>();
+            e.offset = item.at("offset").get<std::uint64_t>();
+            e.size = item.at("size").get<std::uint64_t>();
+            e.compression = item.value("compression", "");
+            e.sha256 = item.value("sha256", "");
+            if (e.name.empty()) return std::unexpected("index entry without a name");
+            idx.entries.push_back(std::move(e));
+        }
+        return idx;
+    } catch (const std::exception& e) {
+        return std::unexpected(std::string("Index parse error: ") + e.what());
+    }
+}
+
+std::string BundleIndex::ToJson() const {
+    json j;
+    j["format"] = kFormat;
+    j["entries"] = json::array();
+    for (const auto& e : entries) {
+        j["entries"].push_back({{"name", e.name},
+                                {"offset", e.offset},
+                                {"size", e.size},
+                                {"compression", e.compression},
+                                {"sha256", e.sha256}});
+    }
+    return j.dump();
+}
+
+Result VerifyIndexEntry(int fd, const BundleIndexEntry& e) {
+    struct stat st {};
+    if (::fstat(fd, &st) != 0) return Result::Fail(errno, Errno("fstat failed"));
+    const auto file_size = static_cast<std::uint64_t>(st.st_size);
+    if (e.offset < kBlock || e.offset % kBlock != 0 || e.offset > file_size || e.size > file_size - e.offset) {
+        return Result::Fail(EBADMSG, "index entry " + e.name + " lies outside the bundle");
+    }
+
+    std::uint8_t h[kBlock];
+    if (!PreadExact(fd, h, sizeof(h), e.offset - kBlock)) {
+        return Result::Fail(errno ? errno : EIO, "Failed to read tar header of " + e.name);
+    }
+    std::uint64_t size = 0;
+    const std::size_t name_len = strnlen(reinterpret_cast<const char*>(h), 100);
+    const std::string name(reinterpret_cast<const char*>(h), name_len);
+    auto strip = [](std::string s) { return s.rfind("./", 0) == 0 ? s.substr(2) : s; };
+    if (std::memcmp(h + 257, "ustar", 5) != 0 || strip(name) != strip(e.name) || !GetSize(h + 124, size) ||
+        size != e.size) {
+        return Result::Fail(EBADMSG, "index entry " + e.name + " does not match the tar header at its offset");
+    }
+    return Result::Ok();
+}
+
+Result ScanTarIndex(int fd, BundleIndex& out) {
+    struct stat st {};
+    if (::fstat(fd, &st) != 0) return Result::Fail(errno, Errno("fstat failed"));
+    const auto file_size = static_cast<std::uint64_t>(st.st_size);
+
+    out.entries.clear();
+    std::string long_name;  // from a pax or GNU 'L' header, applies to the next entry
+    std::string pax_size;
+    std::uint64_t off = 0;
+    std::uint8_t h[kBlock];
+    while (off + kBlock <= file_size) {
+        if (!PreadExact(fd, h, sizeof(h), off)) return Result::Fail(errno ? errno : EIO, "Failed to read tar header");
+        if (std::all_of(h, h + kBlock, [](std::uint8_t b) { return b == 0; })) return Result::Ok();
+
+        std::uint64_t size = 0;
+        if (!ChecksumOk(h) || !GetSize(h + 124, size)) {
+            return Result::Fail(EBADMSG, "not an uncompressed tar (bad header at " + std::to_string(off) + ")");
+        }
+        const std::uint64_t data = off + kBlock;
+        if (size > file_size - data) return Result::Fail(EBADMSG, "tar entry runs past the end of the bundle");
+
+        const char type = static_cast<char>(h[156]);
+        if (type == 'x' || type == 'L') {
+            if (size > 1024 * 1024) return Result::Fail(EBADMSG, "oversized tar extended header");
+            std::string ext(static_cast<std::size_t>(size), '\0');
+            if (!PreadExact(fd, reinterpret_cast<std::uint8_t*>(ext.data()), ext.size(), data)) {
+                return Result::Fail(errno ? errno : EIO, "Failed to read tar extended header");
+            }
+            if (type == 'L') {
+                long_name = ext.c_str();
+            } else {
+                if (auto p = PaxValue(ext, "path"); !p.empty()) long_name = p;
+                pax_size = PaxValue(ext, "size");
+            }
+        } else {
+            if (!pax_size.empty()) size = std::strtoull(pax_size.c_str(), nullptr, 10);
+            if (type == '0' || type == '\0') {
+                BundleIndexEntry e;
+                if (!long_name.empty()) {
+                    e.name = long_name;
+                } else {
+                    const std::string name(reinterpret_cast<const char*>(h), strnlen(reinterpret_cast<const char*>(h), 100));
+                    const std::string prefix(reinterpret_cast<const char*>(h + 345),
+                                             strnlen(reinterpret_cast<const char*>(h + 345), 155));
+                    e.name = prefix.empty() ? name : prefix + "/" + name;
+                }
+                if (e.name.rfind("./", 0) == 0) e.name.erase(0, 2);
+                e.offset = data;
+                e.size = size;
+                out.entries.push_back(std::move(e));
+            }
+            long_name.clear();
+            pax_size.clear();
+        }
+        off = data + Pad(size);
+    }
+    return Result::Fail(EBADMSG, "tar bundle has no end-of-archive marker");
+}
+
+Result WriteIndexedBundle(const std::string& out_path, const std::string& manifest_path,
+                          const std::vector<std::string>& files) {
+    std::string manifest;
+    {
+        Fd in(::open(manifest_path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (in.Get() < 0) return Result::Fail(errno, Errno("Failed to open " + manifest_path));
+        char buf[64 * 1024];
+        ssize_t n;
+        while ((n = ::read(in.Get(), buf, sizeof(buf))) > 0) manifest.append(buf, static_cast<std::size_t>(n));
+        if (n < 0) return Result::Fail(errno, Errno("Failed to read " + manifest_path));
+    }
+
+    BundleIndex idx;
+    for (const auto& f : files) {
+        BundleIndexEntry e;
+        e.name = std::filesystem::path(f).filename().string();
+        if (e.name.empty() || e.name.size() >= 100) {
+            return Result::Fail(EINVAL, "bundle entry name must be 1..99 bytes: " + f);
+        }
+        if (idx.Find(e.name) || e.name == "manifest.json" || e.name == kBundleIndexName) {
+            return Result::Fail(EINVAL, "duplicate bundle entry name: " + e.name);
+        }
+        auto r = Describe(f, e);
+        if (!r.is_ok()) return r;
+        idx.entries.push_back(std::move(e));
+    }
+
+    // Offsets depend on the index's own padded size; grow it until the JSON
+    // fits, then pad the entry with spaces to exactly that size.
+    std::uint64_t index_bytes = kBlock;
+    std::string text;
+    while (true) {
+        std::uint64_t off = kBlock + Pad(manifest.size()) + kBlock + index_bytes;
+        for (auto& e : idx.entries) {
+            e.offset = off + kBlock;
+            off = e.offset + Pad(e.size);
+        }
+        text = idx.ToJson();
+        if (text.size() <= index_bytes) break;
+        index_bytes = Pad(text.size());
+    }
+    text.resize(static_cast<std::size_t>(index_bytes), ' ');
+
+    Fd out(::open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (out.Get() < 0) return Result::Fail(errno, Errno("Failed to create " + out_path));
+
+    auto r = WriteEntry(out.Get(), "manifest.json", reinterpret_cast<const std::uint8_t*>(manifest.data()),
+                        manifest.size());
+    if (r.is_ok()) {
+        r = WriteEntry(out.Get(), kBundleIndexName, reinterpret_cast<const std::uint8_t*>(text.data()), text.size());
+    }
+    for (std::size_t i = 0; r.is_ok() && i < files.size(); ++i) {
+        r = CopyEntry(out.Get(), idx.entries[i].name, files[i], idx.entries[i].size);
+    }
+    if (!r.is_ok()) return r;
+
+    // End-of-archive blocks, padded to a whole record.
+    const off_t end = ::lseek(out.Get(), 0, SEEK_CUR);
+    if (end < 0) return Result::Fail(errno, Errno("lseek failed"));
+    const std::uint64_t tail = 2 * kBlock;
+    const std::uint64_t total = (static_cast<std::uint64_t>(end) + tail + kRecord - 1) / kRecord * kRecord;
+    const std::vector<std::uint8_t> zeros(static_cast<std::size_t>(total - static_cast<std::uint64_t>(end)), 0);
+    r = WriteFull(out.Get(), zeros.data(), zeros.size());
+    if (!r.is_ok()) return r;
+    if (::fsync(out.Get()) != 0) return Result::Fail(errno, Errno("fsync failed"));
+    return Result::Ok();
+}
+
+Result RangeReader::Open(const std::string& path, std::uint64_t offset, std::uint64_t size, RangeReader& out) {
+    out.fd_.Reset(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (out.fd_.Get() < 0) return Result::Fail(errno, Errno("Failed to open " + path));
+    struct stat st {};
+    if (::fstat(out.fd_.Get(), &st) != 0) return Result::Fail(errno, Errno("fstat failed: " + path));
+    if (offset > static_cast<std::uint64_t>(st.st_size) || size > static_cast<std::uint64_t>(st.st_size) - offset) {
+        return Result::Fail(EINVAL, "range past the end of " + path);
+    }
+    (void)::posix_fadvise(out.fd_.Get(), static_cast<off_t>(offset), static_cast<off_t>(size),
+                          POSIX_FADV_SEQUENTIAL);
+    out.base_ = offset;
+    out.size_ = size;
+    out.pos_ = 0;
+    return Result::Ok();
+}
+
+ssize_t RangeReader::Read(std::span<std::uint8_t> out) {
+    const auto want = static_cast<std::size_t>(std::min<std::uint64_t>(out.size(), size_ - pos_));
+    if (want == 0) return 0;
+    while (true) {
+        const ssize_t n = ::pread(fd_.Get(), out.data(), want, static_cast<off_t>(base_ + pos_));
+        if (n < 0 && errno == EINTR) continue;
+        if (n > 0) pos_ += static_cast<std::uint64_t>(n);
+        return n;
+    }
+}
+
+bool RangeReader::KernelSource(FdSource& out) {
+    if (fd_.Get() < 0) return false;
+    out = {};
+    out.fd = fd_.Get();
+    out.offset = static_cast<std::int64_t>(base_ + pos_);
+    out.length = size_ - pos_;
+    return true;
+}
+
+std::int64_t RangeReader::Seek(std::int64_t offset, int whence) {
+    std::int64_t base = 0;
+    if (whence == SEEK_CUR) base = static_cast<std::int64_t>(pos_);
+    else if (whence == SEEK_END) base = static_cast<std::int64_t>(size_);
+    else if (whence != SEEK_SET) {
+        errno = EINVAL;
+        return -1;
+    }
+    const std::int64_t to = base + offset;
+    if (to < 0 || static_cast<std::uint64_t>(to) > size_) {
+        errno = EINVAL;
+        return -1;
+    }
+    pos_ = static_cast<std::uint64_t>(to);
+    return to;
+}
+
+} // namespace flash
@@ -0,0 +1,203 @@
+#include "flash/chunk_hashes.hpp"
+
+#include "flash/fd.hpp"
+#include "flash/manifest.hpp"
+#include "flash/thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace flash {
+
+namespace {
+
+constexpr std::size_t kReadBytes = 1024 * 1024;
+
+std::string Range(const ChunkHashes& h, std::size_t i, std::uint64_t image_bytes) {
+    return "chunk " + std::to_string(i) + " (bytes " + std::to_string(h.Begin(i)) + "-" +
+           std::to_string(h.End(i, image_bytes) - 1) + ")";
+}
+
+} // namespace
+
+std::uint64_t ChunkHashes::End(std::size_t i, std::uint64_t image_bytes) const {
+    return std::min(Begin(i) + chunk_bytes, image_bytes);
+}
+
+Result ChunkHashes::CheckLength(std::uint64_t image_bytes) const {
+    const std::uint64_t n = digests.size();
+    const bool fits = n == 0 ? image_bytes == 0 : image_bytes > (n - 1) * chunk_bytes && image_bytes <= n * chunk_bytes;
+    if (fits) return Result::Ok();
+    return Result::Fail(EBADMSG, "image is " + std::to_string(image_bytes) + " bytes, the manifest lists " +
+                                     std::to_string(n) + " chunks of " + std::to_string(chunk_bytes));
+}
+
+Result ChunkHashes::FromComponent(const Component& comp, ChunkHashes& out) {
+    out = ChunkHashes{};
+    if (comp.chunk_sha256.empty()) return Result::Ok();
+    // Whole 4 KiB blocks keep chunk boundaries on O_DIRECT boundaries.
+    if (comp.chunk_bytes == 0 || comp.chunk_bytes % 4096 != 0) {
+        return Result::Fail(EINVAL, "Invalid chunk size for component " + comp.name + ": " +
+                                        std::to_string(comp.chunk_bytes) + " (a multiple of 4096 expected)");
+    }
+    out.chunk_bytes = comp.chunk_bytes;
+    out.digests.resize(comp.chunk_sha256.size());
+    for (std::size_t i = 0; i < comp.chunk_sha256.size(); ++i) {
+        if (!Sha256::ParseHex(comp.chunk_sha256[i], out.digests[i])) {
+            return Result::Fail(EINVAL, "Invalid sha256 of chunk " + std::to_string(i) + " for component " +
+                                            comp.name + ": " + comp.chunk_sha256[i]);
+        }
+    }
+    return Result::Ok();
+}
+
+Result VerifyChunks(const std::string& path, const ChunkHashes& hashes, std::uint64_t image_bytes,
+                    unsigned threads, std::vector<std::size_t>* bad) {
+    if (bad) bad->clear();
+    auto res = hashes.CheckLength(image_bytes);
+    if (!res.is_ok() || hashes.Empty()) return res;
+
+    Fd fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd.Get() < 0) {
+        return Result::Fail(errno, "Failed to open for verify: " + path + " (" + std::strerror(errno) + ")");
+    }
+    // Drop clean cached pages so the read-back comes from the device.
+    (void)::posix_fadvise(fd.Get(), 0, static_cast<off_t>(image_bytes), POSIX_FADV_DONTNEED);
+
+    // Workers take chunks in order off a shared counter; each chunk is read
+    // and hashed by one of them.
+    std::atomic<std::size_t> next{0};
+    std::mutex mu;
+    std::vector<std::size_t> mismatched;
+    Result failed = Result::Ok();
+    auto work = [&] {
+        std::vector<std::uint8_t> buf(static_cast<std::size_t>(std::min<std::uint64_t>(kReadBytes, hashes.chunk_bytes)));
+        for (std::size_t i = next++; i < hashes.digests.size(); i = next++) {
+            Sha256 h;
+            const std::uint64_t end = hashes.End(i, image_bytes);
+            for (std::uint64_t off = hashes.Begin(i); off < end;) {
+                const auto want = static_cast<std::size_t>(std::min<std::uint64_t>(buf.size(), end - off));
+                const ssize_t n = ::pread(fd.Get(), buf.data(), want, static_cast<off_t>(off));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    const int err = n < 0 ? errno : EIO;
+                    std::lock_guard<std::mutex> lk(mu);
+                    if (failed.is_ok()) {
+                        failed = Result::Fail(err, "Read-back of " + Range(hashes, i, image_bytes) + " failed" +
+                                                       (n < 0 ? " (" + std::string(std::strerror(err)) + ")"
+                                                              : ": target ends at " + std::to_string(off)));
+                    }
+                    next = hashes.digests.size();
+                    return;
+                }
+                h.Update({buf.data(), static_cast<std::size_t>(n)});
+                off += static_cast<std::uint64_t>(n);
+            }
+            if (h.Final() != hashes.digests[i]) {
+                std::lock_guard<std::mutex> lk(mu);
+                mismatched.push_back(i);
+            }
+        }
+    };
+    {
+        if (threads == 0) threads = ThreadPool::DefaultThreads();
+        ThreadPool pool(static_cast<unsigned>(std::min<std::size_t>(threads, hashes.digests.size())));
+        for (std::size_t t = 0; t < pool.Size(); ++t) pool.Submit(work);
+    }
+    if (!failed.is_ok()) return failed;
+
+    std::sort(mismatched.begin(), mismatched.end());
+    if (bad) *bad = mismatched;
+    if (mismatched.empty()) return Result::Ok();
+    std::string msg = "Read-back mismatch in " + std::to_string(mismatched.size()) + " of " +
+                      std::to_string(hashes.digests.size()) + " chunks: ";
+    for (std::size_t k = 0; k < std::min<std::size_t>(mismatched.size(), 4); ++k) {
+        msg += (k ? ", " : "") + Range(hashes, mismatched[k], image_bytes);
+    }
+    if (mismatched.size() > 4) msg += ", ...";
+    return Result::Fail(EIO, msg);
+}
+
+ChunkVerifyWriter::ChunkVerifyWriter(IWriter& inner, const ChunkHashes& hashes, std::uint64_t offset)
+    : inner_(inner), hashes_(hashes), offset_(offset) {
+    if (hashes_.Empty()) return;
+    unchecked_ = static_cast<std::size_t>(offset / hashes_.chunk_bytes);
+    skipped_ = offset % hashes_.chunk_bytes != 0;
+}
+
+Result ChunkVerifyWriter::EndChunk() {
+    const std::size_t i = static_cast<std::size_t>((offset_ - 1) / hashes_.chunk_bytes);
+    if (i >= hashes_.digests.size()) return hashes_.CheckLength(offset_);
+    const Sha256Digest got = ctx_.Final();
+    ctx_ = Sha256{};
+    if (skipped_) {
+        skipped_ = false;
+        ++unchecked_;
+        return Result::Ok();
+    }
+    if (got != hashes_.digests[i]) {
+        return Result::Fail(EBADMSG, Range(hashes_, i, offset_) + " sha256 mismatch: expected " +
+                                         Sha256::ToHex(hashes_.digests[i]) + ", got " + Sha256::ToHex(got));
+    }
+    ++verified_;
+    return Result::Ok();
+}
+
+Result ChunkVerifyWriter::Hash(std::span<const std::uint8_t> in, bool last) {
+    ctx_.Update(in);
+    offset_ += in.size();
+    if (last || offset_ % hashes_.chunk_bytes == 0) return EndChunk();
+    return Result::Ok();
+}
+
+// Everything is checked before any of it is handed on.
+Result ChunkVerifyWriter::WriteAll(std::span<const std::uint8_t> in) {
+    for (std::span<const std::uint8_t> rest = in; !rest.empty();) {
+        const auto n = static_cast<std::size_t>(std::min<std::uint64_t>(rest.size(), Room()));
+        auto res = Hash(rest.first(n));
+        if (!res.is_ok()) return res;
+        rest = rest.subspan(n);
+    }
+    return inner_.WriteAll(in);
+}
+
+Result ChunkVerifyWriter::WriteZeroes(std::uint64_t len) {
+    static const std::uint8_t kZeros[64 * 1024] = {};
+    for (std::uint64_t left = len; left > 0;) {
+        const auto n = static_cast<std::size_t>(std::min<std::uint64_t>({left, sizeof(kZeros), Room()}));
+        auto res = Hash({kZeros, n});
+        if (!res.is_ok()) return res;
+        left -= n;
+    }
+    return inner_.WriteZeroes(len);
+}
+
+Result ChunkVerifyWriter::Skip(std::uint64_t len) {
+    for (std::uint64_t left = len; left > 0;) {
+        const std::uint64_t n = std::min(left, Room());
+        skipped_ = true;
+        offset_ += n;
+        left -= n;
+        if (offset_ % hashes_.chunk_bytes == 0) {
+            auto res = EndChunk();
+            if (!res.is_ok()) return res;
+        }
+    }
+    return inner_.Skip(len);
+}
+
+Result ChunkVerifyWriter::Finish() {
+    if (offset_ % hashes_.chunk_bytes != 0) {
+        auto res = Hash({}, true);
+        if (!res.is_ok()) return res;
+    }
+    return hashes_.CheckLength(offset_);
+}
+
+} // namespace flash
@@ -0,0 +1,348 @@
+// compare_writer.cpp - Read-compare-write adapter for raw installs.
+
+#include "flash/compare_writer.hpp"
+
+#include "flash/block_scan.hpp"
+#include "flash/logger.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace flash {
+
+namespace {
+
+const std::uint8_t kZeros[64 * 1024] = {};
+
+void HashZeros(AsyncSha256& h, std::uint64_t len) {
+    while (len > 0) {
+        const auto n = static_cast<std::size_t>(std::min<std::uint64_t>(len, sizeof(kZeros)));
+        h.Update({kZeros, n});
+        len -= n;
+    }
+}
+
+} // namespace
+
+CompareWriter::CompareWriter(IWriter& inner, Options opt)
+    : inner_(inner), opt_(opt), old_eof_(true), image_hash_(std::make_unique<AsyncSha256>()) {
+    if (opt_.block_bytes == 0) opt_.block_bytes = 4096;
+    if (opt_.readahead_depth < 2) opt_.readahead_depth = 2;
+    // Chunks end on block boundaries so a block never straddles two of them.
+    opt_.readahead_bytes = std::max(opt_.readahead_bytes, opt_.block_bytes) / opt_.block_bytes * opt_.block_bytes;
+}
+
+CompareWriter::~CompareWriter() {
+    Stop();
+    for (auto& c : chunks_) AlignedBufferPool::Shared().Release(std::move(c.buf));
+}
+
+Result CompareWriter::Open(const std::string& path) {
+    Stop();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return Result::Fail(errno, "Failed to open for compare: " + path + " (" + std::strerror(errno) + ")");
+    }
+    path_ = path;
+    fd_.Reset(fd);
+    (void)::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    chunks_.resize(opt_.readahead_depth);
+    free_ = std::make_unique<SpscRing<Chunk*>>(chunks_.size());
+    filled_ = std::make_unique<SpscRing<Chunk*>>(chunks_.size());
+    for (auto& c : chunks_) {
+        if (c.buf.size() != opt_.readahead_bytes) {
+            AlignedBufferPool::Shared().Release(std::move(c.buf));
+            c.buf = AlignedBufferPool::Shared().Acquire(opt_.readahead_bytes);
+        }
+        free_->TryPush(&c);
+    }
+    cur_ = nullptr;
+    cur_pos_ = 0;
+    old_eof_ = false;
+    prefetch_ = std::thread([this] { Prefetch(); });
+    return Result::Ok();
+}
+
+void CompareWriter::Stop() {
+    if (!prefetch_.joinable()) return;
+    free_->Close();
+    filled_->Close();
+    prefetch_.join();
+    cur_ = nullptr;
+    old_eof_ = true;
+}
+
+void CompareWriter::Prefetch() {
+    std::uint64_t off = 0;
+    Chunk* c = nullptr;
+    while (free_->Pop(c)) {
+        c->n = 0;
+        c->err = 0;
+        while (c->n < c->buf.size()) {
+            const ssize_t n = ::pread(fd_.Get(), c->buf.data() + c->n, c->buf.size() - c->n,
+                                      static_cast<off_t>(off + c->n));
+            if (n > 0) {
+                c->n += static_cast<std::size_t>(n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) c->err = errno;
+            break;
+        }
+        off += c->n;
+        const bool last = c->n < c->buf.size();
+        if (!filled_->Push(c) || last) return;
+    }
+}
+
+bool CompareWriter::ConsumeOld(std::size_t len, const std::uint8_t* expect, bool hash) {
+    bool same = true;
+    while (len > 0) {
+        if (!cur_ && !old_eof_) {
+            if (!filled_->Pop(cur_) || cur_->n == 0) {
+                if (cur_ && cur_->err) {
+                    LogWarn("Reading %s for compare failed (%s); writing the rest unconditionally",
+                            path_.c_str(), std::strerror(cur_->err));
+                }
+                cur_ = nullptr;
+                old_eof_ = true;
+            }
+            cur_pos_ = 0;
+        }
+        if (!cur_) {
+            // Past the end of the old contents (a hole if the range is skipped).
+            if (hash) HashZeros(*image_hash_, len);
+            return false;
+        }
+
+        const std::size_t n = std::min(len, cur_->n - cur_pos_);
+        const std::span<const std::uint8_t> old(cur_->buf.data() + cur_pos_, n);
+        if (same) same = expect ? IsEqual(old, {expect, n}) : IsAllZero(old);
+        if (hash) image_hash_->Update(old);
+        if (expect) expect += n;
+        cur_pos_ += n;
+        len -= n;
+
+        if (cur_pos_ == cur_->n) {
+            const bool last = cur_->n < cur_->buf.size() || cur_->err != 0;
+            if (cur_->err) {
+                LogWarn("Reading %s for compare failed (%s); writing the rest unconditionally",
+                        path_.c_str(), std::strerror(cur_->err));
+            }
+            free_->Push(cur_);
+            cur_ = nullptr;
+            if (last) old_eof_ = true;
+        }
+    }
+    return same;
+}
+
+Result CompareWriter::FlushPending() {
+    const std::uint64_t len = pending_len_;
+    const Pending kind = pending_;
+    pending_ = Pending::None;
+    pending_len_ = 0;
+    if (kind == Pending::Skip) return inner_.Skip(len);
+    if (kind == Pending::Zero) return inner_.WriteZeroes(len);
+    return Result::Ok();
+}
+
+Result CompareWriter::Queue(Pending kind, std::uint64_t len) {
+    if (pending_ != kind) {
+        auto r = FlushPending();
+        if (!r.is_ok()) return r;
+        pending_ = kind;
+    }
+    pending_len_ += len;
+    return Result::Ok();
+}
+
+// Walks `in` block by block (aligned to the output offset). Whole blocks that
+// match the old contents become skips; everything else is written, as data or
+// as zeros when `zeros` is set.
+Result CompareWriter::Process(std::span<const std::uint8_t> in, bool zeros) {
+    const std::size_t bs = opt_.block_bytes;
+    const std::uint8_t* run = nullptr;
+    std::size_t run_len = 0;
+
+    auto flush_run = [&]() -> Result {
+        if (run_len == 0) return Result::Ok();
+        const std::size_t n = run_len;
+        run_len = 0;
+        if (zeros) return Queue(Pending::Zero, n);
+        auto r = FlushPending();
+        if (!r.is_ok()) return r;
+        return inner_.WriteAll({run, n});
+    };
+
+    while (!in.empty()) {
+        const std::size_t take = std::min<std::size_t>(bs - offset_ % bs, in.size());
+        const bool whole = take == bs;
+        const bool same = ConsumeOld(take, zeros ? nullptr : in.data(), false);
+
+        if (whole) ++blocks_total_;
+        if (whole && same) {
+            auto r = flush_run();
+            if (!r.is_ok()) return r;
+            r = Queue(Pending::Skip, take);
+            if (!r.is_ok()) return r;
+            ++blocks_skipped_;
+        } else {
+            if (run_len == 0) run = in.data();
+            run_len += take;
+        }
+        offset_ += take;
+        in = in.subspan(take);
+    }
+    return flush_run();
+}
+
+Result CompareWriter::FlushCarry() {
+    if (carry_.empty()) return Result::Ok();
+    auto r = Process(carry_, /*zeros=*/false);
+    carry_.clear();
+    return r;
+}
+
+Result CompareWriter::WriteAll(std::span<const std::uint8_t> in) {
+    const std::size_t bs = opt_.block_bytes;
+    image_hash_->Update(in);
+
+    // Only whole blocks can be skipped, so a block split across calls is
+    // collected first. The output is mid-block only after a flush.
+    const std::size_t head = static_cast<std::size_t>((bs - offset_ % bs) % bs);
+    if (head > 0 && carry_.empty()) {
+        const std::size_t take = std::min(head, in.size());
+        auto r = Process(in.first(take), /*zeros=*/false);
+        if (!r.is_ok()) return r;
+        in = in.subspan(take);
+    }
+    if (!carry_.empty()) {
+        const std::size_t take = std::min(bs - carry_.size(), in.size());
+        carry_.insert(carry_.end(), in.begin(), in.begin() + static_cast<std::ptrdiff_t>(take));
+        in = in.subspan(take);
+        if (carry_.size() < bs) return Result::Ok();
+        auto r = FlushCarry();
+        if (!r.is_ok()) return r;
+    }
+
+    const std::size_t whole = in.size() / bs * bs;
+    auto r = Process(in.first(whole), /*zeros=*/false);
+    if (!r.is_ok()) return r;
+    carry_.assign(in.begin() + static_cast<std::ptrdiff_t>(whole), in.end());
+    return Result::Ok();
+}
+
+Result CompareWriter::WriteZeroes(std::uint64_t len) {
+    auto fr = FlushCarry();
+    if (!fr.is_ok()) return fr;
+    HashZeros(*image_hash_, len);
+    while (len > 0) {
+        const auto n = static_cast<std::size_t>(std::min<std::uint64_t>(len, sizeof(kZeros)));
+        auto r = Process({kZeros, n}, /*zeros=*/true);
+        if (!r.is_ok()) return r;
+        len -= n;
+    }
+    return Result::Ok();
+}
+
+Result CompareWriter::Skip(std::uint64_t len) {
+    auto fr = FlushCarry();
+    if (!fr.is_ok()) return fr;
+    // The old bytes stay, so they are what the image will contain.
+    while (len > 0) {
+        const auto n = static_cast<std::size_t>(std::min<std::uint64_t>(len, opt_.readahead_bytes));
+        (void)ConsumeOld(n, nullptr, /*hash=*/true);
+        len -= n;
+        offset_ += n;
+        auto r = Queue(Pending::Skip, n);
+        if (!r.is_ok()) return r;
+    }
+    return Result::Ok();
+}
+
+Result CompareWriter::FsyncNow() {
+    auto r = FlushCarry();
+    if (!r.is_ok()) return r;
+    r = FlushPending();
+    if (!r.is_ok()) return r;
+    return inner_.FsyncNow();
+}
+
+Result CompareWriter::FsyncAsync() {
+    auto r = FlushPending();
+    if (!r.is_ok()) return r;
+    return inner_.FsyncAsync();
+}
+
+Result CompareWriter::TrimTarget() {
+    Fd fd(::open(path_.c_str(), O_WRONLY | O_CLOEXEC));
+    if (fd.Get() < 0) {
+        return Result::Fail(errno, "Failed to open for trim: " + path_ + " (" + std::strerror(errno) + ")");
+    }
+    struct stat st {};
+    if (::fstat(fd.Get(), &st) != 0) {
+        return Result::Fail(errno, "fstat failed (" + std::string(std::strerror(errno)) + ")");
+    }
+    if (!S_ISREG(st.st_mode) || static_cast<std::uint64_t>(st.st_size) <= offset_) return Result::Ok();
+    if (::ftruncate(fd.Get(), static_cast<off_t>(offset_)) != 0 || ::fsync(fd.Get()) != 0) {
+        return Result::Fail(errno, "Cannot cut " + path_ + " to the image length (" + std::strerror(errno) + ")");
+    }
+    return Result::Ok();
+}
+
+Result CompareWriter::VerifyTarget() {
+    Stop();
+    const Sha256Digest expected = image_hash_->Finish();
+
+    Fd fd(::open(path_.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd.Get() < 0) {
+        return Result::Fail(errno, "Failed to open for verify: " + path_ + " (" + std::strerror(errno) + ")");
+    }
+    // A stale tail past the image would not show up in the hash.
+    struct stat st {};
+    if (::fstat(fd.Get(), &st) == 0 && S_ISREG(st.st_mode) && static_cast<std::uint64_t>(st.st_size) != offset_) {
+        return Result::Fail(EIO, "Read-back mismatch: " + path_ + " is " + std::to_string(st.st_size) +
+                                     " bytes, the image " + std::to_string(offset_));
+    }
+    // Drop clean cached pages so the read-back comes from the device.
+    (void)::posix_fadvise(fd.Get(), 0, static_cast<off_t>(offset_), POSIX_FADV_DONTNEED);
+
+    Sha256 h;
+    AlignedBuffer buf = AlignedBufferPool::Shared().Acquire(opt_.readahead_bytes);
+    std::uint64_t off = 0;
+    Result res = Result::Ok();
+    while (off < offset_) {
+        const auto want = static_cast<std::size_t>(std::min<std::uint64_t>(buf.size(), offset_ - off));
+        const ssize_t n = ::pread(fd.Get(), buf.data(), want, static_cast<off_t>(off));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            res = Result::Fail(errno, "Read-back failed (" + std::string(std::strerror(errno)) + ")");
+            break;
+        }
+        if (n == 0) {
+            res = Result::Fail(EIO, "Read-back failed: target ends at " + std::to_string(off) +
+                                        " of " + std::to_string(offset_) + " bytes");
+            break;
+        }
+        h.Update({buf.data(), static_cast<std::size_t>(n)});
+        off += static_cast<std::uint64_t>(n);
+    }
+    AlignedBufferPool::Shared().Release(std::move(buf));
+    if (!res.is_ok()) return res;
+
+    const Sha256Digest got = h.Final();
+    if (got != expected) {
+        return Result::Fail(EIO, "Read-back mismatch: expected " + Sha256::ToHex(expected) +
+                                     ", got " + Sha256::ToHex(got));
+    }
+    return Result::Ok();
+}
+
+} // namespace flash
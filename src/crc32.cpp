@@ -0,0 +1,169 @@
+#include "flash/crc32.hpp"
+
+#include <zlib.h>
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define FLASH_CRC32_X86 1
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#define FLASH_CRC32_ARM 1
+#endif
+
+namespace flash {
+
+namespace {
+
+using CrcFn = std::uint32_t (*)(std::uint32_t, const std::uint8_t*, std::size_t);
+
+std::uint32_t CrcZlib(std::uint32_t crc, const std::uint8_t* p, std::size_t n) {
+    while (n > 0) {
+        const uInt chunk = n > (1u << 30) ? (1u << 30) : static_cast<uInt>(n);
+        crc = static_cast<std::uint32_t>(::crc32(crc, p, chunk));
+        p += chunk;
+        n -= chunk;
+    }
+    return crc;
+}
+
+#if defined(FLASH_CRC32_X86)
+
+// Folding constants for the reflected gzip polynomial (Intel, "Fast CRC
+// Computation for Generic Polynomials Using PCLMULQDQ").
+alignas(16) const std::uint64_t kK1K2[2] = {0x0154442bd4, 0x01c6e41596};
+alignas(16) const std::uint64_t kK3K4[2] = {0x01751997d0, 0x00ccaa009e};
+alignas(16) const std::uint64_t kK5K0[2] = {0x0163cd6124, 0x0000000000};
+alignas(16) const std::uint64_t kPoly[2] = {0x01db710641, 0x01f7011641};
+
+__attribute__((target("pclmul,sse4.1")))
+inline __m128i Load(const std::uint8_t* q) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(q));
+}
+
+// acc * x^128 mod P, plus `next`: folds one 128-bit lane into the next.
+__attribute__((target("pclmul,sse4.1")))
+inline __m128i Fold(__m128i acc, __m128i k, __m128i next) {
+    const __m128i lo = _mm_clmulepi64_si128(acc, k, 0x00);
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(acc, k, 0x11), next), lo);
+}
+
+// `crc` is the raw (pre-inverted) register; `n` >= 64 and a multiple of 16.
+__attribute__((target("pclmul,sse4.1")))
+std::uint32_t FoldPclmul(std::uint32_t crc, const std::uint8_t* p, std::size_t n) {
+
+    __m128i x1 = _mm_xor_si128(Load(p), _mm_cvtsi32_si128(static_cast<int>(crc)));
+    __m128i x2 = Load(p + 16);
+    __m128i x3 = Load(p + 32);
+    __m128i x4 = Load(p + 48);
+    __m128i k = _mm_load_si128(reinterpret_cast<const __m128i*>(kK1K2));
+    p += 64;
+    n -= 64;
+
+    while (n >= 64) {
+        x1 = Fold(x1, k, Load(p));
+        x2 = Fold(x2, k, Load(p + 16));
+        x3 = Fold(x3, k, Load(p + 32));
+        x4 = Fold(x4, k, Load(p + 48));
+        p += 64;
+        n -= 64;
+    }
+
+    // Fold the four lanes, then the remaining 16-byte blocks, into one.
+    k = _mm_load_si128(reinterpret_cast<const __m128i*>(kK3K4));
+    x1 = Fold(x1, k, x2);
+    x1 = Fold(x1, k, x3);
+    x1 = Fold(x1, k, x4);
+    while (n >= 16) {
+        x1 = Fold(x1, k, Load(p));
+        p += 16;
+        n -= 16;
+    }
+
+    // 128 -> 64 bits.
+    const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    k = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(kK5K0));
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x00), x2);
+
+    // Barrett reduction to 32 bits.
+    k = _mm_load_si128(reinterpret_cast<const __m128i*>(kPoly));
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return static_cast<std::uint32_t>(_mm_extract_epi32(x1, 1));
+}
+
+std::uint32_t CrcPclmul(std::uint32_t crc, const std::uint8_t* p, std::size_t n) {
+    if (n < 64) return CrcZlib(crc, p, n);
+    const std::size_t bulk = n & ~std::size_t{15};
+    crc = ~FoldPclmul(~crc, p, bulk);
+    return CrcZlib(crc, p + bulk, n - bulk);
+}
+
+bool CpuHasPclmul() {
+    unsigned a = 0, b = 0, c = 0, d = 0;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) return false;
+    const bool pclmul = (c & (1u << 1)) != 0;
+    const bool sse41 = (c & (1u << 19)) != 0;
+    return pclmul && sse41;
+}
+
+#elif defined(FLASH_CRC32_ARM)
+
+__attribute__((target("+crc")))
+std::uint32_t CrcArm(std::uint32_t crc, const std::uint8_t* p, std::size_t n) {
+    crc = ~crc;
+    while (n >= 8) {
+        std::uint64_t w;
+        std::memcpy(&w, p, 8);
+        crc = __crc32d(crc, w);
+        p += 8;
+        n -= 8;
+    }
+    while (n--) crc = __crc32b(crc, *p++);
+    return ~crc;
+}
+
+bool CpuHasArmCrc32() {
+    return (::getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+#endif
+
+struct Impl {
+    CrcFn fn;
+    const char* name;
+};
+
+const Impl& SelectImpl() {
+    static const Impl impl = [] {
+#if defined(FLASH_CRC32_X86)
+        if (CpuHasPclmul()) return Impl{CrcPclmul, "pclmul"};
+#elif defined(FLASH_CRC32_ARM)
+        if (CpuHasArmCrc32()) return Impl{CrcArm, "armv8-crc32"};
+#endif
+        return Impl{CrcZlib, "zlib"};
+    }();
+    return impl;
+}
+
+} // namespace
+
+std::uint32_t Crc32(std::uint32_t crc, std::span<const std::uint8_t> data) {
+    return SelectImpl().fn(crc, data.data(), data.size());
+}
+
+const char* Crc32Backend() {
+    return SelectImpl().name;
+}
+
+} // namespace flash
@@ -0,0 +1,127 @@
+// decompress.cpp - Picks the payload decompressor from the stream's magic bytes.
+
+#include "flash/decompress.hpp"
+
+#include "flash/crc32.hpp"
+#include "flash/gzip_reader.hpp"
+#include "flash/logger.hpp"
+#include "flash/parallel_gzip_reader.hpp"
+#include "flash/peek_reader.hpp"
+#ifdef FLASH_HAVE_XZ
+#include "flash/xz_reader.hpp"
+#endif
+#ifdef FLASH_HAVE_ZSTD
+#include "flash/zstd_reader.hpp"
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <string>
+
+namespace flash {
+
+namespace {
+
+bool StartsWith(std::span<const std::uint8_t> head, std::initializer_list<std::uint8_t> magic) {
+    return head.size() >= magic.size() && std::equal(magic.begin(), magic.end(), head.begin());
+}
+
+} // namespace
+
+const char* CompressionName(Compression c) {
+    switch (c) {
+    case Compression::None: return "none";
+    case Compression::Gzip: return "gzip";
+    case Compression::Zstd: return "zstd";
+    case Compression::Xz:   return "xz";
+    case Compression::Lz4:  return "lz4";
+    }
+    return "unknown";
+}
+
+bool ParseCompression(std::string_view name, Compression& out) {
+    for (Compression c : {Compression::None, Compression::Gzip, Compression::Zstd,
+                          Compression::Xz, Compression::Lz4}) {
+        if (name == CompressionName(c)) {
+            out = c;
+            return true;
+        }
+    }
+    return false;
+}
+
+Compression SniffCompression(std::span<const std::uint8_t> head) {
+    if (StartsWith(head, {0x1F, 0x8B})) return Compression::Gzip;
+    if (StartsWith(head, {0x28, 0xB5, 0x2F, 0xFD})) return Compression::Zstd;
+    // zstd skippable frames (0x184D2A50..5F) may precede the first real frame.
+    if (head.size() >= 4 && (head[0] & 0xF0) == 0x50 && head[1] == 0x2A && head[2] == 0x4D && head[3] == 0x18) {
+        return Compression::Zstd;
+    }
+    if (StartsWith(head, {0xFD, '7', 'z', 'X', 'Z', 0x00})) return Compression::Xz;
+    if (StartsWith(head, {0x04, 0x22, 0x4D, 0x18})) return Compression::Lz4;
+    return Compression::None;
+}
+
+Result OpenDecompressor(std::unique_ptr<IReader>& reader, const DecompressOptions& opt,
+                        const Compression* forced, Compression* detected) {
+    auto owned = std::make_unique<PeekReader>(std::move(reader));
+    PeekReader* peek = owned.get();
+    reader = std::move(owned);
+
+    Compression c = Compression::None;
+    if (forced) {
+        c = *forced;
+    } else {
+        std::span<const std::uint8_t> head;
+        if (peek->Peek(6, head) < 0) {
+            const int err = errno;
+            return Result::Fail(err, "Failed to read payload header (" + std::string(std::strerror(err)) + ")");
+        }
+        c = SniffCompression(head);
+    }
+    if (detected) *detected = c;
+
+    try {
+        switch (c) {
+        case Compression::None:
+            return Result::Ok();
+        case Compression::Gzip:
+            if (opt.threads != 1 && ParallelGzipReader::Detect(*peek)) {
+                auto par = std::make_unique<ParallelGzipReader>(
+                    std::move(reader),
+                    ParallelGzipReader::Options{opt.threads, opt.window_bytes, opt.inflate_backend});
+                LogDebug("BGZF payload: inflating members on %u threads", par->Threads());
+                reader = std::move(par);
+            } else {
+                auto gz = std::make_unique<GzipReader>(std::move(reader), opt.inflate_backend);
+                LogDebug("gzip payload: %s inflate, %s crc32", gz->Backend(), Crc32Backend());
+                reader = std::move(gz);
+            }
+            return Result::Ok();
+        case Compression::Zstd:
+#ifdef FLASH_HAVE_ZSTD
+            reader = std::make_unique<ZstdReader>(std::move(reader));
+            return Result::Ok();
+#else
+            break;
+#endif
+        case Compression::Xz:
+#ifdef FLASH_HAVE_XZ
+            reader = std::make_unique<XzReader>(
+                std::move(reader), XzReader::Options{opt.threads, opt.xz_memlimit_threading, opt.xz_memlimit_stop});
+            return Result::Ok();
+#else
+            break;
+#endif
+        case Compression::Lz4:
+            break;
+        }
+    } catch (const std::exception& e) {
+        return Result::Fail(-1, std::string(CompressionName(c)) + " init failed: " + e.what());
+    }
+    return Result::Fail(ENOTSUP, std::string(CompressionName(c)) + " payloads are not supported by this build");
+}
+
+} // namespace flash
@@ -0,0 +1,244 @@
+// delta_builder.cpp - Builds block deltas between two images (see delta.hpp).
+
+#include "flash/delta.hpp"
+
+#include "flash/block_scan.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace flash {
+
+namespace {
+
+void PutLe64(std::uint8_t* p, std::uint64_t v) {
+    for (int i = 0; i < 8; ++i) p[i] = static_cast<std::uint8_t>(v >> (8 * i));
+}
+
+// Cheap 64-bit block fingerprint for the source index; matches are always
+// confirmed with a byte compare.
+std::uint64_t BlockHash(const std::uint8_t* p, std::size_t n) {
+    std::uint64_t h = 0x9E3779B97F4A7C15ULL ^ n;
+    for (std::size_t i = 0; i + 8 <= n; i += 8) {
+        std::uint64_t w;
+        std::memcpy(&w, p + i, 8);
+        h ^= w * 0xBF58476D1CE4E5B9ULL;
+        h = (h << 31) | (h >> 33);
+        h *= 0x94D049BB133111EBULL;
+    }
+    return h ^ (h >> 29);
+}
+
+struct MappedFile {
+    Fd fd;
+    const std::uint8_t* data = nullptr;
+    std::uint64_t size = 0;
+
+    ~MappedFile() {
+        if (data) ::munmap(const_cast<std::uint8_t*>(data), size);
+    }
+
+    Result Open(const std::string& path) {
+        fd.Reset(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (fd.Get() < 0) {
+            return Result::Fail(errno, "Failed to open " + path + " (" + std::strerror(errno) + ")");
+        }
+        struct stat st {};
+        if (::fstat(fd.Get(), &st) != 0) return Result::Fail(errno, "fstat failed: " + path);
+        if (S_ISBLK(st.st_mode)) {
+            const off_t end = ::lseek(fd.Get(), 0, SEEK_END);
+            if (end < 0) return Result::Fail(errno, "lseek failed: " + path);
+            size = static_cast<std::uint64_t>(end);
+        } else {
+            size = static_cast<std::uint64_t>(st.st_size);
+        }
+        if (size == 0) return Result::Ok();
+        void* p = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.Get(), 0);
+        if (p == MAP_FAILED) return Result::Fail(errno, "mmap failed: " + path);
+        data = static_cast<const std::uint8_t*>(p);
+        return Result::Ok();
+    }
+};
+
+// Coalesces consecutive ops of the same kind before encoding them.
+class OpEmitter {
+public:
+    OpEmitter(IWriter& out, DeltaStats& stats) : out_(out), stats_(stats) {}
+
+    Result Copy(std::uint64_t src, std::uint64_t len) {
+        stats_.copy_bytes += len;
+        if (op_ == delta::kOpCopy && src_ + len_ == src) {
+            len_ += len;
+            return Result::Ok();
+        }
+        auto r = Flush();
+        op_ = delta::kOpCopy;
+        src_ = src;
+        len_ = len;
+        return r;
+    }
+
+    Result Zero(std::uint64_t len) {
+        if (op_ != delta::kOpZero) {
+            auto r = Flush();
+            if (!r.is_ok()) return r;
+            op_ = delta::kOpZero;
+        }
+        len_ += len;
+        stats_.zero_bytes += len;
+        return Result::Ok();
+    }
+
+    Result Data(const std::uint8_t* p, std::size_t len) {
+        if (op_ != delta::kOpData || data_.size() >= kMaxData) {
+            auto r = Flush();
+            if (!r.is_ok()) return r;
+            op_ = delta::kOpData;
+        }
+        data_.insert(data_.end(), p, p + len);
+        stats_.data_bytes += len;
+        return Result::Ok();
+    }
+
+    Result Flush() {
+        std::uint8_t rec[17];
+        std::size_t n = 0;
+        const std::uint8_t op = op_;
+        op_ = delta::kOpEnd;
+
+        switch (op) {
+        case delta::kOpEnd:
+            return Result::Ok();
+        case delta::kOpCopy:
+            rec[0] = op;
+            PutLe64(rec + 1, src_);
+            PutLe64(rec + 9, len_);
+            n = 17;
+            break;
+        case delta::kOpZero:
+            rec[0] = op;
+            PutLe64(rec + 1, len_);
+            n = 9;
+            break;
+        case delta::kOpData:
+            rec[0] = op;
+            PutLe64(rec + 1, data_.size());
+            n = 9;
+            break;
+        }
+        ++stats_.ops;
+        len_ = 0;
+        auto r = out_.WriteAll({rec, n});
+        if (r.is_ok() && op == delta::kOpData) r = out_.WriteAll(data_);
+        data_.clear();
+        return r;
+    }
+
+    Result End() {
+        auto r = Flush();
+        if (!r.is_ok()) return r;
+        const std::uint8_t end = delta::kOpEnd;
+        return out_.WriteAll({&end, 1});
+    }
+
+private:
+    static constexpr std::size_t kMaxData = 4 * 1024 * 1024;
+
+    IWriter& out_;
+    DeltaStats& stats_;
+    std::uint8_t op_ = delta::kOpEnd;
+    std::uint64_t src_ = 0;
+    std::uint64_t len_ = 0;
+    std::vector<std::uint8_t> data_;
+};
+
+} // namespace
+
+Result BuildDelta(const std::string& source_path, const std::string& target_path, IWriter& out,
+                  DeltaStats* stats, std::size_t block_bytes) {
+    if (block_bytes == 0) block_bytes = 4096;
+    const std::size_t bs = block_bytes;
+
+    MappedFile src;
+    auto res = src.Open(source_path);
+    if (!res.is_ok()) return res;
+    MappedFile dst;
+    res = dst.Open(target_path);
+    if (!res.is_ok()) return res;
+
+    // Index every non-zero source block by fingerprint (first occurrence wins).
+    std::unordered_map<std::uint64_t, std::uint64_t> index;
+    index.reserve(static_cast<std::size_t>(src.size / bs));
+    for (std::uint64_t off = 0; off + bs <= src.size; off += bs) {
+        const std::span<const std::uint8_t> blk(src.data + off, bs);
+        if (IsAllZero(blk)) continue;
+        index.emplace(BlockHash(blk.data(), bs), off);
+    }
+
+    Sha256 h;
+    if (dst.size > 0) h.Update({dst.data, static_cast<std::size_t>(dst.size)});
+    const Sha256Digest digest = h.Final();
+
+    std::uint8_t hdr[delta::kHeaderBytes];
+    std::memcpy(hdr, delta::kMagic, sizeof(delta::kMagic));
+    PutLe64(hdr + 8, dst.size);
+    std::memcpy(hdr + 16, digest.data(), digest.size());
+    res = out.WriteAll({hdr, sizeof(hdr)});
+    if (!res.is_ok()) return res;
+
+    DeltaStats local;
+    DeltaStats& st = stats ? *stats : local;
+    st = {};
+    OpEmitter emit(out, st);
+
+    auto source_matches = [&](std::uint64_t src_off, const std::uint8_t* p, std::size_t n) {
+        return src_off + n <= src.size && IsEqual({src.data + src_off, n}, {p, n});
+    };
+
+    std::uint64_t next_src = ~0ULL;  // source offset that would continue the last COPY
+    for (std::uint64_t off = 0; off < dst.size; off += bs) {
+        const auto n = static_cast<std::size_t>(std::min<std::uint64_t>(bs, dst.size - off));
+        const std::uint8_t* p = dst.data + off;
+
+        // Zeros first: they cost nothing to apply and never touch the source.
+        if (IsAllZero({p, n})) {
+            res = emit.Zero(n);
+            if (!res.is_ok()) return res;
+            next_src = ~0ULL;
+            continue;
+        }
+
+        std::uint64_t from = ~0ULL;
+        if (next_src != ~0ULL && source_matches(next_src, p, n)) {
+            from = next_src;
+        } else if (source_matches(off, p, n)) {
+            from = off;
+        } else if (n == bs) {
+            auto it = index.find(BlockHash(p, n));
+            if (it != index.end() && source_matches(it->second, p, n)) from = it->second;
+        }
+
+        if (from != ~0ULL) {
+            res = emit.Copy(from, n);
+            next_src = from + n;
+        } else {
+            res = emit.Data(p, n);
+            next_src = ~0ULL;
+        }
+        if (!res.is_ok()) return res;
+    }
+
+    res = emit.End();
+    if (!res.is_ok()) return res;
+    return out.FsyncNow();
+}
+
+} // namespace flash
@@ -0,0 +1,174 @@
+// delta_reader.cpp - Applies a block delta against the active slot while streaming.
+
+#include "flash/delta.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace flash {
+
+namespace {
+
+std::uint64_t Le64(const std::uint8_t* p) {
+    std::uint64_t v = 0;
+    for (int i = 7; i >= 0; --i) v = (v << 8) | p[i];
+    return v;
+}
+
+} // namespace
+
+Result DeltaReader::Open(IReader& payload, std::string source_path, DeltaReader& out) {
+    int fd = ::open(source_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return Result::Fail(errno, "Failed to open delta source: " + source_path + " (" +
+                                       std::strerror(errno) + ")");
+    }
+    (void)::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    out.payload_ = &payload;
+    out.source_path_ = std::move(source_path);
+    out.source_.Reset(fd);
+    out.have_header_ = false;
+    out.done_ = false;
+    out.produced_ = 0;
+    out.hash_ = Sha256();
+    out.op_ = delta::kOpEnd;
+    out.op_left_ = 0;
+    out.error_.clear();
+    out.stats_ = {};
+    return Result::Ok();
+}
+
+ssize_t DeltaReader::Fail(int err, std::string msg) {
+    if (error_.empty()) error_ = std::move(msg);
+    errno = err;
+    return -1;
+}
+
+std::optional<std::uint64_t> DeltaReader::TotalSize() const {
+    if (!have_header_) return std::nullopt;
+    return target_size_;
+}
+
+bool DeltaReader::ReadExact(std::uint8_t* p, std::size_t len) {
+    while (len > 0) {
+        const ssize_t n = payload_->Read({p, len});
+        if (n <= 0) return false;
+        p += n;
+        len -= static_cast<std::size_t>(n);
+    }
+    return true;
+}
+
+bool DeltaReader::ReadHeader() {
+    std::uint8_t h[delta::kHeaderBytes];
+    if (!ReadExact(h, sizeof(h))) return false;
+    if (std::memcmp(h, delta::kMagic, sizeof(delta::kMagic)) != 0) {
+        Fail(EBADMSG, "not a delta payload (bad magic)");
+        return false;
+    }
+    target_size_ = Le64(h + 8);
+    std::memcpy(expected_.data(), h + 16, expected_.size());
+    have_header_ = true;
+    return true;
+}
+
+bool DeltaReader::NextOp() {
+    if (!ReadExact(&op_, 1)) return false;
+
+    std::uint8_t f[16];
+    switch (op_) {
+    case delta::kOpEnd:
+        op_left_ = 0;
+        return true;
+    case delta::kOpCopy:
+        if (!ReadExact(f, 16)) return false;
+        src_off_ = Le64(f);
+        op_left_ = Le64(f + 8);
+        break;
+    case delta::kOpData:
+    case delta::kOpZero:
+        if (!ReadExact(f, 8)) return false;
+        op_left_ = Le64(f);
+        break;
+    default:
+        Fail(EBADMSG, "delta: unknown op " + std::to_string(op_));
+        return false;
+    }
+
+    if (op_left_ > target_size_ - produced_) {
+        Fail(EBADMSG, "delta: op runs past the target size");
+        return false;
+    }
+    ++stats_.ops;
+    return true;
+}
+
+ssize_t DeltaReader::Read(std::span<std::uint8_t> out) {
+    if (!error_.empty()) return Fail(EBADMSG, error_);
+    if (done_ || out.empty()) return 0;
+
+    if (!have_header_ && !ReadHeader()) {
+        return Fail(EBADMSG, "delta: truncated header");
+    }
+
+    size_t filled = 0;
+    while (filled < out.size()) {
+        if (op_left_ == 0) {
+            if (!NextOp()) return Fail(EBADMSG, "delta: truncated op stream");
+            if (op_ == delta::kOpEnd) {
+                if (produced_ != target_size_) {
+                    return Fail(EBADMSG, "delta: ended at " + std::to_string(produced_) + " of " +
+                                             std::to_string(target_size_) + " bytes");
+                }
+                const Sha256Digest got = hash_.Final();
+                if (got != expected_) {
+                    return Fail(EBADMSG, "delta: target sha256 mismatch: expected " +
+                                             Sha256::ToHex(expected_) + ", got " + Sha256::ToHex(got));
+                }
+                done_ = true;
+                break;
+            }
+            continue;
+        }
+
+        std::uint8_t* p = out.data() + filled;
+        const auto want = static_cast<std::size_t>(std::min<std::uint64_t>(op_left_, out.size() - filled));
+        std::size_t got = 0;
+
+        if (op_ == delta::kOpCopy) {
+            const ssize_t n = ::pread(source_.Get(), p, want, static_cast<off_t>(src_off_));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                const int err = errno;
+                return Fail(err, "delta: reading " + source_path_ + " failed (" + std::strerror(err) + ")");
+            }
+            if (n == 0) return Fail(EBADMSG, "delta: COPY past the end of " + source_path_);
+            got = static_cast<std::size_t>(n);
+            src_off_ += got;
+            stats_.copy_bytes += got;
+        } else if (op_ == delta::kOpData) {
+            const ssize_t n = payload_->Read({p, want});
+            if (n < 0) return Fail(errno ? errno : EIO, "delta: payload read failed");
+            if (n == 0) return Fail(EBADMSG, "delta: truncated DATA op");
+            got = static_cast<std::size_t>(n);
+            stats_.data_bytes += got;
+        } else {
+            std::memset(p, 0, want);
+            got = want;
+            stats_.zero_bytes += got;
+        }
+
+        hash_.Update({p, got});
+        op_left_ -= got;
+        produced_ += got;
+        filled += got;
+    }
+    return static_cast<ssize_t>(filled);
+}
+
+} // namespace flash
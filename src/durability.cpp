@@ -0,0 +1,93 @@
+#include "flash/durability.hpp"
+
+#include "flash/fd.hpp"
+#include "flash/logger.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace flash {
+
+const char* DurabilityModeName(DurabilityMode mode) {
+    switch (mode) {
+    case DurabilityMode::Interval: return "interval";
+    case DurabilityMode::Component: return "component";
+    case DurabilityMode::Final: return "final";
+    }
+    return "?";
+}
+
+bool ParseDurabilityMode(std::string_view name, DurabilityMode& out) {
+    for (DurabilityMode m : {DurabilityMode::Interval, DurabilityMode::Component, DurabilityMode::Final}) {
+        if (name == DurabilityModeName(m)) {
+            out = m;
+            return true;
+        }
+    }
+    return false;
+}
+
+Result DurabilityPolicy::Timed(const std::function<Result()>& flush) {
+    const auto t0 = std::chrono::steady_clock::now();
+    Result r = flush();
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0);
+    flushes_.fetch_add(1, std::memory_order_relaxed);
+    flush_ns_.fetch_add(static_cast<std::uint64_t>(ns.count()), std::memory_order_relaxed);
+    return r;
+}
+
+Result DurabilityPolicy::SyncFilesystem(const std::string& path) {
+    return Timed([&]() -> Result {
+        Fd fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (!fd.Valid()) return Result::Fail(errno, "open " + path + " failed (" + std::strerror(errno) + ")");
+        if (::syncfs(fd.Get()) != 0) return Result::Fail(errno, "syncfs " + path + " failed (" + std::strerror(errno) + ")");
+        return Result::Ok();
+    });
+}
+
+Result DurabilityPolicy::Defer(const std::string& path) {
+    struct stat st {};
+    if (::stat(path.c_str(), &st) != 0) return Result::Fail(errno, "stat " + path + " failed (" + std::strerror(errno) + ")");
+    Target t;
+    t.path = path;
+    t.block_device = S_ISBLK(st.st_mode);
+    t.dev = t.block_device ? st.st_rdev : st.st_dev;
+
+    std::lock_guard<std::mutex> lk(mu_);
+    for (const Target& have : deferred_) {
+        if (have.block_device == t.block_device && have.dev == t.dev) return Result::Ok();
+    }
+    deferred_.push_back(std::move(t));
+    return Result::Ok();
+}
+
+Result DurabilityPolicy::FlushAll() {
+    std::vector<Target> targets;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        targets.swap(deferred_);
+    }
+    for (const Target& t : targets) {
+        LogDebug("durability: %s %s", t.block_device ? "fsync" : "syncfs", t.path.c_str());
+        if (!t.block_device) {
+            auto r = SyncFilesystem(t.path);
+            if (!r.is_ok()) return r;
+            continue;
+        }
+        auto r = Timed([&]() -> Result {
+            Fd fd(::open(t.path.c_str(), O_RDONLY | O_CLOEXEC));
+            if (!fd.Valid()) return Result::Fail(errno, "open " + t.path + " failed (" + std::strerror(errno) + ")");
+            if (::fsync(fd.Get()) != 0) return Result::Fail(errno, "fsync " + t.path + " failed (" + std::strerror(errno) + ")");
+            return Result::Ok();
+        });
+        if (!r.is_ok()) return r;
+    }
+    return Result::Ok();
+}
+
+} // namespace flash
@@ -0,0 +1,924 @@
+// ext4_builder.cpp - fresh ext4 filesystem from archive entries (see ext4_builder.hpp).
+
+#include "flash/ext4_builder.hpp"
+
+#include "flash/logger.hpp"
+#include "flash/partition_writer.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+namespace flash {
+
+namespace {
+
+constexpr std::uint32_t kBlock = 4096;
+constexpr std::uint32_t kBlocksPerGroup = 8 * kBlock;
+constexpr std::uint32_t kInodeSize = 256;
+constexpr std::uint32_t kInodesPerBlock = kBlock / kInodeSize;
+constexpr std::uint32_t kExtraIsize = 32;
+constexpr std::uint32_t kDescSize = 32;
+constexpr std::uint32_t kMaxExtentLen = 32768;
+constexpr std::uint32_t kExtentsPerBlock = (kBlock - 12) / 12;
+
+constexpr std::uint32_t kRootIno = 2;
+constexpr std::uint32_t kJournalIno = 8;
+constexpr std::uint32_t kFirstIno = 11;  // lost+found
+constexpr std::uint32_t kLostFoundBlocks = 4;
+
+// Feature bits.
+constexpr std::uint32_t kCompatHasJournal = 0x0004;
+constexpr std::uint32_t kCompatDirIndex = 0x0020;
+constexpr std::uint32_t kIncompatFiletype = 0x0002;
+constexpr std::uint32_t kIncompatExtents = 0x0040;
+constexpr std::uint32_t kIncompatFlexBg = 0x0200;
+constexpr std::uint32_t kRoCompatSparseSuper = 0x0001;
+constexpr std::uint32_t kRoCompatLargeFile = 0x0002;
+constexpr std::uint32_t kRoCompatGdtCsum = 0x0010;
+constexpr std::uint32_t kRoCompatDirNlink = 0x0020;
+constexpr std::uint32_t kRoCompatExtraIsize = 0x0040;
+
+constexpr std::uint32_t kInodeFlagExtents = 0x80000;
+constexpr std::uint16_t kBgInodeUninit = 0x0001;
+
+void Put16(std::uint8_t* p, std::uint16_t v) {
+    p[0] = static_cast<std::uint8_t>(v);
+    p[1] = static_cast<std::uint8_t>(v >> 8);
+}
+
+void Put32(std::uint8_t* p, std::uint32_t v) {
+    for (int i = 0; i < 4; ++i) p[i] = static_cast<std::uint8_t>(v >> (8 * i));
+}
+
+// The journal superblock is big-endian.
+void Put32Be(std::uint8_t* p, std::uint32_t v) {
+    for (int i = 0; i < 4; ++i) p[i] = static_cast<std::uint8_t>(v >> (24 - 8 * i));
+}
+
+// CRC16 (poly 0x8005, reflected) as used for uninit_bg group descriptors.
+std::uint16_t Crc16(std::uint16_t crc, const std::uint8_t* p, std::size_t len) {
+    while (len--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; ++i) crc = (crc & 1) ? static_cast<std::uint16_t>((crc >> 1) ^ 0xA001) : crc >> 1;
+    }
+    return crc;
+}
+
+// Low 32 bits of the seconds go in the base field; the extra field holds
+// the nanoseconds and two epoch bits.
+std::uint32_t TimeExtra(const timespec& ts) {
+    const std::int64_t sec = ts.tv_sec;
+    const std::uint32_t epoch = static_cast<std::uint32_t>(((sec - static_cast<std::int32_t>(sec)) >> 32) & 3);
+    return (static_cast<std::uint32_t>(ts.tv_nsec) << 2) | epoch;
+}
+
+std::uint8_t DirentType(std::uint16_t mode) {
+    switch (mode & S_IFMT) {
+    case S_IFREG: return 1;
+    case S_IFDIR: return 2;
+    case S_IFCHR: return 3;
+    case S_IFBLK: return 4;
+    case S_IFIFO: return 5;
+    case S_IFSOCK: return 6;
+    case S_IFLNK: return 7;
+    }
+    return 0;
+}
+
+// Journal size mke2fs picks for a filesystem of `blocks` 4 KiB blocks.
+std::uint32_t JournalBlocks(std::uint32_t blocks) {
+    if (blocks < 2048) return 0;
+    if (blocks < 32768) return 1024;
+    if (blocks < 256 * 1024) return 4096;
+    if (blocks < 512 * 1024) return 8192;
+    if (blocks < 4096 * 1024) return 16384;
+    if (blocks < 8192 * 1024) return 32768;
+    if (blocks < 16384 * 1024) return 65536;
+    if (blocks < 32768 * 1024) return 131072;
+    return 262144;
+}
+
+bool IsPowerOf(std::uint32_t n, std::uint32_t base) {
+    while (n > 1 && n % base == 0) n /= base;
+    return n == 1;
+}
+
+void SplitPath(const std::string& rel, std::string& parent, std::string& name) {
+    const auto slash = rel.rfind('/');
+    parent = slash == std::string::npos ? std::string() : rel.substr(0, slash);
+    name = slash == std::string::npos ? rel : rel.substr(slash + 1);
+}
+
+} // namespace
+
+Ext4Builder::~Ext4Builder() = default;
+
+Result Ext4Builder::Open(const std::string& target, Options opt, std::unique_ptr<Ext4Builder>& out) {
+    std::unique_ptr<Ext4Builder> b(new Ext4Builder());
+    b->opt_ = std::move(opt);
+    b->path_ = target;
+
+    struct stat st {};
+    if (::stat(target.c_str(), &st) != 0) {
+        return Result::Fail(errno, "stat " + target + " failed (" + std::strerror(errno) + ")");
+    }
+    int flags = O_WRONLY | O_CLOEXEC;
+    if (S_ISBLK(st.st_mode)) {
+        flags |= O_EXCL;  // refuses a mounted device
+    } else if (!S_ISREG(st.st_mode)) {
+        return Result::Fail(EINVAL, target + " is neither a block device nor an image file");
+    }
+    b->fd_.Reset(::open(target.c_str(), flags));
+    if (!b->fd_.Valid()) {
+        return Result::Fail(errno, "open " + target + " failed (" + std::strerror(errno) + ")");
+    }
+    std::uint64_t bytes = static_cast<std::uint64_t>(st.st_size);
+    if (S_ISBLK(st.st_mode) && ::ioctl(b->fd_.Get(), BLKGETSIZE64, &bytes) != 0) {
+        return Result::Fail(errno, "BLKGETSIZE64 " + target + " failed (" + std::strerror(errno) + ")");
+    }
+
+    auto r = b->Layout(bytes);
+    if (!r.is_ok()) return r;
+
+    if (::getrandom(b->uuid_, sizeof(b->uuid_), 0) != sizeof(b->uuid_) ||
+        ::getrandom(b->hash_seed_, sizeof(b->hash_seed_), 0) != sizeof(b->hash_seed_)) {
+        return Result::Fail(errno, std::string("getrandom failed (") + std::strerror(errno) + ")");
+    }
+    b->uuid_[6] = static_cast<std::uint8_t>((b->uuid_[6] & 0x0F) | 0x40);  // version 4
+    b->uuid_[8] = static_cast<std::uint8_t>((b->uuid_[8] & 0x3F) | 0x80);
+    b->now_ = static_cast<std::uint32_t>(std::time(nullptr));
+    b->wbuf_.resize(std::max<std::size_t>(b->opt_.write_buffer_bytes / kBlock, 1) * kBlock);
+
+    // Whatever filesystem was there stops being one before anything else is
+    // written; the new superblock only lands at the very end.
+    std::vector<std::uint8_t> zero(kBlock, 0);
+    r = b->PWrite(zero.data(), zero.size(), 0);
+    if (!r.is_ok()) return r;
+
+    // Inodes 1..10 are reserved; 2 is the root directory, 8 the journal.
+    b->inodes_.resize(kFirstIno - 1);
+    Inode& root = b->Node(kRootIno);
+    root.mode = S_IFDIR | 0755;
+    root.flags = kInodeFlagExtents;
+    root.atime = root.mtime = {static_cast<time_t>(b->now_), 0};
+    b->dirs_[kRootIno].parent = kRootIno;
+
+    if (b->opt_.journal) {
+        r = b->CreateJournal();
+        if (!r.is_ok()) return r;
+    }
+
+    TreeEntryMeta lost_found;
+    lost_found.mode = S_IFDIR | 0700;
+    r = b->Directory("lost+found", lost_found);  // becomes inode 11
+    if (!r.is_ok()) return r;
+
+    LogDebug("ext4: %s: %u blocks, %u groups, %u inodes per group, journal %s", target.c_str(), b->blocks_,
+             b->groups_, b->inodes_per_group_, b->journal_ ? "yes" : "no");
+    out = std::move(b);
+    return Result::Ok();
+}
+
+Result Ext4Builder::Layout(std::uint64_t bytes) {
+    const std::uint64_t blocks = std::min<std::uint64_t>(bytes / kBlock, 0xFFFFFFFFu);
+    if (blocks < 1024) {
+        return Result::Fail(EINVAL, path_ + " is too small for an ext4 filesystem (" + std::to_string(bytes) + " bytes)");
+    }
+    blocks_ = static_cast<std::uint32_t>(blocks);
+    groups_ = (blocks_ + kBlocksPerGroup - 1) / kBlocksPerGroup;
+    // A runt last group is not worth its metadata.
+    const std::uint32_t last = blocks_ - (groups_ - 1) * kBlocksPerGroup;
+    if (groups_ > 1 && last < 512) {
+        blocks_ -= last;
+        --groups_;
+    }
+
+    const std::uint64_t ratio = std::max<std::uint64_t>(opt_.inode_ratio, kBlock);
+    std::uint64_t ipg = (std::uint64_t{blocks_} * kBlock / ratio + groups_ - 1) / groups_;
+    ipg = (ipg + kInodesPerBlock - 1) / kInodesPerBlock * kInodesPerBlock;
+    ipg = std::clamp<std::uint64_t>(ipg, kInodesPerBlock, kBlocksPerGroup);
+    ipg = std::min<std::uint64_t>(ipg, 0xFFFFFFFFu / groups_ / kInodesPerBlock * kInodesPerBlock);
+    inodes_per_group_ = static_cast<std::uint32_t>(ipg);
+    itable_blocks_ = inodes_per_group_ / kInodesPerBlock;
+    gdt_blocks_ = (groups_ * kDescSize + kBlock - 1) / kBlock;
+
+    block_bitmap_.assign(std::size_t{groups_} * kBlock, 0);
+    // Superblock and descriptor copies, then the padding past the end.
+    for (std::uint32_t g = 0; g < groups_; ++g) {
+        if (HasSuper(g)) MarkBlocks(g * kBlocksPerGroup, 1 + gdt_blocks_, true);
+    }
+    for (std::uint64_t b = blocks_; b < std::uint64_t{groups_} * kBlocksPerGroup; ++b) {
+        block_bitmap_[b / 8] |= static_cast<std::uint8_t>(1u << (b % 8));
+    }
+
+    // flex_bg: every group's bitmaps and inode table go right behind the
+    // primary descriptors, so the rest of the device is one data area.
+    cursor_ = 1 + gdt_blocks_;
+    block_bitmap_at_.resize(groups_);
+    inode_bitmap_at_.resize(groups_);
+    inode_table_at_.resize(groups_);
+    for (auto* at : {&block_bitmap_at_, &inode_bitmap_at_}) {
+        for (std::uint32_t g = 0; g < groups_; ++g) {
+            auto r = AllocContiguous(1, (*at)[g]);
+            if (!r.is_ok()) return r;
+        }
+    }
+    for (std::uint32_t g = 0; g < groups_; ++g) {
+        auto r = AllocContiguous(itable_blocks_, inode_table_at_[g]);
+        if (!r.is_ok()) return r;
+    }
+    return Result::Ok();
+}
+
+bool Ext4Builder::HasSuper(std::uint32_t group) const {
+    return group <= 1 || IsPowerOf(group, 3) || IsPowerOf(group, 5) || IsPowerOf(group, 7);
+}
+
+std::uint32_t Ext4Builder::ReservedEnd(std::uint32_t block) const {
+    const std::uint32_t g = block / kBlocksPerGroup;
+    if (g < groups_ && HasSuper(g) && block % kBlocksPerGroup < 1 + gdt_blocks_) {
+        return g * kBlocksPerGroup + 1 + gdt_blocks_;
+    }
+    return block;
+}
+
+std::uint32_t Ext4Builder::NextReserved(std::uint32_t block) const {
+    for (std::uint32_t g = block / kBlocksPerGroup + 1; g < groups_; ++g) {
+        if (HasSuper(g)) return g * kBlocksPerGroup;
+    }
+    return blocks_;
+}
+
+Result Ext4Builder::AllocRun(std::uint32_t want, std::uint32_t& start, std::uint32_t& got) {
+    cursor_ = std::min(ReservedEnd(cursor_), blocks_);
+    if (cursor_ >= blocks_) return Result::Fail(ENOSPC, path_ + ": filesystem full");
+    start = cursor_;
+    got = std::min(want, NextReserved(cursor_) - cursor_);
+    cursor_ += got;
+    MarkBlocks(start, got, true);
+    return Result::Ok();
+}
+
+Result Ext4Builder::AllocContiguous(std::uint32_t count, std::uint32_t& start) {
+    while (true) {
+        cursor_ = std::min(ReservedEnd(cursor_), blocks_);
+        const std::uint32_t limit = NextReserved(cursor_);
+        if (limit - cursor_ >= count) break;
+        if (limit >= blocks_) return Result::Fail(ENOSPC, path_ + ": filesystem full");
+        cursor_ = limit;
+    }
+    start = cursor_;
+    cursor_ += count;
+    MarkBlocks(start, count, true);
+    return Result::Ok();
+}
+
+void Ext4Builder::MarkBlocks(std::uint32_t start, std::uint32_t count, bool used) {
+    for (std::uint64_t b = start; b < std::uint64_t{start} + count; ++b) {
+        const auto bit = static_cast<std::uint8_t>(1u << (b % 8));
+        if (used) {
+            block_bitmap_[b / 8] |= bit;
+        } else {
+            block_bitmap_[b / 8] &= static_cast<std::uint8_t>(~bit);
+        }
+    }
+}
+
+Result Ext4Builder::NewInode(std::uint16_t mode, const TreeEntryMeta& m, std::uint32_t& ino) {
+    if (inodes_.size() >= std::uint64_t{groups_} * inodes_per_group_) {
+        return Result::Fail(ENOSPC, path_ + ": out of inodes (lower the inode ratio)");
+    }
+    Inode node;
+    node.mode = mode;
+    node.uid = static_cast<std::uint32_t>(m.uid);
+    node.gid = static_cast<std::uint32_t>(m.gid);
+    node.mtime = m.has_mtime ? m.mtime : timespec{static_cast<time_t>(now_), 0};
+    node.atime = m.has_atime ? m.atime : node.mtime;
+    if (S_ISREG(mode) || S_ISDIR(mode)) node.flags = kInodeFlagExtents;
+    inodes_.push_back(std::move(node));
+    ino = static_cast<std::uint32_t>(inodes_.size());
+    return Result::Ok();
+}
+
+Result Ext4Builder::LookupDir(const std::string& rel, std::uint32_t& ino) {
+    if (rel.empty()) {
+        ino = kRootIno;
+        return Result::Ok();
+    }
+    auto it = paths_.find(rel);
+    if (it != paths_.end() && S_ISDIR(Node(it->second).mode)) {
+        ino = it->second;
+        return Result::Ok();
+    }
+    // Missing, or something else where a directory is needed.
+    TreeEntryMeta m;
+    auto r = NewInode(S_IFDIR | 0755, m, ino);
+    if (!r.is_ok()) return r;
+    return Link(rel, ino);
+}
+
+Result Ext4Builder::Link(const std::string& rel, std::uint32_t ino) {
+    std::string parent_rel, name;
+    SplitPath(rel, parent_rel, name);
+    if (name.empty() || name == "." || name.size() > 255) return Result::Fail(EINVAL, "Unsupported path: " + rel);
+
+    std::uint32_t parent = 0;
+    auto r = LookupDir(parent_rel, parent);
+    if (!r.is_ok()) return r;
+
+    Inode& node = Node(ino);
+    Dir& dir = dirs_[parent];
+    const DirEntry entry{name, ino, DirentType(node.mode)};
+    auto it = dir.names.find(name);
+    if (it == dir.names.end()) {
+        dir.names.emplace(name, dir.entries.size());
+        dir.entries.push_back(entry);
+    } else {
+        DirEntry& old = dir.entries[it->second];
+        if (old.ino == ino) return Result::Ok();
+        if (S_ISDIR(Node(old.ino).mode)) {
+            const Dir& sub = dirs_[old.ino];
+            if (std::any_of(sub.entries.begin(), sub.entries.end(), [](const DirEntry& e) { return e.ino != 0; })) {
+                return Result::Fail(EEXIST, "Cannot replace non-empty directory " + rel);
+            }
+            dirs_.erase(old.ino);
+            Node(old.ino) = Inode{};
+        } else {
+            Unlink(old.ino);
+        }
+        old = entry;
+    }
+    if (S_ISDIR(node.mode)) dirs_[ino].parent = parent;
+    ++node.links;
+    paths_[rel] = ino;
+    return Result::Ok();
+}
+
+void Ext4Builder::Unlink(std::uint32_t ino) {
+    Inode& node = Node(ino);
+    if (--node.links > 0) return;
+    for (const Extent& e : node.extents) MarkBlocks(e.physical, e.len, false);
+    for (std::uint32_t b : node.tree_blocks) MarkBlocks(b, 1, false);
+    node = Inode{};
+}
+
+Result Ext4Builder::Directory(const std::string& rel, const TreeEntryMeta& m) {
+    auto it = paths_.find(rel);
+    if (it != paths_.end() && S_ISDIR(Node(it->second).mode)) {
+        Inode& node = Node(it->second);
+        node.mode = static_cast<std::uint16_t>(S_IFDIR | (m.mode & 07777));
+        node.uid = static_cast<std::uint32_t>(m.uid);
+        node.gid = static_cast<std::uint32_t>(m.gid);
+        if (m.has_mtime) node.mtime = m.mtime;
+        node.atime = m.has_atime ? m.atime : node.mtime;
+        return Result::Ok();
+    }
+    std::uint32_t ino = 0;
+    auto r = NewInode(static_cast<std::uint16_t>(S_IFDIR | (m.mode & 07777)), m, ino);
+    if (!r.is_ok()) return r;
+    dirs_[ino];
+    return Link(rel, ino);
+}
+
+Result Ext4Builder::Symlink(const std::string& rel, const std::string& target, const TreeEntryMeta& m) {
+    if (target.empty() || target.size() >= kBlock) return Result::Fail(EINVAL, "Unsupported symlink target for " + rel);
+    std::uint32_t ino = 0;
+    auto r = NewInode(static_cast<std::uint16_t>(S_IFLNK | (m.mode & 07777 ? m.mode & 07777 : 0777)), m, ino);
+    if (!r.is_ok()) return r;
+    Inode& node = Node(ino);
+    node.size = target.size();
+    if (target.size() < sizeof(node.iblock)) {
+        // Fast symlink: the target lives in the inode.
+        std::memcpy(node.iblock, target.data(), target.size());
+    } else {
+        std::vector<std::uint8_t> block(kBlock, 0);
+        std::memcpy(block.data(), target.data(), target.size());
+        node.flags = kInodeFlagExtents;
+        r = AppendData(node, 0, block.data(), 1);
+        if (r.is_ok()) r = BuildExtentTree(Node(ino));
+        if (!r.is_ok()) return r;
+    }
+    return Link(rel, ino);
+}
+
+Result Ext4Builder::Hardlink(const std::string& rel, const std::string& target_rel) {
+    auto it = paths_.find(target_rel);
+    if (it == paths_.end()) return Result::Fail(ENOENT, "Hardlink target not found: " + target_rel);
+    if (S_ISDIR(Node(it->second).mode)) return Result::Fail(EPERM, "Hardlink to directory: " + target_rel);
+    return Link(rel, it->second);
+}
+
+Result Ext4Builder::Special(const std::string& rel, const TreeEntryMeta& m) {
+    std::uint32_t ino = 0;
+    auto r = NewInode(static_cast<std::uint16_t>(m.mode), m, ino);
+    if (!r.is_ok()) return r;
+    Inode& node = Node(ino);
+    if (S_ISCHR(m.mode) || S_ISBLK(m.mode)) {
+        const std::uint32_t maj = major(m.rdev);
+        const std::uint32_t min = minor(m.rdev);
+        if (maj < 256 && min < 256) {
+            Put32(node.iblock, (maj << 8) | min);
+        } else {
+            Put32(node.iblock + 4, (min & 0xFF) | (maj << 8) | ((min & ~0xFFu) << 12));
+        }
+    }
+    return Link(rel, ino);
+}
+
+Result Ext4Builder::BeginFile(const std::string& rel, const TreeEntryMeta& m) {
+    std::uint32_t ino = 0;
+    auto r = NewInode(static_cast<std::uint16_t>(S_IFREG | (m.mode & 07777)), m, ino);
+    if (!r.is_ok()) return r;
+    r = Link(rel, ino);
+    if (!r.is_ok()) return r;
+    cur_ = OpenFile{};
+    cur_.ino = ino;
+    cur_.size = m.size > 0 ? static_cast<std::uint64_t>(m.size) : 0;
+    in_file_ = true;
+    return Result::Ok();
+}
+
+Result Ext4Builder::FileData(std::span<const std::uint8_t> data, std::int64_t offset) {
+    if (offset < 0 || static_cast<std::uint64_t>(offset) < cur_.end) {
+        return Result::Fail(EINVAL, "File data out of order in archive");
+    }
+    std::uint64_t pos = static_cast<std::uint64_t>(offset);
+    if ((pos + data.size() + kBlock - 1) / kBlock > 0xFFFFFFFFu) return Result::Fail(EFBIG, "File too large for ext4");
+
+    while (!data.empty()) {
+        const auto logical = static_cast<std::uint32_t>(pos / kBlock);
+        const std::size_t in = pos % kBlock;
+        if (cur_.partial_block >= 0 && cur_.partial_block != logical) {
+            auto r = FlushPartial();
+            if (!r.is_ok()) return r;
+        }
+        if (in == 0 && cur_.partial_block < 0 && data.size() >= kBlock) {
+            const auto count = static_cast<std::uint32_t>(data.size() / kBlock);
+            auto r = AppendData(Node(cur_.ino), logical, data.data(), count);
+            if (!r.is_ok()) return r;
+            data = data.subspan(std::size_t{count} * kBlock);
+            pos += std::uint64_t{count} * kBlock;
+            continue;
+        }
+        if (cur_.partial_block < 0) {
+            cur_.partial.assign(kBlock, 0);
+            cur_.partial_block = logical;
+        }
+        const std::size_t take = std::min<std::size_t>(kBlock - in, data.size());
+        std::memcpy(cur_.partial.data() + in, data.data(), take);
+        data = data.subspan(take);
+        pos += take;
+        if (in + take == kBlock) {
+            auto r = FlushPartial();
+            if (!r.is_ok()) return r;
+        }
+    }
+    cur_.end = std::max(cur_.end, pos);
+    return Result::Ok();
+}
+
+Result Ext4Builder::FlushPartial() {
+    if (cur_.partial_block < 0) return Result::Ok();
+    const auto logical = static_cast<std::uint32_t>(cur_.partial_block);
+    cur_.partial_block = -1;
+    return AppendData(Node(cur_.ino), logical, cur_.partial.data(), 1);
+}
+
+Result Ext4Builder::EndFile() {
+    in_file_ = false;
+    auto r = FlushPartial();
+    if (!r.is_ok()) return r;
+    Inode& node = Node(cur_.ino);
+    node.size = std::max(cur_.size, cur_.end);
+    r = BuildExtentTree(node);
+    if (!r.is_ok()) return r;
+    ++files_;
+    return Result::Ok();
+}
+
+void Ext4Builder::AddExtent(Inode& node, std::uint32_t logical, std::uint32_t physical, std::uint32_t count) {
+    node.blocks += count;
+    while (count > 0) {
+        if (!node.extents.empty()) {
+            Extent& last = node.extents.back();
+            if (last.logical + last.len == logical && last.physical + last.len == physical && last.len < kMaxExtentLen) {
+                const std::uint32_t grow = std::min(count, kMaxExtentLen - last.len);
+                last.len += grow;
+                logical += grow;
+                physical += grow;
+                count -= grow;
+                continue;
+            }
+        }
+        const std::uint32_t len = std::min(count, kMaxExtentLen);
+        node.extents.push_back({logical, physical, len});
+        logical += len;
+        physical += len;
+        count -= len;
+    }
+}
+
+Result Ext4Builder::AppendData(Inode& node, std::uint32_t logical, const std::uint8_t* data, std::uint32_t count) {
+    while (count > 0) {
+        std::uint32_t start = 0, got = 0;
+        auto r = AllocRun(count, start, got);
+        if (!r.is_ok()) return r;
+        r = WriteBlocks(start, data, got);
+        if (!r.is_ok()) return r;
+        AddExtent(node, logical, start, got);
+        logical += got;
+        data += std::size_t{got} * kBlock;
+        count -= got;
+    }
+    return Result::Ok();
+}
+
+// Up to four extents fit in the inode; more get leaf blocks, and more leaf
+// blocks than that get index blocks above them.
+Result Ext4Builder::BuildExtentTree(Inode& node) {
+    struct Record {
+        std::uint32_t logical;
+        std::uint8_t raw[12];
+    };
+    std::vector<Record> level;
+    level.reserve(node.extents.size());
+    for (const Extent& e : node.extents) {
+        Record rec{e.logical, {}};
+        Put32(rec.raw, e.logical);
+        Put16(rec.raw + 4, static_cast<std::uint16_t>(e.len));
+        Put16(rec.raw + 6, 0);
+        Put32(rec.raw + 8, e.physical);
+        level.push_back(rec);
+    }
+
+    auto header = [](std::uint8_t* p, std::size_t entries, std::uint16_t max, std::uint16_t depth) {
+        Put16(p, 0xF30A);
+        Put16(p + 2, static_cast<std::uint16_t>(entries));
+        Put16(p + 4, max);
+        Put16(p + 6, depth);
+        Put32(p + 8, 0);
+    };
+
+    std::uint16_t depth = 0;
+    std::vector<std::uint8_t> block(kBlock);
+    while (level.size() > 4) {
+        std::vector<Record> up;
+        for (std::size_t i = 0; i < level.size(); i += kExtentsPerBlock) {
+            const std::size_t n = std::min<std::size_t>(kExtentsPerBlock, level.size() - i);
+            std::fill(block.begin(), block.end(), 0);
+            header(block.data(), n, kExtentsPerBlock, depth);
+            for (std::size_t k = 0; k < n; ++k) std::memcpy(block.data() + 12 + 12 * k, level[i + k].raw, 12);
+
+            std::uint32_t at = 0;
+            auto r = AllocContiguous(1, at);
+            if (!r.is_ok()) return r;
+            r = WriteBlocks(at, block.data(), 1);
+            if (!r.is_ok()) return r;
+            node.tree_blocks.push_back(at);
+            ++node.blocks;
+
+            Record idx{level[i].logical, {}};
+            Put32(idx.raw, level[i].logical);
+            Put32(idx.raw + 4, at);
+            up.push_back(idx);
+        }
+        level = std::move(up);
+        ++depth;
+    }
+
+    std::memset(node.iblock, 0, sizeof(node.iblock));
+    header(node.iblock, level.size(), 4, depth);
+    for (std::size_t k = 0; k < level.size(); ++k) std::memcpy(node.iblock + 12 + 12 * k, level[k].raw, 12);
+    return Result::Ok();
+}
+
+Result Ext4Builder::PWrite(const void* data, std::size_t len, std::uint64_t off) {
+    const auto* p = static_cast<const std::uint8_t*>(data);
+    while (len > 0) {
+        const ssize_t n = ::pwrite(fd_.Get(), p, len, static_cast<off_t>(off));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return Result::Fail(errno, "write " + path_ + " failed (" + std::strerror(errno) + ")");
+        p += n;
+        len -= static_cast<std::size_t>(n);
+        off += static_cast<std::uint64_t>(n);
+    }
+    return Result::Ok();
+}
+
+Result Ext4Builder::FlushWrites() {
+    if (wbuf_blocks_ == 0) return Result::Ok();
+    auto r = PWrite(wbuf_.data(), std::size_t{wbuf_blocks_} * kBlock, std::uint64_t{wbuf_start_} * kBlock);
+    wbuf_blocks_ = 0;
+    return r;
+}
+
+Result Ext4Builder::WriteBlocks(std::uint32_t start, const std::uint8_t* data, std::uint32_t count) {
+    const std::size_t cap = wbuf_.size() / kBlock;
+    if (wbuf_blocks_ > 0 && (start != wbuf_start_ + wbuf_blocks_ || wbuf_blocks_ + count > cap)) {
+        auto r = FlushWrites();
+        if (!r.is_ok()) return r;
+    }
+    if (wbuf_blocks_ == 0 && count >= cap) return PWrite(data, std::size_t{count} * kBlock, std::uint64_t{start} * kBlock);
+    if (wbuf_blocks_ == 0) wbuf_start_ = start;
+    std::memcpy(wbuf_.data() + std::size_t{wbuf_blocks_} * kBlock, data, std::size_t{count} * kBlock);
+    wbuf_blocks_ += count;
+    return Result::Ok();
+}
+
+Result Ext4Builder::ZeroBlocks(std::uint32_t start, std::uint32_t count) {
+    const std::uint64_t off = std::uint64_t{start} * kBlock;
+    const std::uint64_t len = std::uint64_t{count} * kBlock;
+    if (PartitionWriter::ZeroRange(fd_.Get(), off, len).is_ok()) return Result::Ok();
+    std::vector<std::uint8_t> zero(std::min<std::uint64_t>(len, 1024 * 1024), 0);
+    for (std::uint64_t done = 0; done < len;) {
+        const std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(zero.size(), len - done));
+        auto r = PWrite(zero.data(), n, off + done);
+        if (!r.is_ok()) return r;
+        done += n;
+    }
+    return Result::Ok();
+}
+
+// The journal is zeroed (a stale one at the same place could otherwise be
+// replayed) and starts at a random sequence number.
+Result Ext4Builder::CreateJournal() {
+    const std::uint32_t jblocks = JournalBlocks(blocks_);
+    if (jblocks == 0) return Result::Ok();
+
+    Inode& node = Node(kJournalIno);
+    node.mode = S_IFREG | 0600;
+    node.flags = kInodeFlagExtents;
+    node.links = 1;
+    node.size = std::uint64_t{jblocks} * kBlock;
+    node.atime = node.mtime = {static_cast<time_t>(now_), 0};
+    for (std::uint32_t logical = 0; logical < jblocks;) {
+        std::uint32_t start = 0, got = 0;
+        auto r = AllocRun(jblocks - logical, start, got);
+        if (!r.is_ok()) return r;
+        r = ZeroBlocks(start, got);
+        if (!r.is_ok()) return r;
+        AddExtent(node, logical, start, got);
+        logical += got;
+    }
+
+    std::uint32_t sequence = 0;
+    if (::getrandom(&sequence, sizeof(sequence), 0) != sizeof(sequence)) sequence = now_;
+    std::vector<std::uint8_t> jsb(kBlock, 0);
+    Put32Be(&jsb[0x00], 0xC03B3998);  // magic
+    Put32Be(&jsb[0x04], 4);           // superblock v2
+    Put32Be(&jsb[0x0C], kBlock);
+    Put32Be(&jsb[0x10], jblocks);
+    Put32Be(&jsb[0x14], 1);  // first log block
+    Put32Be(&jsb[0x18], sequence | 1);
+    std::memcpy(&jsb[0x30], uuid_, sizeof(uuid_));
+    Put32Be(&jsb[0x40], 1);  // users
+    auto r = PWrite(jsb.data(), jsb.size(), std::uint64_t{node.extents.front().physical} * kBlock);
+    if (!r.is_ok()) return r;
+
+    journal_ = true;
+    return BuildExtentTree(Node(kJournalIno));
+}
+
+Result Ext4Builder::WriteDirectory(std::uint32_t ino) {
+    Dir& dir = dirs_[ino];
+    std::vector<std::uint8_t> buf;
+    std::size_t used = kBlock;
+    std::size_t last = 0;
+    std::uint32_t subdirs = 0;
+
+    auto add = [&](const std::string& name, std::uint32_t target, std::uint8_t type) {
+        const std::size_t need = (8 + name.size() + 3) & ~std::size_t{3};
+        if (used + need > kBlock) {
+            if (!buf.empty()) Put16(&buf[last + 4], static_cast<std::uint16_t>(buf.size() - last));
+            buf.resize(buf.size() + kBlock, 0);
+            used = 0;
+        }
+        last = buf.size() - kBlock + used;
+        Put32(&buf[last], target);
+        Put16(&buf[last + 4], static_cast<std::uint16_t>(need));
+        buf[last + 6] = static_cast<std::uint8_t>(name.size());
+        buf[last + 7] = type;
+        std::memcpy(&buf[last + 8], name.data(), name.size());
+        used += need;
+    };
+    add(".", ino, 2);
+    add("..", dir.parent, 2);
+    for (const DirEntry& e : dir.entries) {
+        if (e.ino == 0) continue;
+        add(e.name, e.ino, e.type);
+        if (e.type == 2) ++subdirs;
+    }
+    Put16(&buf[last + 4], static_cast<std::uint16_t>(buf.size() - last));
+
+    // lost+found keeps spare blocks so fsck can reconnect files without
+    // allocating.
+    while (ino == kFirstIno && buf.size() < kLostFoundBlocks * kBlock) {
+        buf.resize(buf.size() + kBlock, 0);
+        Put16(&buf[buf.size() - kBlock + 4], static_cast<std::uint16_t>(kBlock));
+    }
+
+    Inode& node = Node(ino);
+    auto r = AppendData(node, 0, buf.data(), static_cast<std::uint32_t>(buf.size() / kBlock));
+    if (!r.is_ok()) return r;
+    node.size = buf.size();
+    node.links = 2 + subdirs > 65000 ? 1 : 2 + subdirs;  // dir_nlink
+    return BuildExtentTree(node);
+}
+
+void Ext4Builder::EncodeInode(std::uint32_t ino, std::uint8_t* p) const {
+    std::memset(p, 0, kInodeSize);
+    const Inode& n = inodes_[ino - 1];
+    if (n.mode == 0) return;
+    Put16(p + 0x00, n.mode);
+    Put16(p + 0x02, static_cast<std::uint16_t>(n.uid));
+    Put32(p + 0x04, static_cast<std::uint32_t>(n.size));
+    Put32(p + 0x08, static_cast<std::uint32_t>(n.atime.tv_sec));
+    Put32(p + 0x0C, static_cast<std::uint32_t>(n.mtime.tv_sec));  // ctime
+    Put32(p + 0x10, static_cast<std::uint32_t>(n.mtime.tv_sec));
+    Put16(p + 0x18, static_cast<std::uint16_t>(n.gid));
+    Put16(p + 0x1A, static_cast<std::uint16_t>(n.links));
+    Put32(p + 0x1C, static_cast<std::uint32_t>(n.blocks * (kBlock / 512)));
+    Put32(p + 0x20, n.flags);
+    std::memcpy(p + 0x28, n.iblock, sizeof(n.iblock));
+    Put32(p + 0x6C, static_cast<std::uint32_t>(n.size >> 32));
+    Put16(p + 0x78, static_cast<std::uint16_t>(n.uid >> 16));
+    Put16(p + 0x7A, static_cast<std::uint16_t>(n.gid >> 16));
+    Put16(p + 0x80, kExtraIsize);
+    Put32(p + 0x84, TimeExtra(n.mtime));  // ctime
+    Put32(p + 0x88, TimeExtra(n.mtime));
+    Put32(p + 0x8C, TimeExtra(n.atime));
+    Put32(p + 0x90, static_cast<std::uint32_t>(n.mtime.tv_sec));  // crtime
+    Put32(p + 0x94, TimeExtra(n.mtime));
+}
+
+void Ext4Builder::EncodeSuper(std::uint8_t* p, std::uint32_t group, std::uint32_t free_blocks,
+                              std::uint32_t free_inodes) const {
+    std::memset(p, 0, 1024);
+    Put32(p + 0x00, groups_ * inodes_per_group_);
+    Put32(p + 0x04, blocks_);
+    Put32(p + 0x08, static_cast<std::uint32_t>(std::uint64_t{blocks_} * std::min(opt_.reserved_percent, 50u) / 100));
+    Put32(p + 0x0C, free_blocks);
+    Put32(p + 0x10, free_inodes);
+    Put32(p + 0x14, 0);  // first data block
+    Put32(p + 0x18, 2);  // 1024 << 2
+    Put32(p + 0x1C, 2);
+    Put32(p + 0x20, kBlocksPerGroup);
+    Put32(p + 0x24, kBlocksPerGroup);
+    Put32(p + 0x28, inodes_per_group_);
+    Put32(p + 0x30, now_);     // wtime
+    Put16(p + 0x36, 0xFFFF);   // max mount count: none
+    Put16(p + 0x38, 0xEF53);
+    Put16(p + 0x3A, 1);        // clean
+    Put16(p + 0x3C, 1);        // errors: continue
+    Put32(p + 0x40, now_);     // lastcheck
+    Put32(p + 0x4C, 1);        // dynamic revision
+    Put32(p + 0x54, kFirstIno);
+    Put16(p + 0x58, kInodeSize);
+    Put16(p + 0x5A, static_cast<std::uint16_t>(group));
+    Put32(p + 0x5C, kCompatDirIndex | (journal_ ? kCompatHasJournal : 0));
+    Put32(p + 0x60, kIncompatFiletype | kIncompatExtents | kIncompatFlexBg);
+    Put32(p + 0x64, kRoCompatSparseSuper | kRoCompatLargeFile | kRoCompatGdtCsum | kRoCompatDirNlink |
+                        kRoCompatExtraIsize);
+    std::memcpy(p + 0x68, uuid_, sizeof(uuid_));
+    std::memcpy(p + 0x78, opt_.label.data(), std::min<std::size_t>(opt_.label.size(), 16));
+    if (journal_) {
+        Put32(p + 0xE0, kJournalIno);
+        // Backup of the journal inode's block map and size.
+        const Inode& j = inodes_[kJournalIno - 1];
+        std::memcpy(p + 0x10C, j.iblock, sizeof(j.iblock));
+        Put32(p + 0x10C + 60, static_cast<std::uint32_t>(j.size >> 32));
+        Put32(p + 0x10C + 64, static_cast<std::uint32_t>(j.size));
+        p[0xFD] = 1;  // EXT3_JNL_BACKUP_BLOCKS
+    }
+    for (int i = 0; i < 4; ++i) Put32(p + 0xEC + 4 * i, hash_seed_[i]);
+    p[0xFC] = 1;                     // half_md4
+    Put32(p + 0x100, 0x000C);        // user_xattr, acl
+    Put32(p + 0x108, now_);          // mkfs time
+    Put16(p + 0x15C, kExtraIsize);   // min extra isize
+    Put16(p + 0x15E, kExtraIsize);   // want extra isize
+    Put32(p + 0x160, std::is_signed_v<char> ? 0x1 : 0x2);  // dir hash signedness
+    p[0x174] = 4;                    // 16 groups per flex group
+}
+
+Result Ext4Builder::WriteMetadata() {
+    const std::uint32_t ipg = inodes_per_group_;
+    const auto inode_count = static_cast<std::uint32_t>(inodes_.size());
+    auto in_use = [&](std::uint32_t ino) { return ino < kFirstIno || inodes_[ino - 1].mode != 0; };
+
+    std::vector<std::uint8_t> gdt(std::size_t{gdt_blocks_} * kBlock, 0);
+    std::vector<std::uint8_t> inode_bitmaps(std::size_t{groups_} * kBlock, 0);
+    std::uint64_t free_blocks = 0, free_inodes = 0;
+
+    for (std::uint32_t g = 0; g < groups_; ++g) {
+        std::uint8_t* ibm = &inode_bitmaps[std::size_t{g} * kBlock];
+        std::uint32_t used_dirs = 0, free_in_group = 0, high = 0;
+        for (std::uint32_t i = 0; i < ipg; ++i) {
+            const std::uint32_t ino = g * ipg + i + 1;
+            if (ino <= inode_count && in_use(ino)) {
+                ibm[i / 8] |= static_cast<std::uint8_t>(1u << (i % 8));
+                if (S_ISDIR(inodes_[ino - 1].mode)) ++used_dirs;
+                high = i + 1;
+            } else {
+                ++free_in_group;
+            }
+        }
+        for (std::uint32_t i = ipg; i < kBlocksPerGroup; ++i) ibm[i / 8] |= static_cast<std::uint8_t>(1u << (i % 8));
+
+        std::uint32_t free_bl = 0;
+        const std::uint32_t first = g * kBlocksPerGroup;
+        const std::uint32_t end = std::min(first + kBlocksPerGroup, blocks_);
+        for (std::uint32_t b = first; b < end; ++b) {
+            if (!(block_bitmap_[b / 8] & (1u << (b % 8)))) ++free_bl;
+        }
+        free_blocks += free_bl;
+        free_inodes += free_in_group;
+
+        std::uint8_t* d = &gdt[std::size_t{g} * kDescSize];
+        Put32(d + 0x00, block_bitmap_at_[g]);
+        Put32(d + 0x04, inode_bitmap_at_[g]);
+        Put32(d + 0x08, inode_table_at_[g]);
+        Put16(d + 0x0C, static_cast<std::uint16_t>(free_bl));
+        Put16(d + 0x0E, static_cast<std::uint16_t>(free_in_group));
+        Put16(d + 0x10, static_cast<std::uint16_t>(used_dirs));
+        Put16(d + 0x12, high == 0 ? kBgInodeUninit : 0);
+        Put16(d + 0x1C, static_cast<std::uint16_t>(ipg - high));  // itable_unused
+        std::uint8_t gle[4];
+        Put32(gle, g);
+        std::uint16_t crc = Crc16(0xFFFF, uuid_, sizeof(uuid_));
+        crc = Crc16(crc, gle, sizeof(gle));
+        crc = Crc16(crc, d, 0x1E);
+        Put16(d + 0x1E, crc);
+    }
+
+    // Bitmaps and inode tables sit in ascending order right behind the
+    // primary descriptors.
+    for (std::uint32_t g = 0; g < groups_; ++g) {
+        auto r = WriteBlocks(block_bitmap_at_[g], &block_bitmap_[std::size_t{g} * kBlock], 1);
+        if (!r.is_ok()) return r;
+    }
+    for (std::uint32_t g = 0; g < groups_; ++g) {
+        auto r = WriteBlocks(inode_bitmap_at_[g], &inode_bitmaps[std::size_t{g} * kBlock], 1);
+        if (!r.is_ok()) return r;
+    }
+    // Only the used part of each table; uninit_bg covers the rest.
+    std::vector<std::uint8_t> table;
+    for (std::uint32_t g = 0; g < groups_ && g * ipg < inode_count; ++g) {
+        const std::uint32_t n = std::min(ipg, inode_count - g * ipg);
+        table.assign((n + kInodesPerBlock - 1) / kInodesPerBlock * kBlock, 0);
+        for (std::uint32_t i = 0; i < n; ++i) EncodeInode(g * ipg + i + 1, &table[std::size_t{i} * kInodeSize]);
+        auto r = WriteBlocks(inode_table_at_[g], table.data(), static_cast<std::uint32_t>(table.size() / kBlock));
+        if (!r.is_ok()) return r;
+    }
+    auto r = FlushWrites();
+    if (!r.is_ok()) return r;
+
+    // Backup superblocks and descriptors, then the primary ones. Everything
+    // else is made durable first, so a target that shows the primary
+    // superblock also holds the tables and data it describes.
+    std::vector<std::uint8_t> block(kBlock, 0);
+    for (std::uint32_t g = groups_; g-- > 0;) {
+        if (!HasSuper(g)) continue;
+        if (g == 0 && ::fdatasync(fd_.Get()) != 0) {
+            return Result::Fail(errno, "fdatasync " + path_ + " failed (" + std::strerror(errno) + ")");
+        }
+        const std::uint64_t at = std::uint64_t{g} * kBlocksPerGroup * kBlock;
+        r = PWrite(gdt.data(), gdt.size(), at + kBlock);
+        if (!r.is_ok()) return r;
+        std::fill(block.begin(), block.end(), 0);
+        EncodeSuper(&block[g == 0 ? 1024 : 0], g, static_cast<std::uint32_t>(free_blocks),
+                    static_cast<std::uint32_t>(free_inodes));
+        r = PWrite(block.data(), block.size(), at);
+        if (!r.is_ok()) return r;
+    }
+    return Result::Ok();
+}
+
+Result Ext4Builder::Finish() {
+    if (in_file_) return Result::Fail(EINVAL, "Unfinished file in archive");
+    for (std::uint32_t ino = 1; ino <= inodes_.size(); ++ino) {
+        if (!dirs_.count(ino) || !S_ISDIR(Node(ino).mode)) continue;
+        auto r = WriteDirectory(ino);
+        if (!r.is_ok()) return r;
+    }
+    auto r = FlushWrites();
+    if (!r.is_ok()) return r;
+    return WriteMetadata();
+}
+
+Result Ext4Builder::Sync() {
+    if (::fsync(fd_.Get()) != 0) return Result::Fail(errno, "fsync " + path_ + " failed (" + std::strerror(errno) + ")");
+    return Result::Ok();
+}
+
+} // namespace flash
@@ -15,6 +15,10 @@ Result FileOrStdinReader::Open(std::string path, FileOrStdinReader &out) {
     if (out.path_ == "-") {
         out.fd_.Reset(STDIN_FILENO);
         out.size_ = std::nullopt;
+        struct stat st {};
+        const bool have_st = ::fstat(STDIN_FILENO, &st) == 0;
+        out.seekable_ = have_st && S_ISREG(st.st_mode);
+        out.pipe_ = have_st && S_ISFIFO(st.st_mode);
         return Result::Ok();
     }
 
@@ -32,6 +36,8 @@ Result FileOrStdinReader::Open(std::string path, FileOrStdinReader &out) {
     } else {
         out.size_ = std::nullopt;
     }
+    out.seekable_ = S_ISREG(st.st_mode);
+    out.pipe_ = S_ISFIFO(st.st_mode);
 
     return Result::Ok();
 }
@@ -40,6 +46,30 @@ std::optional<std::uint64_t> FileOrStdinReader::TotalSize() const {
     return size_;
 }
 
+std::int64_t FileOrStdinReader::Seek(std::int64_t offset, int whence) {
+    if (!seekable_) {
+        errno = ESPIPE;
+        return -1;
+    }
+    return static_cast<std::int64_t>(::lseek(fd_.Get(), static_cast<off_t>(offset), whence));
+}
+
+bool FileOrStdinReader::KernelSource(FdSource& out) {
+    out = {};
+    out.fd = fd_.Get();
+    if (pipe_) return true;
+    if (!seekable_) return false;
+    const off_t pos = ::lseek(fd_.Get(), 0, SEEK_CUR);
+    if (pos < 0) return false;
+    out.offset = pos;
+    if (size_ && *size_ >= static_cast<std::uint64_t>(pos)) out.length = *size_ - static_cast<std::uint64_t>(pos);
+    return true;
+}
+
+void FileOrStdinReader::Consumed(std::uint64_t n) {
+    if (seekable_) (void)::lseek(fd_.Get(), static_cast<off_t>(n), SEEK_CUR);
+}
+
 ssize_t FileOrStdinReader::Read(std::span<std::uint8_t> out) {
     while (true) {
         ssize_t n = ::read(fd_.Get(), out.data(), out.size());
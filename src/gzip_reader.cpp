@@ -1,71 +1,471 @@
 #include "flash/gzip_reader.hpp"
-#include <stdexcept>
+
+#include "flash/crc32.hpp"
+#include "flash/fd.hpp"
+#include "flash/logger.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace flash {
 
-GzipReader::GzipReader(std::unique_ptr<IReader> source) 
-    : source_(std::move(source)), in_buffer_(16384) {
-    strm_.zalloc = Z_NULL;
-    strm_.zfree = Z_NULL;
-    strm_.opaque = Z_NULL;
-    strm_.avail_in = 0;
-    strm_.next_in = Z_NULL;
+namespace {
+
+constexpr std::size_t kMinBuffer = 64 * 1024;
+constexpr std::size_t kMaxBuffer = 1024 * 1024;
+
+constexpr std::uint8_t kFlagHcrc = 0x02;
+constexpr std::uint8_t kFlagExtra = 0x04;
+constexpr std::uint8_t kFlagName = 0x08;
+constexpr std::uint8_t kFlagComment = 0x10;
+constexpr std::uint8_t kFlagReserved = 0xE0;
+
+std::uint32_t Le32(const std::uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<std::uint32_t>(p[3]) << 24);
+}
+
+std::uint64_t Le64(const std::uint8_t* p) {
+    return Le32(p) | (static_cast<std::uint64_t>(Le32(p + 4)) << 32);
+}
+
+void PutLe32(std::vector<std::uint8_t>& v, std::uint32_t x) {
+    for (int i = 0; i < 4; ++i) v.push_back(static_cast<std::uint8_t>(x >> (8 * i)));
+}
+
+void PutLe64(std::vector<std::uint8_t>& v, std::uint64_t x) {
+    PutLe32(v, static_cast<std::uint32_t>(x));
+    PutLe32(v, static_cast<std::uint32_t>(x >> 32));
+}
+
+// Index file: kIndexMagic, then per point
+//   le64 out, le64 in, le64 members, le32 crc, le32 size,
+//   u8 bits, u8 byte, le16 0, le32 window length, window, le32 CRC32 of the record.
+constexpr char kIndexMagic[8] = {'F', 'L', 'G', 'Z', 'I', 'X', '0', '1'};
+constexpr std::size_t kRecordHead = 8 * 3 + 4 * 2 + 4 + 4;
+constexpr std::size_t kMaxWindow = 32768;
+
+std::string Errno(const std::string& what) {
+    return what + " (" + std::strerror(errno) + ")";
+}
+
+bool ReadFull(int fd, std::uint8_t* p, std::size_t n) {
+    while (n > 0) {
+        const ssize_t r = ::read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r;
+        n -= static_cast<std::size_t>(r);
+    }
+    return true;
+}
+
+// Reads the intact records of an index open as `fd`; `end` receives the
+// offset after the last of them. Fails only if the magic is wrong.
+Result ReadIndex(int fd, std::vector<GzipAccessPoint>* points, std::uint64_t& end) {
+    std::uint8_t magic[sizeof(kIndexMagic)];
+    if (::lseek(fd, 0, SEEK_SET) != 0 || !ReadFull(fd, magic, sizeof(magic)) ||
+        std::memcmp(magic, kIndexMagic, sizeof(magic)) != 0) {
+        return Result::Fail(EBADMSG, "not a gzip index");
+    }
+    end = sizeof(kIndexMagic);
+    std::vector<std::uint8_t> rec;
+    while (true) {
+        rec.resize(kRecordHead);
+        if (!ReadFull(fd, rec.data(), kRecordHead)) break;
+        const std::uint32_t wlen = Le32(rec.data() + kRecordHead - 4);
+        if (wlen > kMaxWindow) break;
+        rec.resize(kRecordHead + wlen + 4);
+        if (!ReadFull(fd, rec.data() + kRecordHead, wlen + 4)) break;
+        const std::size_t body = kRecordHead + wlen;
+        if (Crc32(0, {rec.data(), body}) != Le32(rec.data() + body)) break;
 
-    // 16 + MAX_WBITS tells zlib to expect a gzip header
-    if (inflateInit2(&strm_, 16 + MAX_WBITS) != Z_OK) {
-        throw std::runtime_error("Failed to initialize zlib inflate");
+        if (points) {
+            GzipAccessPoint p;
+            p.out = Le64(rec.data());
+            p.in = Le64(rec.data() + 8);
+            p.members = Le64(rec.data() + 16);
+            p.crc = Le32(rec.data() + 24);
+            p.size = Le32(rec.data() + 28);
+            p.bits = rec[32] & 7;
+            p.byte = rec[33];
+            p.window.assign(rec.begin() + kRecordHead, rec.begin() + static_cast<std::ptrdiff_t>(body));
+            points->push_back(std::move(p));
+        }
+        end += rec.size();
+    }
+    return Result::Ok();
+}
+
+} // namespace
+
+const GzipAccessPoint* GzipIndex::Before(std::uint64_t out) const {
+    auto it = std::upper_bound(points.begin(), points.end(), out,
+                               [](std::uint64_t o, const GzipAccessPoint& p) { return o < p.out; });
+    return it == points.begin() ? nullptr : &*std::prev(it);
+}
+
+Result GzipIndex::Load(const std::string& path, GzipIndex& out) {
+    out.points.clear();
+    Fd fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd.Get() < 0) return Result::Fail(errno, Errno("Cannot open " + path));
+    std::uint64_t end = 0;
+    auto r = ReadIndex(fd.Get(), &out.points, end);
+    if (!r.is_ok()) return Result::Fail(r.err, path + ": " + r.msg);
+    return Result::Ok();
+}
+
+Result GzipIndex::Append(const std::string& path, std::span<const GzipAccessPoint> points) {
+    Fd fd(::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600));
+    if (fd.Get() < 0) return Result::Fail(errno, Errno("Cannot open " + path));
+
+    // Anything after the last intact record (a torn append) is cut off first.
+    std::vector<std::uint8_t> buf;
+    struct stat st {};
+    if (::fstat(fd.Get(), &st) != 0) return Result::Fail(errno, Errno("fstat failed"));
+    std::uint64_t end = 0;
+    if (st.st_size == 0 || !ReadIndex(fd.Get(), nullptr, end).is_ok()) {
+        end = 0;
+        buf.assign(kIndexMagic, kIndexMagic + sizeof(kIndexMagic));
+    }
+    if (::ftruncate(fd.Get(), static_cast<off_t>(end)) != 0) return Result::Fail(errno, Errno("ftruncate failed"));
+
+    for (const GzipAccessPoint& p : points) {
+        const std::size_t at = buf.size();
+        PutLe64(buf, p.out);
+        PutLe64(buf, p.in);
+        PutLe64(buf, p.members);
+        PutLe32(buf, p.crc);
+        PutLe32(buf, p.size);
+        buf.push_back(static_cast<std::uint8_t>(p.bits));
+        buf.push_back(p.byte);
+        buf.push_back(0);
+        buf.push_back(0);
+        PutLe32(buf, static_cast<std::uint32_t>(p.window.size()));
+        buf.insert(buf.end(), p.window.begin(), p.window.end());
+        PutLe32(buf, Crc32(0, {buf.data() + at, buf.size() - at}));
+    }
+    for (std::size_t off = 0; off < buf.size();) {
+        const ssize_t n = ::pwrite(fd.Get(), buf.data() + off, buf.size() - off, static_cast<off_t>(end + off));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return Result::Fail(errno, Errno("Cannot write " + path));
+        off += static_cast<std::size_t>(n);
+    }
+    if (::fsync(fd.Get()) != 0) return Result::Fail(errno, Errno("fsync of " + path + " failed"));
+    return Result::Ok();
+}
+
+GzipReader::GzipReader(std::unique_ptr<IReader> source, InflateBackend backend)
+    : source_(std::move(source)), inflater_(MakeInflater(backend)), in_buffer_(kMinBuffer) {
+    if (source_->Seekable()) base_ = source_->Seek(0, SEEK_CUR);
+}
+
+GzipReader::~GzipReader() = default;
+
+ssize_t GzipReader::Fail(int err, const char* msg) {
+    if (!error_) {
+        error_ = err;
+        LogError("gzip: %s", msg);
+    }
+    errno = error_;
+    return -1;
+}
+
+bool GzipReader::Fill(std::size_t need) {
+    while (in_len_ - in_pos_ < need) {
+        if (source_eof_) return false;
+        if (in_pos_ > 0) {
+            std::memmove(in_buffer_.data(), in_buffer_.data() + in_pos_, in_len_ - in_pos_);
+            in_len_ -= in_pos_;
+            in_pos_ = 0;
+        }
+        if (in_len_ == in_buffer_.size()) in_buffer_.resize(std::max(in_buffer_.size() * 2, need));
+
+        const std::size_t room = in_buffer_.size() - in_len_;
+        const ssize_t n = source_->Read({in_buffer_.data() + in_len_, room});
+        if (n < 0) {
+            read_err_ = errno ? errno : EIO;
+            return false;
+        }
+        if (n == 0) {
+            source_eof_ = true;
+            return false;
+        }
+        in_len_ += static_cast<std::size_t>(n);
+        source_read_ += static_cast<std::uint64_t>(n);
+        // A source that fills the whole buffer can keep up with bigger reads.
+        if (static_cast<std::size_t>(n) == room && in_buffer_.size() < kMaxBuffer) {
+            in_buffer_.resize(std::min(in_buffer_.size() * 2, kMaxBuffer));
+        }
     }
+    return true;
 }
 
-GzipReader::~GzipReader() {
-    inflateEnd(&strm_);
+int GzipReader::ParseHeader() {
+    if (!Fill(1)) {
+        if (read_err_) return -1;
+        if (members_ == 0) {
+            read_err_ = EBADMSG;
+            return -1;
+        }
+        return 0;
+    }
+    // Some packers pad the last member with zeros up to a block boundary.
+    if (members_ > 0 && in_buffer_[in_pos_] == 0) {
+        while (Fill(1)) {
+            const std::uint8_t* p = in_buffer_.data() + in_pos_;
+            const std::uint8_t* end = in_buffer_.data() + in_len_;
+            if (std::any_of(p, end, [](std::uint8_t b) { return b != 0; })) {
+                read_err_ = EBADMSG;
+                return -1;
+            }
+            in_pos_ = in_len_;
+        }
+        return read_err_ ? -1 : 0;
+    }
+
+    if (!Fill(10)) return -1;
+    const std::uint8_t* h = in_buffer_.data() + in_pos_;
+    if (h[0] != 0x1F || h[1] != 0x8B || h[2] != 8 || (h[3] & kFlagReserved)) {
+        read_err_ = EBADMSG;
+        return -1;
+    }
+    const std::uint8_t flags = h[3];
+    in_pos_ += 10;
+
+    if (flags & kFlagExtra) {
+        if (!Fill(2)) return -1;
+        const std::size_t xlen = in_buffer_[in_pos_] | (in_buffer_[in_pos_ + 1] << 8);
+        if (!Fill(2 + xlen)) return -1;
+        in_pos_ += 2 + xlen;
+    }
+    for (std::uint8_t f : {kFlagName, kFlagComment}) {
+        if (!(flags & f)) continue;
+        while (true) {
+            if (!Fill(1)) return -1;
+            const auto* p = in_buffer_.data() + in_pos_;
+            const auto* end = in_buffer_.data() + in_len_;
+            const auto* nul = std::find(p, end, std::uint8_t{0});
+            in_pos_ += static_cast<std::size_t>(nul - p);
+            if (nul != end) {
+                ++in_pos_;
+                break;
+            }
+        }
+    }
+    if (flags & kFlagHcrc) {
+        if (!Fill(2)) return -1;
+        in_pos_ += 2;
+    }
+    return 1;
 }
 
 ssize_t GzipReader::Read(std::span<std::uint8_t> out) {
-    if (eof_reached_) return 0;
-
-    strm_.next_out = out.data();
-    strm_.avail_out = static_cast<uInt>(out.size());
-
-    while (strm_.avail_out > 0) {
-        if (strm_.avail_in == 0) {
-            ssize_t n = source_->Read(in_buffer_);
-            if (n < 0) return -1; 
-            if (n == 0) {
-                // Source exhausted. If zlib hasn't finished, it's a truncated file.
-                break; 
+    if (error_) {
+        errno = error_;
+        return -1;
+    }
+
+    std::uint8_t* dst = out.data();
+    std::size_t room = out.size();
+    while (room > 0 && state_ != State::Done) {
+        if (state_ == State::Header) {
+            const int r = ParseHeader();
+            if (r < 0) {
+                if (read_err_ && read_err_ != EBADMSG) return Fail(read_err_, "read failed");
+                return Fail(EBADMSG, "bad or truncated member header");
+            }
+            if (r == 0) {
+                state_ = State::Done;
+                break;
             }
-            strm_.avail_in = static_cast<uInt>(n);
-            strm_.next_in = in_buffer_.data();
+            inflater_->Reset();
+            crc_ = 0;
+            size_ = 0;
+            state_ = State::Body;
+            continue;
         }
 
-        int ret = inflate(&strm_, Z_NO_FLUSH);
+        if (state_ == State::Trailer) {
+            if (!Fill(8)) return Fail(read_err_ ? read_err_ : EBADMSG, "truncated member trailer");
+            const std::uint8_t* t = in_buffer_.data() + in_pos_;
+            if (Le32(t) != crc_) return Fail(EBADMSG, "member crc mismatch");
+            if (Le32(t + 4) != size_) return Fail(EBADMSG, "member size mismatch");
+            in_pos_ += 8;
+            ++members_;
+            state_ = State::Header;
+            continue;
+        }
 
-        if (ret == Z_STREAM_END) {
-            eof_reached_ = true;
-            break;
+        if (in_pos_ == in_len_ && !Fill(1)) {
+            if (read_err_) return Fail(read_err_, "read failed");
+            return Fail(EBADMSG, "truncated deflate stream");
         }
+        const std::uint8_t* in = in_buffer_.data() + in_pos_;
+        std::size_t in_len = in_len_ - in_pos_;
+        std::uint8_t* const start = dst;
+        // Due for an access point: stop at every block boundary until one is taken.
+        // Before that, inflate no further than where it becomes due.
+        int bits = -1;
+        const std::uint64_t pos = out_ + static_cast<std::uint64_t>(dst - out.data());
+        const bool due = spacing_ > 0 && pos >= next_point_;
+        std::size_t step = room;
+        if (spacing_ > 0 && !due) step = static_cast<std::size_t>(std::min<std::uint64_t>(room, next_point_ - pos));
+        const std::size_t left = room - step;
+        const Inflater::Status st =
+            due ? inflater_->InflateToBlock(in, in_len, dst, step, bits) : inflater_->Inflate(in, in_len, dst, step);
+        room = step + left;
+        const std::size_t used = static_cast<std::size_t>(in - (in_buffer_.data() + in_pos_));
+        in_pos_ += used;
+        if (used > 0) last_byte_ = in[-1];
 
-        // Z_BUF_ERROR is not fatal; it just means we need more input or output space.
-        if (ret != Z_OK && ret != Z_BUF_ERROR) {
-            return -1;
+        const std::size_t made = static_cast<std::size_t>(dst - start);
+        crc_ = Crc32(crc_, {start, made});
+        size_ += static_cast<std::uint32_t>(made);
+
+        if (st == Inflater::Status::Error) return Fail(EBADMSG, "corrupt deflate data");
+        if (st == Inflater::Status::StreamEnd) state_ = State::Trailer;
+        if (bits >= 0) AddPoint(bits, out_ + static_cast<std::uint64_t>(dst - out.data()));
+    }
+    out_ += out.size() - room;
+    return static_cast<ssize_t>(out.size() - room);
+}
+
+void GzipReader::RecordAccessPoints(std::uint64_t spacing) {
+    if (!inflater_->SupportsAccessPoints()) {
+        LogDebug("gzip: %s inflate cannot stop at block boundaries, using zlib", inflater_->Name());
+        inflater_ = MakeInflater(InflateBackend::Zlib);
+    }
+    spacing_ = spacing;
+    std::lock_guard<std::mutex> lk(points_mu_);
+    next_point_ = (points_.empty() ? 0 : points_.back().out) + spacing_;
+}
+
+void GzipReader::UseIndex(GzipIndex index) {
+    std::lock_guard<std::mutex> lk(points_mu_);
+    points_ = std::move(index.points);
+    next_point_ = (points_.empty() ? 0 : points_.back().out) + spacing_;
+}
+
+std::vector<GzipAccessPoint> GzipReader::AccessPoints(std::size_t from) const {
+    std::lock_guard<std::mutex> lk(points_mu_);
+    if (from >= points_.size()) return {};
+    return {points_.begin() + static_cast<std::ptrdiff_t>(from), points_.end()};
+}
+
+std::size_t GzipReader::AccessPointCount() const {
+    std::lock_guard<std::mutex> lk(points_mu_);
+    return points_.size();
+}
+
+void GzipReader::AddPoint(int bits, std::uint64_t at) {
+    GzipAccessPoint p;
+    p.out = at;
+    p.in = source_read_ - (in_len_ - in_pos_);
+    p.bits = bits;
+    p.byte = last_byte_;
+    p.members = members_;
+    p.crc = crc_;
+    p.size = size_;
+    if (!inflater_->Window(p.window)) return;
+    next_point_ = at + spacing_;
+    std::lock_guard<std::mutex> lk(points_mu_);
+    points_.push_back(std::move(p));
+}
+
+bool GzipReader::StartAt(const GzipAccessPoint& p) {
+    if (!inflater_->SupportsAccessPoints()) inflater_ = MakeInflater(InflateBackend::Zlib);
+
+    const std::uint64_t consumed = source_read_ - (in_len_ - in_pos_);
+    if (p.in >= consumed && p.in - consumed <= in_len_ - in_pos_) {
+        in_pos_ += static_cast<std::size_t>(p.in - consumed);
+    } else if (base_ >= 0) {
+        if (source_->Seek(base_ + static_cast<std::int64_t>(p.in), SEEK_SET) < 0) {
+            Fail(errno ? errno : EIO, "seek in compressed input failed");
+            return false;
         }
-        
-        // If we made no progress and have no more input, stop to avoid infinite loop
-        if (ret == Z_BUF_ERROR && strm_.avail_in == 0) {
-            break;
+        in_pos_ = in_len_ = 0;
+        source_read_ = p.in;
+        source_eof_ = false;
+    } else if (p.in > consumed) {
+        // Read and drop the compressed bytes in between.
+        std::uint64_t skip = p.in - consumed - (in_len_ - in_pos_);
+        in_pos_ = in_len_ = 0;
+        while (skip > 0) {
+            const ssize_t n = source_->Read(
+                {in_buffer_.data(), static_cast<std::size_t>(std::min<std::uint64_t>(skip, in_buffer_.size()))});
+            if (n <= 0) {
+                Fail(n < 0 ? errno : EBADMSG, "compressed input ends before the access point");
+                return false;
+            }
+            source_read_ += static_cast<std::uint64_t>(n);
+            skip -= static_cast<std::uint64_t>(n);
         }
+    } else {
+        errno = ESPIPE;
+        return false;
+    }
+
+    if (!inflater_->ResumeAt(p.bits, p.byte, p.window)) {
+        Fail(EINVAL, "cannot resume inflate at access point");
+        return false;
     }
+    state_ = State::Body;
+    crc_ = p.crc;
+    size_ = p.size;
+    members_ = p.members;
+    out_ = p.out;
+    last_byte_ = p.byte;
+    next_point_ = std::max(next_point_, p.out + spacing_);
+    return true;
+}
 
-    size_t produced = out.size() - strm_.avail_out;
-    
-    // Safety: If we produced 0 bytes but haven't reached Z_STREAM_END, 
-    // and the source is dead, then it's an actual error/EOF.
-    if (produced == 0 && !eof_reached_) {
-        return 0; 
+std::int64_t GzipReader::Seek(std::int64_t offset, int whence) {
+    if (error_) {
+        errno = error_;
+        return -1;
+    }
+    std::int64_t target = 0;
+    if (whence == SEEK_SET) {
+        target = offset;
+    } else if (whence == SEEK_CUR) {
+        target = static_cast<std::int64_t>(out_) + offset;
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+    if (target < 0) {
+        errno = EINVAL;
+        return -1;
     }
+    const auto to = static_cast<std::uint64_t>(target);
 
-    return static_cast<ssize_t>(produced);
+    // Only this thread adds points, so reading them needs no lock.
+    auto it = std::upper_bound(points_.begin(), points_.end(), to,
+                               [](std::uint64_t o, const GzipAccessPoint& p) { return o < p.out; });
+    const GzipAccessPoint* p = it == points_.begin() ? nullptr : &*std::prev(it);
+    if (p && (to < out_ || p->out > out_)) {
+        if (!StartAt(*p)) return -1;
+    } else if (to < out_) {
+        errno = ESPIPE;
+        return -1;
+    }
+
+    std::vector<std::uint8_t> scratch(256 * 1024);
+    while (out_ < to) {
+        const ssize_t n =
+            Read({scratch.data(), static_cast<std::size_t>(std::min<std::uint64_t>(to - out_, scratch.size()))});
+        if (n < 0) return -1;
+        if (n == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    return target;
 }
 
-} // namespace flash
\ No newline at end of file
+} // namespace flash
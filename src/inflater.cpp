@@ -0,0 +1,184 @@
+// inflater.cpp - Raw deflate backends for the gzip readers.
+
+#include "flash/inflater.hpp"
+
+#include <zlib.h>
+#ifdef FLASH_HAVE_ISAL
+#include <isa-l/igzip_lib.h>
+#endif
+
+#include <algorithm>
+#include <climits>
+#include <stdexcept>
+#include <string>
+
+namespace flash {
+
+namespace {
+
+// zlib counts in uInt; feed it at most this much per call.
+constexpr std::size_t kMaxStep = UINT_MAX;
+
+class ZlibInflater final : public Inflater {
+public:
+    ZlibInflater() {
+        if (inflateInit2(&strm_, -MAX_WBITS) != Z_OK) throw std::runtime_error("Failed to initialize zlib inflate");
+    }
+    ~ZlibInflater() override { inflateEnd(&strm_); }
+
+    void Reset() override { inflateReset(&strm_); }
+
+    Status Inflate(const std::uint8_t*& in, std::size_t& in_len, std::uint8_t*& out,
+                   std::size_t& out_len) override {
+        return Step(in, in_len, out, out_len, Z_NO_FLUSH);
+    }
+
+    const char* Name() const override { return "zlib"; }
+
+    bool SupportsAccessPoints() const override { return true; }
+
+    Status InflateToBlock(const std::uint8_t*& in, std::size_t& in_len, std::uint8_t*& out, std::size_t& out_len,
+                          int& bits) override {
+        const Status st = Step(in, in_len, out, out_len, Z_BLOCK);
+        // data_type: 128 => just past an end-of-block code, 64 => in the
+        // last block, low 3 bits => unused bits of the last byte taken.
+        bits = (st == Status::Ok && (strm_.data_type & 128) && !(strm_.data_type & 64)) ? (strm_.data_type & 7) : -1;
+        return st;
+    }
+
+    bool Window(std::vector<std::uint8_t>& out) override {
+        out.resize(32768);
+        uInt len = 0;
+        if (inflateGetDictionary(&strm_, out.data(), &len) != Z_OK) {
+            out.clear();
+            return false;
+        }
+        out.resize(len);
+        return true;
+    }
+
+    bool ResumeAt(int bits, std::uint8_t byte, std::span<const std::uint8_t> window) override {
+        if (inflateReset(&strm_) != Z_OK) return false;
+        if (bits > 0 && inflatePrime(&strm_, bits, byte >> (8 - bits)) != Z_OK) return false;
+        return window.empty() ||
+               inflateSetDictionary(&strm_, window.data(), static_cast<uInt>(window.size())) == Z_OK;
+    }
+
+private:
+    Status Step(const std::uint8_t*& in, std::size_t& in_len, std::uint8_t*& out, std::size_t& out_len, int flush) {
+        strm_.next_in = const_cast<Bytef*>(in);
+        strm_.avail_in = static_cast<uInt>(std::min(in_len, kMaxStep));
+        strm_.next_out = out;
+        strm_.avail_out = static_cast<uInt>(std::min(out_len, kMaxStep));
+        const uInt avail_in = strm_.avail_in;
+        const uInt avail_out = strm_.avail_out;
+
+        const int ret = inflate(&strm_, flush);
+
+        const std::size_t used = avail_in - strm_.avail_in;
+        const std::size_t made = avail_out - strm_.avail_out;
+        in += used;
+        in_len -= used;
+        out += made;
+        out_len -= made;
+
+        if (ret == Z_STREAM_END) return Status::StreamEnd;
+        // Z_BUF_ERROR only means no progress was possible with these buffers.
+        if (ret == Z_OK || ret == Z_BUF_ERROR) return Status::Ok;
+        return Status::Error;
+    }
+
+    z_stream strm_{};
+};
+
+#ifdef FLASH_HAVE_ISAL
+
+class IsalInflater final : public Inflater {
+public:
+    IsalInflater() : state_(std::make_unique<inflate_state>()) { Reset(); }
+
+    void Reset() override {
+        isal_inflate_init(state_.get());
+        state_->crc_flag = ISAL_DEFLATE;
+    }
+
+    Status Inflate(const std::uint8_t*& in, std::size_t& in_len, std::uint8_t*& out,
+                   std::size_t& out_len) override {
+        state_->next_in = const_cast<std::uint8_t*>(in);
+        state_->avail_in = static_cast<std::uint32_t>(std::min(in_len, kMaxStep));
+        state_->next_out = out;
+        state_->avail_out = static_cast<std::uint32_t>(std::min(out_len, kMaxStep));
+        const std::uint32_t avail_in = state_->avail_in;
+        const std::uint32_t avail_out = state_->avail_out;
+
+        const int ret = isal_inflate(state_.get());
+
+        // On ISAL_BLOCK_FINISH igzip hands back the bytes it read ahead, so
+        // avail_in is exact and the next gzip member can follow.
+        const std::size_t used = avail_in - state_->avail_in;
+        const std::size_t made = avail_out - state_->avail_out;
+        in += used;
+        in_len -= used;
+        out += made;
+        out_len -= made;
+
+        if (ret < 0) return Status::Error;
+        return state_->block_state == ISAL_BLOCK_FINISH ? Status::StreamEnd : Status::Ok;
+    }
+
+    const char* Name() const override { return "isal"; }
+
+private:
+    std::unique_ptr<inflate_state> state_;  // large; keep it off the stack
+};
+
+#endif
+
+} // namespace
+
+const char* InflateBackendName(InflateBackend backend) {
+    switch (backend) {
+    case InflateBackend::Auto: return "auto";
+    case InflateBackend::Zlib: return "zlib";
+    case InflateBackend::Isal: return "isal";
+    }
+    return "unknown";
+}
+
+bool ParseInflateBackend(std::string_view name, InflateBackend& out) {
+    for (InflateBackend b : {InflateBackend::Auto, InflateBackend::Zlib, InflateBackend::Isal}) {
+        if (name == InflateBackendName(b)) {
+            out = b;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<InflateBackend> AvailableInflateBackends() {
+    std::vector<InflateBackend> v;
+#ifdef FLASH_HAVE_ISAL
+    v.push_back(InflateBackend::Isal);
+#endif
+    v.push_back(InflateBackend::Zlib);
+    return v;
+}
+
+std::unique_ptr<Inflater> MakeInflater(InflateBackend backend) {
+    if (backend == InflateBackend::Auto) backend = AvailableInflateBackends().front();
+    switch (backend) {
+    case InflateBackend::Zlib:
+        return std::make_unique<ZlibInflater>();
+    case InflateBackend::Isal:
+#ifdef FLASH_HAVE_ISAL
+        return std::make_unique<IsalInflater>();
+#else
+        break;
+#endif
+    case InflateBackend::Auto:
+        break;
+    }
+    throw std::runtime_error(std::string("inflate backend not built in: ") + InflateBackendName(backend));
+}
+
+} // namespace flash
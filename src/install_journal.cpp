@@ -0,0 +1,150 @@
+#include "flash/install_journal.hpp"
+
+#include "flash/fd.hpp"
+#include "flash/logger.hpp"
+#include "flash/sha256.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using json = nlohmann::json;
+
+namespace flash {
+
+namespace {
+
+constexpr const char* kFormat = "flash-install-journal-1";
+
+std::string Errno(const std::string& what) {
+    return what + " (" + std::strerror(errno) + ")";
+}
+
+std::string DirName(const std::string& path) {
+    const auto slash = path.rfind('/');
+    if (slash == std::string::npos) return ".";
+    return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+} // namespace
+
+std::string InstallJournal::BundleId(const std::string& manifest_json) {
+    Sha256 h;
+    h.Update({reinterpret_cast<const std::uint8_t*>(manifest_json.data()), manifest_json.size()});
+    return Sha256::ToHex(h.Final());
+}
+
+Result InstallJournal::Open(const std::string& path, const std::string& bundle_id, InstallJournal& out) {
+    std::lock_guard<std::mutex> lk(out.mu_);
+    out.path_ = path;
+    out.bundle_ = bundle_id;
+    out.done_.clear();
+    out.raw_.clear();
+
+    std::ifstream is(path, std::ios::binary);
+    if (!is) {
+        if (errno == ENOENT) return Result::Ok();
+        return Result::Fail(errno, Errno("Cannot read journal " + path));
+    }
+    std::stringstream ss;
+    ss << is.rdbuf();
+
+    try {
+        auto j = json::parse(ss.str());
+        if (!j.is_object() || j.value("format", "") != kFormat) {
+            return Result::Fail(EBADMSG, path + " is not a " + kFormat + " journal");
+        }
+        if (j.value("bundle", "") != bundle_id) {
+            LogInfo("Journal %s belongs to another bundle; starting over", path.c_str());
+            return Result::Ok();
+        }
+        for (const auto& name : j.at("done")) out.done_.insert(name.get<std::string>());
+        for (const auto& [name, off] : j.at("raw").items()) out.raw_[name] = off.get<std::uint64_t>();
+    } catch (const std::exception& e) {
+        // A torn write cannot happen (rename), so this is not our file.
+        return Result::Fail(EBADMSG, "Journal " + path + " parse error: " + e.what());
+    }
+    return Result::Ok();
+}
+
+bool InstallJournal::Resuming() const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return !done_.empty() || !raw_.empty();
+}
+
+bool InstallJournal::Done(const std::string& component) const {
+    std::lock_guard<std::mutex> lk(mu_);
+    return done_.count(component) != 0;
+}
+
+std::uint64_t InstallJournal::RawOffset(const std::string& component) const {
+    std::lock_guard<std::mutex> lk(mu_);
+    const auto it = raw_.find(component);
+    return it == raw_.end() ? 0 : it->second;
+}
+
+Result InstallJournal::MarkDone(const std::string& component) {
+    std::lock_guard<std::mutex> lk(mu_);
+    done_.insert(component);
+    raw_.erase(component);
+    auto r = Save();
+    if (r.is_ok()) (void)::unlink(SidecarPath(component).c_str());
+    return r;
+}
+
+Result InstallJournal::RecordRawOffset(const std::string& component, std::uint64_t offset) {
+    std::lock_guard<std::mutex> lk(mu_);
+    raw_[component] = offset;
+    return Save();
+}
+
+Result InstallJournal::Remove() {
+    std::lock_guard<std::mutex> lk(mu_);
+    for (const auto& [name, off] : raw_) (void)::unlink(SidecarPath(name).c_str());
+    done_.clear();
+    raw_.clear();
+    if (::unlink(path_.c_str()) != 0 && errno != ENOENT) {
+        return Result::Fail(errno, Errno("Cannot remove journal " + path_));
+    }
+    Fd dir(::open(DirName(path_).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (dir.Get() >= 0) (void)::fsync(dir.Get());
+    return Result::Ok();
+}
+
+Result InstallJournal::Save() {
+    json j;
+    j["format"] = kFormat;
+    j["bundle"] = bundle_;
+    j["done"] = done_;
+    j["raw"] = raw_;
+    const std::string text = j.dump();
+
+    const std::string tmp = path_ + ".tmp";
+    {
+        Fd fd(::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+        if (fd.Get() < 0) return Result::Fail(errno, Errno("Cannot create " + tmp));
+        for (std::size_t off = 0; off < text.size();) {
+            const ssize_t n = ::write(fd.Get(), text.data() + off, text.size() - off);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return Result::Fail(errno, Errno("Cannot write " + tmp));
+            off += static_cast<std::size_t>(n);
+        }
+        if (::fsync(fd.Get()) != 0) return Result::Fail(errno, Errno("fsync of " + tmp + " failed"));
+    }
+    if (::rename(tmp.c_str(), path_.c_str()) != 0) {
+        return Result::Fail(errno, Errno("Cannot rename " + tmp));
+    }
+    Fd dir(::open(DirName(path_).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (dir.Get() < 0 || ::fsync(dir.Get()) != 0) {
+        return Result::Fail(errno, Errno("fsync of the journal directory failed"));
+    }
+    return Result::Ok();
+}
+
+} // namespace flash
@@ -0,0 +1,516 @@
+// io_uring_writer.cpp - Queued writer for block devices/partitions on top of io_uring.
+
+#include "flash/io_uring_writer.hpp"
+#include "flash/partition_writer.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define FLASH_HAVE_IO_URING 1
+#endif
+
+namespace flash {
+
+#if defined(FLASH_HAVE_IO_URING) && defined(__NR_io_uring_setup)
+
+namespace {
+
+constexpr std::uint64_t kFsyncTag = 1ULL << 63;
+
+int SysSetup(unsigned entries, io_uring_params* p) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+}
+
+int SysEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+int SysRegister(int fd, unsigned op, const void* arg, unsigned nr) {
+    return static_cast<int>(::syscall(__NR_io_uring_register, fd, op, arg, nr));
+}
+
+std::string Errno(const char* what, int err) {
+    return std::string(what) + " (" + std::strerror(err) + ")";
+}
+
+} // namespace
+
+struct IoUringWriter::Ring {
+    struct Slot {
+        std::uint8_t* buf = nullptr;
+        size_t len = 0;          // bytes staged
+        size_t done = 0;         // bytes the kernel already wrote
+        std::uint64_t off = 0;   // file offset of buf[0]
+        bool busy = false;
+    };
+
+    Fd fd;
+    unsigned sq_entries = 0;
+
+    void* sq_map = MAP_FAILED;
+    size_t sq_map_len = 0;
+    void* cq_map = MAP_FAILED;
+    size_t cq_map_len = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqes_len = 0;
+
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    void* arena = MAP_FAILED;
+    size_t arena_len = 0;
+    bool fixed = false;
+
+    std::vector<Slot> slots;
+    int fill = -1;
+    std::uint64_t next_off = 0;
+    std::uint64_t hole_end = 0;   // end of the last zeroed or skipped range
+    unsigned to_submit = 0;
+    unsigned writes_inflight = 0;
+    unsigned fsyncs_inflight = 0;
+    bool sync = true;
+
+    int err = 0;
+    std::string err_msg;
+
+    ~Ring() {
+        if (arena != MAP_FAILED) ::munmap(arena, arena_len);
+        if (sqes != MAP_FAILED) ::munmap(sqes, sqes_len);
+        if (cq_map != MAP_FAILED && cq_map != sq_map) ::munmap(cq_map, cq_map_len);
+        if (sq_map != MAP_FAILED) ::munmap(sq_map, sq_map_len);
+    }
+
+    void SetError(int e, std::string m) {
+        if (err == 0) {
+            err = e;
+            err_msg = std::move(m);
+        }
+    }
+
+    io_uring_sqe* NextSqe() {
+        const unsigned tail = *sq_tail;
+        const unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= sq_entries) return nullptr;
+        const unsigned idx = tail & *sq_mask;
+        io_uring_sqe* sqe = &sqes[idx];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array[idx] = idx;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ++to_submit;
+        return sqe;
+    }
+
+    void PrepWrite(io_uring_sqe* sqe, int file_fd, size_t slot_idx, std::uint8_t flags) {
+        Slot& s = slots[slot_idx];
+        sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = file_fd;
+        sqe->addr = reinterpret_cast<std::uint64_t>(s.buf + s.done);
+        sqe->len = static_cast<std::uint32_t>(s.len - s.done);
+        sqe->off = s.off + s.done;
+        sqe->buf_index = fixed ? static_cast<std::uint16_t>(slot_idx) : 0;
+        sqe->flags = flags;
+        sqe->user_data = slot_idx;
+    }
+
+    Result Submit(unsigned min_complete) {
+        while (to_submit > 0 || min_complete > 0) {
+            const unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+            const int ret = SysEnter(fd.Get(), to_submit, min_complete, flags);
+            if (ret < 0) {
+                if (errno == EINTR) continue;
+                return Result::Fail(errno, Errno("io_uring_enter failed", errno));
+            }
+            to_submit -= std::min<unsigned>(to_submit, static_cast<unsigned>(ret));
+            min_complete = 0;
+        }
+        return Result::Ok();
+    }
+
+    // Processes every available completion; may queue resubmissions for short writes.
+    void Reap(int file_fd) {
+        unsigned head = *cq_head;
+        const unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            const io_uring_cqe& cqe = cqes[head & *cq_mask];
+            ++head;
+
+            if (cqe.user_data & kFsyncTag) {
+                --fsyncs_inflight;
+                if (cqe.res == -ECANCELED) {
+                    // Its linked write came back short; queue the barrier again.
+                    if (io_uring_sqe* sqe = NextSqe()) {
+                        sqe->opcode = IORING_OP_FSYNC;
+                        sqe->fd = file_fd;
+                        sqe->fsync_flags = static_cast<std::uint32_t>(cqe.user_data & ~kFsyncTag);
+                        sqe->flags = IOSQE_IO_DRAIN;
+                        sqe->user_data = cqe.user_data;
+                        ++fsyncs_inflight;
+                    } else {
+                        SetError(EBUSY, "io_uring submission queue full");
+                    }
+                } else if (cqe.res < 0) {
+                    SetError(-cqe.res, Errno("fsync failed", -cqe.res));
+                }
+                continue;
+            }
+
+            const size_t idx = static_cast<size_t>(cqe.user_data);
+            Slot& s = slots[idx];
+            if (cqe.res < 0) {
+                SetError(-cqe.res, Errno("Write failed", -cqe.res));
+            } else if (cqe.res == 0) {
+                SetError(EIO, "Write failed (no progress)");
+            } else {
+                s.done += static_cast<size_t>(cqe.res);
+                if (s.done < s.len && err == 0) {
+                    if (io_uring_sqe* sqe = NextSqe()) {
+                        PrepWrite(sqe, file_fd, idx, 0);
+                        continue; // still in flight
+                    }
+                    SetError(EBUSY, "io_uring submission queue full");
+                }
+            }
+            s.busy = false;
+            --writes_inflight;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+};
+
+IoUringWriter::IoUringWriter() = default;
+
+IoUringWriter::~IoUringWriter() {
+    // Registered buffers must not be unmapped while the kernel still uses them.
+    if (ring_) (void)Drain();
+}
+
+Result IoUringWriter::Open(std::string path, IoUringWriter &out) {
+    return Open(std::move(path), Options{}, out);
+}
+
+Result IoUringWriter::Open(std::string path, const Options& opt, IoUringWriter &out) {
+    const unsigned qd = opt.queue_depth ? opt.queue_depth : 1;
+    const size_t buf_bytes = opt.buffer_bytes ? opt.buffer_bytes : 1024 * 1024;
+
+    auto ring = std::make_unique<Ring>();
+
+    io_uring_params p{};
+    const int rfd = SysSetup(2 * qd + 4, &p);
+    if (rfd < 0) {
+        return Result::Fail(errno, Errno("io_uring_setup failed", errno));
+    }
+    ring->fd.Reset(rfd);
+    ring->sq_entries = p.sq_entries;
+
+    ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    const bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) ring->sq_map_len = ring->cq_map_len = std::max(ring->sq_map_len, ring->cq_map_len);
+
+    ring->sq_map = ::mmap(nullptr, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) return Result::Fail(errno, Errno("io_uring sq mmap failed", errno));
+
+    if (single) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = ::mmap(nullptr, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) return Result::Fail(errno, Errno("io_uring cq mmap failed", errno));
+    }
+
+    ring->sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = ::mmap(nullptr, ring->sqes_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, rfd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return Result::Fail(errno, Errno("io_uring sqe mmap failed", errno));
+    ring->sqes = static_cast<io_uring_sqe*>(sqes);
+
+    auto* sq = static_cast<std::uint8_t*>(ring->sq_map);
+    auto* cq = static_cast<std::uint8_t*>(ring->cq_map);
+    ring->sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    ring->sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    ring->sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    ring->sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    ring->cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    ring->cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    ring->cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    ring->cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+    // One page-aligned arena carved into per-slot buffers.
+    ring->arena_len = static_cast<size_t>(qd) * buf_bytes;
+    ring->arena = ::mmap(nullptr, ring->arena_len, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->arena == MAP_FAILED) return Result::Fail(errno, Errno("buffer mmap failed", errno));
+
+    ring->slots.resize(qd);
+    std::vector<iovec> iov(qd);
+    for (unsigned i = 0; i < qd; ++i) {
+        ring->slots[i].buf = static_cast<std::uint8_t*>(ring->arena) + static_cast<size_t>(i) * buf_bytes;
+        iov[i].iov_base = ring->slots[i].buf;
+        iov[i].iov_len = buf_bytes;
+    }
+
+    // Fixed buffers count against RLIMIT_MEMLOCK on older kernels; plain
+    // IORING_OP_WRITE from the same buffers still keeps the queue full.
+    ring->fixed = SysRegister(rfd, IORING_REGISTER_BUFFERS, iov.data(), qd) == 0;
+    ring->sync = opt.sync;
+
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | (opt.truncate ? O_TRUNC : 0), 0644);
+    if (fd < 0) {
+        return Result::Fail(
+            errno,
+            "Failed to open output: " + path + " (" + std::strerror(errno) + ")");
+    }
+
+    if (out.ring_) (void)out.Drain();
+    out.path_ = std::move(path);
+    out.fd_.Reset(fd);
+    out.ring_ = std::move(ring);
+    return Result::Ok();
+}
+
+Result IoUringWriter::WaitForSlot() {
+    Ring& r = *ring_;
+    while (true) {
+        for (size_t i = 0; i < r.slots.size(); ++i) {
+            if (!r.slots[i].busy) {
+                r.fill = static_cast<int>(i);
+                r.slots[i].len = 0;
+                r.slots[i].done = 0;
+                r.slots[i].off = r.next_off;
+                r.slots[i].busy = true;
+                return Result::Ok();
+            }
+        }
+        auto res = r.Submit(1);
+        if (!res.is_ok()) return res;
+        r.Reap(fd_.Get());
+        if (r.err) return Result::Fail(r.err, r.err_msg);
+    }
+}
+
+Result IoUringWriter::SubmitFill() {
+    Ring& r = *ring_;
+    if (r.fill < 0) return Result::Ok();
+    const size_t idx = static_cast<size_t>(r.fill);
+    r.fill = -1;
+    if (r.slots[idx].len == 0) {
+        r.slots[idx].busy = false;
+        return Result::Ok();
+    }
+
+    io_uring_sqe* sqe = nullptr;
+    auto res = GetSqe(sqe);
+    if (!res.is_ok()) return res;
+    r.PrepWrite(sqe, fd_.Get(), idx, 0);
+    ++r.writes_inflight;
+    return r.Submit(0);
+}
+
+Result IoUringWriter::SubmitFsync(bool datasync) {
+    Ring& r = *ring_;
+
+    io_uring_sqe* wsqe = nullptr;
+    io_uring_sqe* fsqe = nullptr;
+
+    // Flush the partially filled buffer as a write linked to the fsync; DRAIN
+    // on the fsync makes it wait for every earlier write as well.
+    if (r.fill >= 0) {
+        const size_t idx = static_cast<size_t>(r.fill);
+        r.fill = -1;
+        if (r.slots[idx].len > 0) {
+            auto res = GetSqe(wsqe);
+            if (!res.is_ok()) return res;
+            r.PrepWrite(wsqe, fd_.Get(), idx, r.sync ? IOSQE_IO_LINK : 0);
+            ++r.writes_inflight;
+        } else {
+            r.slots[idx].busy = false;
+        }
+    }
+    if (!r.sync) return r.Submit(0);
+
+    auto res = GetSqe(fsqe);
+    if (!res.is_ok()) return res;
+    fsqe->opcode = IORING_OP_FSYNC;
+    fsqe->fd = fd_.Get();
+    fsqe->fsync_flags = datasync ? IORING_FSYNC_DATASYNC : 0;
+    fsqe->flags = IOSQE_IO_DRAIN;
+    fsqe->user_data = kFsyncTag | fsqe->fsync_flags;
+    ++r.fsyncs_inflight;
+    return r.Submit(0);
+}
+
+Result IoUringWriter::GetSqe(io_uring_sqe*& out) {
+    Ring& r = *ring_;
+    out = r.NextSqe();
+    if (out) return Result::Ok();
+
+    // The SQ frees up as soon as the kernel has consumed it.
+    auto res = r.Submit(0);
+    if (!res.is_ok()) return res;
+    out = r.NextSqe();
+    if (!out) return Result::Fail(EBUSY, "io_uring submission queue full");
+    return Result::Ok();
+}
+
+Result IoUringWriter::Drain() {
+    Ring& r = *ring_;
+    auto res = r.Submit(0);
+    while (r.writes_inflight > 0 || r.fsyncs_inflight > 0) {
+        auto wr = r.Submit(1);
+        if (!wr.is_ok()) return wr;
+        r.Reap(fd_.Get());
+        res = r.Submit(0);
+        if (!res.is_ok()) return res;
+    }
+    return res;
+}
+
+Result IoUringWriter::WriteAll(std::span<const std::uint8_t> in) {
+    if (!ring_) return Result::Fail(EBADF, "io_uring writer not open");
+    Ring& r = *ring_;
+
+    while (!in.empty()) {
+        if (r.err) return Result::Fail(r.err, r.err_msg);
+        if (r.fill < 0) {
+            auto res = WaitForSlot();
+            if (!res.is_ok()) return res;
+        }
+
+        Ring::Slot& s = r.slots[static_cast<size_t>(r.fill)];
+        const size_t cap = r.arena_len / r.slots.size();
+        const size_t take = std::min(in.size(), cap - s.len);
+        std::memcpy(s.buf + s.len, in.data(), take);
+        s.len += take;
+        r.next_off += take;
+        in = in.subspan(take);
+
+        if (s.len == cap) {
+            auto res = SubmitFill();
+            if (!res.is_ok()) return res;
+        }
+    }
+
+    // Pick up finished writes without blocking so errors surface early.
+    r.Reap(fd_.Get());
+    if (r.err) return Result::Fail(r.err, r.err_msg);
+    return r.Submit(0);
+}
+
+Result IoUringWriter::WriteZeroes(std::uint64_t len) {
+    if (!ring_) return Result::Fail(EBADF, "io_uring writer not open");
+    Ring& r = *ring_;
+    if (r.err) return Result::Fail(r.err, r.err_msg);
+    if (len == 0) return Result::Ok();
+
+    // The zeroed range never overlaps a queued write, so it can be issued
+    // synchronously without waiting for them.
+    if (!PartitionWriter::ZeroRange(fd_.Get(), r.next_off, len).is_ok()) {
+        return IWriter::WriteZeroes(len);
+    }
+
+    // Close the current buffer so the next write starts past the zeroed range.
+    auto res = SubmitFill();
+    if (!res.is_ok()) return res;
+    r.next_off += len;
+    r.hole_end = r.next_off;
+    return Result::Ok();
+}
+
+Result IoUringWriter::Skip(std::uint64_t len) {
+    if (!ring_) return Result::Fail(EBADF, "io_uring writer not open");
+    Ring& r = *ring_;
+    if (r.err) return Result::Fail(r.err, r.err_msg);
+    if (len == 0) return Result::Ok();
+
+    auto res = SubmitFill();
+    if (!res.is_ok()) return res;
+    r.next_off += len;
+    r.hole_end = r.next_off;
+    return Result::Ok();
+}
+
+Result IoUringWriter::FsyncAsync() {
+    if (!ring_) return Result::Fail(EBADF, "io_uring writer not open");
+    Ring& r = *ring_;
+
+    // Bound the number of queued barriers; one outstanding is enough to keep
+    // the device busy.
+    while (r.fsyncs_inflight >= 2) {
+        auto res = r.Submit(1);
+        if (!res.is_ok()) return res;
+        r.Reap(fd_.Get());
+    }
+    if (r.err) return Result::Fail(r.err, r.err_msg);
+    return SubmitFsync(/*datasync=*/true);
+}
+
+Result IoUringWriter::FsyncNow() {
+    if (!ring_) return Result::Fail(EBADF, "io_uring writer not open");
+    auto res = SubmitFsync(/*datasync=*/false);
+    if (!res.is_ok()) return res;
+    res = Drain();
+    if (!res.is_ok()) return res;
+    if (ring_->err) return Result::Fail(ring_->err, ring_->err_msg);
+
+    // A trailing hole does not extend a regular file on its own.
+    if (ring_->hole_end > 0) {
+        struct stat st {};
+        if (::fstat(fd_.Get(), &st) == 0 && S_ISREG(st.st_mode) &&
+            static_cast<std::uint64_t>(st.st_size) < ring_->hole_end) {
+            if (::ftruncate(fd_.Get(), static_cast<off_t>(ring_->hole_end)) != 0) {
+                return Result::Fail(errno, Errno("ftruncate failed", errno));
+            }
+            if (ring_->sync && ::fdatasync(fd_.Get()) != 0) {
+                return Result::Fail(errno, Errno("fdatasync failed", errno));
+            }
+        }
+    }
+    return Result::Ok();
+}
+
+#else // !FLASH_HAVE_IO_URING
+
+struct IoUringWriter::Ring {};
+
+IoUringWriter::IoUringWriter() = default;
+IoUringWriter::~IoUringWriter() = default;
+
+Result IoUringWriter::Open(std::string path, IoUringWriter &out) {
+    return Open(std::move(path), Options{}, out);
+}
+
+Result IoUringWriter::Open(std::string, const Options&, IoUringWriter&) {
+    return Result::Fail(ENOSYS, "io_uring not available in this build");
+}
+
+Result IoUringWriter::WriteAll(std::span<const std::uint8_t>) { return Result::Fail(EBADF, "io_uring writer not open"); }
+Result IoUringWriter::FsyncNow() { return Result::Fail(EBADF, "io_uring writer not open"); }
+Result IoUringWriter::FsyncAsync() { return Result::Fail(EBADF, "io_uring writer not open"); }
+Result IoUringWriter::WriteZeroes(std::uint64_t) { return Result::Fail(EBADF, "io_uring writer not open"); }
+Result IoUringWriter::Skip(std::uint64_t) { return Result::Fail(EBADF, "io_uring writer not open"); }
+Result IoUringWriter::SubmitFill() { return Result::Ok(); }
+Result IoUringWriter::SubmitFsync(bool) { return Result::Ok(); }
+Result IoUringWriter::GetSqe(io_uring_sqe*&) { return Result::Ok(); }
+Result IoUringWriter::WaitForSlot() { return Result::Ok(); }
+Result IoUringWriter::Drain() { return Result::Ok(); }
+
+#endif
+
+} // namespace flash
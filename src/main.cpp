@@ -4,11 +4,14 @@
 #include "flash/ota_installer.hpp"
 #include "flash/signals.hpp"
 
+#include <algorithm>
+#include <cstdlib>
 #include <getopt.h>
+#include <string>
 
 namespace {
 void PrintUsage(const char* argv0) {
-    flash::LogError("Usage: %s -i <ota.tar | -> [-v]", argv0);
+    flash::LogError("Usage: %s -i <ota.tar | -> [-q <io_uring depth, 0=sync>] [-d] [-Z (write zero blocks; lets stored raw images use the kernel copy)] [-c] [-j <decompress threads, 0=auto>] [-I <inflate backend: auto|zlib|isal>] [-o <component>[,<component>...]] [-r <retries>] [-J <concurrent components>] [-M] [-K (no in-kernel copy; raw images only take it with -Z)] [-x <extract workers, 0=auto>] [-P] [-D <durability: interval|component|final>] [-R <journal file>] [-V] [-v]", argv0);
 }
 } // namespace
 
@@ -17,9 +20,26 @@ int main(int argc, char** argv) {
     flash::Logger::Instance().SetLevel(flash::LogLevel::Info);
 
     const char* in = nullptr;
+    flash::OtaInstaller::Options opt;
 
     static option long_opts[] = {
         {"input", required_argument, nullptr, 'i'},
+        {"io-uring-depth", required_argument, nullptr, 'q'},
+        {"direct", no_argument, nullptr, 'd'},
+        {"no-zero-skip", no_argument, nullptr, 'Z'},
+        {"compare", no_argument, nullptr, 'c'},
+        {"decompress-threads", required_argument, nullptr, 'j'},
+        {"inflate", required_argument, nullptr, 'I'},
+        {"only", required_argument, nullptr, 'o'},
+        {"retries", required_argument, nullptr, 'r'},
+        {"jobs", required_argument, nullptr, 'J'},
+        {"no-mmap", no_argument, nullptr, 'M'},
+        {"no-kernel-copy", no_argument, nullptr, 'K'},
+        {"extract-workers", required_argument, nullptr, 'x'},
+        {"no-preallocate", no_argument, nullptr, 'P'},
+        {"durability", required_argument, nullptr, 'D'},
+        {"journal", required_argument, nullptr, 'R'},
+        {"verify-chunks", no_argument, nullptr, 'V'},
         {"verbose", no_argument, nullptr, 'v'},
         {"help", no_argument, nullptr, 'h'},
         {nullptr, 0, nullptr, 0},
@@ -27,10 +47,44 @@ int main(int argc, char** argv) {
 
     int idx = 0;
     int c;
-    while ((c = getopt_long(argc, argv, "hi:v", long_opts, &idx)) != -1) {
+    while ((c = getopt_long(argc, argv, "hi:q:dZcj:I:o:r:J:MKx:PD:R:Vv", long_opts, &idx)) != -1) {
         switch (c) {
             case 'h': PrintUsage(argv[0]); return 0;
             case 'i': in = optarg; break;
+            case 'd': opt.direct_io = true; break;
+            case 'Z': opt.skip_zero_blocks = false; break;
+            case 'c': opt.compare_before_write = true; break;
+            case 'M': opt.mmap_input = false; break;
+            case 'K': opt.kernel_copy = false; break;
+            case 'P': opt.preallocate = false; break;
+            case 'I':
+                if (!flash::ParseInflateBackend(optarg, opt.inflate_backend)) {
+                    flash::LogError("Unknown inflate backend: %s", optarg);
+                    return 2;
+                }
+                break;
+            case 'D':
+                if (!flash::ParseDurabilityMode(optarg, opt.durability)) {
+                    flash::LogError("Unknown durability mode: %s", optarg);
+                    return 2;
+                }
+                break;
+            case 'R': opt.journal_path = optarg; break;
+            case 'V': opt.verify_chunks = true; break;
+            case 'j': opt.decompress_threads = static_cast<unsigned>(std::strtoul(optarg, nullptr, 10)); break;
+            case 'o': {
+                std::string list = optarg;
+                for (size_t pos = 0; pos <= list.size();) {
+                    const size_t comma = std::min(list.find(',', pos), list.size());
+                    if (comma > pos) opt.only_components.push_back(list.substr(pos, comma - pos));
+                    pos = comma + 1;
+                }
+                break;
+            }
+            case 'r': opt.component_retries = static_cast<unsigned>(std::strtoul(optarg, nullptr, 10)); break;
+            case 'x': opt.extract_workers = static_cast<unsigned>(std::strtoul(optarg, nullptr, 10)); break;
+            case 'J': opt.component_jobs = static_cast<unsigned>(std::strtoul(optarg, nullptr, 10)); break;
+            case 'q': opt.io_uring_queue_depth = static_cast<unsigned>(std::strtoul(optarg, nullptr, 10)); break;
             case 'v': flash::Logger::Instance().SetLevel(flash::LogLevel::Debug); break;
             default:  PrintUsage(argv[0]); return 2;
         }
@@ -38,7 +92,7 @@ int main(int argc, char** argv) {
 
     if (!in) { PrintUsage(argv[0]); return 2; }
 
-    flash::OtaInstaller installer;
+    flash::OtaInstaller installer(opt);
     auto r = installer.Run(in);
     if (!r.is_ok()) {
         flash::LogError("%s", r.message().c_str());
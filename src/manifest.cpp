@@ -38,6 +38,20 @@ std::expected<Manifest, std::string> ManifestHandler::Parse(const std::string& j
                 c.path = item.value("path", "");
                 c.permissions = item.value("permissions", "0644");
                 c.create_destination = item.value("create-destination", false);
+                c.delta_source = item.value("delta_source", "");
+                c.mkfs = item.value("mkfs", "");
+                c.compression = item.value("compression", "");
+                c.format = item.value("format", "");
+                c.size = item.value("size", std::uint64_t{0});
+                c.installed_size = item.value("installed_size", std::uint64_t{0});
+                if (item.contains("chunks")) {
+                    const auto& chunks = item["chunks"];
+                    if (!chunks.is_object() || !chunks.contains("sha256") || !chunks["sha256"].is_array()) {
+                        return std::unexpected("'chunks' of component '" + c.name + "' needs a 'sha256' array");
+                    }
+                    c.chunk_bytes = chunks.value("size", std::uint64_t{0});
+                    c.chunk_sha256 = chunks["sha256"].get<std::vector<std::string>>();
+                }
                 m.components.push_back(c);
             }
         } else if (j.contains("components") && !j["components"].is_array()) {
@@ -52,6 +66,16 @@ std::expected<Manifest, std::string> ManifestHandler::Parse(const std::string& j
     }
 }
 
+std::uint64_t ManifestHandler::DeclaredBundleBytes(const Manifest& manifest) {
+    std::uint64_t total = 0;
+    for (const auto& c : manifest.components) {
+        if (c.filename.empty()) continue;
+        if (c.size == 0) return 0;
+        total += c.size;
+    }
+    return total;
+}
+
 int ManifestHandler::CompareVersions(const std::string& v1, const std::string& v2) {
     if (v1 == v2) return 0;
 
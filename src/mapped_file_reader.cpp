@@ -0,0 +1,231 @@
+// mapped_file_reader.cpp - mmap-backed file reader with SIGBUS protection.
+
+#include "flash/mapped_file_reader.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace flash {
+
+namespace {
+
+constexpr std::uint64_t kDropBytes = 8 * 1024 * 1024;  // MADV_DONTNEED granularity
+
+// Live mappings, looked up by the SIGBUS handler. Lock-free: a slot is
+// claimed by CAS of `base` from 0 to kClaimed, then `len` and `faulted` are
+// set and the mapping's address is published in `base` with release.
+constexpr std::uintptr_t kClaimed = 1;  // never a page address
+struct Slot {
+    std::atomic<std::uintptr_t> base{0};
+    std::atomic<std::size_t> len{0};
+    std::atomic<std::atomic_bool*> faulted{nullptr};
+};
+constexpr int kSlots = 16;
+Slot g_slots[kSlots];
+
+struct sigaction g_prev_bus {};
+std::once_flag g_install_once;
+std::uintptr_t g_page = 4096;
+
+void OnSigbus(int sig, siginfo_t* info, void* uctx) {
+    const auto addr = reinterpret_cast<std::uintptr_t>(info->si_addr);
+    for (auto& s : g_slots) {
+        const std::uintptr_t base = s.base.load(std::memory_order_acquire);
+        if (base <= kClaimed || addr < base) continue;
+        const std::size_t len = s.len.load(std::memory_order_acquire);
+        auto* faulted = s.faulted.load(std::memory_order_acquire);
+        // `base` is read again last: unchanged, the slot was not released or
+        // reused while `len` and `faulted` were read.
+        if (s.base.load(std::memory_order_acquire) != base || addr - base >= len) continue;
+
+        // Our mapping lost its file pages (truncated underneath us). Put a
+        // zero page in their place so the access completes, and flag the
+        // reader; it fails on its next call. mmap is a plain syscall here.
+        void* page = reinterpret_cast<void*>(addr & ~(g_page - 1));
+        if (::mmap(page, g_page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+            if (faulted) faulted->store(true, std::memory_order_relaxed);
+            return;
+        }
+        break;
+    }
+
+    // Not ours: hand over to whatever was installed before.
+    if ((g_prev_bus.sa_flags & SA_SIGINFO) && g_prev_bus.sa_sigaction) {
+        g_prev_bus.sa_sigaction(sig, info, uctx);
+    } else if (g_prev_bus.sa_handler != SIG_DFL && g_prev_bus.sa_handler != SIG_IGN) {
+        g_prev_bus.sa_handler(sig);
+    } else {
+        // Returning re-runs the faulting access under the default action.
+        std::signal(SIGBUS, SIG_DFL);
+    }
+}
+
+void InstallSigbusHandler() {
+    std::call_once(g_install_once, [] {
+        const long ps = ::sysconf(_SC_PAGESIZE);
+        if (ps > 0) g_page = static_cast<std::uintptr_t>(ps);
+        struct sigaction sa {};
+        sa.sa_sigaction = OnSigbus;
+        sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&sa.sa_mask);
+        ::sigaction(SIGBUS, &sa, &g_prev_bus);
+    });
+}
+
+int RegisterMapping(void* base, std::size_t len, std::atomic_bool* faulted) {
+    for (int i = 0; i < kSlots; ++i) {
+        std::uintptr_t expect = 0;
+        if (!g_slots[i].base.compare_exchange_strong(expect, kClaimed, std::memory_order_acquire)) continue;
+        g_slots[i].len.store(len, std::memory_order_relaxed);
+        g_slots[i].faulted.store(faulted, std::memory_order_relaxed);
+        g_slots[i].base.store(reinterpret_cast<std::uintptr_t>(base), std::memory_order_release);
+        return i;
+    }
+    return -1;
+}
+
+} // namespace
+
+MappedFileReader::~MappedFileReader() {
+    Unmap();
+}
+
+void MappedFileReader::Unmap() {
+    if (slot_ >= 0) {
+        g_slots[slot_].base.store(0, std::memory_order_release);
+        slot_ = -1;
+    }
+    if (base_) ::munmap(base_, size_);
+    base_ = nullptr;
+    size_ = pos_ = released_ = 0;
+    faulted_ = false;
+    fd_.Close();
+}
+
+Result MappedFileReader::Open(const std::string& path, MappedFileReader& out) {
+    out.Unmap();
+
+    out.fd_.Reset(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (out.fd_.Get() < 0) {
+        return Result::Fail(errno, "Failed to open input: " + path + " (" + std::strerror(errno) + ")");
+    }
+    struct stat st {};
+    if (::fstat(out.fd_.Get(), &st) != 0) return Result::Fail(errno, "fstat failed: " + path);
+    if (!S_ISREG(st.st_mode) || st.st_size <= 0) {
+        out.fd_.Close();
+        return Result::Fail(ENODEV, path + " is not a non-empty regular file");
+    }
+
+    const auto size = static_cast<std::uint64_t>(st.st_size);
+    if (size > SIZE_MAX) {
+        out.fd_.Close();
+        return Result::Fail(ENOMEM, path + " is too large to map");
+    }
+    void* p = ::mmap(nullptr, static_cast<std::size_t>(size), PROT_READ, MAP_SHARED, out.fd_.Get(), 0);
+    if (p == MAP_FAILED) {
+        const int err = errno;
+        out.fd_.Close();
+        return Result::Fail(err, "mmap failed: " + path + " (" + std::strerror(err) + ")");
+    }
+    (void)::madvise(p, static_cast<std::size_t>(size), MADV_SEQUENTIAL);
+
+    InstallSigbusHandler();
+    out.slot_ = RegisterMapping(p, static_cast<std::size_t>(size), &out.faulted_);
+    if (out.slot_ < 0) {
+        ::munmap(p, static_cast<std::size_t>(size));
+        out.fd_.Close();
+        return Result::Fail(EMFILE, "too many mapped inputs");
+    }
+    out.base_ = static_cast<std::uint8_t*>(p);
+    out.size_ = size;
+    return Result::Ok();
+}
+
+bool MappedFileReader::Intact() {
+    struct stat st {};
+    if (faulted_.load(std::memory_order_relaxed) ||
+        (::fstat(fd_.Get(), &st) == 0 && static_cast<std::uint64_t>(st.st_size) < size_)) {
+        faulted_ = true;
+        errno = EIO;
+        return false;
+    }
+    return true;
+}
+
+// Whatever lies below pos_ has been consumed: earlier views are invalid
+// once the caller comes back. The pages stay in the page cache.
+void MappedFileReader::Release() {
+    const std::uint64_t upto = pos_ & ~static_cast<std::uint64_t>(g_page - 1);
+    if (upto < released_ + kDropBytes) return;
+    (void)::madvise(base_ + released_, static_cast<std::size_t>(upto - released_), MADV_DONTNEED);
+    released_ = upto;
+}
+
+ssize_t MappedFileReader::ReadView(std::size_t max, std::span<const std::uint8_t>& out) {
+    out = {};
+    if (!base_) {
+        errno = EBADF;
+        return -1;
+    }
+    if (!Intact()) return -1;
+    Release();
+    const auto n = static_cast<std::size_t>(std::min<std::uint64_t>(max, size_ - pos_));
+    out = {base_ + pos_, n};
+    pos_ += n;
+    return static_cast<ssize_t>(n);
+}
+
+ssize_t MappedFileReader::Read(std::span<std::uint8_t> out) {
+    if (!base_) {
+        errno = EBADF;
+        return -1;
+    }
+    if (!Intact()) return -1;
+    Release();
+    const auto n = static_cast<std::size_t>(std::min<std::uint64_t>(out.size(), size_ - pos_));
+    std::memcpy(out.data(), base_ + pos_, n);
+    if (!Intact()) return -1;
+    pos_ += n;
+    return static_cast<ssize_t>(n);
+}
+
+bool MappedFileReader::KernelSource(FdSource& out) {
+    if (!base_ || faulted_.load(std::memory_order_relaxed)) return false;
+    out = {};
+    out.fd = fd_.Get();
+    out.offset = static_cast<std::int64_t>(pos_);
+    out.length = size_ - pos_;
+    return true;
+}
+
+void MappedFileReader::Consumed(std::uint64_t n) {
+    pos_ = std::min(size_, pos_ + n);
+}
+
+std::int64_t MappedFileReader::Seek(std::int64_t offset, int whence) {
+    std::int64_t base = 0;
+    if (whence == SEEK_CUR) base = static_cast<std::int64_t>(pos_);
+    else if (whence == SEEK_END) base = static_cast<std::int64_t>(size_);
+    else if (whence != SEEK_SET) {
+        errno = EINVAL;
+        return -1;
+    }
+    const std::int64_t to = base + offset;
+    if (to < 0 || static_cast<std::uint64_t>(to) > size_) {
+        errno = EINVAL;
+        return -1;
+    }
+    pos_ = static_cast<std::uint64_t>(to);
+    released_ = std::min(released_, pos_ & ~static_cast<std::uint64_t>(g_page - 1));
+    return to;
+}
+
+} // namespace flash
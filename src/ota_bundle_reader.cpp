@@ -1,11 +1,27 @@
 #include "flash/ota_bundle_reader.hpp"
 
 #include <algorithm>
+#include <cerrno>
 #include <cstring>
+#include <unistd.h>
 #include <vector>
 
 namespace flash {
 
+struct OtaTarBundleReader::Ctx {
+    IReader* r = nullptr;
+    bool views = true;  // until the reader says ENOTSUP
+    std::vector<std::uint8_t> buf;
+    // Last block handed to libarchive, to tell whether it still holds
+    // bytes beyond what an entry reader has seen.
+    const std::uint8_t* last = nullptr;
+    std::size_t last_len = 0;
+    // Pipe bytes copied in-kernel behind libarchive's back; they read back
+    // as zeros when libarchive skips over them.
+    std::uint64_t phantom = 0;
+    explicit Ctx(IReader& rr) : r(&rr), buf(64 * 1024) {}
+};
+
 OtaTarBundleReader::~OtaTarBundleReader() {
     if (ar_) {
         archive_read_free(ar_);
@@ -23,35 +39,79 @@ Result OtaTarBundleReader::Open(IReader& src) {
 
     // Use archive_read_open with custom callbacks from IReader.
     // We'll use archive_read_open2 for read callback.
-    struct Ctx {
-        IReader* r = nullptr;
-        std::vector<std::uint8_t> buf;
-        explicit Ctx(IReader& rr) : r(&rr), buf(64 * 1024) {}
-    };
-
     auto* ctx = new Ctx(src);
 
+    // Readers that hold the bytes already (mapped files) hand libarchive a
+    // pointer; the rest are copied through buf.
     auto read_cb = [](archive*, void* cd, const void** buff) -> la_ssize_t {
+        static const std::uint8_t kZeros[64 * 1024] = {};
         auto* c = static_cast<Ctx*>(cd);
+        if (c->phantom > 0) {
+            const auto n = static_cast<std::size_t>(std::min<std::uint64_t>(c->phantom, sizeof(kZeros)));
+            c->phantom -= n;
+            c->last = kZeros;
+            c->last_len = n;
+            *buff = kZeros;
+            return static_cast<la_ssize_t>(n);
+        }
+        if (c->views) {
+            std::span<const std::uint8_t> view;
+            const ssize_t v = c->r->ReadView(1024 * 1024, view);
+            if (v >= 0) {
+                c->last = view.data();
+                c->last_len = view.size();
+                *buff = view.data();
+                return static_cast<la_ssize_t>(v);
+            }
+            if (errno != ENOTSUP) return -1;
+            c->views = false;
+        }
         const ssize_t n = c->r->Read(std::span<std::uint8_t>(c->buf.data(), c->buf.size()));
         if (n < 0) return -1;
+        c->last = c->buf.data();
+        c->last_len = static_cast<std::size_t>(n);
         *buff = c->buf.data();
         return static_cast<la_ssize_t>(n); // 0 => EOF
     };
 
+    // Skipping unwanted entry data costs one lseek on regular files. Returning
+    // 0 tells libarchive to read and discard instead (pipes).
+    auto skip_cb = [](archive*, void* cd, la_int64_t request) -> la_int64_t {
+        auto* c = static_cast<Ctx*>(cd);
+        if (!c->r->Seekable() || request <= 0) return 0;
+        const std::int64_t cur = c->r->Seek(0, SEEK_CUR);
+        if (cur < 0) return 0;
+        // Never seek past EOF: a truncated bundle must still fail as truncated.
+        std::int64_t n = request;
+        if (auto total = c->r->TotalSize()) {
+            n = std::min<std::int64_t>(n, std::max<std::int64_t>(0, static_cast<std::int64_t>(*total) - cur));
+        }
+        if (n == 0 || c->r->Seek(n, SEEK_CUR) < 0) return 0;
+        return static_cast<la_int64_t>(n);
+    };
+
+    auto seek_cb = [](archive*, void* cd, la_int64_t offset, int whence) -> la_int64_t {
+        auto* c = static_cast<Ctx*>(cd);
+        if (!c->r->Seekable()) return ARCHIVE_FATAL;
+        const std::int64_t pos = c->r->Seek(offset, whence);
+        return pos < 0 ? ARCHIVE_FATAL : static_cast<la_int64_t>(pos);
+    };
+
     auto close_cb = [](archive*, void* cd) -> int {
         auto* c = static_cast<Ctx*>(cd);
         delete c;
         return ARCHIVE_OK;
     };
 
-    if (archive_read_open2(ar_, ctx, /*open*/nullptr, read_cb, /*skip*/nullptr, close_cb) != ARCHIVE_OK) {
+    archive_read_set_seek_callback(ar_, seek_cb);
+    if (archive_read_open2(ar_, ctx, /*open*/nullptr, read_cb, skip_cb, close_cb) != ARCHIVE_OK) {
         std::string em = archive_error_string(ar_) ? archive_error_string(ar_) : "unknown";
         archive_read_free(ar_);
         ar_ = nullptr;
         return Result::Fail(-1, "archive_read_open2 failed: " + em);
     }
 
+    ctx_ = ctx;
     opened_ = true;
     return Result::Ok();
 }
@@ -128,18 +188,90 @@ Result OtaTarBundleReader::OpenCurrentEntryReader(std::unique_ptr<IReader>& out_
     return Result::Ok();
 }
 
+int OtaTarBundleReader::EntryReader::FetchBlock() {
+    const void* p = nullptr;
+    size_t len = 0;
+    la_int64_t off = 0;
+    const int r = archive_read_data_block(parent_->ar_, &p, &len, &off);
+    if (r == ARCHIVE_EOF) return 0;
+    if (r != ARCHIVE_OK && r != ARCHIVE_WARN) return -1;
+    const auto at = static_cast<std::uint64_t>(off);
+    if (at < fetched_) return -1;
+    zeros_ = at - fetched_;
+    block_ = static_cast<const std::uint8_t*>(p);
+    block_len_ = len;
+    block_pos_ = 0;
+    fetched_ = at + len;
+    return 1;
+}
+
+ssize_t OtaTarBundleReader::EntryReader::Finish() {
+    done_ = true;
+    parent_->in_entry_ = false;
+    return 0;
+}
+
 ssize_t OtaTarBundleReader::EntryReader::Read(std::span<std::uint8_t> out) {
-    if (!parent_ || !parent_->in_entry_) return -1;
-    const la_ssize_t n = archive_read_data(parent_->ar_, out.data(), out.size());
-    if (n < 0) return -1;
-    if (n == 0) {
-        // entry finished
-        parent_->in_entry_ = false;
-        return 0;
+    if (!parent_) return -1;
+    if (done_) return 0;
+    if (!parent_->in_entry_) return -1;
+    if (out.empty()) return 0;
+
+    if (zeros_ == 0 && block_pos_ == block_len_) {
+        // The kernel took everything after the last block.
+        if (taken_ > 0) return Finish();
+        const int r = FetchBlock();
+        if (r == 0) return Finish();
+        if (r < 0) return -1;
     }
+
+    if (zeros_ > 0) {
+        const auto n = static_cast<std::size_t>(std::min<std::uint64_t>(zeros_, out.size()));
+        std::memset(out.data(), 0, n);
+        zeros_ -= n;
+        return static_cast<ssize_t>(n);
+    }
+    const std::size_t n = std::min(out.size(), block_len_ - block_pos_);
+    std::memcpy(out.data(), block_ + block_pos_, n);
+    block_pos_ += n;
     return static_cast<ssize_t>(n);
 }
 
+bool OtaTarBundleReader::EntryReader::KernelSource(FdSource& out) {
+    if (!parent_ || done_ || taken_ > 0 || !parent_->in_entry_ || !parent_->ctx_) return false;
+    archive* ar = parent_->ar_;
+    archive_entry* e = parent_->cur_entry_;
+    // Stored, contiguous entry data only.
+    if (archive_filter_count(ar) != 1 || archive_filter_code(ar, 0) != ARCHIVE_FILTER_NONE ||
+        !archive_entry_size_is_set(e) || archive_entry_sparse_count(e) > 0) {
+        return false;
+    }
+    if (block_ == nullptr && FetchBlock() <= 0) return false;
+
+    const auto size = static_cast<std::uint64_t>(archive_entry_size(e));
+    if (fetched_ >= size) return false;
+    // libarchive must have handed out everything it read; then the input
+    // sits exactly at the next byte of this entry.
+    const Ctx* c = parent_->ctx_;
+    if (block_ + block_len_ != c->last + c->last_len) return false;
+
+    FdSource in;
+    if (!c->r->KernelSource(in) || in.buffered != 0) return false;
+    out = in;
+    out.length = size - fetched_;
+    out.buffered = zeros_ + (block_len_ - block_pos_);
+    pipe_source_ = in.offset < 0;
+    return true;
+}
+
+void OtaTarBundleReader::EntryReader::Consumed(std::uint64_t n) {
+    taken_ += n;
+    // File input: libarchive's cursor is still before these bytes and
+    // seeks over them when the entry is skipped. Pipe input: they are
+    // gone, so its skip reads zeros in their place.
+    if (pipe_source_) parent_->ctx_->phantom += n;
+}
+
 std::optional<std::uint64_t> OtaTarBundleReader::EntryReader::TotalSize() const {
     if (!parent_ || !parent_->cur_entry_) return std::nullopt;
     const la_int64_t sz = archive_entry_size(parent_->cur_entry_);
@@ -1,15 +1,27 @@
 #include "flash/ota_installer.hpp"
 
+#include "flash/bundle_index.hpp"
 #include "flash/file_reader.hpp"
+#include "flash/flasher.hpp"
 #include "flash/logger.hpp"
 #include "flash/manifest.hpp"
+#include "flash/mapped_file_reader.hpp"
 #include "flash/ota_bundle_reader.hpp"
+#include "flash/signals.hpp"
+#include "flash/thread_pool.hpp"
 #include "flash/update_module.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <filesystem>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_set>
 
+#include <sys/stat.h>
+
 namespace flash {
 
 std::string NormalizeTarName(std::string s) {
@@ -17,6 +29,8 @@ std::string NormalizeTarName(std::string s) {
     return s;
 }
 
+// Fallback when the manifest does not declare entry sizes: reads every tar
+// header of the bundle a second time, which means reading the whole file.
 static std::uint64_t ComputeOverallTotalFromFile(const std::string& input_path,
                                                  const Manifest& manifest) {
     if (input_path == "-") return 0;
@@ -66,6 +80,163 @@ static std::uint64_t ComputeOverallTotalFromFile(const std::string& input_path,
     return total;
 }
 
+// The same total from a bundle index, without touching the input.
+static std::uint64_t ComputeOverallTotalFromIndex(const BundleIndex& index, const Manifest& manifest) {
+    std::unordered_set<std::string> want;
+    want.reserve(manifest.components.size());
+    for (const auto& c : manifest.components) {
+        if (!c.filename.empty()) want.insert(c.filename);
+    }
+
+    std::uint64_t total = 0;
+    for (const auto& e : index.entries) {
+        if (want.find(e.name) != want.end()) total += e.size;
+    }
+    return total;
+}
+
+static UpdateModule::Options ComponentOptions(const OtaInstaller::Options& o) {
+    UpdateModule::Options uopt;
+    uopt.progress = true;
+    uopt.io_uring_queue_depth = o.io_uring_queue_depth;
+    uopt.direct_io = o.direct_io;
+    uopt.skip_zero_blocks = o.skip_zero_blocks;
+    uopt.compare_before_write = o.compare_before_write;
+    uopt.kernel_copy = o.kernel_copy;
+    uopt.decompress_threads = o.decompress_threads;
+    uopt.extract_workers = o.extract_workers;
+    uopt.preallocate = o.preallocate;
+    uopt.inflate_backend = o.inflate_backend;
+    uopt.journal_interval_bytes = o.journal_interval_bytes;
+    uopt.verify_chunks = o.verify_chunks;
+    return uopt;
+}
+
+namespace {
+
+struct PlannedComponent {
+    Component comp;
+    const BundleIndexEntry* entry;
+};
+
+// Component reader for concurrent installs: adds consumed bytes to the
+// shared progress counter and fails with ECANCELED once another component
+// has failed or the user interrupted, so every worker stops promptly.
+class SharedProgressReader final : public IReader {
+public:
+    // `read` receives this reader's own byte count; it outlives the reader
+    // so a failed attempt can be taken back out of `done`.
+    SharedProgressReader(std::unique_ptr<IReader> inner, std::atomic<std::uint64_t>& done,
+                         const std::atomic_bool& cancel, std::uint64_t& read)
+        : inner_(std::move(inner)), done_(done), cancel_(cancel), read_(read) {}
+
+    ssize_t Read(std::span<std::uint8_t> out) override {
+        if (cancel_.load(std::memory_order_relaxed) || g_cancel.load(std::memory_order_relaxed)) {
+            errno = ECANCELED;
+            return -1;
+        }
+        const ssize_t n = inner_->Read(out);
+        if (n > 0) {
+            read_ += static_cast<std::uint64_t>(n);
+            done_.fetch_add(static_cast<std::uint64_t>(n), std::memory_order_relaxed);
+        }
+        return n;
+    }
+    std::optional<std::uint64_t> TotalSize() const override { return inner_->TotalSize(); }
+
+    // In-kernel copies only check g_cancel, so a sibling's failure is seen
+    // once this component's copy is done.
+    bool KernelSource(FdSource& out) override {
+        return !cancel_.load(std::memory_order_relaxed) && inner_->KernelSource(out);
+    }
+    void Consumed(std::uint64_t n) override {
+        read_ += n;
+        done_.fetch_add(n, std::memory_order_relaxed);
+        inner_->Consumed(n);
+    }
+
+private:
+    std::unique_ptr<IReader> inner_;
+    std::atomic<std::uint64_t>& done_;
+    const std::atomic_bool& cancel_;
+    std::uint64_t& read_;
+};
+
+// What a target names on this host: the device number of a device node,
+// else the canonical path, resolved through its nearest existing ancestor
+// when it does not exist yet. Aliases ("a/../b", symlinks) compare equal.
+std::string CanonicalTarget(const std::string& target) {
+    struct stat st {};
+    if (::stat(target.c_str(), &st) == 0 && (S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode))) {
+        return "dev:" + std::to_string(static_cast<unsigned long long>(st.st_rdev));
+    }
+    std::error_code ec;
+    auto p = std::filesystem::weakly_canonical(std::filesystem::absolute(target, ec), ec);
+    if (ec) return target;
+    std::string out = p.string();
+    while (out.size() > 1 && out.back() == '/') out.pop_back();
+    return out;
+}
+
+// Same target, or one path lies under the other (a file component inside
+// the folder of an archive component).
+bool TargetsOverlap(const std::string& a, const std::string& b) {
+    const std::string& shorter = a.size() <= b.size() ? a : b;
+    const std::string& longer = a.size() <= b.size() ? b : a;
+    if (longer.compare(0, shorter.size(), shorter) != 0) return false;
+    if (longer.size() == shorter.size()) return true;
+    return shorter[0] == '/' && (shorter.back() == '/' || longer[shorter.size()] == '/');
+}
+
+// Splits the plan into chains that may run at the same time. Components
+// whose targets (install_to, path or delta_source) overlap land in the same
+// chain and keep their manifest order.
+std::vector<std::vector<std::size_t>> ChainsByTarget(const std::vector<PlannedComponent>& plan) {
+    std::vector<std::vector<std::size_t>> chains;
+    std::vector<std::vector<std::string>> targets;
+    for (std::size_t i = 0; i < plan.size(); ++i) {
+        const Component& c = plan[i].comp;
+        std::vector<std::string> mine;
+        for (const std::string* t : {&c.install_to, &c.path, &c.delta_source}) {
+            if (!t->empty()) mine.push_back(CanonicalTarget(*t));
+        }
+
+        std::size_t into = chains.size();
+        for (std::size_t k = 0; k < chains.size(); ++k) {
+            const bool shared = std::any_of(mine.begin(), mine.end(), [&](const std::string& t) {
+                return std::any_of(targets[k].begin(), targets[k].end(),
+                                   [&](const std::string& u) { return TargetsOverlap(t, u); });
+            });
+            if (!shared) continue;
+            if (into == chains.size()) {
+                into = k;
+                continue;
+            }
+            // Bridges two chains: merge k into `into`.
+            chains[into].insert(chains[into].end(), chains[k].begin(), chains[k].end());
+            targets[into].insert(targets[into].end(), targets[k].begin(), targets[k].end());
+            chains[k].clear();
+            targets[k].clear();
+        }
+        if (into == chains.size()) {
+            chains.emplace_back();
+            targets.emplace_back();
+        }
+        chains[into].push_back(i);
+        targets[into].insert(targets[into].end(), mine.begin(), mine.end());
+    }
+
+    std::vector<std::vector<std::size_t>> out;
+    for (auto& ch : chains) {
+        if (ch.empty()) continue;
+        std::sort(ch.begin(), ch.end());
+        out.push_back(std::move(ch));
+    }
+    return out;
+}
+
+} // namespace
+
 static const Component* FindComponentByFilename(const Manifest& m, const std::string& filename) {
     for (const auto& c : m.components) {
         if (c.filename == filename) return &c;
@@ -74,17 +245,53 @@ static const Component* FindComponentByFilename(const Manifest& m, const std::st
 }
 
 Result OtaInstaller::Run(const std::string& input_path) {
-    // Open input
-    FileOrStdinReader input;
-    {
-        auto r = FileOrStdinReader::Open(input_path.c_str(), input);
+    DurabilityPolicy policy(opt_.durability);
+    durability_ = &policy;
+    const std::uint64_t t0 = NowMs();
+    auto r = Install(input_path);
+    durability_ = nullptr;
+    if (!r.is_ok()) {
+        journal_.reset();
+        return r;
+    }
+
+    // Final mode: the one flush that makes the whole install durable.
+    r = policy.FlushAll();
+    if (r.is_ok() && journal_) r = journal_->Remove();
+    journal_.reset();
+    if (!r.is_ok()) return r;
+
+    const auto st = policy.GetStats();
+    const std::uint64_t ms = std::max<std::uint64_t>(1, NowMs() - t0);
+    LogInfo("Durability %s: %llu flushes, %.2fs blocked in flushes (summed over components), %.2fs total",
+            DurabilityModeName(policy.Mode()), (unsigned long long)st.flushes, (double)st.flush_ns / 1e9,
+            (double)ms / 1000.0);
+    return Result::Ok();
+}
+
+Result OtaInstaller::Install(const std::string& input_path) {
+    // Open input: map regular files, read() anything else.
+    std::unique_ptr<IReader> input;
+    if (opt_.mmap_input && input_path != "-") {
+        auto mapped = std::make_unique<MappedFileReader>();
+        auto r = MappedFileReader::Open(input_path, *mapped);
+        if (r.is_ok()) {
+            input = std::move(mapped);
+        } else {
+            LogDebug("Not mapping input (%s); using read()", r.message().c_str());
+        }
+    }
+    if (!input) {
+        auto file = std::make_unique<FileOrStdinReader>();
+        auto r = FileOrStdinReader::Open(input_path.c_str(), *file);
         if (!r.ok) return Result::Fail(-1, r.msg);
+        input = std::move(file);
     }
 
     // Open bundle
     OtaTarBundleReader bundle;
     {
-        auto r = bundle.Open(input);
+        auto r = bundle.Open(*input);
         if (!r.is_ok()) return r;
     }
 
@@ -115,46 +322,123 @@ Result OtaInstaller::Run(const std::string& input_path) {
                 manifest.version.c_str(),
                 manifest.hw_compatibility.c_str(),
                 manifest.components.size());
+
+        if (!opt_.journal_path.empty()) {
+            journal_ = std::make_unique<InstallJournal>();
+            auto jr = InstallJournal::Open(opt_.journal_path, InstallJournal::BundleId(manifest_json), *journal_);
+            if (!jr.is_ok()) return jr;
+            if (journal_->Resuming()) LogInfo("Resuming install from journal %s", opt_.journal_path.c_str());
+        }
+    }
+
+    for (const auto& name : opt_.only_components) {
+        const bool known = std::any_of(manifest.components.begin(), manifest.components.end(),
+                                       [&](const Component& c) { return c.name == name; });
+        if (!known) return Result::Fail(EINVAL, "no component named '" + name + "' in the manifest");
+    }
+
+    // An index, if present, directly follows the manifest. File bundles
+    // with one are installed by random access instead of streaming.
+    bool eof = false;
+    BundleEntryInfo ent{};
+    {
+        auto r = bundle.Next(ent, eof);
+        if (!r.is_ok()) return r;
+    }
+    bool have_entry = !eof;
+    std::uint64_t index_total = 0;
+    // "-" cannot be reopened per component, even when stdin is seekable.
+    const bool random_access = input_path != "-" && input->Seekable();
+    if (have_entry && NormalizeTarName(ent.name) == kBundleIndexName) {
+        std::string text;
+        auto rr = bundle.ReadCurrentToString(text);
+        if (!rr.is_ok()) return rr;
+        have_entry = false;
+
+        auto idx = BundleIndex::Parse(text);
+        if (!idx) {
+            LogWarn("Ignoring bundle index: %s", idx.error().c_str());
+        } else if (!random_access) {
+            LogInfo("Bundle index present but input is not a seekable file; streaming");
+            index_total = ComputeOverallTotalFromIndex(*idx, manifest);
+        } else {
+            return RunIndexed(input_path, manifest, *idx, true);
+        }
+    }
+
+    // Concurrent installs and retries need per-component readers; a plain
+    // uncompressed tar file can be indexed from its headers.
+    if (random_access && (opt_.component_jobs > 1 || opt_.component_retries > 0)) {
+        Fd fd(::open(input_path.c_str(), O_RDONLY | O_CLOEXEC));
+        BundleIndex scanned;
+        auto sr = fd.Get() >= 0 ? ScanTarIndex(fd.Get(), scanned) : Result::Fail(errno, "open failed");
+        if (sr.is_ok()) return RunIndexed(input_path, manifest, scanned, false);
+        LogWarn("Cannot index bundle (%s); installing sequentially", sr.message().c_str());
+    } else if (opt_.component_jobs > 1 || opt_.component_retries > 0) {
+        LogWarn("Concurrent installs and retries need a bundle file; streaming sequentially");
     }
 
-    // Pre-scan overall total (only if input is a file path)
-    const std::uint64_t overall_total = ComputeOverallTotalFromFile(input_path, manifest);
+    // Overall total: declared in the manifest or taken from the bundle index
+    // (single pass, works for pipes); otherwise pre-scan the bundle when it
+    // is a file.
+    std::uint64_t overall_total = ManifestHandler::DeclaredBundleBytes(manifest);
     if (overall_total > 0) {
-        LogInfo("OTA overall total (bundle bytes) = %llu", (unsigned long long)overall_total);
+        LogInfo("OTA overall total (manifest) = %llu bytes", (unsigned long long)overall_total);
+    } else if (index_total > 0) {
+        overall_total = index_total;
+        LogInfo("OTA overall total (bundle index) = %llu bytes", (unsigned long long)overall_total);
     } else {
-        LogInfo("OTA overall total unknown (stdin or pre-scan failed)");
+        overall_total = ComputeOverallTotalFromFile(input_path, manifest);
+        if (overall_total > 0) {
+            LogInfo("OTA overall total (bundle pre-scan) = %llu bytes", (unsigned long long)overall_total);
+        } else {
+            LogInfo("OTA overall total unknown (no sizes in manifest; stdin or pre-scan failed)");
+        }
     }
 
     // Process entries
     std::uint64_t overall_done_base = 0;
 
-    bool eof = false;
-    BundleEntryInfo ent{};
     while (true) {
-        auto r = bundle.Next(ent, eof);
-        if (!r.is_ok()) return r;
-        if (eof) break;
+        if (!have_entry) {
+            auto r = bundle.Next(ent, eof);
+            if (!r.is_ok()) return r;
+            if (eof) break;
+        }
+        have_entry = false;
 
         const std::string name = NormalizeTarName(ent.name);
 
         const Component* comp = FindComponentByFilename(manifest, name);
-        if (!comp) {
+        if (!comp || !Selected(comp->name)) {
             LogDebug("skip: %s", name.c_str());
             auto sk = bundle.SkipCurrent();
             if (!sk.is_ok()) return sk;
             continue;
         }
+        if (AlreadyDone(*comp)) {
+            overall_done_base += ent.size;
+            auto sk = bundle.SkipCurrent();
+            if (!sk.is_ok()) return sk;
+            continue;
+        }
 
         LogInfo("Install: name=%s type=%s file=%s (entry=%llu bytes)",
                 comp->name.c_str(), comp->type.c_str(), comp->filename.c_str(),
                 (unsigned long long)ent.size);
 
+        if (comp->size != 0 && comp->size != ent.size) {
+            LogWarn("[%s] manifest size %llu != bundle entry size %llu", comp->name.c_str(),
+                    (unsigned long long)comp->size, (unsigned long long)ent.size);
+        }
+
         std::unique_ptr<IReader> entry_reader;
         auto er = bundle.OpenCurrentEntryReader(entry_reader);
         if (!er.is_ok()) return er;
 
-        UpdateModule::Options uopt;
-        uopt.progress = true;
+        UpdateModule::Options uopt = ComponentOptions(opt_);
+        uopt.durability = durability_;
+        uopt.journal = journal_.get();
         uopt.component_total_bytes = ent.size;          // per-component %
         uopt.overall_total_bytes = overall_total;       // overall % (0 => unknown)
         uopt.overall_done_base_bytes = overall_done_base;
@@ -163,6 +447,8 @@ Result OtaInstaller::Run(const std::string& input_path) {
         if (!ur.is_ok()) {
             return Result::Fail(-1, "component '" + comp->name + "' failed: " + ur.message());
         }
+        ur = Completed(*comp);
+        if (!ur.is_ok()) return ur;
 
         // update overall base after success
         overall_done_base += ent.size;
@@ -172,6 +458,115 @@ Result OtaInstaller::Run(const std::string& input_path) {
         if (!sk.is_ok()) return sk;
     }
 
+    return Result::Ok();
+}
+
+bool OtaInstaller::Selected(const std::string& component_name) const {
+    return opt_.only_components.empty() ||
+           std::find(opt_.only_components.begin(), opt_.only_components.end(), component_name) !=
+               opt_.only_components.end();
+}
+
+bool OtaInstaller::AlreadyDone(const Component& comp) const {
+    if (!journal_ || !journal_->Done(comp.name)) return false;
+    LogInfo("[%s] installed by an earlier run (journal), skipping", comp.name.c_str());
+    return true;
+}
+
+Result OtaInstaller::Completed(const Component& comp) {
+    if (!journal_ || !durability_->ComponentFlushes()) return Result::Ok();
+    return journal_->MarkDone(comp.name);
+}
+
+Result OtaInstaller::RunIndexed(const std::string& input_path, const Manifest& manifest, const BundleIndex& index,
+                                bool check_offsets) {
+    Fd fd(::open(input_path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd.Get() < 0) return Result::Fail(errno, "Failed to reopen " + input_path);
+
+    // Resolve and check every selected component before installing any.
+    std::vector<PlannedComponent> plan;
+    std::uint64_t overall_total = 0;
+    for (const auto& c : manifest.components) {
+        if (c.filename.empty() || !Selected(c.name) || AlreadyDone(c)) continue;
+        const BundleIndexEntry* e = index.Find(c.filename);
+        if (!e) return Result::Fail(ENOENT, "component '" + c.name + "': " + c.filename + " not in bundle index");
+        if (check_offsets) {
+            auto vr = VerifyIndexEntry(fd.Get(), *e);
+            if (!vr.is_ok()) return vr;
+        }
+
+        PlannedComponent pc{c, e};
+        // The index fills in what the manifest leaves open.
+        if (pc.comp.sha256.empty()) pc.comp.sha256 = e->sha256;
+        if (pc.comp.compression.empty()) pc.comp.compression = e->compression;
+        plan.push_back(std::move(pc));
+        overall_total += e->size;
+    }
+
+    const auto chains = ChainsByTarget(plan);
+    const unsigned jobs = static_cast<unsigned>(
+        std::clamp<std::size_t>(opt_.component_jobs, 1, std::max<std::size_t>(chains.size(), 1)));
+    LogInfo("Indexed bundle: %zu component(s), %llu bytes, %zu independent chain(s), %u at once", plan.size(),
+            (unsigned long long)overall_total, chains.size(), jobs);
+
+    std::atomic<std::uint64_t> overall_done{0};
+    std::atomic_bool cancel{false};
+    std::mutex mu;
+    Result first_error = Result::Ok();
+
+    auto install = [&](const PlannedComponent& pc) -> Result {
+        const Component& comp = pc.comp;
+        const unsigned attempts = 1 + opt_.component_retries;
+        Result ur = Result::Ok();
+        for (unsigned attempt = 1; attempt <= attempts; ++attempt) {
+            LogInfo("Install: name=%s type=%s file=%s (entry=%llu bytes @%llu)%s", comp.name.c_str(),
+                    comp.type.c_str(), comp.filename.c_str(), (unsigned long long)pc.entry->size,
+                    (unsigned long long)pc.entry->offset, attempt > 1 ? " [retry]" : "");
+
+            auto range = std::make_unique<RangeReader>();
+            ur = RangeReader::Open(input_path, pc.entry->offset, pc.entry->size, *range);
+            if (!ur.is_ok()) return ur;
+            std::uint64_t attempt_bytes = 0;
+            auto reader = std::make_unique<SharedProgressReader>(std::move(range), overall_done, cancel, attempt_bytes);
+
+            UpdateModule::Options uopt = ComponentOptions(opt_);
+            uopt.durability = durability_;
+            uopt.journal = journal_.get();
+            uopt.component_total_bytes = pc.entry->size;
+            uopt.overall_total_bytes = overall_total;
+            uopt.overall_done_bytes = &overall_done;
+            ur = UpdateModule::Execute(comp, std::move(reader), uopt);
+            if (ur.is_ok()) return Completed(comp);
+            overall_done.fetch_sub(attempt_bytes, std::memory_order_relaxed);
+            if (cancel.load() || g_cancel.load(std::memory_order_relaxed)) return ur;
+            LogWarn("component '%s' attempt %u/%u failed: %s", comp.name.c_str(), attempt, attempts,
+                    ur.message().c_str());
+        }
+        return ur;
+    };
+
+    {
+        ThreadPool pool(jobs);
+        for (const auto& chain : chains) {
+            pool.Submit([&, chain] {
+                for (std::size_t i : chain) {
+                    if (cancel.load()) return;
+                    auto r = install(plan[i]);
+                    if (r.is_ok()) continue;
+
+                    std::lock_guard<std::mutex> lk(mu);
+                    if (!cancel.exchange(true)) {
+                        first_error = Result::Fail(r.err, "component '" + plan[i].comp.name + "' failed: " + r.message());
+                    }
+                    return;
+                }
+            });
+        }
+    }  // joins the pool
+
+    if (!first_error.is_ok()) return first_error;
+    if (g_cancel.load(std::memory_order_relaxed)) return Result::Fail(ECANCELED, "Canceled by user");
+
     LogInfo("OTA completed successfully");
     return Result::Ok();
 }
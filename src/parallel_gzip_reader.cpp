@@ -0,0 +1,255 @@
+// parallel_gzip_reader.cpp - Inflates BGZF gzip members concurrently, in order.
+
+#include "flash/parallel_gzip_reader.hpp"
+
+#include "flash/crc32.hpp"
+#include "flash/logger.hpp"
+#include "flash/peek_reader.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+
+namespace flash {
+
+namespace {
+
+constexpr std::size_t kFixedHeader = 12;  // ID1 ID2 CM FLG MTIME(4) XFL OS XLEN(2)
+constexpr std::size_t kTrailer = 8;       // CRC32 ISIZE
+constexpr std::uint8_t kFlagHcrc = 0x02;
+constexpr std::uint8_t kFlagExtra = 0x04;
+constexpr std::uint8_t kFlagName = 0x08;
+constexpr std::uint8_t kFlagComment = 0x10;
+// Deflate cannot expand data by more than ~1032:1; bounds ISIZE allocations.
+constexpr std::uint64_t kMaxRatio = 1032;
+
+std::uint32_t Le16(const std::uint8_t* p) { return p[0] | (p[1] << 8); }
+std::uint32_t Le32(const std::uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<std::uint32_t>(p[3]) << 24);
+}
+
+// Total member size from the "BC" subfield, or 0 if the extra field has none.
+std::size_t BlockSize(const std::uint8_t* extra, std::size_t xlen) {
+    std::size_t i = 0;
+    while (i + 4 <= xlen) {
+        const std::size_t slen = Le16(extra + i + 2);
+        if (extra[i] == 'B' && extra[i + 1] == 'C' && slen == 2 && i + 6 <= xlen) {
+            return static_cast<std::size_t>(Le16(extra + i + 4)) + 1;
+        }
+        i += 4 + slen;
+    }
+    return 0;
+}
+
+bool IsGzipHeader(const std::uint8_t* h) {
+    return h[0] == 0x1F && h[1] == 0x8B && h[2] == 8 && (h[3] & kFlagExtra);
+}
+
+} // namespace
+
+ParallelGzipReader::ParallelGzipReader(std::unique_ptr<IReader> source, Options opt)
+    : source_(std::move(source)), opt_(opt), pool_(std::make_unique<ThreadPool>(opt.threads)) {}
+
+ParallelGzipReader::~ParallelGzipReader() {
+    pool_.reset();
+}
+
+bool ParallelGzipReader::Detect(PeekReader& in) {
+    std::span<const std::uint8_t> head;
+    if (in.Peek(kFixedHeader, head) != static_cast<ssize_t>(kFixedHeader) || !IsGzipHeader(head.data())) {
+        return false;
+    }
+    const std::size_t xlen = Le16(head.data() + 10);
+    if (in.Peek(kFixedHeader + xlen, head) != static_cast<ssize_t>(kFixedHeader + xlen)) return false;
+    return BlockSize(head.data() + kFixedHeader, xlen) != 0;
+}
+
+ssize_t ParallelGzipReader::Fail(int err, std::string msg) {
+    if (!error_) {
+        error_ = err;
+        LogError("gzip: %s", msg.c_str());
+    }
+    errno = error_;
+    return -1;
+}
+
+bool ParallelGzipReader::ReadExact(std::uint8_t* p, std::size_t len, bool allow_eof, bool& eof) {
+    std::size_t got = 0;
+    eof = false;
+    while (got < len) {
+        const ssize_t n = source_->Read({p + got, len - got});
+        if (n < 0) {
+            source_err_ = errno ? errno : EIO;
+            source_msg_ = std::string("read failed (") + std::strerror(source_err_) + ")";
+            return false;
+        }
+        if (n == 0) {
+            if (got == 0 && allow_eof) {
+                eof = true;
+                return false;
+            }
+            source_err_ = EBADMSG;
+            source_msg_ = "truncated member";
+            return false;
+        }
+        got += static_cast<std::size_t>(n);
+    }
+    return true;
+}
+
+int ParallelGzipReader::QueueNext() {
+    auto m = std::make_unique<Member>();
+    std::uint8_t hdr[kFixedHeader];
+    bool eof = false;
+    if (!ReadExact(hdr, 1, true, eof)) return eof ? 0 : -1;
+    // Some packers pad the last member with zeros up to a block boundary.
+    if (queued_ > 0 && hdr[0] == 0) return SkipPadding();
+    if (!ReadExact(hdr + 1, sizeof(hdr) - 1, false, eof)) return -1;
+    if (!IsGzipHeader(hdr)) {
+        source_err_ = EBADMSG;
+        source_msg_ = "member without a BGZF block size";
+        return -1;
+    }
+
+    const std::size_t xlen = Le16(hdr + 10);
+    m->in.resize(kFixedHeader + xlen);
+    std::memcpy(m->in.data(), hdr, sizeof(hdr));
+    if (!ReadExact(m->in.data() + kFixedHeader, xlen, false, eof)) return -1;
+
+    const std::size_t total = BlockSize(m->in.data() + kFixedHeader, xlen);
+    if (total < kFixedHeader + xlen + kTrailer) {
+        source_err_ = EBADMSG;
+        source_msg_ = total ? "bad BGZF block size" : "member without a BGZF block size";
+        return -1;
+    }
+    const std::size_t have = m->in.size();
+    m->in.resize(total);
+    if (!ReadExact(m->in.data() + have, total - have, false, eof)) return -1;
+
+    const std::uint32_t isize = Le32(m->in.data() + total - 4);
+    if (isize > total * kMaxRatio) {
+        source_err_ = EBADMSG;
+        source_msg_ = "implausible member size";
+        return -1;
+    }
+    m->out.resize(isize);
+    m->cost = total + isize;
+    inflight_ += m->cost;
+
+    Member* raw = m.get();
+    members_.push_back(std::move(m));
+    ++queued_;
+    pool_->Submit([this, raw] {
+        Inflate(*raw, opt_.backend);
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            raw->done = true;
+        }
+        cv_.notify_all();
+    });
+    return 1;
+}
+
+int ParallelGzipReader::SkipPadding() {
+    std::uint8_t buf[4096];
+    while (true) {
+        const ssize_t n = source_->Read({buf, sizeof(buf)});
+        if (n < 0) {
+            source_err_ = errno ? errno : EIO;
+            source_msg_ = std::string("read failed (") + std::strerror(source_err_) + ")";
+            return -1;
+        }
+        if (n == 0) return 0;
+        if (std::any_of(buf, buf + n, [](std::uint8_t b) { return b != 0; })) {
+            source_err_ = EBADMSG;
+            source_msg_ = "garbage after the last member";
+            return -1;
+        }
+    }
+}
+
+void ParallelGzipReader::Inflate(Member& m, InflateBackend backend) {
+    const std::uint8_t* p = m.in.data();
+    const std::size_t size = m.in.size();
+    const std::uint8_t flags = p[3];
+    std::size_t off = kFixedHeader + Le16(p + 10);
+
+    auto skip_string = [&] {
+        while (off < size - kTrailer && p[off] != 0) ++off;
+        ++off;
+    };
+    if (flags & kFlagName) skip_string();
+    if (flags & kFlagComment) skip_string();
+    if (flags & kFlagHcrc) off += 2;
+    if (off > size - kTrailer) {
+        m.err = EBADMSG;
+        m.msg = "bad member header";
+        return;
+    }
+
+    std::uint8_t dummy = 0;
+    const std::uint8_t* in = p + off;
+    std::size_t in_len = size - kTrailer - off;
+    std::uint8_t* out = m.out.empty() ? &dummy : m.out.data();
+    std::size_t out_len = m.out.size();
+    Inflater::Status st = Inflater::Status::Error;
+    try {
+        auto inflater = MakeInflater(backend);
+        st = inflater->Inflate(in, in_len, out, out_len);
+    } catch (const std::exception& e) {
+        m.err = ENOMEM;
+        m.msg = e.what();
+        return;
+    }
+
+    if (st != Inflater::Status::StreamEnd || out_len != 0) {
+        m.err = EBADMSG;
+        m.msg = st == Inflater::Status::StreamEnd ? "member size mismatch" : "corrupt deflate data";
+    } else if (Crc32(0, m.out) != Le32(p + size - kTrailer)) {
+        m.err = EBADMSG;
+        m.msg = "member crc mismatch";
+    }
+    std::vector<std::uint8_t>().swap(m.in);
+}
+
+ssize_t ParallelGzipReader::Read(std::span<std::uint8_t> out) {
+    if (error_) {
+        errno = error_;
+        return -1;
+    }
+
+    std::size_t filled = 0;
+    while (filled < out.size()) {
+        while (!source_done_ && (members_.empty() || inflight_ < opt_.window_bytes)) {
+            const int r = QueueNext();
+            if (r <= 0) source_done_ = true;
+        }
+        if (members_.empty()) {
+            if (source_err_) return Fail(source_err_, source_msg_);
+            break;
+        }
+
+        Member& m = *members_.front();
+        {
+            std::unique_lock<std::mutex> lk(mu_);
+            if (!m.done) {
+                if (filled > 0) break;  // hand back what is ready instead of stalling
+                cv_.wait(lk, [&] { return m.done; });
+            }
+        }
+        if (m.err) return Fail(m.err, m.msg);
+
+        const std::size_t n = std::min(out.size() - filled, m.out.size() - m.pos);
+        std::memcpy(out.data() + filled, m.out.data() + m.pos, n);
+        m.pos += n;
+        filled += n;
+        if (m.pos == m.out.size()) {
+            inflight_ -= m.cost;
+            members_.pop_front();
+        }
+    }
+    return static_cast<ssize_t>(filled);
+}
+
+} // namespace flash
@@ -1,30 +1,188 @@
 // partition_writer.cpp - Writer implementation for block device/partition path.
 
 #include "flash/partition_writer.hpp"
+#include "flash/logger.hpp"
 
+#include <algorithm>
 #include <cerrno>
 #include <cstring>
 
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 namespace flash {
 
+namespace {
+
+// Smallest I/O unit O_DIRECT accepts for this fd (logical sector for block
+// devices, filesystem block for regular files).
+size_t QueryDirectAlignment(int fd) {
+    struct stat st {};
+    if (::fstat(fd, &st) == 0) {
+        if (S_ISBLK(st.st_mode)) {
+            int ssz = 0;
+            if (::ioctl(fd, BLKSSZGET, &ssz) == 0 && ssz >= 512) return static_cast<size_t>(ssz);
+            return 512;
+        }
+        const size_t bs = static_cast<size_t>(st.st_blksize);
+        if (bs >= 512 && bs <= 64 * 1024 && (bs & (bs - 1)) == 0) return bs;
+    }
+    return 4096;
+}
+
+} // namespace
+
+PartitionWriter::~PartitionWriter() {
+    AlignedBufferPool::Shared().Release(std::move(stage_));
+}
+
 Result PartitionWriter::Open(std::string path, PartitionWriter &out) {
+    return Open(std::move(path), Options{}, out);
+}
+
+Result PartitionWriter::Open(std::string path, const Options &opt, PartitionWriter &out) {
     out.path_ = std::move(path);
+    out.direct_ = false;
+    out.staged_ = 0;
+    out.offset_ = 0;
+    out.hole_end_ = 0;
+    out.sync_ = opt.sync;
+    out.preallocated_ = 0;
+    out.buffered_fd_.Close();
 
-    // O_WRONLY is enough for MVP; later you can add O_SYNC / O_DIRECT options.
-    int fd = ::open(out.path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int flags = O_WRONLY | O_CREAT | (opt.truncate ? O_TRUNC : 0);
+    int fd = -1;
+    if (opt.direct) {
+        fd = ::open(out.path_.c_str(), flags | O_DIRECT, 0644);
+        if (fd >= 0) {
+            out.direct_ = true;
+            flags &= ~O_TRUNC;  // already truncated by the first open
+        } else if (errno == EINVAL) {
+            LogWarn("O_DIRECT not supported for %s, using buffered writes", out.path_.c_str());
+        } else {
+            return Result::Fail(
+                errno,
+                "Failed to open output: " + out.path_ + " (" + std::strerror(errno) + ")");
+        }
+    }
     if (fd < 0) {
-        return Result::Fail(
-            errno,
-            "Failed to open output: " + out.path_ + " (" + std::strerror(errno) + ")");
+        fd = ::open(out.path_.c_str(), flags, 0644);
+        if (fd < 0) {
+            return Result::Fail(
+                errno,
+                "Failed to open output: " + out.path_ + " (" + std::strerror(errno) + ")");
+        }
     }
     out.fd_.Reset(fd);
+
+    if (opt.preallocate_bytes > 0) {
+        struct stat st {};
+        if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            auto r = Preallocate(fd, opt.preallocate_bytes);
+            if (!r.is_ok()) return Result::Fail(r.err, out.path_ + ": " + r.msg);
+            out.preallocated_ = opt.preallocate_bytes;
+        }
+    }
+
+    if (out.direct_) {
+        int bfd = ::open(out.path_.c_str(), (flags & ~O_WRONLY) | O_RDWR, 0644);
+        if (bfd < 0 && errno == EACCES) bfd = ::open(out.path_.c_str(), flags, 0644);
+        if (bfd < 0) {
+            return Result::Fail(
+                errno,
+                "Failed to open output: " + out.path_ + " (" + std::strerror(errno) + ")");
+        }
+        out.buffered_fd_.Reset(bfd);
+
+        out.align_ = std::max(QueryDirectAlignment(fd), AlignedBuffer::PageSize());
+        size_t cap = opt.direct_buffer_bytes ? opt.direct_buffer_bytes : out.align_;
+        cap = (cap + out.align_ - 1) / out.align_ * out.align_;
+        if (out.stage_.size() != cap) {
+            AlignedBufferPool::Shared().Release(std::move(out.stage_));
+            out.stage_ = AlignedBufferPool::Shared().Acquire(cap);
+        }
+    }
+    return Result::Ok();
+}
+
+Result PartitionWriter::WriteFd(int fd, const std::uint8_t* p, size_t len, std::uint64_t off) {
+    while (len > 0) {
+        const ssize_t n = ::pwrite(fd, p, len, static_cast<off_t>(off));
+        if (n > 0) {
+            p += static_cast<size_t>(n);
+            len -= static_cast<size_t>(n);
+            off += static_cast<std::uint64_t>(n);
+            continue;
+        }
+        if (n == -1 && errno == EINTR) continue;
+        return Result::Fail(n == 0 ? EIO : errno,
+                            "Write failed (" + std::string(std::strerror(n == 0 ? EIO : errno)) + ")");
+    }
+    return Result::Ok();
+}
+
+Result PartitionWriter::FallBackToBuffered(int err) {
+    LogWarn("O_DIRECT write rejected for %s (%s), using buffered writes",
+            path_.c_str(), std::strerror(err));
+    direct_ = false;
+    fd_ = std::move(buffered_fd_);
+    if (::lseek(fd_.Get(), static_cast<off_t>(offset_), SEEK_SET) < 0) {
+        return Result::Fail(errno, "lseek failed (" + std::string(std::strerror(errno)) + ")");
+    }
+    const size_t n = staged_;
+    staged_ = 0;
+    return WriteAll({stage_.data(), n});
+}
+
+// `len` is a multiple of align_ and `p` is aligned.
+Result PartitionWriter::WriteDirect(const std::uint8_t* p, size_t len) {
+    auto r = WriteFd(fd_.Get(), p, len, offset_);
+    if (!r.is_ok()) return r;
+    offset_ += len;
     return Result::Ok();
 }
 
 Result PartitionWriter::WriteAll(std::span<const std::uint8_t> in) {
+    if (direct_) {
+        while (!in.empty()) {
+            // Aligned caller buffers skip the staging copy entirely.
+            if (staged_ == 0 && in.size() >= align_ &&
+                reinterpret_cast<std::uintptr_t>(in.data()) % align_ == 0) {
+                const size_t len = in.size() / align_ * align_;
+                auto r = WriteDirect(in.data(), len);
+                if (!r.is_ok()) {
+                    if (r.err != EINVAL) return r;
+                    auto fb = FallBackToBuffered(r.err);
+                    if (!fb.is_ok()) return fb;
+                    return WriteAll(in);
+                }
+                in = in.subspan(len);
+                continue;
+            }
+
+            const size_t take = std::min(in.size(), stage_.size() - staged_);
+            std::memcpy(stage_.data() + staged_, in.data(), take);
+            staged_ += take;
+            in = in.subspan(take);
+
+            if (staged_ == stage_.size()) {
+                auto r = WriteDirect(stage_.data(), staged_);
+                if (!r.is_ok()) {
+                    if (r.err != EINVAL) return r;
+                    auto fb = FallBackToBuffered(r.err);
+                    if (!fb.is_ok()) return fb;
+                    return WriteAll(in);
+                }
+                staged_ = 0;
+            }
+        }
+        return Result::Ok();
+    }
+
     size_t rem = in.size();
     const std::uint8_t *p = in.data();
 
@@ -44,11 +202,204 @@ Result PartitionWriter::WriteAll(std::span<const std::uint8_t> in) {
     return Result::Ok();
 }
 
+ssize_t PartitionWriter::CopyFromFd(int fd, std::int64_t* offset, std::size_t len) {
+    if (direct_) {
+        errno = EINVAL;
+        return -1;
+    }
+    while (true) {
+        ssize_t n;
+        if (!offset) {
+            n = ::splice(fd, nullptr, fd_.Get(), nullptr, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        } else if (!no_copy_file_range_) {
+            loff_t off = *offset;
+            n = ::copy_file_range(fd, &off, fd_.Get(), nullptr, len, 0);
+            if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP ||
+                          errno == EBADF)) {
+                // Cross-device before 5.3, block device targets, old kernels.
+                no_copy_file_range_ = true;
+                continue;
+            }
+            if (n > 0) *offset = off;
+        } else {
+            off_t off = static_cast<off_t>(*offset);
+            n = ::sendfile(fd_.Get(), fd, &off, len);
+            if (n > 0) *offset = off;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        return n;
+    }
+}
+
+Result PartitionWriter::ZeroRange(int fd, std::uint64_t off, std::uint64_t len) {
+    if (len == 0) return Result::Ok();
+
+    struct stat st {};
+    if (::fstat(fd, &st) != 0) {
+        return Result::Fail(errno, "fstat failed (" + std::string(std::strerror(errno)) + ")");
+    }
+
+    if (S_ISBLK(st.st_mode)) {
+        std::uint64_t range[2] = {off, len};
+        unsigned int discard_zeroes = 0;
+        if (::ioctl(fd, BLKDISCARDZEROES, &discard_zeroes) == 0 && discard_zeroes &&
+            ::ioctl(fd, BLKDISCARD, range) == 0) {
+            return Result::Ok();
+        }
+        if (::ioctl(fd, BLKZEROOUT, range) == 0) return Result::Ok();
+        return Result::Fail(EOPNOTSUPP,
+                            "BLKZEROOUT failed (" + std::string(std::strerror(errno)) + ")");
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        if (::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        static_cast<off_t>(off), static_cast<off_t>(len)) == 0) {
+            return Result::Ok();
+        }
+        return Result::Fail(EOPNOTSUPP,
+                            "hole punch failed (" + std::string(std::strerror(errno)) + ")");
+    }
+    return Result::Fail(EOPNOTSUPP, "target cannot zero ranges in place");
+}
+
+Result PartitionWriter::Preallocate(int fd, std::uint64_t len) {
+    if (len == 0) return Result::Ok();
+    if (::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(len)) == 0) return Result::Ok();
+    const int err = errno;
+    if (err == ENOSPC || err == EDQUOT || err == EFBIG) {
+        return Result::Fail(err, "cannot reserve " + std::to_string(len) + " bytes (" + std::strerror(err) + ")");
+    }
+    LogDebug("fallocate unavailable (%s), not preallocating", std::strerror(err));
+    return Result::Ok();
+}
+
+Result PartitionWriter::TrimPreallocation() {
+    if (preallocated_ == 0) return Result::Ok();
+    struct stat st {};
+    if (::fstat(fd_.Get(), &st) != 0) {
+        return Result::Fail(errno, "fstat failed (" + std::string(std::strerror(errno)) + ")");
+    }
+    if (static_cast<std::uint64_t>(st.st_size) < preallocated_ && ::ftruncate(fd_.Get(), st.st_size) != 0) {
+        return Result::Fail(errno, "ftruncate failed (" + std::string(std::strerror(errno)) + ")");
+    }
+    preallocated_ = 0;
+    return Result::Ok();
+}
+
+// Moves the write position `len` bytes forward, zeroing the range in place
+// when `zero` is set. Falls back to writing zeros when that is not possible.
+Result PartitionWriter::Advance(std::uint64_t len, bool zero) {
+    if (len == 0) return Result::Ok();
+
+    if (direct_) {
+        // Only whole blocks can be jumped over; anything else goes through
+        // the stage: zeros, or for a skip the bytes already there.
+        if (staged_ % align_ != 0 || len % align_ != 0) {
+            if (zero) return IWriter::WriteZeroes(len);
+            const std::uint64_t head = std::min<std::uint64_t>(len, (align_ - staged_ % align_) % align_);
+            // (A write in between may fall back to buffered mode.)
+            auto r = KeepOld(static_cast<std::size_t>(head));
+            if (!r.is_ok() || !direct_) return r.is_ok() ? Advance(len - head, zero) : r;
+            const std::uint64_t whole = (len - head) / align_ * align_;
+            r = Advance(whole, zero);
+            if (!r.is_ok() || !direct_) return r.is_ok() ? Advance(len - head - whole, zero) : r;
+            return KeepOld(static_cast<std::size_t>(len - head - whole));
+        }
+        if (staged_ > 0) {
+            auto r = WriteDirect(stage_.data(), staged_);
+            if (!r.is_ok()) {
+                if (r.err != EINVAL) return r;
+                auto fb = FallBackToBuffered(r.err);
+                if (!fb.is_ok()) return fb;
+                return Advance(len, zero);
+            }
+            staged_ = 0;
+        }
+        if (zero && !ZeroRange(fd_.Get(), offset_, len).is_ok()) return IWriter::WriteZeroes(len);
+        offset_ += len;
+        hole_end_ = offset_;
+        return Result::Ok();
+    }
+
+    const off_t pos = ::lseek(fd_.Get(), 0, SEEK_CUR);
+    if (pos < 0 || (zero && !ZeroRange(fd_.Get(), static_cast<std::uint64_t>(pos), len).is_ok())) {
+        return IWriter::WriteZeroes(len);
+    }
+    if (::lseek(fd_.Get(), static_cast<off_t>(len), SEEK_CUR) < 0) {
+        return Result::Fail(errno, "lseek failed (" + std::string(std::strerror(errno)) + ")");
+    }
+    hole_end_ = static_cast<std::uint64_t>(pos) + len;
+    return Result::Ok();
+}
+
+// Direct mode: stages the `len` (< align_) bytes the target holds at the
+// write position, so the block they share with new data goes out whole
+// without changing them. Past the end of a file they are zeros.
+Result PartitionWriter::KeepOld(std::size_t len) {
+    std::uint8_t old[64 * 1024];
+    std::memset(old, 0, len);
+    const std::uint64_t at = offset_ + staged_;
+    for (std::size_t got = 0; got < len;) {
+        const ssize_t n = ::pread(buffered_fd_.Get(), old + got, len - got, static_cast<off_t>(at + got));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return Result::Fail(errno, "Cannot read the bytes to keep (" + std::string(std::strerror(errno)) + ")");
+        if (n == 0) break;
+        got += static_cast<std::size_t>(n);
+    }
+    return WriteAll({old, len});
+}
+
+Result PartitionWriter::WriteZeroes(std::uint64_t len) {
+    return Advance(len, /*zero=*/true);
+}
+
+Result PartitionWriter::Skip(std::uint64_t len) {
+    return Advance(len, /*zero=*/false);
+}
+
 Result PartitionWriter::FsyncNow() {
-    if (::fsync(fd_.Get()) == -1) {
+    if (direct_ && staged_ > 0) {
+        // Whole blocks go out with O_DIRECT. The unaligned tail is written through
+        // the buffered descriptor but also kept staged: if more data follows, the
+        // next direct write rewrites that block in full.
+        const size_t aligned = staged_ / align_ * align_;
+        if (aligned > 0) {
+            auto r = WriteDirect(stage_.data(), aligned);
+            if (!r.is_ok()) {
+                if (r.err != EINVAL) return r;
+                auto fb = FallBackToBuffered(r.err);
+                if (!fb.is_ok()) return fb;
+                return FsyncNow();
+            }
+            std::memmove(stage_.data(), stage_.data() + aligned, staged_ - aligned);
+            staged_ -= aligned;
+        }
+        if (staged_ > 0) {
+            auto r = WriteFd(buffered_fd_.Get(), stage_.data(), staged_, offset_);
+            if (!r.is_ok()) return r;
+        }
+    }
+
+    if (hole_end_ > 0) {
+        struct stat st {};
+        if (::fstat(fd_.Get(), &st) == 0 && S_ISREG(st.st_mode) &&
+            static_cast<std::uint64_t>(st.st_size) < hole_end_ &&
+            ::ftruncate(fd_.Get(), static_cast<off_t>(hole_end_)) != 0) {
+            return Result::Fail(errno, "ftruncate failed (" + std::string(std::strerror(errno)) + ")");
+        }
+    }
+
+    if (sync_ && ::fsync(fd_.Get()) == -1) {
         return Result::Fail(errno, "fsync failed (" + std::string(std::strerror(errno)) + ")");
     }
     return Result::Ok();
 }
 
+Result PartitionWriter::DataSync() {
+    if (::fdatasync(fd_.Get()) == -1) {
+        return Result::Fail(errno, "fdatasync failed (" + std::string(std::strerror(errno)) + ")");
+    }
+    return Result::Ok();
+}
+
 } // namespace flash
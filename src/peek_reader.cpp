@@ -0,0 +1,68 @@
+#include "flash/peek_reader.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace flash {
+
+ssize_t PeekReader::Peek(std::size_t n, std::span<const std::uint8_t>& out) {
+    while (head_.size() - head_pos_ < n) {
+        const std::size_t have = head_.size();
+        head_.resize(head_pos_ + n);
+        const ssize_t r = source_->Read({head_.data() + have, head_.size() - have});
+        if (r <= 0) {
+            head_.resize(have);
+            if (r < 0) return -1;
+            break;
+        }
+        head_.resize(have + static_cast<std::size_t>(r));
+    }
+    const std::size_t avail = std::min(n, head_.size() - head_pos_);
+    out = {head_.data() + head_pos_, avail};
+    return static_cast<ssize_t>(avail);
+}
+
+ssize_t PeekReader::Read(std::span<std::uint8_t> out) {
+    if (head_pos_ < head_.size()) {
+        const std::size_t n = std::min(out.size(), head_.size() - head_pos_);
+        std::memcpy(out.data(), head_.data() + head_pos_, n);
+        head_pos_ += n;
+        if (head_pos_ == head_.size()) {
+            head_.clear();
+            head_pos_ = 0;
+        }
+        return static_cast<ssize_t>(n);
+    }
+    return source_->Read(out);
+}
+
+std::int64_t PeekReader::Seek(std::int64_t offset, int whence) {
+    const std::int64_t end = source_->Seek(0, SEEK_CUR);
+    if (end < 0) return -1;
+    const std::int64_t here = end - static_cast<std::int64_t>(head_.size() - head_pos_);
+    std::int64_t to = 0;
+    if (whence == SEEK_SET) {
+        to = offset;
+    } else if (whence == SEEK_CUR) {
+        to = here + offset;
+    } else {
+        head_.clear();
+        head_pos_ = 0;
+        return source_->Seek(offset, whence);
+    }
+    if (to >= here && to <= end) {
+        head_pos_ += static_cast<std::size_t>(to - here);
+        return to;
+    }
+    head_.clear();
+    head_pos_ = 0;
+    return source_->Seek(to, SEEK_SET);
+}
+
+bool PeekReader::KernelSource(FdSource& out) {
+    if (!source_->KernelSource(out)) return false;
+    out.buffered += head_.size() - head_pos_;
+    return true;
+}
+
+} // namespace flash
@@ -0,0 +1,392 @@
+#include "flash/sha256.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define FLASH_SHA256_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#define FLASH_SHA256_ARM 1
+#endif
+
+namespace flash {
+
+namespace {
+
+alignas(16) constexpr std::uint32_t kK[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+constexpr std::uint32_t kInit[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+inline std::uint32_t Rotr(std::uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+// Processes `blocks` consecutive 64-byte blocks.
+using BlockFn = void (*)(std::uint32_t state[8], const std::uint8_t* data, size_t blocks);
+
+void BlocksPortable(std::uint32_t state[8], const std::uint8_t* data, size_t blocks) {
+    std::uint32_t w[64];
+    while (blocks--) {
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (std::uint32_t)data[4 * i] << 24 | (std::uint32_t)data[4 * i + 1] << 16 |
+                   (std::uint32_t)data[4 * i + 2] << 8 | (std::uint32_t)data[4 * i + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            const std::uint32_t s0 = Rotr(w[i - 15], 7) ^ Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const std::uint32_t s1 = Rotr(w[i - 2], 17) ^ Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        std::uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        std::uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            const std::uint32_t s1 = Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25);
+            const std::uint32_t ch = (e & f) ^ (~e & g);
+            const std::uint32_t t1 = h + s1 + ch + kK[i] + w[i];
+            const std::uint32_t s0 = Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22);
+            const std::uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            const std::uint32_t t2 = s0 + maj;
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        data += 64;
+    }
+}
+
+#if defined(FLASH_SHA256_X86)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+void BlocksShaNi(std::uint32_t state[8], const std::uint8_t* data, size_t blocks) {
+    const __m128i kShuf = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0]));
+    __m128i st1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4]));
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);          // CDAB
+    st1 = _mm_shuffle_epi32(st1, 0x1B);          // EFGH
+    __m128i st0 = _mm_alignr_epi8(tmp, st1, 8);  // ABEF
+    st1 = _mm_blend_epi16(st1, tmp, 0xF0);       // CDGH
+
+    while (blocks--) {
+        const __m128i abef = st0;
+        const __m128i cdgh = st1;
+        __m128i w[4];
+
+        for (int g = 0; g < 16; ++g) {
+            __m128i& cur = w[g & 3];
+            if (g < 4) {
+                cur = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * g)), kShuf);
+            } else {
+                // w[g-4] is the slot being replaced; g-1/g-2/g-3 are the other three.
+                __m128i t = _mm_sha256msg1_epu32(cur, w[(g - 3) & 3]);
+                t = _mm_add_epi32(t, _mm_alignr_epi8(w[(g - 1) & 3], w[(g - 2) & 3], 4));
+                cur = _mm_sha256msg2_epu32(t, w[(g - 1) & 3]);
+            }
+            __m128i m = _mm_add_epi32(cur, _mm_load_si128(reinterpret_cast<const __m128i*>(&kK[4 * g])));
+            st1 = _mm_sha256rnds2_epu32(st1, st0, m);
+            m = _mm_shuffle_epi32(m, 0x0E);
+            st0 = _mm_sha256rnds2_epu32(st0, st1, m);
+        }
+
+        st0 = _mm_add_epi32(st0, abef);
+        st1 = _mm_add_epi32(st1, cdgh);
+        data += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(st0, 0x1B);          // FEBA
+    st1 = _mm_shuffle_epi32(st1, 0xB1);          // DCHG
+    st0 = _mm_blend_epi16(tmp, st1, 0xF0);       // DCBA
+    st1 = _mm_alignr_epi8(st1, tmp, 8);          // ABEF -> HGFE
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), st0);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), st1);
+}
+
+bool CpuHasShaNi() {
+    unsigned a = 0, b = 0, c = 0, d = 0;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) return false;
+    const bool ssse3 = (c & (1u << 9)) != 0;
+    const bool sse41 = (c & (1u << 19)) != 0;
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return false;
+    const bool sha = (b & (1u << 29)) != 0;
+    return ssse3 && sse41 && sha;
+}
+
+#elif defined(FLASH_SHA256_ARM)
+
+#if defined(__clang__)
+__attribute__((target("sha2")))
+#else
+__attribute__((target("+crypto")))
+#endif
+void BlocksArmCe(std::uint32_t state[8], const std::uint8_t* data, size_t blocks) {
+    uint32x4_t st0 = vld1q_u32(&state[0]);
+    uint32x4_t st1 = vld1q_u32(&state[4]);
+
+    while (blocks--) {
+        const uint32x4_t abcd = st0;
+        const uint32x4_t efgh = st1;
+        uint32x4_t w[4];
+
+        for (int g = 0; g < 16; ++g) {
+            uint32x4_t& cur = w[g & 3];
+            if (g < 4) {
+                cur = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * g)));
+            } else {
+                cur = vsha256su1q_u32(vsha256su0q_u32(cur, w[(g - 3) & 3]), w[(g - 2) & 3], w[(g - 1) & 3]);
+            }
+            const uint32x4_t k = vaddq_u32(cur, vld1q_u32(&kK[4 * g]));
+            const uint32x4_t prev = st0;
+            st0 = vsha256hq_u32(st0, st1, k);
+            st1 = vsha256h2q_u32(st1, prev, k);
+        }
+
+        st0 = vaddq_u32(st0, abcd);
+        st1 = vaddq_u32(st1, efgh);
+        data += 64;
+    }
+
+    vst1q_u32(&state[0], st0);
+    vst1q_u32(&state[4], st1);
+}
+
+bool CpuHasArmSha2() {
+    return (::getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+}
+
+#endif
+
+struct Impl {
+    BlockFn fn;
+    const char* name;
+};
+
+const Impl& SelectImpl() {
+    static const Impl impl = [] {
+#if defined(FLASH_SHA256_X86)
+        if (CpuHasShaNi()) return Impl{BlocksShaNi, "sha-ni"};
+#elif defined(FLASH_SHA256_ARM)
+        if (CpuHasArmSha2()) return Impl{BlocksArmCe, "armv8-ce"};
+#endif
+        return Impl{BlocksPortable, "portable"};
+    }();
+    return impl;
+}
+
+} // namespace
+
+Sha256::Sha256() {
+    std::memcpy(state_, kInit, sizeof(state_));
+}
+
+Sha256 Sha256::Portable() {
+    Sha256 h;
+    h.portable_ = true;
+    return h;
+}
+
+void Sha256::Update(std::span<const std::uint8_t> in) {
+    const BlockFn fn = portable_ ? BlocksPortable : SelectImpl().fn;
+    const std::uint8_t* p = in.data();
+    size_t n = in.size();
+    total_ += n;
+
+    if (buf_len_ > 0) {
+        const size_t take = std::min(n, sizeof(buf_) - buf_len_);
+        std::memcpy(buf_ + buf_len_, p, take);
+        buf_len_ += take;
+        p += take;
+        n -= take;
+        if (buf_len_ < sizeof(buf_)) return;
+        fn(state_, buf_, 1);
+        buf_len_ = 0;
+    }
+
+    if (n >= 64) {
+        const size_t blocks = n / 64;
+        fn(state_, p, blocks);
+        p += blocks * 64;
+        n -= blocks * 64;
+    }
+
+    if (n > 0) {
+        std::memcpy(buf_, p, n);
+        buf_len_ = n;
+    }
+}
+
+Sha256Digest Sha256::Final() {
+    const std::uint64_t bits = total_ * 8;
+
+    std::uint8_t pad[72] = {0x80};
+    const size_t pad_len = (buf_len_ < 56) ? (56 - buf_len_) : (120 - buf_len_);
+    for (int i = 0; i < 8; ++i) {
+        pad[pad_len + i] = static_cast<std::uint8_t>(bits >> (56 - 8 * i));
+    }
+    Update({pad, pad_len + 8});
+
+    Sha256Digest out{};
+    for (int i = 0; i < 8; ++i) {
+        out[4 * i] = static_cast<std::uint8_t>(state_[i] >> 24);
+        out[4 * i + 1] = static_cast<std::uint8_t>(state_[i] >> 16);
+        out[4 * i + 2] = static_cast<std::uint8_t>(state_[i] >> 8);
+        out[4 * i + 3] = static_cast<std::uint8_t>(state_[i]);
+    }
+    return out;
+}
+
+const char* Sha256::Backend() {
+    return SelectImpl().name;
+}
+
+std::string Sha256::ToHex(const Sha256Digest& d) {
+    static const char* kHex = "0123456789abcdef";
+    std::string s;
+    s.reserve(64);
+    for (auto b : d) {
+        s.push_back(kHex[b >> 4]);
+        s.push_back(kHex[b & 0xF]);
+    }
+    return s;
+}
+
+bool Sha256::ParseHex(std::string_view hex, Sha256Digest& out) {
+    if (hex.size() != 64) return false;
+    auto nibble = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+    for (size_t i = 0; i < 32; ++i) {
+        const int hi = nibble(hex[2 * i]);
+        const int lo = nibble(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) return false;
+        out[i] = static_cast<std::uint8_t>((hi << 4) | lo);
+    }
+    return true;
+}
+
+AsyncSha256::AsyncSha256(size_t slot_bytes, size_t slots) : slots_(slots ? slots : 1) {
+    for (size_t i = 0; i < slots_.size(); ++i) {
+        slots_[i].data.resize(slot_bytes ? slot_bytes : 64 * 1024);
+        free_.push_back(i);
+    }
+    worker_ = std::thread([this] { Worker(); });
+}
+
+AsyncSha256::~AsyncSha256() {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        done_ = true;
+    }
+    cv_.notify_all();
+    if (worker_.joinable()) worker_.join();
+}
+
+void AsyncSha256::Update(std::span<const std::uint8_t> in) {
+    while (!in.empty()) {
+        if (!have_cur_) {
+            std::unique_lock<std::mutex> lk(mu_);
+            cv_.wait(lk, [this] { return !free_.empty(); });
+            cur_ = free_.front();
+            free_.pop_front();
+            slots_[cur_].len = 0;
+            have_cur_ = true;
+        }
+
+        Slot& s = slots_[cur_];
+        const size_t take = std::min(in.size(), s.data.size() - s.len);
+        std::memcpy(s.data.data() + s.len, in.data(), take);
+        s.len += take;
+        in = in.subspan(take);
+
+        if (s.len == s.data.size()) Submit();
+    }
+}
+
+void AsyncSha256::Submit() {
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        queued_.push_back(cur_);
+    }
+    have_cur_ = false;
+    cv_.notify_all();
+}
+
+void AsyncSha256::Worker() {
+    while (true) {
+        size_t idx = 0;
+        {
+            std::unique_lock<std::mutex> lk(mu_);
+            cv_.wait(lk, [this] { return done_ || !queued_.empty(); });
+            if (queued_.empty()) return;
+            idx = queued_.front();
+        }
+
+        ctx_.Update({slots_[idx].data.data(), slots_[idx].len});
+
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            queued_.pop_front();
+            free_.push_back(idx);
+        }
+        cv_.notify_all();
+    }
+}
+
+Sha256Digest AsyncSha256::Finish() {
+    if (have_cur_) Submit();
+    {
+        std::unique_lock<std::mutex> lk(mu_);
+        cv_.wait(lk, [this] { return queued_.empty(); });
+    }
+    return ctx_.Final();
+}
+
+Sha256Reader::Sha256Reader(std::unique_ptr<IReader> inner, Sha256Digest expected)
+    : inner_(std::move(inner)), expected_(expected) {}
+
+ssize_t Sha256Reader::Read(std::span<std::uint8_t> out) {
+    const ssize_t n = inner_->Read(out);
+    if (n > 0) hasher_.Update({out.data(), static_cast<size_t>(n)});
+    return n;
+}
+
+std::optional<std::uint64_t> Sha256Reader::TotalSize() const {
+    return inner_ ? inner_->TotalSize() : std::nullopt;
+}
+
+Result Sha256Reader::Verify() {
+    std::vector<std::uint8_t> scratch(64 * 1024);
+    while (true) {
+        const ssize_t n = Read(scratch);
+        if (n == 0) break;
+        if (n < 0) return Result::Fail(errno, "Read failed while draining for sha256");
+    }
+
+    const Sha256Digest got = hasher_.Finish();
+    if (got != expected_) {
+        return Result::Fail(EBADMSG,
+            "sha256 mismatch: expected " + Sha256::ToHex(expected_) + ", got " + Sha256::ToHex(got));
+    }
+    return Result::Ok();
+}
+
+} // namespace flash
@@ -0,0 +1,296 @@
+// sparse_image_writer.cpp - Streaming Android sparse image (simg) decoder.
+
+#include "flash/sparse_image_writer.hpp"
+
+#include "flash/crc32.hpp"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+namespace flash {
+
+namespace {
+
+constexpr std::size_t kFileHeaderBytes = 28;
+constexpr std::size_t kChunkHeaderBytes = 12;
+
+constexpr std::uint16_t kChunkRaw = 0xCAC1;
+constexpr std::uint16_t kChunkFill = 0xCAC2;
+constexpr std::uint16_t kChunkDontCare = 0xCAC3;
+constexpr std::uint16_t kChunkCrc32 = 0xCAC4;
+
+std::uint16_t Le16(const std::uint8_t* p) {
+    return static_cast<std::uint16_t>(p[0] | (p[1] << 8));
+}
+
+std::uint32_t Le32(const std::uint8_t* p) {
+    return static_cast<std::uint32_t>(p[0]) | (static_cast<std::uint32_t>(p[1]) << 8) |
+           (static_cast<std::uint32_t>(p[2]) << 16) | (static_cast<std::uint32_t>(p[3]) << 24);
+}
+
+Result Bad(const std::string& msg) {
+    return Result::Fail(EBADMSG, "sparse image: " + msg);
+}
+
+} // namespace
+
+void SparseImageWriter::Enter(State s, std::size_t need) {
+    acc_len_ = 0;
+    acc_need_ = need;
+    if (skip_in_ > 0) {
+        next_ = s;
+        state_ = State::SkipHeader;
+    } else {
+        state_ = s;
+    }
+}
+
+Result SparseImageWriter::StartPassthrough() {
+    state_ = State::Passthrough;
+    const std::size_t n = acc_len_;
+    acc_len_ = 0;
+    if (n == 0) return Result::Ok();
+    return inner_.WriteAll({acc_.data(), n});
+}
+
+// CRC32 of `len` zero bytes appended to crc_, in O(log len) combines.
+void SparseImageWriter::CrcZeros(std::uint64_t len) {
+    static const std::uint8_t kZero = 0;
+    uLong pow_crc = ::crc32(0L, &kZero, 1);  // crc of 2^k zero bytes
+    std::uint64_t pow_len = 1;
+    uLong zeros = 0;
+    std::uint64_t zeros_len = 0;
+    while (len > 0) {
+        if (len & 1) {
+            zeros = ::crc32_combine(zeros, pow_crc, static_cast<z_off_t>(pow_len));
+            zeros_len += pow_len;
+        }
+        len >>= 1;
+        if (len > 0) {
+            pow_crc = ::crc32_combine(pow_crc, pow_crc, static_cast<z_off_t>(pow_len));
+            pow_len <<= 1;
+        }
+    }
+    if (zeros_len > 0) {
+        crc_ = static_cast<std::uint32_t>(::crc32_combine(crc_, zeros, static_cast<z_off_t>(zeros_len)));
+    }
+}
+
+Result SparseImageWriter::OnFileHeader() {
+    const std::uint8_t* h = acc_.data();
+    const std::uint16_t major = Le16(h + 4);
+    const std::uint16_t file_hdr_sz = Le16(h + 8);
+    chunk_hdr_sz_ = Le16(h + 10);
+    blk_sz_ = Le32(h + 12);
+    total_blks_ = Le32(h + 16);
+    total_chunks_ = Le32(h + 20);
+
+    if (major != 1) return Bad("unsupported major version " + std::to_string(major));
+    if (file_hdr_sz < kFileHeaderBytes || chunk_hdr_sz_ < kChunkHeaderBytes) {
+        return Bad("bad header sizes");
+    }
+    if (blk_sz_ == 0 || blk_sz_ % 4 != 0) return Bad("bad block size " + std::to_string(blk_sz_));
+
+    skip_in_ = file_hdr_sz - kFileHeaderBytes;
+    if (total_chunks_ == 0) {
+        Enter(State::Done);
+        return blks_done_ == total_blks_ ? Result::Ok() : Bad("no chunks");
+    }
+    Enter(State::ChunkHeader, kChunkHeaderBytes);
+    return Result::Ok();
+}
+
+Result SparseImageWriter::OnChunkHeader() {
+    const std::uint8_t* h = acc_.data();
+    chunk_type_ = Le16(h);
+    const std::uint32_t chunk_sz = Le32(h + 4);
+    const std::uint32_t total_sz = Le32(h + 8);
+    const std::uint64_t body = total_sz >= chunk_hdr_sz_ ? total_sz - chunk_hdr_sz_ : ~0ULL;
+
+    chunk_bytes_ = static_cast<std::uint64_t>(chunk_sz) * blk_sz_;
+    if (blks_done_ + chunk_sz > total_blks_) return Bad("chunks exceed the declared block count");
+    skip_in_ = chunk_hdr_sz_ - kChunkHeaderBytes;
+
+    switch (chunk_type_) {
+    case kChunkRaw:
+        if (body != chunk_bytes_) return Bad("RAW chunk size mismatch");
+        raw_left_ = chunk_bytes_;
+        Enter(State::RawData);
+        if (raw_left_ == 0 && state_ == State::RawData) return EndChunk();
+        return Result::Ok();
+    case kChunkFill:
+        if (body != 4) return Bad("FILL chunk size mismatch");
+        Enter(State::FillValue, 4);
+        return Result::Ok();
+    case kChunkCrc32:
+        if (body != 4) return Bad("CRC32 chunk size mismatch");
+        Enter(State::Crc, 4);
+        return Result::Ok();
+    case kChunkDontCare: {
+        if (body != 0) return Bad("DONT_CARE chunk size mismatch");
+        auto r = inner_.Skip(chunk_bytes_);
+        if (!r.is_ok()) return r;
+        skipped_ += chunk_bytes_;
+        CrcZeros(chunk_bytes_);
+        return EndChunk();
+    }
+    default: {
+        char buf[16];
+        std::snprintf(buf, sizeof(buf), "0x%04x", chunk_type_);
+        return Bad(std::string("unknown chunk type ") + buf);
+    }
+    }
+}
+
+Result SparseImageWriter::OnFillValue() {
+    const std::uint32_t value = Le32(acc_.data());
+    if (value == 0) {
+        auto r = inner_.WriteZeroes(chunk_bytes_);
+        if (!r.is_ok()) return r;
+        CrcZeros(chunk_bytes_);
+        return EndChunk();
+    }
+
+    if (fill_.empty()) fill_.resize(64 * 1024);
+    for (std::size_t i = 0; i < fill_.size(); i += 4) std::memcpy(fill_.data() + i, acc_.data(), 4);
+
+    std::uint64_t left = chunk_bytes_;
+    while (left > 0) {
+        const auto n = static_cast<std::size_t>(std::min<std::uint64_t>(left, fill_.size()));
+        auto r = inner_.WriteAll({fill_.data(), n});
+        if (!r.is_ok()) return r;
+        crc_ = Crc32(crc_, {fill_.data(), n});
+        left -= n;
+    }
+    return EndChunk();
+}
+
+Result SparseImageWriter::OnCrc() {
+    const std::uint32_t expected = Le32(acc_.data());
+    if (expected != crc_) {
+        char buf[64];
+        std::snprintf(buf, sizeof(buf), "crc32 mismatch: expected %08x, got %08x", expected, crc_);
+        return Bad(buf);
+    }
+    return EndChunk();
+}
+
+Result SparseImageWriter::EndChunk() {
+    if (chunk_type_ != kChunkCrc32) blks_done_ += chunk_bytes_ / blk_sz_;
+    if (++chunks_done_ == total_chunks_) {
+        Enter(State::Done);
+        if (blks_done_ != total_blks_) return Bad("chunks do not cover the declared block count");
+        return Result::Ok();
+    }
+    Enter(State::ChunkHeader, kChunkHeaderBytes);
+    return Result::Ok();
+}
+
+Result SparseImageWriter::Dispatch() {
+    switch (state_) {
+    case State::Detect:      return OnFileHeader();
+    case State::ChunkHeader: return OnChunkHeader();
+    case State::FillValue:   return OnFillValue();
+    case State::Crc:         return OnCrc();
+    default:                 return Result::Ok();
+    }
+}
+
+Result SparseImageWriter::WriteAll(std::span<const std::uint8_t> in) {
+    if (state_ == State::Detect && acc_need_ == 0) acc_need_ = kFileHeaderBytes;
+
+    while (!in.empty()) {
+        switch (state_) {
+        case State::Passthrough:
+            return inner_.WriteAll(in);
+
+        case State::Done:
+            return Bad("trailing data after the last chunk");
+
+        case State::SkipHeader: {
+            const auto take = static_cast<std::size_t>(std::min<std::uint64_t>(skip_in_, in.size()));
+            skip_in_ -= take;
+            in = in.subspan(take);
+            if (skip_in_ == 0) {
+                state_ = next_;
+                if (state_ == State::RawData && raw_left_ == 0) {
+                    auto r = EndChunk();
+                    if (!r.is_ok()) return r;
+                }
+            }
+            break;
+        }
+
+        case State::RawData: {
+            const auto take = static_cast<std::size_t>(std::min<std::uint64_t>(raw_left_, in.size()));
+            auto r = inner_.WriteAll(in.first(take));
+            if (!r.is_ok()) return r;
+            crc_ = Crc32(crc_, in.first(take));
+            raw_left_ -= take;
+            in = in.subspan(take);
+            if (raw_left_ == 0) {
+                r = EndChunk();
+                if (!r.is_ok()) return r;
+            }
+            break;
+        }
+
+        default: {
+            const std::size_t take = std::min(acc_need_ - acc_len_, in.size());
+            std::memcpy(acc_.data() + acc_len_, in.data(), take);
+            acc_len_ += take;
+            in = in.subspan(take);
+
+            if (state_ == State::Detect && acc_len_ >= 4 && Le32(acc_.data()) != kMagic) {
+                auto r = StartPassthrough();
+                if (!r.is_ok()) return r;
+                break;
+            }
+            if (acc_len_ == acc_need_) {
+                auto r = Dispatch();
+                if (!r.is_ok()) return r;
+            }
+            break;
+        }
+        }
+    }
+    return Result::Ok();
+}
+
+Result SparseImageWriter::FsyncNow() {
+    // A stream shorter than the magic cannot be a sparse image.
+    if (state_ == State::Detect && acc_len_ < 4) {
+        auto r = StartPassthrough();
+        if (!r.is_ok()) return r;
+    }
+    return inner_.FsyncNow();
+}
+
+Result SparseImageWriter::FsyncAsync() {
+    return inner_.FsyncAsync();
+}
+
+Result SparseImageWriter::Finish() {
+    switch (state_) {
+    case State::Detect:
+        if (acc_len_ < 4) return StartPassthrough();
+        return Bad("truncated file header");
+    case State::Passthrough:
+        return Result::Ok();
+    case State::Done:
+        return Result::Ok();
+    case State::SkipHeader:
+        if (next_ == State::Done) return Result::Ok();
+        [[fallthrough]];
+    default:
+        return Bad("truncated after " + std::to_string(chunks_done_) + " of " +
+                   std::to_string(total_chunks_) + " chunks");
+    }
+}
+
+} // namespace flash
@@ -0,0 +1,417 @@
+// tree_writer.cpp - dirfd-relative tree extraction with a worker pool (see tree_writer.hpp).
+
+#include "flash/tree_writer.hpp"
+
+#include "flash/partition_writer.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace flash {
+
+namespace {
+
+// Queued entries hold their parent directory's fd, so both limits also
+// bound the number of open descriptors.
+constexpr std::size_t kMaxQueued = 256;
+constexpr std::size_t kMaxOpenDirs = 128;
+
+Result Errno(const char* what, const std::string& rel) {
+    const int err = errno;
+    return Result::Fail(err, std::string(what) + " " + rel + " failed (" + std::strerror(err) + ")");
+}
+
+// unlink() that also takes empty directories, as ARCHIVE_EXTRACT_UNLINK does.
+int RemoveAt(int dir, const char* name) {
+    if (::unlinkat(dir, name, 0) == 0) return 0;
+    if (errno == EISDIR || errno == EPERM) return ::unlinkat(dir, name, AT_REMOVEDIR);
+    return -1;
+}
+
+void Times(const TreeEntryMeta& m, timespec ts[2]) {
+    ts[0] = m.has_atime ? m.atime : timespec{0, UTIME_NOW};
+    ts[1] = m.has_mtime ? m.mtime : timespec{0, UTIME_OMIT};
+}
+
+// Owners are not restored, so set-id bits only survive when the extracting
+// user already matches.
+mode_t PermBits(const TreeEntryMeta& m, uid_t euid, gid_t egid) {
+    mode_t perm = m.mode & 07777;
+    if (m.uid != static_cast<std::int64_t>(euid)) perm &= ~S_ISUID;
+    if (m.gid != static_cast<std::int64_t>(egid)) perm &= ~S_ISGID;
+    return perm;
+}
+
+Result CreateFile(int dir, const std::string& name, const std::string& rel, mode_t perm, Fd& out) {
+    const int flags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC;
+    int fd = ::openat(dir, name.c_str(), flags, perm & 0777);
+    if (fd < 0 && errno == EEXIST) {
+        if (RemoveAt(dir, name.c_str()) != 0 && errno != ENOENT) return Errno("unlink", rel);
+        fd = ::openat(dir, name.c_str(), flags, perm & 0777);
+    }
+    if (fd < 0) return Errno("create", rel);
+    out.Reset(fd);
+    return Result::Ok();
+}
+
+Result WriteAt(int fd, std::span<const std::uint8_t> data, std::int64_t offset, const std::string& rel) {
+    while (!data.empty()) {
+        const ssize_t n = ::pwrite(fd, data.data(), data.size(), static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return Errno("write", rel);
+        data = data.subspan(static_cast<std::size_t>(n));
+        offset += n;
+    }
+    return Result::Ok();
+}
+
+// Size (sparse tails), mode when the umask got in the way, and times.
+Result FinishFile(Fd& fd, const std::string& rel, const TreeEntryMeta& m, std::int64_t end, mode_t perm,
+                  mode_t umask) {
+    if (m.size > end && ::ftruncate(fd.Get(), static_cast<off_t>(m.size)) != 0) return Errno("truncate", rel);
+    if (((perm & 0777) & ~umask) != perm && ::fchmod(fd.Get(), perm) != 0) return Errno("chmod", rel);
+    if (m.has_mtime || m.has_atime) {
+        timespec ts[2];
+        Times(m, ts);
+        if (::futimens(fd.Get(), ts) != 0) return Errno("utimens", rel);
+    }
+    fd.Close();
+    return Result::Ok();
+}
+
+} // namespace
+
+Result TreeWriter::Open(const std::string& root, Options opt, std::unique_ptr<TreeWriter>& out) {
+    std::unique_ptr<TreeWriter> w(new TreeWriter());
+    const int fd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return Errno("open", root);
+
+    w->opt_ = opt;
+    w->root_ = std::make_shared<Fd>(fd);
+    w->dirs_.emplace("", w->root_);
+    w->umask_ = ::umask(0);
+    ::umask(w->umask_);
+    w->euid_ = ::geteuid();
+    w->egid_ = ::getegid();
+
+    const unsigned workers = opt.workers ? opt.workers : ThreadPool::DefaultThreads();
+    if (workers > 1) w->pool_ = std::make_unique<ThreadPool>(workers);
+    out = std::move(w);
+    return Result::Ok();
+}
+
+TreeWriter::~TreeWriter() {
+    // Abandoned mid-archive: let queued entries drop out quickly.
+    failed_.store(true);
+    pool_.reset();
+}
+
+void TreeWriter::Fail(Result r) {
+    std::lock_guard<std::mutex> lk(mu_);
+    if (error_.is_ok()) error_ = std::move(r);
+    failed_.store(true);
+}
+
+Result TreeWriter::Failed() {
+    if (!failed_.load(std::memory_order_relaxed)) return Result::Ok();
+    std::lock_guard<std::mutex> lk(mu_);
+    return error_;
+}
+
+void TreeWriter::WaitFor(const std::string& rel) {
+    if (!pool_) return;
+    std::unique_lock<std::mutex> lk(mu_);
+    cv_.wait(lk, [&] { return pending_.count(rel) == 0; });
+}
+
+void TreeWriter::Drain() {
+    if (!pool_) return;
+    std::unique_lock<std::mutex> lk(mu_);
+    cv_.wait(lk, [&] { return queued_ == 0; });
+}
+
+void TreeWriter::Submit(const std::string& rel, std::size_t bytes, std::function<Result()> work) {
+    if (!pool_) {
+        auto r = work();
+        if (!r.is_ok()) Fail(std::move(r));
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lk(mu_);
+        cv_.wait(lk, [&] {
+            return queued_ == 0 || (queued_ < kMaxQueued && buffered_bytes_ + bytes <= opt_.max_buffered_bytes);
+        });
+        ++queued_;
+        buffered_bytes_ += bytes;
+        pending_.insert(rel);
+    }
+    pool_->Submit([this, rel, bytes, work = std::move(work)] {
+        if (!failed_.load(std::memory_order_relaxed)) {
+            auto r = work();
+            if (!r.is_ok()) Fail(std::move(r));
+        }
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            --queued_;
+            buffered_bytes_ -= bytes;
+            pending_.erase(pending_.find(rel));
+        }
+        cv_.notify_all();
+    });
+}
+
+// Something is about to be created at `rel`. If that replaces a directory
+// this tree already used, everything queued below it must land first and
+// its cached fd and deferred metadata go away.
+void TreeWriter::PrepareReplace(const std::string& rel) {
+    WaitFor(rel);
+    if (made_dirs_.count(rel) == 0) return;
+
+    Drain();
+    const std::string prefix = rel + "/";
+    auto under = [&](const std::string& p) { return p == rel || p.compare(0, prefix.size(), prefix) == 0; };
+    for (auto it = dirs_.begin(); it != dirs_.end();) it = under(it->first) ? dirs_.erase(it) : std::next(it);
+    for (auto it = made_dirs_.begin(); it != made_dirs_.end();) it = under(*it) ? made_dirs_.erase(it) : std::next(it);
+    dir_meta_.erase(std::remove_if(dir_meta_.begin(), dir_meta_.end(), [&](const DirMeta& d) { return under(d.rel); }),
+                    dir_meta_.end());
+}
+
+Result TreeWriter::ParentDir(const std::string& rel, std::shared_ptr<Fd>& dir, std::string& name) {
+    const auto slash = rel.rfind('/');
+    if (slash == std::string::npos) {
+        dir = root_;
+        name = rel;
+        return Result::Ok();
+    }
+    name = rel.substr(slash + 1);
+    return OpenDir(rel.substr(0, slash), dir);
+}
+
+// Opens (creating if needed) the directory `rel`, one component at a time
+// and never through a symlink.
+Result TreeWriter::OpenDir(const std::string& rel, std::shared_ptr<Fd>& out) {
+    if (auto it = dirs_.find(rel); it != dirs_.end()) {
+        out = it->second;
+        return Result::Ok();
+    }
+
+    std::shared_ptr<Fd> parent;
+    std::string name;
+    auto r = ParentDir(rel, parent, name);
+    if (!r.is_ok()) return r;
+    WaitFor(rel);
+
+    const int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    int fd = ::openat(parent->Get(), name.c_str(), flags);
+    if (fd < 0 && (errno == ENOTDIR || errno == ELOOP)) {
+        // A file or symlink where the archive needs a directory.
+        if (RemoveAt(parent->Get(), name.c_str()) != 0) return Errno("unlink", rel);
+        errno = ENOENT;
+    }
+    if (fd < 0 && errno == ENOENT) {
+        if (::mkdirat(parent->Get(), name.c_str(), 0755 & ~umask_) != 0 && errno != EEXIST) return Errno("mkdir", rel);
+        fd = ::openat(parent->Get(), name.c_str(), flags);
+    }
+    if (fd < 0) return Errno("open", rel);
+
+    if (dirs_.size() >= kMaxOpenDirs) {
+        dirs_.clear();
+        dirs_.emplace("", root_);
+    }
+    made_dirs_.insert(rel);
+    out = std::make_shared<Fd>(fd);
+    dirs_.emplace(rel, out);
+    return Result::Ok();
+}
+
+Result TreeWriter::Directory(const std::string& rel, const TreeEntryMeta& m) {
+    if (auto r = Failed(); !r.is_ok()) return r;
+    WaitFor(rel);
+    if (made_dirs_.count(rel) == 0) {
+        std::shared_ptr<Fd> parent;
+        std::string name;
+        auto r = ParentDir(rel, parent, name);
+        if (!r.is_ok()) return r;
+
+        // Owner-writable until Finish() applies the real mode.
+        if (::mkdirat(parent->Get(), name.c_str(), 0700) != 0) {
+            if (errno != EEXIST) return Errno("mkdir", rel);
+            struct stat st {};
+            if (::fstatat(parent->Get(), name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) return Errno("stat", rel);
+            if (!S_ISDIR(st.st_mode)) {
+                if (RemoveAt(parent->Get(), name.c_str()) != 0) return Errno("unlink", rel);
+                if (::mkdirat(parent->Get(), name.c_str(), 0700) != 0) return Errno("mkdir", rel);
+            }
+        }
+        made_dirs_.insert(rel);
+    }
+    dir_meta_.push_back({rel, m});
+    return Result::Ok();
+}
+
+Result TreeWriter::Symlink(const std::string& rel, const std::string& target, const TreeEntryMeta& m) {
+    if (auto r = Failed(); !r.is_ok()) return r;
+    PrepareReplace(rel);
+    std::shared_ptr<Fd> dir;
+    std::string name;
+    auto r = ParentDir(rel, dir, name);
+    if (!r.is_ok()) return r;
+
+    Submit(rel, 0, [dir, name, rel, target, m]() -> Result {
+        if (::symlinkat(target.c_str(), dir->Get(), name.c_str()) != 0) {
+            if (errno != EEXIST) return Errno("symlink", rel);
+            if (RemoveAt(dir->Get(), name.c_str()) != 0) return Errno("unlink", rel);
+            if (::symlinkat(target.c_str(), dir->Get(), name.c_str()) != 0) return Errno("symlink", rel);
+        }
+        if (m.has_mtime) {
+            timespec ts[2];
+            Times(m, ts);
+            (void)::utimensat(dir->Get(), name.c_str(), ts, AT_SYMLINK_NOFOLLOW);
+        }
+        return Result::Ok();
+    });
+    return Result::Ok();
+}
+
+Result TreeWriter::Hardlink(const std::string& rel, const std::string& target_rel) {
+    if (auto r = Failed(); !r.is_ok()) return r;
+    PrepareReplace(rel);
+    WaitFor(target_rel);
+
+    std::shared_ptr<Fd> tdir, dir;
+    std::string tname, name;
+    auto r = ParentDir(target_rel, tdir, tname);
+    if (r.is_ok()) r = ParentDir(rel, dir, name);
+    if (!r.is_ok()) return r;
+
+    if (::linkat(tdir->Get(), tname.c_str(), dir->Get(), name.c_str(), 0) != 0) {
+        if (errno != EEXIST) return Errno("link", rel);
+        if (RemoveAt(dir->Get(), name.c_str()) != 0) return Errno("unlink", rel);
+        if (::linkat(tdir->Get(), tname.c_str(), dir->Get(), name.c_str(), 0) != 0) return Errno("link", rel);
+    }
+    return Result::Ok();
+}
+
+Result TreeWriter::Special(const std::string& rel, const TreeEntryMeta& m) {
+    if (auto r = Failed(); !r.is_ok()) return r;
+    PrepareReplace(rel);
+    std::shared_ptr<Fd> dir;
+    std::string name;
+    auto r = ParentDir(rel, dir, name);
+    if (!r.is_ok()) return r;
+
+    const mode_t perm = PermBits(m, euid_, egid_);
+    Submit(rel, 0, [dir, name, rel, m, perm]() -> Result {
+        const mode_t type = m.mode & S_IFMT;
+        if (::mknodat(dir->Get(), name.c_str(), type | 0600, m.rdev) != 0) {
+            if (errno != EEXIST) return Errno("mknod", rel);
+            if (RemoveAt(dir->Get(), name.c_str()) != 0) return Errno("unlink", rel);
+            if (::mknodat(dir->Get(), name.c_str(), type | 0600, m.rdev) != 0) return Errno("mknod", rel);
+        }
+        if (::fchmodat(dir->Get(), name.c_str(), perm, 0) != 0) return Errno("chmod", rel);
+        timespec ts[2];
+        Times(m, ts);
+        if (::utimensat(dir->Get(), name.c_str(), ts, AT_SYMLINK_NOFOLLOW) != 0) return Errno("utimens", rel);
+        return Result::Ok();
+    });
+    return Result::Ok();
+}
+
+Result TreeWriter::BeginFile(const std::string& rel, const TreeEntryMeta& m) {
+    if (auto r = Failed(); !r.is_ok()) return r;
+    PrepareReplace(rel);
+
+    auto job = std::make_unique<FileJob>();
+    auto r = ParentDir(rel, job->dir, job->name);
+    if (!r.is_ok()) return r;
+    job->rel = rel;
+    job->meta = m;
+    job->perm = PermBits(m, euid_, egid_);
+
+    const bool queue = pool_ && m.size >= 0 && static_cast<std::uint64_t>(m.size) <= opt_.small_file_bytes;
+    if (queue) {
+        job->data.reserve(static_cast<std::size_t>(m.size));
+    } else {
+        r = CreateFile(job->dir->Get(), job->name, rel, job->perm, job->fd);
+        if (!r.is_ok()) return r;
+        if (opt_.preallocate && !m.sparse && m.size > 0 && static_cast<std::uint64_t>(m.size) > opt_.small_file_bytes) {
+            r = PartitionWriter::Preallocate(job->fd.Get(), static_cast<std::uint64_t>(m.size));
+            if (!r.is_ok()) return Result::Fail(r.err, rel + ": " + r.msg);
+        }
+    }
+    cur_ = std::move(job);
+    return Result::Ok();
+}
+
+Result TreeWriter::FileData(std::span<const std::uint8_t> data, std::int64_t offset) {
+    FileJob& job = *cur_;
+    job.end = std::max(job.end, offset + static_cast<std::int64_t>(data.size()));
+    if (job.fd.Valid()) return WriteAt(job.fd.Get(), data, offset, job.rel);
+
+    job.segments.push_back({offset, job.data.size(), data.size()});
+    job.data.insert(job.data.end(), data.begin(), data.end());
+    if (job.data.size() <= opt_.small_file_bytes) return Result::Ok();
+
+    // Bigger than its header said; write it here instead.
+    auto r = CreateFile(job.dir->Get(), job.name, job.rel, job.perm, job.fd);
+    for (const Segment& s : job.segments) {
+        if (!r.is_ok()) break;
+        r = WriteAt(job.fd.Get(), {job.data.data() + s.pos, s.len}, s.offset, job.rel);
+    }
+    job.data = {};
+    job.segments.clear();
+    return r;
+}
+
+Result TreeWriter::EndFile() {
+    std::shared_ptr<FileJob> job(std::move(cur_));
+    if (job->fd.Valid()) {
+        files_.fetch_add(1, std::memory_order_relaxed);
+        return FinishFile(job->fd, job->rel, job->meta, job->end, job->perm, umask_);
+    }
+
+    const std::size_t bytes = job->data.size();
+    const mode_t umask = umask_;
+    Submit(job->rel, bytes, [this, job, umask]() -> Result {
+        auto r = CreateFile(job->dir->Get(), job->name, job->rel, job->perm, job->fd);
+        for (const Segment& s : job->segments) {
+            if (!r.is_ok()) return r;
+            r = WriteAt(job->fd.Get(), {job->data.data() + s.pos, s.len}, s.offset, job->rel);
+        }
+        if (r.is_ok()) r = FinishFile(job->fd, job->rel, job->meta, job->end, job->perm, umask);
+        job->data = {};
+        if (r.is_ok()) files_.fetch_add(1, std::memory_order_relaxed);
+        return r;
+    });
+    return Failed();
+}
+
+Result TreeWriter::Finish() {
+    Drain();
+    if (auto r = Failed(); !r.is_ok()) return r;
+
+    // In reverse order every directory comes before its parent, so modes
+    // that deny writing land last; of duplicates the last entry wins.
+    std::stable_sort(dir_meta_.begin(), dir_meta_.end(),
+                     [](const DirMeta& a, const DirMeta& b) { return a.rel > b.rel; });
+    for (const DirMeta& d : dir_meta_) {
+        std::shared_ptr<Fd> dir;
+        auto r = OpenDir(d.rel, dir);
+        if (!r.is_ok()) return r;
+        if (::fchmod(dir->Get(), PermBits(d.meta, euid_, egid_)) != 0) return Errno("chmod", d.rel);
+        if (d.meta.has_mtime || d.meta.has_atime) {
+            timespec ts[2];
+            Times(d.meta, ts);
+            if (::futimens(dir->Get(), ts) != 0) return Errno("utimens", d.rel);
+        }
+    }
+    dir_meta_.clear();
+    return Result::Ok();
+}
+
+} // namespace flash
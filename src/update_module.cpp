@@ -1,14 +1,35 @@
 #include "flash/update_module.hpp"
 
-#include "flash/gzip_reader.hpp"
+#include "flash/aligned_buffer.hpp"
+#include "flash/decompress.hpp"
+#include "flash/flasher.hpp"
+#include "flash/io_uring_writer.hpp"
 #include "flash/logger.hpp"
 #include "flash/partition_writer.hpp"
 #include "flash/archive_installer.hpp"
-
+#include "flash/compare_writer.hpp"
+#include "flash/delta.hpp"
+#include "flash/durability.hpp"
+#include "flash/chunk_hashes.hpp"
+#include "flash/fd.hpp"
+#include "flash/gzip_reader.hpp"
+#include "flash/install_journal.hpp"
+#include "flash/sha256.hpp"
+#include "flash/signals.hpp"
+#include "flash/sparse_image_writer.hpp"
+#include "flash/spsc_ring.hpp"
+#include "flash/zero_skip_writer.hpp"
+
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <cstring>
 #include <filesystem>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <thread>
 #include <unistd.h>
 #include <vector>
 
@@ -16,15 +37,50 @@ namespace flash {
 
 namespace {
 
-static bool EndsWithGz(const std::string& s) {
-    return s.size() >= 3 && s.compare(s.size() - 3, 3, ".gz") == 0;
+// End of a component's byte stream: writers always write out what they
+// staged; the bottom writer skips the fsync itself under DurabilityMode::Final.
+Result FinalFlush(IWriter& w, DurabilityPolicy& policy) {
+    if (!policy.ComponentFlushes()) return w.FsyncNow();
+    return policy.Timed([&] { return w.FsyncNow(); });
 }
 
+// Resume points are whole MiBs, so an O_DIRECT writer can skip to them.
+constexpr std::uint64_t kResumeAlign = 1024 * 1024;
+
 static bool IsDevPath(std::string_view s) {
     return s.rfind("/dev/", 0) == 0;
 }
 
-// Counts bytes read from the *bundle entry stream* (compressed bytes if the entry is .gz).
+// Size of `path` if it is a block device; false otherwise.
+static bool BlockDeviceSize(const std::string& path, std::uint64_t& out) {
+    struct stat st {};
+    if (::stat(path.c_str(), &st) != 0 || !S_ISBLK(st.st_mode)) return false;
+    Fd fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd.Get() < 0) return false;
+    return ::ioctl(fd.Get(), BLKGETSIZE64, &out) == 0;
+}
+
+// Moves `r` forward by `n` bytes: a seek when the bytes need not be seen,
+// reading (and, through a Sha256Reader, hashing) them otherwise.
+static Result SkipInput(IReader& r, std::uint64_t n) {
+    if (r.Seekable()) {
+        const std::int64_t at = r.Seek(0, SEEK_CUR);
+        if (at >= 0 && r.Seek(static_cast<std::int64_t>(n), SEEK_CUR) == at + static_cast<std::int64_t>(n)) {
+            return Result::Ok();
+        }
+        if (at < 0 || r.Seek(at, SEEK_SET) != at) return Result::Fail(errno, "Seek failed in payload");
+    }
+    std::vector<std::uint8_t> buf(1024 * 1024);
+    while (n > 0) {
+        const ssize_t got = r.Read({buf.data(), static_cast<std::size_t>(std::min<std::uint64_t>(n, buf.size()))});
+        if (got < 0) return Result::Fail(errno, "Read failed while skipping");
+        if (got == 0) return Result::Fail(EBADMSG, "payload ends before the resume offset");
+        n -= static_cast<std::uint64_t>(got);
+    }
+    return Result::Ok();
+}
+
+// Counts bytes read from the *bundle entry stream* (compressed bytes for compressed entries).
 class CountingReader final : public IReader {
 public:
     CountingReader(std::unique_ptr<IReader> inner, std::uint64_t* counter)
@@ -40,11 +96,56 @@ public:
         return inner_ ? inner_->TotalSize() : std::nullopt;
     }
 
+    bool KernelSource(FdSource& out) override { return inner_->KernelSource(out); }
+    void Consumed(std::uint64_t n) override {
+        if (counter_) *counter_ += n;
+        inner_->Consumed(n);
+    }
+
+    // Bytes seeked over count as read.
+    bool Seekable() const override { return inner_->Seekable(); }
+    std::int64_t Seek(std::int64_t offset, int whence) override {
+        const std::int64_t from = inner_->Seek(0, SEEK_CUR);
+        const std::int64_t to = inner_->Seek(offset, whence);
+        if (counter_ && from >= 0 && to >= 0) *counter_ += static_cast<std::uint64_t>(to - from);
+        return to;
+    }
+
 private:
     std::unique_ptr<IReader> inner_;
     std::uint64_t* counter_ = nullptr;
 };
 
+// Counts bytes accepted by the wrapped writer (for throughput reporting).
+class CountingWriter final : public IWriter {
+public:
+    explicit CountingWriter(IWriter& inner) : inner_(inner) {}
+
+    Result WriteAll(std::span<const std::uint8_t> in) override {
+        auto r = inner_.WriteAll(in);
+        if (r.is_ok()) written_ += in.size();
+        return r;
+    }
+    Result FsyncNow() override { return inner_.FsyncNow(); }
+    Result FsyncAsync() override { return inner_.FsyncAsync(); }
+    Result WriteZeroes(std::uint64_t len) override {
+        auto r = inner_.WriteZeroes(len);
+        if (r.is_ok()) written_ += len;
+        return r;
+    }
+    Result Skip(std::uint64_t len) override {
+        auto r = inner_.Skip(len);
+        if (r.is_ok()) written_ += len;
+        return r;
+    }
+
+    std::uint64_t Written() const { return written_; }
+
+private:
+    IWriter& inner_;
+    std::uint64_t written_ = 0;
+};
+
 static void EmitProgress(const UpdateModule::Options& opt,
                          const char* tag,
                          std::uint64_t in_done,
@@ -56,7 +157,9 @@ static void EmitProgress(const UpdateModule::Options& opt,
         const int comp_pct = static_cast<int>((in_done * 100ULL) / opt.component_total_bytes);
 
         if (opt.overall_total_bytes > 0) {
-            const std::uint64_t overall_done = opt.overall_done_base_bytes + in_done;
+            const std::uint64_t overall_done = opt.overall_done_bytes
+                                                   ? opt.overall_done_bytes->load(std::memory_order_relaxed)
+                                                   : opt.overall_done_base_bytes + in_done;
             const int ota_pct = static_cast<int>((overall_done * 100ULL) / opt.overall_total_bytes);
 
             LogInfo("[%s] %s OTA:%d%% COMP:%d%% (in %llu/%llu, out %llu)",
@@ -87,9 +190,13 @@ static void EmitProgress(const UpdateModule::Options& opt,
 
 } // namespace
 
-Result UpdateModule::Execute(const Component& comp, std::unique_ptr<IReader> source, const Options& opt) {
+Result UpdateModule::Execute(const Component& comp, std::unique_ptr<IReader> source, const Options& options) {
     if (!source) return Result::Fail(-1, "Null source reader");
 
+    Options opt = options;
+    DurabilityPolicy default_policy;
+    if (!opt.durability) opt.durability = &default_policy;
+
     const char* tag = comp.name.c_str();
 
     LogInfo("UpdateModule: name=%s type=%s file=%s",
@@ -99,47 +206,299 @@ Result UpdateModule::Execute(const Component& comp, std::unique_ptr<IReader> sou
     std::unique_ptr<IReader> effective_reader =
         std::make_unique<CountingReader>(std::move(source), &in_read);
 
-    if (EndsWithGz(comp.filename)) {
-        try {
-            LogDebug("Wrapping GzipReader for %s", comp.filename.c_str());
-            effective_reader = std::make_unique<GzipReader>(std::move(effective_reader));
-        } catch (const std::exception& e) {
-            return Result::Fail(-1, std::string("Gzip init failed: ") + e.what());
+    // Hash the bundle entry bytes (what sha256sum of `filename` gives) on a worker
+    // thread while the install consumes them.
+    Sha256Reader* digest = nullptr;
+    if (!comp.sha256.empty()) {
+        Sha256Digest expected{};
+        if (!Sha256::ParseHex(comp.sha256, expected)) {
+            return Result::Fail(EINVAL, "Invalid sha256 for component " + comp.name + ": " + comp.sha256);
         }
+        auto hashing = std::make_unique<Sha256Reader>(std::move(effective_reader), expected);
+        digest = hashing.get();
+        effective_reader = std::move(hashing);
+        LogDebug("[%s] sha256 verification enabled (%s)", tag, Sha256::Backend());
+    }
+
+    // The entry's magic bytes pick the decompressor; the manifest can force one
+    // ("none" for an image that merely starts like a compressed stream).
+    Compression forced{};
+    const bool force = !comp.compression.empty() && comp.compression != "auto";
+    if (force && !ParseCompression(comp.compression, forced)) {
+        return Result::Fail(EINVAL, "Unknown compression for component " + comp.name + ": " + comp.compression);
+    }
+    Compression codec{};
+    DecompressOptions dopt;
+    dopt.threads = opt.decompress_threads;
+    dopt.window_bytes = opt.decompress_window_bytes;
+    dopt.inflate_backend = opt.inflate_backend;
+    dopt.xz_memlimit_threading = opt.xz_memlimit_bytes;
+    auto dec = OpenDecompressor(effective_reader, dopt, force ? &forced : nullptr, &codec);
+    if (!dec.is_ok()) return Result::Fail(dec.err, "[" + comp.name + "] " + dec.msg);
+    LogDebug("[%s] payload compression: %s%s", tag, CompressionName(codec), force ? " (manifest)" : "");
+
+    // Resuming in the middle of an image needs payload offsets to be image
+    // offsets, and a decoder that can start there (none, or plain gzip).
+    GzipReader* gzip = codec == Compression::Gzip ? dynamic_cast<GzipReader*>(effective_reader.get()) : nullptr;
+    if (comp.type != "raw" || (codec != Compression::None && !gzip) || opt.compare_before_write) {
+        opt.journal = nullptr;
     }
 
     if (comp.type == "raw") {
-        return InstallRaw(comp, *effective_reader, opt, tag, &in_read);
+        return InstallRaw(comp, *effective_reader, opt, tag, &in_read, digest, opt.journal ? gzip : nullptr);
+    } else if (comp.type == "delta") {
+        return InstallDelta(comp, *effective_reader, opt, tag, &in_read, digest);
     } else if (comp.type == "archive") {
-        return InstallArchive(comp, *effective_reader, opt, tag, &in_read);
+        return InstallArchive(comp, *effective_reader, opt, tag, &in_read, digest);
     } else if (comp.type == "file") {
-        return InstallAtomicFile(comp, *effective_reader, opt, tag, &in_read);
+        return InstallAtomicFile(comp, *effective_reader, opt, tag, &in_read, digest);
     }
 
     return Result::Fail(-1, "Unsupported component type: " + comp.type);
 }
 
 Result UpdateModule::InstallRaw(const Component& comp, IReader& reader, const Options& opt,
-                                const char* tag, const std::uint64_t* in_read) {
+                                const char* tag, const std::uint64_t* in_read, Sha256Reader* digest,
+                                GzipReader* gzip) {
     if (comp.install_to.empty()) {
         return Result::Fail(-1, "install_to empty for raw component: " + comp.name);
     }
+    if (!comp.format.empty() && comp.format != "auto" && comp.format != "raw") {
+        return Result::Fail(EINVAL, "Unknown format for component " + comp.name + ": " + comp.format);
+    }
 
-    PartitionWriter writer;
-    auto res = PartitionWriter::Open(comp.install_to, writer);
+    // Refuse an image that cannot fit before writing any of it.
+    if (comp.installed_size > 0) {
+        std::uint64_t capacity = 0;
+        if (BlockDeviceSize(comp.install_to, capacity) && capacity < comp.installed_size) {
+            return Result::Fail(ENOSPC, comp.install_to + " holds " + std::to_string(capacity) +
+                                            " bytes, image needs " + std::to_string(comp.installed_size));
+        }
+    }
+
+    ChunkHashes chunks;
+    if (auto cr = ChunkHashes::FromComponent(comp, chunks); !cr.is_ok()) return cr;
+
+    // Continue a stored image where a killed run left it: the payload is
+    // skipped (read when it must be hashed), and so is the target.
+    const std::uint64_t resume = opt.journal ? opt.journal->RawOffset(comp.name) : 0;
+    const std::string index_path = gzip ? opt.journal->SidecarPath(comp.name) : std::string();
+    std::size_t index_saved = 0;
+    if (gzip) {
+        GzipIndex index;
+        if (resume == 0) {
+            (void)::unlink(index_path.c_str());
+        } else if (auto lr = GzipIndex::Load(index_path, index); !lr.is_ok()) {
+            LogWarn("[%s] no gzip index (%s); inflating from the start", tag, lr.message().c_str());
+        }
+        gzip->UseIndex(std::move(index));
+        gzip->RecordAccessPoints(opt.journal_interval_bytes);
+        index_saved = gzip->AccessPointCount();
+    }
+    if (resume > 0) {
+        auto res = SkipInput(reader, resume);
+        if (!res.is_ok()) return Result::Fail(res.err, "[" + comp.name + "] resume: " + res.msg);
+        LogInfo("[%s] resuming at %llu bytes (journal)", tag, (unsigned long long)resume);
+    }
+
+    // Stored payloads on a file or pipe go in-kernel when nothing needs to
+    // look at the bytes on the way. Zero-block skipping does, and wins.
+    FdSource probe;
+    const bool kernel_able = opt.kernel_copy && !opt.direct_io && !opt.compare_before_write && chunks.Empty() &&
+                             reader.KernelSource(probe);
+    const bool kernel = kernel_able && !opt.skip_zero_blocks;
+    if (kernel_able && !kernel) LogDebug("[%s] zero-block skipping keeps the payload off the kernel copy", tag);
+
+    // Prefer io_uring; kernels without it (or seccomp'd containers) get the
+    // synchronous writer.
+    PartitionWriter sync_writer;
+    IoUringWriter uring_writer;
+    IWriter* sink = nullptr;
+    const char* backend = kernel ? "kernel copy" : "sync";
+
+    if (opt.direct_io) {
+        PartitionWriter::Options popt;
+        popt.direct = true;
+        popt.truncate = !opt.compare_before_write && resume == 0;
+        popt.sync = opt.durability->ComponentFlushes();
+        auto res = PartitionWriter::Open(comp.install_to, popt, sync_writer);
+        if (!res.is_ok()) return res;
+        sink = &sync_writer;
+        backend = sync_writer.Direct() ? "O_DIRECT" : "sync";
+    } else if (!kernel && opt.io_uring_queue_depth > 0) {
+        IoUringWriter::Options wopt;
+        wopt.queue_depth = opt.io_uring_queue_depth;
+        wopt.truncate = !opt.compare_before_write && resume == 0;
+        wopt.sync = opt.durability->ComponentFlushes();
+        auto ur = IoUringWriter::Open(comp.install_to, wopt, uring_writer);
+        if (ur.is_ok()) {
+            sink = &uring_writer;
+            backend = "io_uring";
+        } else {
+            LogInfo("[%s] io_uring unavailable (%s), using synchronous writes", tag, ur.msg.c_str());
+        }
+    }
+    if (!sink) {
+        PartitionWriter::Options popt;
+        popt.truncate = !opt.compare_before_write && resume == 0;
+        popt.sync = opt.durability->ComponentFlushes();
+        auto res = PartitionWriter::Open(comp.install_to, popt, sync_writer);
+        if (!res.is_ok()) return res;
+        sink = &sync_writer;
+    }
+
+    ZeroSkipWriter zero_skip(*sink);
+    IWriter* out = opt.skip_zero_blocks ? static_cast<IWriter*>(&zero_skip) : sink;
+    if (resume > 0) {
+        auto res = out->Skip(resume);
+        if (!res.is_ok()) return res;
+    }
+
+    // Read-compare-write: only blocks that differ from the current contents
+    // reach the device. Skips must stay block aligned for O_DIRECT.
+    CompareWriter::Options copt;
+    if (sync_writer.Direct()) copt.block_bytes = std::max(copt.block_bytes, sync_writer.DirectAlignment());
+    CompareWriter compare(*out, copt);
+    if (opt.compare_before_write) {
+        auto res = compare.Open(comp.install_to);
+        if (!res.is_ok()) return res;
+        out = &compare;
+    }
+
+    // Chunk hashes are checked on the image itself, above the writers that
+    // turn unchanged or zero blocks into skips.
+    ChunkVerifyWriter chunk_check(*out, chunks, resume);
+    if (!chunks.Empty()) out = &chunk_check;
+
+    CountingWriter writer(*out);
+    // Android sparse images are expanded on the way; other payloads pass
+    // through. Detection is off for "format": "raw", and a resumed payload
+    // is never a sparse image (see below).
+    SparseImageWriter sparse(writer);
+    const bool detect_sparse = resume == 0 && comp.format != "raw";
+    IWriter& head = detect_sparse ? static_cast<IWriter&>(sparse) : writer;
+    const std::uint64_t t0 = NowMs();
+
+    // Durable progress goes to the journal, except for sparse images whose
+    // payload offsets are not image offsets.
+    Checkpoint checkpoint;
+    if (opt.journal && opt.durability->IntervalFlushes()) {
+        checkpoint = [&](std::uint64_t written) -> Result {
+            if (detect_sparse && !sparse.Passthrough()) return Result::Ok();
+            const std::uint64_t at = (resume + written) / kResumeAlign * kResumeAlign;
+            if (at <= resume) return Result::Ok();
+            // The access points go out before the offset that relies on them.
+            if (gzip) {
+                const auto points = gzip->AccessPoints(index_saved);
+                if (!points.empty()) {
+                    auto r = GzipIndex::Append(index_path, points);
+                    if (!r.is_ok()) return r;
+                    index_saved += points.size();
+                }
+            }
+            return opt.journal->RecordRawOffset(comp.name, at);
+        };
+    }
+
+    std::uint64_t bypassed_bytes = 0;
+    auto res = kernel ? KernelPipe(reader, head, sync_writer, detect_sparse ? &sparse : nullptr, opt, tag, in_read,
+                                   digest, &bypassed_bytes, checkpoint)
+                      : InternalPipe(reader, head, opt, tag, in_read, checkpoint);
+    if (!res.is_ok()) return res;
+    res = sparse.Finish();
+    if (!res.is_ok()) return Result::Fail(res.err, comp.install_to + ": " + res.msg);
+    if (!chunks.Empty()) {
+        res = chunk_check.Finish();
+        if (!res.is_ok()) return Result::Fail(res.err, comp.install_to + ": " + res.msg);
+        LogInfo("[%s] chunk hashes: %zu of %zu chunks checked while writing", tag, chunk_check.ChunksVerified(),
+                chunks.digests.size());
+        if (opt.verify_chunks) {
+            const std::uint64_t v0 = NowMs();
+            res = VerifyChunks(comp.install_to, chunks, chunk_check.ImageBytes(), opt.verify_threads);
+            if (!res.is_ok()) return Result::Fail(res.err, comp.install_to + ": " + res.msg);
+            LogInfo("[%s] read-back verify OK: %zu chunks in %.2fs", tag, chunks.digests.size(),
+                    (double)(NowMs() - v0) / 1000.0);
+        }
+    }
+    if (opt.compare_before_write) {
+        LogInfo("[%s] compare: %llu of %llu blocks unchanged (%zu bytes each), skipped",
+                tag, (unsigned long long)compare.BlocksSkipped(),
+                (unsigned long long)compare.BlocksTotal(), compare.BlockBytes());
+        res = compare.TrimTarget();
+        if (res.is_ok()) res = compare.VerifyTarget();
+        if (!res.is_ok()) return Result::Fail(res.err, comp.install_to + ": " + res.msg);
+        LogInfo("[%s] read-back verify OK", tag);
+    }
+    if (sparse.IsSparse()) {
+        LogInfo("[%s] sparse image: %u chunks, %u blocks of %u bytes, %llu bytes left untouched",
+                tag, sparse.TotalChunks(), sparse.TotalBlocks(), sparse.BlockSize(),
+                (unsigned long long)sparse.SkippedBytes());
+    }
+
+    const std::uint64_t ms = std::max<std::uint64_t>(1, NowMs() - t0);
+    const std::uint64_t total_written = writer.Written() + bypassed_bytes;
+    LogInfo("[%s] wrote %llu bytes via %s (qd=%u) in %.2fs: %.2f MiB/s",
+            tag, (unsigned long long)total_written, backend,
+            sink == &uring_writer ? opt.io_uring_queue_depth : 1u,
+            (double)ms / 1000.0,
+            ((double)total_written / (1024.0 * 1024.0)) / ((double)ms / 1000.0));
+    if (opt.skip_zero_blocks) {
+        LogInfo("[%s] skipped %llu zero bytes (%.1f%%)",
+                tag, (unsigned long long)zero_skip.SkippedBytes(),
+                writer.Written() ? 100.0 * (double)zero_skip.SkippedBytes() / (double)writer.Written() : 0.0);
+    }
+
+    // The slot is only good once the image bytes match the manifest.
+    if (digest) {
+        res = digest->Verify();
+        if (!res.is_ok()) return Result::Fail(res.err, comp.install_to + ": " + res.msg);
+        LogInfo("[%s] sha256 OK", tag);
+    }
+    if (!opt.durability->ComponentFlushes()) return opt.durability->Defer(comp.install_to);
+    return Result::Ok();
+}
+
+Result UpdateModule::InstallDelta(const Component& comp, IReader& reader, const Options& opt,
+                                  const char* tag, const std::uint64_t* in_read, Sha256Reader* digest) {
+    if (comp.delta_source.empty()) {
+        return Result::Fail(EINVAL, "delta_source empty for delta component: " + comp.name);
+    }
+    if (comp.delta_source == comp.install_to) {
+        return Result::Fail(EINVAL, "delta_source and install_to are the same for: " + comp.name);
+    }
+
+    // The decoded delta is just another raw image stream.
+    DeltaReader delta;
+    auto res = DeltaReader::Open(reader, comp.delta_source, delta);
     if (!res.is_ok()) return res;
 
-    return InternalPipe(reader, writer, opt, tag, in_read);
+    res = InstallRaw(comp, delta, opt, tag, in_read, digest);
+    if (!res.is_ok()) {
+        if (!delta.Error().empty()) return Result::Fail(res.err, comp.install_to + ": " + delta.Error());
+        return res;
+    }
+
+    const DeltaStats& st = delta.Stats();
+    LogInfo("[%s] delta from %s: %llu ops, copied %llu, data %llu, zero %llu bytes, target sha256 OK",
+            tag, comp.delta_source.c_str(), (unsigned long long)st.ops,
+            (unsigned long long)st.copy_bytes, (unsigned long long)st.data_bytes,
+            (unsigned long long)st.zero_bytes);
+    return Result::Ok();
 }
 
 Result UpdateModule::InstallArchive(const Component& comp, IReader& reader, const Options& opt,
-                                    const char* /*tag*/, const std::uint64_t* /*in_read*/) {
+                                    const char* tag, const std::uint64_t* /*in_read*/,
+                                    Sha256Reader* digest) {
     // Decide destination:
     // - prefer install_to if it is /dev/...
     // - else if manifest provides "path" => extract to that folder
     // - else use install_to as folder
+    // - with "mkfs", install_to is formatted (device or image file)
     std::string target;
-    if (!comp.install_to.empty() && IsDevPath(comp.install_to)) {
+    if (!comp.mkfs.empty()) {
+        if (comp.install_to.empty()) return Result::Fail(-1, "mkfs needs install_to: " + comp.name);
+        target = comp.install_to;
+    } else if (!comp.install_to.empty() && IsDevPath(comp.install_to)) {
         target = comp.install_to; // device node
     } else if (!comp.path.empty()) {
         target = comp.path;       // folder path like /boot/efi
@@ -152,14 +511,28 @@ Result UpdateModule::InstallArchive(const Component& comp, IReader& reader, cons
     ArchiveInstaller::Options aopt;
     aopt.progress = opt.progress;
     aopt.progress_interval_bytes = opt.progress_interval_bytes;
+    aopt.extract_workers = opt.extract_workers;
+    aopt.durability = opt.durability;
+    aopt.preallocate = opt.preallocate;
+    aopt.mkfs = comp.mkfs;
     // keep safe paths enabled by default
     ArchiveInstaller installer(aopt);
 
-    return installer.InstallTarStreamToTarget(reader, target, comp.name);
+    auto res = installer.InstallTarStreamToTarget(reader, target, comp.name);
+    if (!res.is_ok()) return res;
+
+    // libarchive stops at the end-of-archive marker; Verify() hashes the rest.
+    if (digest) {
+        res = digest->Verify();
+        if (!res.is_ok()) return Result::Fail(res.err, target + ": " + res.msg);
+        LogInfo("[%s] sha256 OK", tag);
+    }
+    return Result::Ok();
 }
 
 Result UpdateModule::InstallAtomicFile(const Component& comp, IReader& reader, const Options& opt,
-                                       const char* tag, const std::uint64_t* in_read) {
+                                       const char* tag, const std::uint64_t* in_read,
+                                       Sha256Reader* digest) {
     if (comp.path.empty()) {
         return Result::Fail(-1, "File path is empty for component: " + comp.name);
     }
@@ -186,15 +559,44 @@ Result UpdateModule::InstallAtomicFile(const Component& comp, IReader& reader, c
     std::string tmp_path = comp.path + ".tmp";
 
     PartitionWriter writer;
-    auto res = PartitionWriter::Open(tmp_path, writer);
+    PartitionWriter::Options wopt;
+    wopt.sync = opt.durability->ComponentFlushes();
+    if (opt.preallocate) {
+        // A stored payload's size is the file's; decompressors do not know theirs.
+        wopt.preallocate_bytes = comp.installed_size ? comp.installed_size : reader.TotalSize().value_or(0);
+    }
+    auto res = PartitionWriter::Open(tmp_path, wopt, writer);
     if (!res.is_ok()) return res;
 
-    res = InternalPipe(reader, writer, opt, tag, in_read);
+    res = opt.kernel_copy ? KernelPipe(reader, writer, writer, nullptr, opt, tag, in_read, digest, nullptr)
+                          : InternalPipe(reader, writer, opt, tag, in_read);
+    if (res.is_ok()) res = writer.TrimPreallocation();
     if (!res.is_ok()) {
         ::unlink(tmp_path.c_str());
         return res;
     }
 
+    // Verify before the rename so a bad payload never replaces the old file.
+    if (digest) {
+        res = digest->Verify();
+        if (!res.is_ok()) {
+            ::unlink(tmp_path.c_str());
+            return Result::Fail(res.err, comp.path + ": " + res.msg);
+        }
+        LogInfo("[%s] sha256 OK", tag);
+    }
+
+    // The rename must never publish data that is not on disk yet, or a power
+    // cut could leave a short file where the old one was. Final mode skipped
+    // the flush above, so the file's data is flushed here.
+    if (!opt.durability->ComponentFlushes()) {
+        res = opt.durability->Timed([&] { return writer.DataSync(); });
+        if (!res.is_ok()) {
+            ::unlink(tmp_path.c_str());
+            return Result::Fail(res.err, tmp_path + ": " + res.msg);
+        }
+    }
+
     if (::rename(tmp_path.c_str(), comp.path.c_str()) != 0) {
         const int err = errno;
         ::unlink(tmp_path.c_str());
@@ -209,49 +611,317 @@ Result UpdateModule::InstallAtomicFile(const Component& comp, IReader& reader, c
         }
     }
 
+    if (!opt.durability->ComponentFlushes()) return opt.durability->Defer(comp.path);
     return Result::Ok();
 }
 
 Result UpdateModule::InternalPipe(IReader& r, IWriter& w, const Options& opt,
-                                  const char* tag, const std::uint64_t* in_read) {
-    std::vector<std::uint8_t> buffer(1024 * 1024);
+                                  const char* tag, const std::uint64_t* in_read,
+                                  const Checkpoint& checkpoint) {
+    // Two stages: a reader thread pulls (and inflates) into a small pool of
+    // buffers while this thread writes and fsyncs them. Buffers cycle through
+    // two SPSC rings: `free` (writer -> reader) and `filled` (reader -> writer).
+    struct Chunk {
+        AlignedBuffer data;        // page-aligned so O_DIRECT writers can use it as is
+        ssize_t n = 0;             // bytes in data; 0 => EOF; < 0 => read error
+        int err = 0;
+        std::uint64_t in_done = 0; // *in_read snapshot taken by the reader thread
+    };
+
+    const size_t depth = std::max<size_t>(2, opt.pipeline_depth);
+    std::vector<Chunk> chunks(depth);
+    SpscRing<size_t> free_ring(depth);
+    SpscRing<size_t> filled_ring(depth);
+    for (size_t i = 0; i < depth; ++i) {
+        chunks[i].data = AlignedBufferPool::Shared().Acquire(
+            opt.pipeline_buffer_bytes ? opt.pipeline_buffer_bytes : 1024 * 1024);
+        free_ring.TryPush(i);
+    }
+
+    // Hand the buffers back to the pool on every exit path (after the reader joined).
+    struct ReleaseChunks {
+        std::vector<Chunk>& chunks;
+        ~ReleaseChunks() {
+            for (auto& c : chunks) AlignedBufferPool::Shared().Release(std::move(c.data));
+        }
+    } release_chunks{chunks};
+
+    std::atomic_bool stop{false};
+
+    std::thread producer([&] {
+        size_t idx = 0;
+        while (free_ring.Pop(idx)) {
+            Chunk& c = chunks[idx];
+            if (stop.load(std::memory_order_relaxed) || g_cancel.load(std::memory_order_relaxed)) {
+                c.n = -1;
+                c.err = ECANCELED;
+            } else {
+                c.n = r.Read(std::span<std::uint8_t>(c.data.data(), c.data.size()));
+                c.err = (c.n < 0) ? errno : 0;
+                c.in_done = in_read ? *in_read : 0;
+            }
+            const bool last = (c.n <= 0);
+            if (!filled_ring.Push(idx) || last) break;
+        }
+    });
+
+    // Stops the reader thread on every exit path (error, cancel, EOF).
+    auto join_producer = [&] {
+        stop.store(true, std::memory_order_relaxed);
+        free_ring.Close();
+        filled_ring.Close();
+        if (producer.joinable()) producer.join();
+    };
 
     std::uint64_t written = 0;
     std::uint64_t next_progress = opt.progress_interval_bytes;
-    std::uint64_t next_fsync = opt.fsync_interval_bytes;
+    const std::uint64_t fsync_interval = opt.durability->IntervalFlushes() ? opt.fsync_interval_bytes : 0;
+    std::uint64_t next_fsync = fsync_interval;
+    const std::uint64_t checkpoint_interval = checkpoint ? opt.journal_interval_bytes : 0;
+    std::uint64_t next_checkpoint = checkpoint_interval;
 
-    EmitProgress(opt, tag, in_read ? *in_read : 0, written, false);
+    EmitProgress(opt, tag, 0, written, false);
 
     while (true) {
-        const ssize_t n = r.Read(std::span<std::uint8_t>(buffer.data(), buffer.size()));
-        if (n == 0) break;
-        if (n < 0) return Result::Fail(errno, "Read failed during pipe");
+        size_t idx = 0;
+        if (!filled_ring.Pop(idx)) {
+            join_producer();
+            return Result::Fail(-1, "Reader stage stopped unexpectedly");
+        }
+        Chunk& c = chunks[idx];
 
-        auto res = w.WriteAll({buffer.data(), static_cast<size_t>(n)});
-        if (!res.is_ok()) return res;
+        if (c.n == 0) break;
+        if (c.n < 0) {
+            join_producer();
+            if (c.err == ECANCELED) return Result::Fail(ECANCELED, "Canceled by user");
+            return Result::Fail(c.err, "Read failed during pipe");
+        }
+        if (g_cancel.load(std::memory_order_relaxed)) {
+            join_producer();
+            return Result::Fail(ECANCELED, "Canceled by user");
+        }
+
+        auto res = w.WriteAll({c.data.data(), static_cast<size_t>(c.n)});
+        if (!res.is_ok()) {
+            join_producer();
+            return res;
+        }
 
-        written += static_cast<std::uint64_t>(n);
+        written += static_cast<std::uint64_t>(c.n);
 
-        const std::uint64_t in_done = in_read ? *in_read : written;
+        const std::uint64_t in_done = in_read ? c.in_done : written;
+
+        // Hand the buffer back before fsync so the reader keeps inflating meanwhile.
+        free_ring.Push(idx);
 
         if (opt.progress && opt.progress_interval_bytes > 0 && in_done >= next_progress) {
             EmitProgress(opt, tag, in_done, written, false);
             next_progress = in_done + opt.progress_interval_bytes;
         }
 
-        if (opt.fsync_interval_bytes > 0 && written >= next_fsync) {
-            auto fr = w.FsyncNow();
-            if (!fr.is_ok()) return fr;
+        if (fsync_interval > 0 && written >= next_fsync) {
+            auto fr = opt.durability->Timed([&] { return w.FsyncAsync(); });
+            if (!fr.is_ok()) {
+                join_producer();
+                return fr;
+            }
             LogDebug("[%s] fsync at out=%llu bytes", tag, (unsigned long long)written);
-            next_fsync = written + opt.fsync_interval_bytes;
+            next_fsync = written + fsync_interval;
+        }
+
+        if (checkpoint_interval > 0 && written >= next_checkpoint) {
+            auto fr = opt.durability->Timed([&] { return w.FsyncNow(); });
+            if (fr.is_ok()) fr = checkpoint(written);
+            if (!fr.is_ok()) {
+                join_producer();
+                return fr;
+            }
+            next_checkpoint = written + checkpoint_interval;
         }
     }
 
-    auto fr = w.FsyncNow();
+    join_producer();
+
+    auto fr = FinalFlush(w, *opt.durability);
     if (!fr.is_ok()) return fr;
 
     EmitProgress(opt, tag, in_read ? *in_read : written, written, true);
     return Result::Ok();
 }
 
+Result UpdateModule::KernelPipe(IReader& r, IWriter& w, PartitionWriter& out, const SparseImageWriter* sparse,
+                                const Options& opt, const char* tag, const std::uint64_t* in_read,
+                                Sha256Reader* digest, std::uint64_t* bypassed_bytes,
+                                const Checkpoint& checkpoint) {
+    FdSource src;
+    if (!r.KernelSource(src)) return InternalPipe(r, w, opt, tag, in_read, checkpoint);
+
+    std::vector<std::uint8_t> buf(opt.pipeline_buffer_bytes ? opt.pipeline_buffer_bytes : 1024 * 1024);
+    std::uint64_t written = 0;
+    std::uint64_t next_progress = opt.progress_interval_bytes;
+    const std::uint64_t fsync_interval = opt.durability->IntervalFlushes() ? opt.fsync_interval_bytes : 0;
+    std::uint64_t next_fsync = fsync_interval;
+    const std::uint64_t checkpoint_interval = checkpoint ? opt.journal_interval_bytes : 0;
+    std::uint64_t next_checkpoint = checkpoint_interval;
+    auto in_done = [&] { return in_read ? *in_read : written; };
+
+    auto account = [&](std::uint64_t n) -> Result {
+        written += n;
+        if (opt.progress && opt.progress_interval_bytes > 0 && in_done() >= next_progress) {
+            EmitProgress(opt, tag, in_done(), written, false);
+            next_progress = in_done() + opt.progress_interval_bytes;
+        }
+        if (fsync_interval > 0 && written >= next_fsync) {
+            auto fr = opt.durability->Timed([&] { return w.FsyncAsync(); });
+            if (!fr.is_ok()) return fr;
+            next_fsync = written + fsync_interval;
+        }
+        if (checkpoint_interval > 0 && written >= next_checkpoint) {
+            auto fr = opt.durability->Timed([&] { return w.FsyncNow(); });
+            if (fr.is_ok()) fr = checkpoint(written);
+            if (!fr.is_ok()) return fr;
+            next_checkpoint = written + checkpoint_interval;
+        }
+        return Result::Ok();
+    };
+
+    EmitProgress(opt, tag, 0, 0, false);
+
+    // What the reader already holds goes the normal way.
+    while (src.buffered > 0) {
+        const ssize_t n = r.Read({buf.data(), static_cast<std::size_t>(std::min<std::uint64_t>(buf.size(), src.buffered))});
+        if (n < 0) return Result::Fail(errno, "Read failed during pipe");
+        if (n == 0) break;
+        auto res = w.WriteAll({buf.data(), static_cast<std::size_t>(n)});
+        if (res.is_ok()) res = account(static_cast<std::uint64_t>(n));
+        if (!res.is_ok()) return res;
+        src.buffered -= static_cast<std::uint64_t>(n);
+    }
+    if ((sparse && !sparse->Passthrough()) || !r.KernelSource(src) || src.buffered != 0) {
+        // The pipe counts from zero again.
+        const std::uint64_t base = written;
+        Checkpoint rebased;
+        if (checkpoint) rebased = [&](std::uint64_t n) { return checkpoint(base + n); };
+        auto res = InternalPipe(r, w, opt, tag, in_read, rebased);
+        if (res.is_ok()) LogDebug("[%s] in-kernel copy not possible after %llu bytes", tag, (unsigned long long)written);
+        return res;
+    }
+
+    // A pipe that must also be hashed is tee()d into a private pipe first:
+    // the original bytes are spliced on, the copy is read back for sha256.
+    Fd tee_r, tee_w;
+    const bool pipe = src.offset < 0;
+    bool kernel = true;
+    if (digest && pipe) {
+        int p[2];
+        if (::pipe2(p, O_CLOEXEC) == 0) {
+            tee_r.Reset(p[0]);
+            tee_w.Reset(p[1]);
+            (void)::fcntl(p[1], F_SETPIPE_SZ, static_cast<int>(std::min<std::size_t>(buf.size(), 1 << 20)));
+        } else {
+            kernel = false;
+        }
+    }
+    auto fallback_errno = [](int e) {
+        return e == EXDEV || e == EINVAL || e == ENOSYS || e == EOPNOTSUPP || e == ENOTSUP;
+    };
+    auto read_back = [&](int fd, std::int64_t at, std::size_t n) -> bool {
+        for (std::size_t got = 0; got < n;) {
+            const ssize_t k = at >= 0 ? ::pread(fd, buf.data() + got, n - got, static_cast<off_t>(at) + static_cast<off_t>(got))
+                                      : ::read(fd, buf.data() + got, n - got);
+            if (k < 0 && errno == EINTR) continue;
+            if (k <= 0) return false;
+            got += static_cast<std::size_t>(k);
+        }
+        return true;
+    };
+
+    std::uint64_t left = src.length.value_or(UINT64_MAX);
+    std::int64_t off = src.offset;
+    std::uint64_t in_kernel = 0;
+    std::uint64_t bypassed = 0;  // in_kernel plus the user-space fallback, all straight into `out`
+    while (left > 0) {
+        if (g_cancel.load(std::memory_order_relaxed)) return Result::Fail(ECANCELED, "Canceled by user");
+
+        std::size_t want = static_cast<std::size_t>(std::min<std::uint64_t>(left, 64ULL * 1024 * 1024));
+        if (digest || !kernel) want = std::min(want, buf.size());
+        ssize_t n = 0;
+
+        if (kernel && tee_w.Valid()) {
+            const ssize_t t = ::tee(src.fd, tee_w.Get(), want, 0);
+            if (t < 0 && errno == EINTR) continue;
+            if (t < 0 && fallback_errno(errno)) {
+                kernel = false;
+                continue;
+            }
+            if (t < 0) return Result::Fail(errno, "tee failed (" + std::string(std::strerror(errno)) + ")");
+            std::size_t moved = 0;
+            while (moved < static_cast<std::size_t>(t)) {
+                const ssize_t m = out.CopyFromFd(src.fd, nullptr, static_cast<std::size_t>(t) - moved);
+                if (m <= 0) break;
+                moved += static_cast<std::size_t>(m);
+            }
+            if (moved == 0 && t > 0 && fallback_errno(errno)) {
+                // Nothing left the source pipe; drop the copy and read instead.
+                if (!read_back(tee_r.Get(), -1, static_cast<std::size_t>(t))) return Result::Fail(EIO, "tee pipe drain failed");
+                kernel = false;
+                continue;
+            }
+            if (moved != static_cast<std::size_t>(t)) {
+                return Result::Fail(errno ? errno : EIO, "splice failed (" + std::string(std::strerror(errno)) + ")");
+            }
+            // Hash exactly what moved.
+            if (!read_back(tee_r.Get(), -1, moved)) return Result::Fail(EIO, "tee pipe read failed");
+            digest->Update({buf.data(), moved});
+            n = t;
+        } else if (kernel) {
+            const std::int64_t at = off;
+            n = out.CopyFromFd(src.fd, pipe ? nullptr : &off, want);
+            if (n < 0 && fallback_errno(errno)) {
+                LogDebug("[%s] in-kernel copy refused (%s), copying through user space", tag, std::strerror(errno));
+                kernel = false;
+                continue;
+            }
+            if (n < 0) return Result::Fail(errno, "in-kernel copy failed (" + std::string(std::strerror(errno)) + ")");
+            if (n > 0 && digest) {
+                if (!read_back(src.fd, at, static_cast<std::size_t>(n))) {
+                    return Result::Fail(errno ? errno : EIO, "Read failed while hashing");
+                }
+                digest->Update({buf.data(), static_cast<std::size_t>(n)});
+            }
+        } else {
+            n = pipe ? ::read(src.fd, buf.data(), want) : ::pread(src.fd, buf.data(), want, static_cast<off_t>(off));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return Result::Fail(errno, "Read failed during pipe");
+            if (n > 0) {
+                if (digest) digest->Update({buf.data(), static_cast<std::size_t>(n)});
+                auto res = out.WriteAll({buf.data(), static_cast<std::size_t>(n)});
+                if (!res.is_ok()) return res;
+                if (!pipe) off += n;
+            }
+        }
+
+        if (n == 0) {
+            if (src.length) return Result::Fail(EBADMSG, "payload ends " + std::to_string(left) + " bytes early");
+            break;
+        }
+        const auto moved = static_cast<std::uint64_t>(n);
+        if (src.length) left -= moved;
+        if (kernel) in_kernel += moved;
+        bypassed += moved;
+        r.Consumed(moved);
+        auto res = account(moved);
+        if (!res.is_ok()) return res;
+    }
+
+    if (bypassed_bytes) *bypassed_bytes = bypassed;
+    LogInfo("[%s] %llu of %llu bytes copied in-kernel", tag, (unsigned long long)in_kernel,
+            (unsigned long long)written);
+
+    auto fr = FinalFlush(w, *opt.durability);
+    if (!fr.is_ok()) return fr;
+    EmitProgress(opt, tag, in_done(), written, true);
+    return Result::Ok();
+}
+
 } // namespace flash
@@ -0,0 +1,133 @@
+// xz_reader.cpp - liblzma stream decoder, multi-threaded when available.
+
+#include "flash/xz_reader.hpp"
+
+#include "flash/logger.hpp"
+#include "flash/thread_pool.hpp"
+
+#include <lzma.h>
+
+#include <cerrno>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+// lzma_stream_decoder_mt() is stable from liblzma 5.4.0.
+#if LZMA_VERSION >= 50040002
+#define FLASH_XZ_MT 1
+#endif
+
+namespace flash {
+
+namespace {
+
+constexpr std::size_t kInBuffer = 256 * 1024;
+
+const char* LzmaError(lzma_ret ret) {
+    switch (ret) {
+    case LZMA_MEM_ERROR:          return "out of memory";
+    case LZMA_MEMLIMIT_ERROR:     return "memory limit exceeded";
+    case LZMA_FORMAT_ERROR:       return "not an xz stream";
+    case LZMA_OPTIONS_ERROR:      return "unsupported options";
+    case LZMA_DATA_ERROR:         return "corrupt data";
+    case LZMA_BUF_ERROR:          return "truncated stream";
+    case LZMA_UNSUPPORTED_CHECK:  return "unsupported integrity check";
+    default:                      return "decoder error";
+    }
+}
+
+int ErrnoFor(lzma_ret ret) {
+    switch (ret) {
+    case LZMA_MEM_ERROR:
+    case LZMA_MEMLIMIT_ERROR:
+        return ENOMEM;
+    case LZMA_OPTIONS_ERROR:
+    case LZMA_UNSUPPORTED_CHECK:
+        return ENOTSUP;
+    default:
+        return EBADMSG;
+    }
+}
+
+} // namespace
+
+struct XzReader::State {
+    lzma_stream strm = LZMA_STREAM_INIT;
+    ~State() { lzma_end(&strm); }
+};
+
+XzReader::XzReader(std::unique_ptr<IReader> source, Options opt)
+    : source_(std::move(source)), st_(std::make_unique<State>()), in_buffer_(kInBuffer) {
+    threads_ = opt.threads ? opt.threads : ThreadPool::DefaultThreads();
+    memlimit_ = opt.memlimit_threading ? opt.memlimit_threading : lzma_physmem() / 4;
+    const std::uint64_t stop = opt.memlimit_stop ? opt.memlimit_stop : std::numeric_limits<std::uint64_t>::max();
+    const std::uint32_t flags = LZMA_CONCATENATED;
+
+    lzma_ret ret;
+#ifdef FLASH_XZ_MT
+    if (threads_ > 1) {
+        lzma_mt mt{};
+        mt.flags = flags;
+        mt.threads = threads_;
+        mt.memlimit_threading = memlimit_;
+        mt.memlimit_stop = stop;
+        ret = lzma_stream_decoder_mt(&st_->strm, &mt);
+    } else {
+        ret = lzma_stream_decoder(&st_->strm, stop, flags);
+    }
+#else
+    threads_ = 1;
+    ret = lzma_stream_decoder(&st_->strm, stop, flags);
+#endif
+    if (ret != LZMA_OK) throw std::runtime_error(std::string("lzma decoder init: ") + LzmaError(ret));
+}
+
+XzReader::~XzReader() = default;
+
+ssize_t XzReader::Read(std::span<std::uint8_t> out) {
+    if (error_) {
+        errno = error_;
+        return -1;
+    }
+    if (eof_reached_ || out.empty()) return 0;
+
+    lzma_stream& s = st_->strm;
+    s.next_out = out.data();
+    s.avail_out = out.size();
+
+    while (s.avail_out > 0) {
+        if (s.avail_in == 0 && !source_eof_) {
+            const ssize_t n = source_->Read(in_buffer_);
+            if (n < 0) return -1;
+            if (n == 0) {
+                source_eof_ = true;
+            } else {
+                s.next_in = in_buffer_.data();
+                s.avail_in = static_cast<std::size_t>(n);
+            }
+        }
+
+        const lzma_ret ret = lzma_code(&s, source_eof_ ? LZMA_FINISH : LZMA_RUN);
+        if (ret == LZMA_STREAM_END) {
+            eof_reached_ = true;
+            LogInfo("xz: decoded %llu bytes on %u thread(s), peak decoder memory %.1f of %.1f MiB",
+                    (unsigned long long)s.total_out, threads_, peak_mem_ / (1024.0 * 1024.0),
+                    memlimit_ / (1024.0 * 1024.0));
+            break;
+        }
+        if (ret != LZMA_OK) {
+            error_ = ErrnoFor(ret);
+            LogError("xz: %s", LzmaError(ret));
+            errno = error_;
+            return -1;
+        }
+        const std::uint64_t mem = lzma_memusage(&s);
+        if (mem > peak_mem_) peak_mem_ = mem;
+        // With LZMA_RUN the MT decoder may hand back less than requested
+        // while workers catch up; return what is ready.
+        if (s.avail_out < out.size() && s.avail_in == 0 && !source_eof_) break;
+    }
+    return static_cast<ssize_t>(out.size() - s.avail_out);
+}
+
+} // namespace flash
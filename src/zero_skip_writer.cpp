@@ -0,0 +1,126 @@
+#include "flash/zero_skip_writer.hpp"
+
+#include "flash/block_scan.hpp"
+
+#include <algorithm>
+
+namespace flash {
+
+ZeroSkipWriter::ZeroSkipWriter(IWriter& inner, Options opt) : inner_(inner), opt_(opt) {
+    if (opt_.block_bytes == 0) opt_.block_bytes = 4096;
+}
+
+Result ZeroSkipWriter::FlushZeroes() {
+    if (pending_ == 0) return Result::Ok();
+    const std::uint64_t len = pending_;
+    pending_ = 0;
+    if (len < opt_.min_run_bytes) return inner_.IWriter::WriteZeroes(len);
+    auto r = inner_.WriteZeroes(len);
+    if (r.is_ok()) skipped_ += len;
+    return r;
+}
+
+Result ZeroSkipWriter::WriteData(std::span<const std::uint8_t> in) {
+    auto r = FlushZeroes();
+    if (!r.is_ok()) return r;
+    r = inner_.WriteAll(in);
+    if (r.is_ok()) offset_ += in.size();
+    return r;
+}
+
+Result ZeroSkipWriter::FlushCarry() {
+    if (carry_.empty()) return Result::Ok();
+    auto r = WriteData(carry_);
+    carry_.clear();
+    return r;
+}
+
+// Scans whole blocks of `in`; offset_ is block aligned on entry.
+Result ZeroSkipWriter::WriteBlocks(std::span<const std::uint8_t> in) {
+    const size_t bs = opt_.block_bytes;
+
+    while (!in.empty()) {
+        size_t zeros = 0;
+        while (zeros + bs <= in.size() && IsAllZero(in.subspan(zeros, bs))) zeros += bs;
+        if (zeros > 0) {
+            pending_ += zeros;
+            offset_ += zeros;
+            in = in.subspan(zeros);
+            continue;
+        }
+
+        // A data run ends at the next zero block.
+        size_t data = bs;
+        while (data + bs <= in.size() && !IsAllZero(in.subspan(data, bs))) data += bs;
+        auto r = WriteData(in.first(data));
+        if (!r.is_ok()) return r;
+        in = in.subspan(data);
+    }
+    return Result::Ok();
+}
+
+Result ZeroSkipWriter::WriteAll(std::span<const std::uint8_t> in) {
+    const size_t bs = opt_.block_bytes;
+
+    // Bytes up to the next block boundary are never skipped. This only happens
+    // after a flush left the output mid-block.
+    const size_t head = static_cast<size_t>((bs - offset_ % bs) % bs);
+    if (head > 0 && carry_.empty()) {
+        const size_t take = std::min(head, in.size());
+        auto r = WriteData(in.first(take));
+        if (!r.is_ok()) return r;
+        in = in.subspan(take);
+    }
+
+    // Complete a block left over from the previous call.
+    if (!carry_.empty()) {
+        const size_t take = std::min(bs - carry_.size(), in.size());
+        carry_.insert(carry_.end(), in.begin(), in.begin() + static_cast<std::ptrdiff_t>(take));
+        in = in.subspan(take);
+        if (carry_.size() < bs) return Result::Ok();
+        auto r = WriteBlocks(carry_);
+        carry_.clear();
+        if (!r.is_ok()) return r;
+    }
+
+    const size_t whole = in.size() / bs * bs;
+    auto r = WriteBlocks(in.first(whole));
+    if (!r.is_ok()) return r;
+    carry_.assign(in.begin() + static_cast<std::ptrdiff_t>(whole), in.end());
+    return Result::Ok();
+}
+
+Result ZeroSkipWriter::WriteZeroes(std::uint64_t len) {
+    auto r = FlushCarry();
+    if (!r.is_ok()) return r;
+    pending_ += len;
+    offset_ += len;
+    return Result::Ok();
+}
+
+Result ZeroSkipWriter::Skip(std::uint64_t len) {
+    auto r = FlushCarry();
+    if (!r.is_ok()) return r;
+    r = FlushZeroes();
+    if (!r.is_ok()) return r;
+    r = inner_.Skip(len);
+    if (r.is_ok()) offset_ += len;
+    return r;
+}
+
+Result ZeroSkipWriter::FsyncNow() {
+    auto r = FlushCarry();
+    if (!r.is_ok()) return r;
+    r = FlushZeroes();
+    if (!r.is_ok()) return r;
+    return inner_.FsyncNow();
+}
+
+// The partial block stays carried; only the final FsyncNow() writes it out.
+Result ZeroSkipWriter::FsyncAsync() {
+    auto r = FlushZeroes();
+    if (!r.is_ok()) return r;
+    return inner_.FsyncAsync();
+}
+
+} // namespace flash
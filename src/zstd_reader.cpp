@@ -0,0 +1,64 @@
+#include "flash/zstd_reader.hpp"
+
+#include "flash/logger.hpp"
+
+#include <zstd.h>
+
+#include <cerrno>
+#include <stdexcept>
+
+namespace flash {
+
+ZstdReader::ZstdReader(std::unique_ptr<IReader> source, int max_window_log)
+    : source_(std::move(source)), in_buffer_(ZSTD_DStreamInSize()) {
+    dctx_ = ZSTD_createDCtx();
+    if (!dctx_) throw std::runtime_error("Failed to create zstd decompression context");
+
+    if (max_window_log <= 0) max_window_log = ZSTD_dParam_getBounds(ZSTD_d_windowLogMax).upperBound;
+    const size_t ret = ZSTD_DCtx_setParameter(dctx_, ZSTD_d_windowLogMax, max_window_log);
+    if (ZSTD_isError(ret)) {
+        ZSTD_freeDCtx(dctx_);
+        throw std::runtime_error(std::string("zstd windowLogMax: ") + ZSTD_getErrorName(ret));
+    }
+}
+
+ZstdReader::~ZstdReader() {
+    ZSTD_freeDCtx(dctx_);
+}
+
+ssize_t ZstdReader::Read(std::span<std::uint8_t> out) {
+    if (eof_reached_ || out.empty()) return 0;
+
+    ZSTD_outBuffer ob{out.data(), out.size(), 0};
+    while (ob.pos < ob.size) {
+        if (in_pos_ == in_len_) {
+            const ssize_t n = source_->Read(in_buffer_);
+            if (n < 0) return -1;
+            if (n == 0) {
+                if (in_frame_) {
+                    LogError("zstd: stream truncated inside a frame");
+                    errno = EBADMSG;
+                    return -1;
+                }
+                eof_reached_ = true;
+                break;
+            }
+            in_pos_ = 0;
+            in_len_ = static_cast<std::size_t>(n);
+        }
+
+        ZSTD_inBuffer ib{in_buffer_.data(), in_len_, in_pos_};
+        const size_t ret = ZSTD_decompressStream(dctx_, &ob, &ib);
+        in_pos_ = ib.pos;
+        if (ZSTD_isError(ret)) {
+            LogError("zstd: %s", ZSTD_getErrorName(ret));
+            errno = EBADMSG;
+            return -1;
+        }
+        // 0 => a frame just ended; the next input (if any) starts a new one.
+        in_frame_ = ret != 0;
+    }
+    return static_cast<ssize_t>(ob.pos);
+}
+
+} // namespace flash
@@ -0,0 +1,162 @@
+#include <gtest/gtest.h>
+
+#include "flash/archive_installer.hpp"
+#include "flash/file_reader.hpp"
+
+#include "testing.hpp"
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+using testutil::Pattern;
+using testutil::TarDir;
+using testutil::TarFile;
+using testutil::TarHardlink;
+using testutil::TarNode;
+using testutil::TarSymlink;
+
+class ArchiveInstallerTests : public ::testing::Test {
+protected:
+    testutil::TemporaryDirectory tmp;
+
+    // Owned by the current user so the tree extracts without root.
+    std::string MakeTar(std::vector<testutil::TarEntry> entries) {
+        for (auto& e : entries) e.uid = ::geteuid();
+        return testutil::WriteTar(tmp.Path() + "/tree.tar", entries);
+    }
+
+    flash::Result Extract(const std::string& tar, const std::string& dst, unsigned workers) {
+        flash::FileOrStdinReader in;
+        auto r = flash::FileOrStdinReader::Open(tar, in);
+        if (!r.is_ok()) return r;
+        flash::ArchiveInstaller::Options opt;
+        opt.progress = false;
+        opt.extract_workers = workers;
+        flash::ArchiveInstaller installer(opt);
+        return installer.InstallTarStreamToTarget(in, dst, "tree");
+    }
+
+    static std::string Slurp(const std::string& path) {
+        std::ifstream is(path, std::ios::binary);
+        return std::string((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    }
+};
+
+TEST_F(ArchiveInstallerTests, ExtractsTreeWithMetadata) {
+    std::vector<testutil::TarEntry> entries;
+    entries.push_back(TarDir("./etc/"));
+    entries.push_back(TarDir("etc/ro/", 0555));
+    for (unsigned i = 0; i < 300; ++i) {
+        entries.push_back(TarFile("etc/ro/f" + std::to_string(i), Pattern<std::string>(i * 37, i), i % 2 ? 0640u : 0755u));
+    }
+    entries.push_back(TarFile("usr/lib/deep/big.bin", Pattern<std::string>(3 * 1024 * 1024 + 11, 7)));
+    entries.push_back(TarFile("etc/hostname", "old"));
+    entries.push_back(TarFile("etc/hostname", "new", 0600));
+    entries.push_back(TarSymlink("etc/link", "ro/f1"));
+    entries.push_back(TarHardlink("etc/hard", "etc/ro/f2"));
+    entries.push_back(TarNode("run/fifo", AE_IFIFO, 0620));
+    const std::string tar = MakeTar(entries);
+
+    for (unsigned workers : {1u, 4u}) {
+        SCOPED_TRACE(workers);
+        const std::string dst = tmp.Path() + "/out" + std::to_string(workers);
+        const auto res = Extract(tar, dst, workers);
+        ASSERT_TRUE(res.is_ok()) << res.msg;
+
+        for (unsigned i = 0; i < 300; ++i) {
+            const std::string p = dst + "/etc/ro/f" + std::to_string(i);
+            ASSERT_EQ(Slurp(p), Pattern<std::string>(i * 37, i)) << p;
+            struct stat st {};
+            ASSERT_EQ(::stat(p.c_str(), &st), 0);
+            EXPECT_EQ(st.st_mode & 07777, i % 2 ? 0640u : 0755u);
+            EXPECT_EQ(st.st_mtim.tv_sec, 1600000000);
+        }
+        EXPECT_TRUE(Slurp(dst + "/usr/lib/deep/big.bin") == Pattern<std::string>(3 * 1024 * 1024 + 11, 7));
+        EXPECT_EQ(Slurp(dst + "/etc/hostname"), "new");
+
+        struct stat st {};
+        ASSERT_EQ(::stat((dst + "/etc/ro").c_str(), &st), 0);
+        EXPECT_EQ(st.st_mode & 07777, 0555u);
+        EXPECT_EQ(st.st_mtim.tv_sec, 1600000000);
+        ASSERT_EQ(::stat((dst + "/etc/hostname").c_str(), &st), 0);
+        EXPECT_EQ(st.st_mode & 07777, 0600u);
+
+        char target[64] = {};
+        ASSERT_GT(::readlink((dst + "/etc/link").c_str(), target, sizeof(target) - 1), 0);
+        EXPECT_STREQ(target, "ro/f1");
+
+        struct stat a {}, b {};
+        ASSERT_EQ(::stat((dst + "/etc/hard").c_str(), &a), 0);
+        ASSERT_EQ(::stat((dst + "/etc/ro/f2").c_str(), &b), 0);
+        EXPECT_EQ(a.st_ino, b.st_ino);
+
+        ASSERT_EQ(::lstat((dst + "/run/fifo").c_str(), &st), 0);
+        EXPECT_TRUE(S_ISFIFO(st.st_mode));
+
+        // Let the temporary directory clean up.
+        ::chmod((dst + "/etc/ro").c_str(), 0755);
+    }
+}
+
+TEST_F(ArchiveInstallerTests, RejectsPathsOutsideTheRoot) {
+    const std::string dst = tmp.Path() + "/out";
+    auto res = Extract(MakeTar({TarFile("ok", "x"), TarFile("a/../../escape", "x")}), dst, 4);
+    ASSERT_FALSE(res.is_ok());
+    EXPECT_NE(res.msg.find("Unsafe path"), std::string::npos) << res.msg;
+    EXPECT_FALSE(std::ifstream(tmp.Path() + "/escape").good());
+
+    res = Extract(MakeTar({TarHardlink("h", "../outside")}), dst, 4);
+    EXPECT_FALSE(res.is_ok());
+}
+
+TEST_F(ArchiveInstallerTests, NeverWritesThroughExistingSymlinks) {
+    const std::string dst = tmp.Path() + "/out";
+    const std::string outside = tmp.Path() + "/outside";
+    ASSERT_EQ(::mkdir(dst.c_str(), 0755), 0);
+    ASSERT_EQ(::mkdir(outside.c_str(), 0755), 0);
+    ASSERT_EQ(::symlink(outside.c_str(), (dst + "/dir").c_str()), 0);
+    ASSERT_EQ(::symlink((outside + "/victim").c_str(), (dst + "/file").c_str()), 0);
+
+    const auto res = Extract(MakeTar({TarFile("dir/payload", "p"), TarFile("file", "f")}), dst, 4);
+    ASSERT_TRUE(res.is_ok()) << res.msg;
+
+    struct stat st {};
+    ASSERT_EQ(::lstat((dst + "/dir").c_str(), &st), 0);
+    EXPECT_TRUE(S_ISDIR(st.st_mode));
+    EXPECT_EQ(Slurp(dst + "/dir/payload"), "p");
+    ASSERT_EQ(::lstat((dst + "/file").c_str(), &st), 0);
+    EXPECT_TRUE(S_ISREG(st.st_mode));
+    EXPECT_FALSE(std::ifstream(outside + "/payload").good());
+    EXPECT_FALSE(std::ifstream(outside + "/victim").good());
+}
+
+TEST_F(ArchiveInstallerTests, LaterEntriesReplaceEarlierOnes) {
+    const std::string dst = tmp.Path() + "/out";
+    const std::string tar = MakeTar({
+        TarDir("x/"),
+        TarFile("x/a", "a"),
+        TarFile("y", "file first"),
+        TarDir("y/", 0700),
+        TarFile("y/b", "b"),
+        TarSymlink("z", "x"),
+        TarFile("z", "z"),
+    });
+    const auto res = Extract(tar, dst, 4);
+    ASSERT_TRUE(res.is_ok()) << res.msg;
+
+    EXPECT_EQ(Slurp(dst + "/x/a"), "a");
+    EXPECT_EQ(Slurp(dst + "/y/b"), "b");
+    struct stat st {};
+    ASSERT_EQ(::lstat((dst + "/z").c_str(), &st), 0);
+    EXPECT_TRUE(S_ISREG(st.st_mode));
+    EXPECT_EQ(Slurp(dst + "/z"), "z");
+}
+
+} // namespace
@@ -0,0 +1,303 @@
+#include <gtest/gtest.h>
+
+#include "flash/bundle_index.hpp"
+#include "flash/file_reader.hpp"
+#include "flash/ota_bundle_reader.hpp"
+#include "flash/ota_installer.hpp"
+
+#include "testing.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+class BundleIndexTests : public ::testing::Test {
+protected:
+    testutil::TemporaryDirectory tmp;
+
+    std::string Path(const std::string& name) { return tmp.Path() + "/" + name; }
+
+    static void WriteFile(const std::string& path, const std::string& data) {
+        std::ofstream os(path, std::ios::binary | std::ios::trunc);
+        os << data;
+    }
+
+    static std::string ReadFile(const std::string& path) {
+        std::ifstream is(path, std::ios::binary);
+        std::stringstream ss;
+        ss << is.rdbuf();
+        return ss.str();
+    }
+
+    // Two "file" components installed under the temp dir.
+    std::string MakeBundle() {
+        WriteFile(Path("manifest.json"),
+                  R"({"version":"1.0","components":[
+                      {"name":"a","type":"file","filename":"a.bin","path":")" + Path("out/a") + R"("},
+                      {"name":"b","type":"file","filename":"b.bin","path":")" + Path("out/b") + R"("}]})");
+        WriteFile(Path("a.bin"), std::string(70000, 'a'));
+        WriteFile(Path("b.bin"), "bee");
+        std::filesystem::create_directories(Path("out"));
+
+        const std::string bundle = Path("ota.tar");
+        auto r = flash::WriteIndexedBundle(bundle, Path("manifest.json"), {Path("a.bin"), Path("b.bin")});
+        EXPECT_TRUE(r.is_ok()) << r.message();
+        return bundle;
+    }
+
+    flash::BundleIndex LoadIndex(const std::string& bundle) {
+        flash::FileOrStdinReader in;
+        EXPECT_TRUE(flash::FileOrStdinReader::Open(bundle, in).is_ok());
+        flash::OtaTarBundleReader reader;
+        EXPECT_TRUE(reader.Open(in).is_ok());
+        flash::BundleEntryInfo ent;
+        bool eof = false;
+        std::string text;
+        for (int i = 0; i < 2; ++i) {
+            EXPECT_TRUE(reader.Next(ent, eof).is_ok());
+            EXPECT_TRUE(reader.ReadCurrentToString(text).is_ok());
+        }
+        EXPECT_EQ(ent.name, flash::kBundleIndexName);
+        auto idx = flash::BundleIndex::Parse(text);
+        EXPECT_TRUE(idx.has_value()) << idx.error();
+        return idx.value_or(flash::BundleIndex{});
+    }
+
+    // Plain pax tar (no index) written by libarchive.
+    std::string MakePlainTar(const std::string& manifest,
+                             const std::vector<std::pair<std::string, std::string>>& files) {
+        std::vector<testutil::TarEntry> entries{testutil::TarFile("manifest.json", manifest)};
+        for (const auto& [name, body] : files) entries.push_back(testutil::TarFile(name, body));
+        return testutil::WriteTar(Path("plain.tar"), entries);
+    }
+
+    std::string FileComponent(const std::string& name, const std::string& filename, const std::string& dst) {
+        return R"({"name":")" + name + R"(","type":"file","filename":")" + filename + R"(","path":")" + dst + R"("})";
+    }
+};
+
+TEST_F(BundleIndexTests, IndexedBundleIsPlainTar) {
+    const std::string bundle = MakeBundle();
+
+    flash::FileOrStdinReader in;
+    ASSERT_TRUE(flash::FileOrStdinReader::Open(bundle, in).is_ok());
+    flash::OtaTarBundleReader reader;
+    ASSERT_TRUE(reader.Open(in).is_ok());
+
+    std::vector<std::string> names;
+    std::string last;
+    flash::BundleEntryInfo ent;
+    bool eof = false;
+    while (true) {
+        ASSERT_TRUE(reader.Next(ent, eof).is_ok());
+        if (eof) break;
+        names.push_back(ent.name);
+        ASSERT_TRUE(reader.ReadCurrentToString(last).is_ok());
+    }
+    EXPECT_EQ(names, (std::vector<std::string>{"manifest.json", flash::kBundleIndexName, "a.bin", "b.bin"}));
+    EXPECT_EQ(last, "bee");
+}
+
+TEST_F(BundleIndexTests, EntriesPointAtTheirData) {
+    const std::string bundle = MakeBundle();
+    const flash::BundleIndex idx = LoadIndex(bundle);
+    ASSERT_EQ(idx.entries.size(), 2u);
+
+    const flash::BundleIndexEntry* b = idx.Find("b.bin");
+    ASSERT_NE(b, nullptr);
+    EXPECT_EQ(b->size, 3u);
+    EXPECT_EQ(b->compression, "none");
+    EXPECT_EQ(b->sha256.size(), 64u);
+
+    flash::Fd fd(::open(bundle.c_str(), O_RDONLY | O_CLOEXEC));
+    ASSERT_GE(fd.Get(), 0);
+    for (const auto& e : idx.entries) EXPECT_TRUE(flash::VerifyIndexEntry(fd.Get(), e).is_ok()) << e.name;
+
+    flash::BundleIndexEntry stale = *b;
+    stale.offset += 512;
+    EXPECT_FALSE(flash::VerifyIndexEntry(fd.Get(), stale).is_ok());
+    stale = *b;
+    stale.name = "a.bin";
+    EXPECT_FALSE(flash::VerifyIndexEntry(fd.Get(), stale).is_ok());
+
+    flash::RangeReader rr;
+    ASSERT_TRUE(flash::RangeReader::Open(bundle, b->offset, b->size, rr).is_ok());
+    std::uint8_t buf[16];
+    ASSERT_EQ(rr.Read(buf), 3);
+    EXPECT_EQ(std::string(reinterpret_cast<char*>(buf), 3), "bee");
+    EXPECT_EQ(rr.Read(buf), 0);
+    EXPECT_EQ(rr.Seek(1, SEEK_SET), 1);
+    ASSERT_EQ(rr.Read(buf), 2);
+    EXPECT_EQ(std::string(reinterpret_cast<char*>(buf), 2), "ee");
+    EXPECT_LT(rr.Seek(4, SEEK_SET), 0);
+}
+
+TEST_F(BundleIndexTests, InstallerHonoursOnlyComponents) {
+    const std::string bundle = MakeBundle();
+
+    flash::OtaInstaller::Options opt;
+    opt.only_components = {"b"};
+    flash::OtaInstaller installer(opt);
+    auto r = installer.Run(bundle);
+    ASSERT_TRUE(r.is_ok()) << r.message();
+    EXPECT_EQ(ReadFile(Path("out/b")), "bee");
+    EXPECT_FALSE(std::filesystem::exists(Path("out/a")));
+
+    flash::OtaInstaller all{flash::OtaInstaller::Options{}};
+    r = all.Run(bundle);
+    ASSERT_TRUE(r.is_ok()) << r.message();
+    EXPECT_EQ(ReadFile(Path("out/a")), std::string(70000, 'a'));
+
+    opt.only_components = {"nope"};
+    EXPECT_FALSE(flash::OtaInstaller(opt).Run(bundle).is_ok());
+}
+
+TEST_F(BundleIndexTests, IndexedBundleFromStdinIsStreamed) {
+    const std::string bundle = MakeBundle();
+
+    // `-i - < bundle`: stdin is seekable, but "-" cannot be reopened per
+    // component, so the bundle is streamed. The index still gives the
+    // overall total.
+    flash::Fd in(::open(bundle.c_str(), O_RDONLY | O_CLOEXEC));
+    ASSERT_GE(in.Get(), 0);
+    flash::Fd saved(::dup(STDIN_FILENO));
+    ASSERT_GE(::dup2(in.Get(), STDIN_FILENO), 0);
+    flash::OtaInstaller::Options opt;
+    opt.component_jobs = 2;
+    ::testing::internal::CaptureStderr();
+    auto r = flash::OtaInstaller(opt).Run("-");
+    const std::string log = ::testing::internal::GetCapturedStderr();
+    ::dup2(saved.Get(), STDIN_FILENO);
+    ASSERT_TRUE(r.is_ok()) << r.message();
+    EXPECT_EQ(ReadFile(Path("out/a")), std::string(70000, 'a'));
+    EXPECT_EQ(ReadFile(Path("out/b")), "bee");
+    EXPECT_NE(log.find("OTA overall total (bundle index) = 70003 bytes"), std::string::npos) << log;
+}
+
+TEST_F(BundleIndexTests, ScanFindsEntriesOfPlainTar) {
+    const std::string long_name = std::string(120, 'n') + ".bin";
+    const std::string bundle = MakePlainTar("{}", {{"a.bin", "alpha"}, {long_name, std::string(1000, 'z')}});
+
+    flash::Fd fd(::open(bundle.c_str(), O_RDONLY | O_CLOEXEC));
+    flash::BundleIndex idx;
+    auto r = flash::ScanTarIndex(fd.Get(), idx);
+    ASSERT_TRUE(r.is_ok()) << r.message();
+    ASSERT_EQ(idx.entries.size(), 3u);
+
+    const flash::BundleIndexEntry* e = idx.Find(long_name);
+    ASSERT_NE(e, nullptr);
+    EXPECT_EQ(e->size, 1000u);
+    std::string got(1000, '\0');
+    ASSERT_EQ(::pread(fd.Get(), got.data(), got.size(), static_cast<off_t>(e->offset)), 1000);
+    EXPECT_EQ(got, std::string(1000, 'z'));
+
+    WriteFile(Path("junk"), std::string(4096, 'j'));
+    flash::Fd junk(::open(Path("junk").c_str(), O_RDONLY | O_CLOEXEC));
+    EXPECT_EQ(flash::ScanTarIndex(junk.Get(), idx).err, EBADMSG);
+}
+
+TEST_F(BundleIndexTests, ConcurrentInstallOfPlainTar) {
+    std::filesystem::create_directories(Path("out"));
+    const std::string manifest = R"({"version":"1.0","components":[)" +
+                                 FileComponent("a", "a.bin", Path("out/a")) + "," +
+                                 FileComponent("b", "b.bin", Path("out/b")) + "," +
+                                 FileComponent("a2", "a2.bin", Path("out/a")) + "]}";
+    const std::string bundle = MakePlainTar(
+        manifest, {{"a.bin", std::string(300000, 'a')}, {"b.bin", std::string(200000, 'b')}, {"a2.bin", "second"}});
+
+    flash::OtaInstaller::Options opt;
+    opt.component_jobs = 4;
+    auto r = flash::OtaInstaller(opt).Run(bundle);
+    ASSERT_TRUE(r.is_ok()) << r.message();
+    EXPECT_EQ(ReadFile(Path("out/b")), std::string(200000, 'b'));
+    // a and a2 share a target: a2 must land last.
+    EXPECT_EQ(ReadFile(Path("out/a")), "second");
+}
+
+TEST_F(BundleIndexTests, ConcurrentInstallChainsAliasedAndNestedTargets) {
+    std::filesystem::create_directories(Path("out/tree"));
+    std::filesystem::create_directory_symlink(Path("out"), Path("link"));
+    const std::string big(3 * 1024 * 1024, 'x');
+    const std::string tree = [&] {
+        const std::string p = MakePlainTar("{}", {{"x", big}});
+        return ReadFile(p);
+    }();
+    // The big first component of each pair would finish last if the pair ran
+    // at the same time: "a" reaches out/a through a symlink, and "tree"
+    // extracts the folder that holds "x".
+    const std::string manifest =
+        R"({"version":"1.0","components":[)" + FileComponent("a", "a.bin", Path("link/a")) + "," +
+        R"({"name":"tree","type":"archive","filename":"tree.tar","path":")" + Path("out/tree") + R"("},)" +
+        FileComponent("a2", "a2.bin", Path("out/./a")) + "," + FileComponent("x", "x.bin", Path("out/tree/x")) +
+        "]}";
+    const std::string bundle = MakePlainTar(
+        manifest, {{"a.bin", big}, {"tree.tar", tree}, {"a2.bin", "second"}, {"x.bin", "last"}});
+
+    flash::OtaInstaller::Options opt;
+    opt.component_jobs = 4;
+    auto r = flash::OtaInstaller(opt).Run(bundle);
+    ASSERT_TRUE(r.is_ok()) << r.message();
+    EXPECT_EQ(ReadFile(Path("out/a")), "second");
+    EXPECT_EQ(ReadFile(Path("out/tree/x")), "last");
+    EXPECT_EQ(ReadFile(Path("out/tree/manifest.json")), "{}");
+}
+
+// Archive components extract relative to their own folder, never the
+// process cwd, so concurrent ones cannot spill into each other's trees.
+TEST_F(BundleIndexTests, ConcurrentArchiveComponentsStayInTheirFolders) {
+    std::vector<std::pair<std::string, std::string>> files;
+    std::string comps;
+    for (int k = 0; k < 4; ++k) {
+        const std::string dir = Path("out/t" + std::to_string(k));
+        std::filesystem::create_directories(dir);
+        std::vector<std::pair<std::string, std::string>> tree;
+        for (int i = 0; i < 50; ++i) {
+            tree.push_back({"d" + std::to_string(i % 5) + "/f" + std::to_string(i), std::string(1000 + i, 'a' + k)});
+        }
+        files.push_back({"t" + std::to_string(k) + ".tar", ReadFile(MakePlainTar("{}", tree))});
+        comps += std::string(k ? "," : "") + R"({"name":"t)" + std::to_string(k) +
+                 R"(","type":"archive","filename":"t)" + std::to_string(k) + R"(.tar","path":")" + dir + R"("})";
+    }
+    const std::string bundle = MakePlainTar(R"({"version":"1.0","components":[)" + comps + "]}", files);
+
+    flash::OtaInstaller::Options opt;
+    opt.component_jobs = 4;
+    auto r = flash::OtaInstaller(opt).Run(bundle);
+    ASSERT_TRUE(r.is_ok()) << r.message();
+    for (int k = 0; k < 4; ++k) {
+        std::size_t n = 0;
+        for (const auto& e : std::filesystem::recursive_directory_iterator(Path("out/t" + std::to_string(k)))) {
+            if (!e.is_regular_file() || e.path().filename() == "manifest.json") continue;
+            ++n;
+            EXPECT_EQ(ReadFile(e.path()).front(), 'a' + k) << e.path();
+        }
+        EXPECT_EQ(n, 50u) << k;
+    }
+}
+
+TEST_F(BundleIndexTests, ConcurrentInstallReportsFirstFailure) {
+    std::filesystem::create_directories(Path("out"));
+    const std::string manifest = R"({"version":"1.0","components":[)" +
+                                 FileComponent("good", "good.bin", Path("out/good")) + "," +
+                                 R"({"name":"bad","type":"file","filename":"bad.bin","path":")" + Path("out/bad") +
+                                 R"(","sha256":")" + std::string(64, '0') + R"("}]})";
+    const std::string bundle = MakePlainTar(manifest, {{"good.bin", "ok"}, {"bad.bin", "corrupt"}});
+
+    flash::OtaInstaller::Options opt;
+    opt.component_jobs = 2;
+    opt.component_retries = 1;
+    auto r = flash::OtaInstaller(opt).Run(bundle);
+    ASSERT_FALSE(r.is_ok());
+    EXPECT_NE(r.message().find("component 'bad'"), std::string::npos) << r.message();
+    EXPECT_FALSE(std::filesystem::exists(Path("out/bad")));
+}
+
+} // namespace
@@ -0,0 +1,209 @@
+#include <gtest/gtest.h>
+
+#include "flash/chunk_hashes.hpp"
+#include "flash/manifest.hpp"
+#include "flash/sha256.hpp"
+#include "flash/update_module.hpp"
+
+#include "testing.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Collects what reaches it; skipped bytes read back as 'S'.
+class RecordingWriter : public flash::IWriter {
+public:
+    flash::Result WriteAll(std::span<const std::uint8_t> in) override {
+        data.append(reinterpret_cast<const char*>(in.data()), in.size());
+        return flash::Result::Ok();
+    }
+    flash::Result FsyncNow() override { return flash::Result::Ok(); }
+    flash::Result Skip(std::uint64_t len) override {
+        data.append(len, 'S');
+        return flash::Result::Ok();
+    }
+
+    std::string data;
+};
+
+class StringReader : public flash::IReader {
+public:
+    explicit StringReader(std::string data) : data_(std::move(data)) {}
+    ssize_t Read(std::span<std::uint8_t> out) override {
+        const size_t n = std::min(out.size(), data_.size() - pos_);
+        std::copy_n(data_.data() + pos_, n, out.data());
+        pos_ += n;
+        return static_cast<ssize_t>(n);
+    }
+
+private:
+    std::string data_;
+    size_t pos_ = 0;
+};
+
+class ChunkHashesTests : public ::testing::Test {
+protected:
+    static constexpr std::uint64_t kChunk = 16 * 1024;
+
+    testutil::TemporaryDirectory tmp;
+
+    static std::string Image(size_t n) { return testutil::Pattern<std::string>(n); }
+
+    static std::vector<std::string> HexChunks(const std::string& image, std::uint64_t chunk) {
+        std::vector<std::string> out;
+        for (std::uint64_t off = 0; off < image.size(); off += chunk) {
+            flash::Sha256 h;
+            h.Update({reinterpret_cast<const std::uint8_t*>(image.data()) + off,
+                      static_cast<size_t>(std::min<std::uint64_t>(chunk, image.size() - off))});
+            out.push_back(flash::Sha256::ToHex(h.Final()));
+        }
+        return out;
+    }
+
+    static flash::ChunkHashes Hashes(const std::string& image) {
+        flash::Component comp;
+        comp.chunk_bytes = kChunk;
+        comp.chunk_sha256 = HexChunks(image, kChunk);
+        flash::ChunkHashes h;
+        EXPECT_TRUE(flash::ChunkHashes::FromComponent(comp, h).is_ok());
+        return h;
+    }
+
+    // Feeds `image` in odd-sized pieces so chunks straddle WriteAll() calls.
+    static flash::Result Feed(flash::IWriter& w, const std::string& image) {
+        for (size_t off = 0, step = 5000; off < image.size(); off += step, step = step * 7 % 40009 + 1) {
+            const size_t n = std::min(step, image.size() - off);
+            auto r = w.WriteAll({reinterpret_cast<const std::uint8_t*>(image.data()) + off, n});
+            if (!r.is_ok()) return r;
+        }
+        return flash::Result::Ok();
+    }
+};
+
+TEST_F(ChunkHashesTests, ParsesManifestChunks) {
+    auto m = flash::ManifestHandler::Parse(R"({"components":[
+        {"name":"rootfs","type":"raw","chunks":{"size":4194304,"sha256":["aa","bb"]}}]})");
+    ASSERT_TRUE(m.has_value()) << m.error();
+    EXPECT_EQ(m->components[0].chunk_bytes, 4194304u);
+    EXPECT_EQ(m->components[0].chunk_sha256, (std::vector<std::string>{"aa", "bb"}));
+    EXPECT_FALSE(flash::ManifestHandler::Parse(R"({"components":[{"name":"x","chunks":{"size":4096}}]})").has_value());
+
+    flash::ChunkHashes h;
+    EXPECT_EQ(flash::ChunkHashes::FromComponent(m->components[0], h).err, EINVAL);  // not hex
+    flash::Component comp;
+    comp.chunk_bytes = 1000;
+    comp.chunk_sha256 = HexChunks("x", 1000);
+    EXPECT_EQ(flash::ChunkHashes::FromComponent(comp, h).err, EINVAL);
+    comp.chunk_sha256.clear();
+    ASSERT_TRUE(flash::ChunkHashes::FromComponent(comp, h).is_ok());
+    EXPECT_TRUE(h.Empty());
+}
+
+TEST_F(ChunkHashesTests, WriterStopsAtFirstBadChunk) {
+    const std::string image = Image(5 * kChunk + 123);
+    const auto hashes = Hashes(image);
+    {
+        RecordingWriter out;
+        flash::ChunkVerifyWriter w(out, hashes);
+        ASSERT_TRUE(Feed(w, image).is_ok());
+        ASSERT_TRUE(w.Finish().is_ok());
+        EXPECT_EQ(w.ChunksVerified(), 6u);
+        EXPECT_TRUE(out.data == image);
+    }
+
+    std::string bad = image;
+    bad[2 * kChunk + 77] ^= 1;
+    RecordingWriter out;
+    flash::ChunkVerifyWriter w(out, hashes);
+    const auto r = Feed(w, bad);
+    ASSERT_FALSE(r.is_ok());
+    EXPECT_EQ(r.err, EBADMSG);
+    EXPECT_NE(r.msg.find("chunk 2 (bytes 32768-49151)"), std::string::npos) << r.msg;
+    // The write that completed the bad chunk never reached the target.
+    EXPECT_LT(out.data.size(), 3 * kChunk);
+    EXPECT_EQ(w.ChunksVerified(), 2u);
+}
+
+TEST_F(ChunkHashesTests, WriterChecksZeroesAndLengthAndSkipsResumedChunks) {
+    std::string image = Image(3 * kChunk);
+    std::fill(image.begin() + 1000, image.begin() + 2 * kChunk + 10, '\0');
+    const auto hashes = Hashes(image);
+    {
+        RecordingWriter out;
+        flash::ChunkVerifyWriter w(out, hashes);
+        ASSERT_TRUE(w.WriteAll({reinterpret_cast<const std::uint8_t*>(image.data()), 1000}).is_ok());
+        ASSERT_TRUE(w.WriteZeroes(2 * kChunk + 10 - 1000).is_ok());
+        ASSERT_TRUE(Feed(w, image.substr(2 * kChunk + 10)).is_ok());
+        ASSERT_TRUE(w.Finish().is_ok());
+        EXPECT_EQ(w.ChunksVerified(), 3u);
+    }
+    {
+        // Resumed in the middle of chunk 1: chunks 0 and 1 go unchecked.
+        RecordingWriter out;
+        flash::ChunkVerifyWriter w(out, hashes, kChunk + 4096);
+        ASSERT_TRUE(Feed(w, image.substr(kChunk + 4096)).is_ok());
+        ASSERT_TRUE(w.Finish().is_ok());
+        EXPECT_EQ(w.ChunksVerified(), 1u);
+        EXPECT_EQ(w.ChunksUnchecked(), 2u);
+    }
+    for (const std::string& wrong : {image.substr(0, 2 * kChunk), image + "x"}) {
+        RecordingWriter out;
+        flash::ChunkVerifyWriter w(out, hashes);
+        auto r = Feed(w, wrong);
+        if (r.is_ok()) r = w.Finish();
+        EXPECT_EQ(r.err, EBADMSG) << wrong.size();
+    }
+}
+
+TEST_F(ChunkHashesTests, ReadBackNamesTheBadChunks) {
+    const std::string image = Image(40 * kChunk + 5);
+    const auto hashes = Hashes(image);
+    const std::string path = tmp.Path() + "/part";
+    std::string on_disk = image;
+    on_disk[3 * kChunk] ^= 1;
+    on_disk[17 * kChunk + 9] ^= 1;
+    on_disk[40 * kChunk + 4] ^= 1;
+    std::ofstream(path, std::ios::binary) << on_disk;
+
+    std::vector<std::size_t> bad;
+    const auto r = flash::VerifyChunks(path, hashes, image.size(), 4, &bad);
+    EXPECT_EQ(r.err, EIO);
+    EXPECT_EQ(bad, (std::vector<std::size_t>{3, 17, 40}));
+    EXPECT_NE(r.msg.find("chunk 40 (bytes 655360-655364)"), std::string::npos) << r.msg;
+
+    std::ofstream(path, std::ios::binary) << image;
+    EXPECT_TRUE(flash::VerifyChunks(path, hashes, image.size(), 0, &bad).is_ok());
+    EXPECT_TRUE(bad.empty());
+    EXPECT_EQ(flash::VerifyChunks(path, hashes, image.size() - kChunk, 2).err, EBADMSG);
+}
+
+TEST_F(ChunkHashesTests, RawInstallAbortsEarlyAndVerifiesReadBack) {
+    const std::string image = Image(64 * kChunk);
+    flash::Component comp;
+    comp.name = "rootfs";
+    comp.type = "raw";
+    comp.install_to = tmp.Path() + "/slot";
+    comp.chunk_bytes = kChunk;
+    comp.chunk_sha256 = HexChunks(image, kChunk);
+
+    flash::UpdateModule::Options opt;
+    opt.verify_chunks = true;
+    opt.verify_threads = 3;
+    auto r = flash::UpdateModule::Execute(comp, std::make_unique<StringReader>(image), opt);
+    ASSERT_TRUE(r.is_ok()) << r.msg;
+
+    std::string bad = image;
+    bad[5 * kChunk + 1] ^= 1;
+    r = flash::UpdateModule::Execute(comp, std::make_unique<StringReader>(bad), opt);
+    ASSERT_FALSE(r.is_ok());
+    EXPECT_EQ(r.err, EBADMSG);
+    EXPECT_NE(r.msg.find("chunk 5 "), std::string::npos) << r.msg;
+}
+
+} // namespace
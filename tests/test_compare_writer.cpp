@@ -0,0 +1,225 @@
+#include <gtest/gtest.h>
+
+#include "flash/compare_writer.hpp"
+#include "flash/partition_writer.hpp"
+
+#include "testing.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+using testutil::Pattern;
+
+// Counts what actually reaches the target.
+struct RecordingWriter final : flash::IWriter {
+    explicit RecordingWriter(flash::IWriter& inner) : inner(inner) {}
+    flash::Result WriteAll(std::span<const std::uint8_t> in) override {
+        written += in.size();
+        return inner.WriteAll(in);
+    }
+    flash::Result WriteZeroes(std::uint64_t len) override {
+        zeroed += len;
+        return inner.WriteZeroes(len);
+    }
+    flash::Result Skip(std::uint64_t len) override {
+        skipped += len;
+        return inner.Skip(len);
+    }
+    flash::Result FsyncNow() override { return inner.FsyncNow(); }
+
+    flash::IWriter& inner;
+    std::uint64_t written = 0;
+    std::uint64_t zeroed = 0;
+    std::uint64_t skipped = 0;
+};
+
+class CompareWriterTests : public ::testing::Test {
+protected:
+    testutil::TemporaryDirectory tmp;
+
+    static void WriteFile(const std::string& path, const std::vector<std::uint8_t>& data) {
+        std::ofstream os(path, std::ios::binary | std::ios::trunc);
+        os.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+    }
+
+    static std::vector<std::uint8_t> ReadFile(const std::string& path) {
+        std::ifstream is(path, std::ios::binary);
+        return std::vector<std::uint8_t>((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    }
+
+    static flash::CompareWriter::Options SmallChunks() {
+        flash::CompareWriter::Options o;
+        o.readahead_bytes = 64 * 1024;
+        o.readahead_depth = 3;
+        return o;
+    }
+
+    static void Feed(flash::IWriter& w, const std::vector<std::uint8_t>& data) {
+        size_t off = 0;
+        size_t step = 1000;
+        while (off < data.size()) {
+            const size_t n = std::min(step, data.size() - off);
+            ASSERT_TRUE(w.WriteAll({data.data() + off, n}).ok);
+            off += n;
+            step = step * 5 % 70001 + 1;
+        }
+        ASSERT_TRUE(w.FsyncNow().ok);
+    }
+};
+
+TEST_F(CompareWriterTests, OnlyChangedBlocksAreWritten) {
+    const std::string path = tmp.Path() + "/slot_b";
+    const auto old_img = Pattern(1024 * 1024, 1);
+    WriteFile(path, old_img);
+
+    auto new_img = old_img;
+    new_img[5] ^= 0xFF;                  // block 0
+    new_img[100 * 4096 + 17] ^= 0x01;    // block 100
+    new_img[255 * 4096 + 4095] ^= 0x80;  // block 255 (last)
+
+    flash::PartitionWriter::Options popt;
+    popt.truncate = false;
+    flash::PartitionWriter pw;
+    ASSERT_TRUE(flash::PartitionWriter::Open(path, popt, pw).ok);
+    RecordingWriter rec(pw);
+    flash::CompareWriter w(rec, SmallChunks());
+    auto res = w.Open(path);
+    ASSERT_TRUE(res.ok) << res.msg;
+
+    Feed(w, new_img);
+    res = w.VerifyTarget();
+    ASSERT_TRUE(res.ok) << res.msg;
+
+    EXPECT_EQ(ReadFile(path), new_img);
+    EXPECT_EQ(w.BlocksTotal(), 256u);
+    EXPECT_EQ(w.BlocksSkipped(), 253u);
+    EXPECT_EQ(rec.written, 3u * 4096);
+    EXPECT_EQ(rec.skipped, 253u * 4096);
+}
+
+TEST_F(CompareWriterTests, LongerImageThanTargetWritesTheTail) {
+    const std::string path = tmp.Path() + "/short";
+    const auto new_img = Pattern(300 * 1024 + 123, 2);
+    WriteFile(path, std::vector<std::uint8_t>(new_img.begin(), new_img.begin() + 100 * 1024));
+
+    flash::PartitionWriter::Options popt;
+    popt.truncate = false;
+    flash::PartitionWriter pw;
+    ASSERT_TRUE(flash::PartitionWriter::Open(path, popt, pw).ok);
+    flash::CompareWriter w(pw, SmallChunks());
+    ASSERT_TRUE(w.Open(path).ok);
+
+    Feed(w, new_img);
+    auto res = w.VerifyTarget();
+    ASSERT_TRUE(res.ok) << res.msg;
+    EXPECT_EQ(ReadFile(path), new_img);
+    EXPECT_EQ(w.BlocksSkipped(), 25u);
+}
+
+TEST_F(CompareWriterTests, ShorterImageThanTargetCutsTheStaleTail) {
+    const std::string path = tmp.Path() + "/long";
+    const auto new_img = Pattern(200 * 1024 + 5, 4);
+    auto old_img = new_img;
+    old_img.resize(500 * 1024, 0x5A);
+    WriteFile(path, old_img);
+
+    // Without the trim the old tail is still there, and verify sees it.
+    for (bool trim : {false, true}) {
+        flash::PartitionWriter::Options popt;
+        popt.truncate = false;
+        flash::PartitionWriter pw;
+        ASSERT_TRUE(flash::PartitionWriter::Open(path, popt, pw).ok);
+        flash::CompareWriter w(pw, SmallChunks());
+        ASSERT_TRUE(w.Open(path).ok);
+        Feed(w, new_img);
+        if (trim) {
+            ASSERT_TRUE(w.TrimTarget().ok);
+        }
+        auto res = w.VerifyTarget();
+        EXPECT_EQ(res.ok, trim) << res.msg;
+    }
+    EXPECT_EQ(ReadFile(path), new_img);
+}
+
+// A skip that ends mid-block under O_DIRECT must keep the old bytes of that
+// block rather than zero them.
+TEST_F(CompareWriterTests, DirectUnalignedSkipsKeepTheOldBytes) {
+    const std::string path = tmp.Path() + "/direct";
+    const auto img = Pattern(300 * 1024 + 123, 5);
+    WriteFile(path, img);
+
+    flash::PartitionWriter::Options popt;
+    popt.truncate = false;
+    popt.direct = true;
+    flash::PartitionWriter pw;
+    ASSERT_TRUE(flash::PartitionWriter::Open(path, popt, pw).ok);
+    if (!pw.Direct()) GTEST_SKIP() << "no O_DIRECT on this filesystem";
+    flash::CompareWriter w(pw, SmallChunks());
+    ASSERT_TRUE(w.Open(path).ok);
+
+    const std::size_t cuts[] = {1000, 70000 + 1000, 150000, img.size()};
+    for (std::size_t k = 0, pos = 0; k < 4; pos = cuts[k++]) {
+        if (k % 2 == 0) {
+            ASSERT_TRUE(w.Skip(cuts[k] - pos).ok);
+        } else {
+            ASSERT_TRUE(w.WriteAll({img.data() + pos, cuts[k] - pos}).ok);
+        }
+    }
+    ASSERT_TRUE(w.FsyncNow().ok);
+    auto res = w.VerifyTarget();
+    ASSERT_TRUE(res.ok) << res.msg;
+    EXPECT_EQ(ReadFile(path), img);
+}
+
+TEST_F(CompareWriterTests, ZeroRangesCompareAgainstZeros) {
+    const std::string path = tmp.Path() + "/zeros";
+    std::vector<std::uint8_t> old_img(512 * 1024, 0);
+    old_img[300 * 1024] = 1;  // one dirty block inside the zero range
+    WriteFile(path, old_img);
+
+    flash::PartitionWriter::Options popt;
+    popt.truncate = false;
+    flash::PartitionWriter pw;
+    ASSERT_TRUE(flash::PartitionWriter::Open(path, popt, pw).ok);
+    RecordingWriter rec(pw);
+    flash::CompareWriter w(rec, SmallChunks());
+    ASSERT_TRUE(w.Open(path).ok);
+
+    ASSERT_TRUE(w.WriteZeroes(old_img.size()).ok);
+    ASSERT_TRUE(w.FsyncNow().ok);
+    auto res = w.VerifyTarget();
+    ASSERT_TRUE(res.ok) << res.msg;
+
+    EXPECT_EQ(ReadFile(path), std::vector<std::uint8_t>(old_img.size(), 0));
+    EXPECT_EQ(rec.zeroed, 4096u);
+    EXPECT_EQ(w.BlocksSkipped(), 127u);
+}
+
+TEST_F(CompareWriterTests, VerifyDetectsCorruptedTarget) {
+    const std::string path = tmp.Path() + "/corrupt";
+    const auto img = Pattern(200 * 1024, 3);
+    WriteFile(path, img);
+
+    flash::PartitionWriter::Options popt;
+    popt.truncate = false;
+    flash::PartitionWriter pw;
+    ASSERT_TRUE(flash::PartitionWriter::Open(path, popt, pw).ok);
+    flash::CompareWriter w(pw, SmallChunks());
+    ASSERT_TRUE(w.Open(path).ok);
+    Feed(w, img);
+
+    auto bad = img;
+    bad[12345] ^= 0x10;
+    WriteFile(path, bad);
+
+    auto res = w.VerifyTarget();
+    EXPECT_FALSE(res.ok);
+    EXPECT_EQ(res.err, EIO);
+}
+
+} // namespace
@@ -0,0 +1,114 @@
+#include <gtest/gtest.h>
+
+#include "flash/decompress.hpp"
+#include "flash/peek_reader.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Hands out at most `chunk` bytes per Read() so peeks span several reads.
+class ChunkReader final : public flash::IReader {
+public:
+    ChunkReader(std::vector<std::uint8_t> data, std::size_t chunk) : data_(std::move(data)), chunk_(chunk) {}
+    ssize_t Read(std::span<std::uint8_t> out) override {
+        const std::size_t n = std::min({out.size(), data_.size() - pos_, chunk_});
+        std::copy_n(data_.begin() + static_cast<std::ptrdiff_t>(pos_), n, out.begin());
+        pos_ += n;
+        return static_cast<ssize_t>(n);
+    }
+
+private:
+    std::vector<std::uint8_t> data_;
+    std::size_t chunk_;
+    std::size_t pos_ = 0;
+};
+
+std::vector<std::uint8_t> ReadAll(flash::IReader& r) {
+    std::vector<std::uint8_t> out;
+    std::vector<std::uint8_t> buf(5);
+    while (true) {
+        const ssize_t n = r.Read(buf);
+        EXPECT_GE(n, 0);
+        if (n <= 0) break;
+        out.insert(out.end(), buf.begin(), buf.begin() + n);
+    }
+    return out;
+}
+
+TEST(DecompressTest, SniffsKnownMagics) {
+    using flash::Compression;
+    using V = std::vector<std::uint8_t>;
+    EXPECT_EQ(flash::SniffCompression(V{0x1F, 0x8B, 0x08, 0x00}), Compression::Gzip);
+    EXPECT_EQ(flash::SniffCompression(V{0x28, 0xB5, 0x2F, 0xFD, 0x04}), Compression::Zstd);
+    EXPECT_EQ(flash::SniffCompression(V{0x5E, 0x2A, 0x4D, 0x18, 0x00}), Compression::Zstd);
+    EXPECT_EQ(flash::SniffCompression(V{0xFD, '7', 'z', 'X', 'Z', 0x00}), Compression::Xz);
+    EXPECT_EQ(flash::SniffCompression(V{0x04, 0x22, 0x4D, 0x18}), Compression::Lz4);
+    EXPECT_EQ(flash::SniffCompression(V{0x1F}), Compression::None);
+    EXPECT_EQ(flash::SniffCompression(V{0x00, 0x00, 0x00, 0x00}), Compression::None);
+    EXPECT_EQ(flash::SniffCompression(V{}), Compression::None);
+}
+
+TEST(DecompressTest, PeekKeepsSniffedBytes) {
+    std::vector<std::uint8_t> data(100);
+    for (std::size_t i = 0; i < data.size(); ++i) data[i] = static_cast<std::uint8_t>(i);
+
+    flash::PeekReader peek(std::make_unique<ChunkReader>(data, 3));
+    std::span<const std::uint8_t> head;
+    ASSERT_EQ(peek.Peek(8, head), 8);
+    EXPECT_TRUE(std::equal(head.begin(), head.end(), data.begin()));
+    EXPECT_EQ(ReadAll(peek), data);
+
+    flash::PeekReader short_stream(std::make_unique<ChunkReader>(std::vector<std::uint8_t>{1, 2}, 1));
+    ASSERT_EQ(short_stream.Peek(6, head), 2);
+    EXPECT_EQ(ReadAll(short_stream), (std::vector<std::uint8_t>{1, 2}));
+}
+
+TEST(DecompressTest, RawPayloadPassesThrough) {
+    const std::vector<std::uint8_t> data = {'r', 'a', 'w', ' ', 'i', 'm', 'g'};
+    std::unique_ptr<flash::IReader> r = std::make_unique<ChunkReader>(data, 2);
+    flash::Compression c{};
+    ASSERT_TRUE(flash::OpenDecompressor(r, {}, nullptr, &c).ok);
+    EXPECT_EQ(c, flash::Compression::None);
+    EXPECT_EQ(ReadAll(*r), data);
+}
+
+TEST(DecompressTest, GzipDetectedWithoutFilename) {
+    // echo -n "hello" | gzip -c
+    const std::vector<std::uint8_t> gz = {0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+                                          0x03, 0xcb, 0x48, 0xcd, 0xc9, 0xc9, 0x07, 0x00, 0x86,
+                                          0xa6, 0x10, 0x36, 0x05, 0x00, 0x00, 0x00};
+    std::unique_ptr<flash::IReader> r = std::make_unique<ChunkReader>(gz, 1);
+    flash::Compression c{};
+    ASSERT_TRUE(flash::OpenDecompressor(r, {}, nullptr, &c).ok);
+    EXPECT_EQ(c, flash::Compression::Gzip);
+    EXPECT_EQ(ReadAll(*r), (std::vector<std::uint8_t>{'h', 'e', 'l', 'l', 'o'}));
+
+    // Forcing "none" keeps the compressed bytes as the image.
+    r = std::make_unique<ChunkReader>(gz, 4);
+    const flash::Compression none = flash::Compression::None;
+    ASSERT_TRUE(flash::OpenDecompressor(r, {}, &none).ok);
+    EXPECT_EQ(ReadAll(*r), gz);
+}
+
+TEST(DecompressTest, UnsupportedFormatFails) {
+    std::unique_ptr<flash::IReader> r =
+        std::make_unique<ChunkReader>(std::vector<std::uint8_t>{0x04, 0x22, 0x4D, 0x18, 0x64, 0x40}, 16);
+    auto res = flash::OpenDecompressor(r);
+    EXPECT_FALSE(res.ok);
+    EXPECT_EQ(res.err, ENOTSUP);
+}
+
+TEST(DecompressTest, ParsesManifestNames) {
+    flash::Compression c{};
+    ASSERT_TRUE(flash::ParseCompression("zstd", c));
+    EXPECT_EQ(c, flash::Compression::Zstd);
+    ASSERT_TRUE(flash::ParseCompression("none", c));
+    EXPECT_EQ(c, flash::Compression::None);
+    EXPECT_FALSE(flash::ParseCompression("bzip2", c));
+}
+
+} // namespace
@@ -0,0 +1,166 @@
+#include <gtest/gtest.h>
+
+#include "flash/delta.hpp"
+#include "flash/update_module.hpp"
+
+#include "testing.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+using testutil::Pattern;
+
+struct VecWriter final : flash::IWriter {
+    std::vector<std::uint8_t> data;
+    flash::Result WriteAll(std::span<const std::uint8_t> in) override {
+        data.insert(data.end(), in.begin(), in.end());
+        return flash::Result::Ok();
+    }
+    flash::Result FsyncNow() override { return flash::Result::Ok(); }
+};
+
+class VecReader final : public flash::IReader {
+public:
+    explicit VecReader(std::vector<std::uint8_t> data) : data_(std::move(data)) {}
+    ssize_t Read(std::span<std::uint8_t> out) override {
+        // Short reads on purpose: ops must survive arbitrary read sizes.
+        const size_t n = std::min({out.size(), data_.size() - pos_, size_t{7777}});
+        std::copy_n(data_.begin() + static_cast<std::ptrdiff_t>(pos_), n, out.begin());
+        pos_ += n;
+        return static_cast<ssize_t>(n);
+    }
+
+private:
+    std::vector<std::uint8_t> data_;
+    size_t pos_ = 0;
+};
+
+class DeltaTests : public ::testing::Test {
+protected:
+    testutil::TemporaryDirectory tmp;
+
+    std::string Path(const std::string& name) { return tmp.Path() + "/" + name; }
+
+    static void WriteFile(const std::string& path, const std::vector<std::uint8_t>& data) {
+        std::ofstream os(path, std::ios::binary | std::ios::trunc);
+        os.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+    }
+
+    static std::vector<std::uint8_t> ReadFile(const std::string& path) {
+        std::ifstream is(path, std::ios::binary);
+        return std::vector<std::uint8_t>((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    }
+
+    // Source slot plus a target that keeps most blocks, moves some, zeroes a
+    // range, changes a few bytes and grows by a partial block.
+    void MakeImages(std::vector<std::uint8_t>& src, std::vector<std::uint8_t>& dst) {
+        src = Pattern(2 * 1024 * 1024, 1);
+        dst = src;
+        std::copy_n(src.begin() + 100 * 4096, 8 * 4096, dst.begin() + 300 * 4096);  // moved blocks
+        std::fill_n(dst.begin() + 400 * 4096, 32 * 4096, 0);                          // zeroed
+        dst[12345] ^= 0xFF;                                                           // changed
+        const auto tail = Pattern(5000, 9);
+        dst.insert(dst.end(), tail.begin(), tail.end());
+        WriteFile(Path("slot_a"), src);
+        WriteFile(Path("target.img"), dst);
+    }
+
+    std::vector<std::uint8_t> Build(flash::DeltaStats* stats = nullptr) {
+        VecWriter out;
+        auto r = flash::BuildDelta(Path("slot_a"), Path("target.img"), out, stats);
+        EXPECT_TRUE(r.ok) << r.msg;
+        return out.data;
+    }
+};
+
+TEST_F(DeltaTests, RoundTripReproducesTarget) {
+    std::vector<std::uint8_t> src, dst;
+    MakeImages(src, dst);
+
+    flash::DeltaStats st;
+    const auto payload = Build(&st);
+    EXPECT_EQ(st.copy_bytes + st.data_bytes + st.zero_bytes, dst.size());
+    EXPECT_EQ(st.zero_bytes, 32u * 4096);
+    EXPECT_EQ(st.data_bytes, 4096u + 5000u);
+    EXPECT_LT(payload.size(), 16u * 1024);
+
+    VecReader in(payload);
+    flash::DeltaReader reader;
+    ASSERT_TRUE(flash::DeltaReader::Open(in, Path("slot_a"), reader).ok);
+    ASSERT_EQ(reader.TotalSize(), std::nullopt);
+
+    std::vector<std::uint8_t> out;
+    std::vector<std::uint8_t> buf(64 * 1024 + 3);
+    while (true) {
+        const ssize_t n = reader.Read(buf);
+        ASSERT_GE(n, 0) << reader.Error();
+        if (n == 0) break;
+        out.insert(out.end(), buf.begin(), buf.begin() + n);
+    }
+    EXPECT_EQ(out, dst);
+    EXPECT_EQ(reader.Stats().copy_bytes, st.copy_bytes);
+}
+
+TEST_F(DeltaTests, ChangedSourceFailsHashCheck) {
+    std::vector<std::uint8_t> src, dst;
+    MakeImages(src, dst);
+    const auto payload = Build();
+
+    src[5] ^= 0x01;  // the active slot is not what the delta was built against
+    WriteFile(Path("slot_a"), src);
+
+    VecReader in(payload);
+    flash::DeltaReader reader;
+    ASSERT_TRUE(flash::DeltaReader::Open(in, Path("slot_a"), reader).ok);
+    std::vector<std::uint8_t> buf(1024 * 1024);
+    ssize_t n = 0;
+    while ((n = reader.Read(buf)) > 0) {}
+    EXPECT_EQ(n, -1);
+    EXPECT_NE(reader.Error().find("sha256 mismatch"), std::string::npos) << reader.Error();
+}
+
+TEST_F(DeltaTests, TruncatedPayloadFails) {
+    std::vector<std::uint8_t> src, dst;
+    MakeImages(src, dst);
+    auto payload = Build();
+    payload.resize(payload.size() - 1);  // drop END
+
+    VecReader in(payload);
+    flash::DeltaReader reader;
+    ASSERT_TRUE(flash::DeltaReader::Open(in, Path("slot_a"), reader).ok);
+    std::vector<std::uint8_t> buf(1024 * 1024);
+    ssize_t n = 0;
+    while ((n = reader.Read(buf)) > 0) {}
+    EXPECT_EQ(n, -1);
+    EXPECT_EQ(errno, EBADMSG);
+}
+
+TEST_F(DeltaTests, UpdateModuleInstallsDeltaComponent) {
+    std::vector<std::uint8_t> src, dst;
+    MakeImages(src, dst);
+    const auto payload = Build();
+
+    flash::Component comp;
+    comp.name = "rootfs";
+    comp.type = "delta";
+    comp.filename = "rootfs.delta";
+    comp.delta_source = Path("slot_a");
+    comp.install_to = Path("slot_b");
+
+    flash::UpdateModule::Options opt;
+    opt.progress = false;
+    auto res = flash::UpdateModule::Execute(comp, std::make_unique<VecReader>(payload), opt);
+    ASSERT_TRUE(res.ok) << res.msg;
+    EXPECT_EQ(ReadFile(Path("slot_b")), dst);
+
+    comp.delta_source.clear();
+    EXPECT_FALSE(flash::UpdateModule::Execute(comp, std::make_unique<VecReader>(payload), opt).ok);
+}
+
+} // namespace
@@ -0,0 +1,129 @@
+#include <gtest/gtest.h>
+
+#include "flash/archive_installer.hpp"
+#include "flash/durability.hpp"
+#include "flash/update_module.hpp"
+
+#include "testing.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <string>
+
+namespace {
+
+class StringReader final : public flash::IReader {
+public:
+    explicit StringReader(std::string data) : data_(std::move(data)) {}
+    ssize_t Read(std::span<std::uint8_t> out) override {
+        const std::size_t n = std::min(out.size(), data_.size() - pos_);
+        std::copy_n(data_.data() + pos_, n, out.data());
+        pos_ += n;
+        return static_cast<ssize_t>(n);
+    }
+
+private:
+    std::string data_;
+    std::size_t pos_ = 0;
+};
+
+class DurabilityTests : public ::testing::Test {
+protected:
+    testutil::TemporaryDirectory tmp;
+
+    // Installs a 5 MiB raw image with 1 MiB fsync interval under `policy`.
+    void InstallRaw(flash::DurabilityPolicy& policy, const std::string& name) {
+        std::string image(5 * 1024 * 1024, '\0');
+        for (std::size_t i = 0; i < image.size(); ++i) image[i] = static_cast<char>(i * 131 >> 5);
+
+        flash::Component comp;
+        comp.name = name;
+        comp.type = "raw";
+        comp.install_to = tmp.Path() + "/" + name;
+
+        flash::UpdateModule::Options opt;
+        opt.progress = false;
+        opt.io_uring_queue_depth = 0;
+        opt.pipeline_buffer_bytes = 256 * 1024;
+        opt.fsync_interval_bytes = 1024 * 1024;
+        opt.durability = &policy;
+        const auto res = flash::UpdateModule::Execute(comp, std::make_unique<StringReader>(image), opt);
+        ASSERT_TRUE(res.is_ok()) << res.msg;
+
+        std::ifstream is(comp.install_to, std::ios::binary);
+        EXPECT_TRUE(std::string((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>()) == image);
+    }
+};
+
+TEST_F(DurabilityTests, ParsesModeNames) {
+    for (auto m : {flash::DurabilityMode::Interval, flash::DurabilityMode::Component, flash::DurabilityMode::Final}) {
+        flash::DurabilityMode parsed{};
+        ASSERT_TRUE(flash::ParseDurabilityMode(flash::DurabilityModeName(m), parsed));
+        EXPECT_EQ(parsed, m);
+    }
+    flash::DurabilityMode parsed{};
+    EXPECT_FALSE(flash::ParseDurabilityMode("sometimes", parsed));
+}
+
+TEST_F(DurabilityTests, IntervalModeFlushesPeriodically) {
+    flash::DurabilityPolicy policy(flash::DurabilityMode::Interval);
+    InstallRaw(policy, "slot");
+    EXPECT_GE(policy.GetStats().flushes, 5u);
+}
+
+TEST_F(DurabilityTests, ComponentModeFlushesOncePerComponent) {
+    flash::DurabilityPolicy policy(flash::DurabilityMode::Component);
+    InstallRaw(policy, "a");
+    InstallRaw(policy, "b");
+    EXPECT_EQ(policy.GetStats().flushes, 2u);
+}
+
+TEST_F(DurabilityTests, FinalModeCoalescesIntoOneSyncfs) {
+    flash::DurabilityPolicy policy(flash::DurabilityMode::Final);
+    InstallRaw(policy, "a");
+    InstallRaw(policy, "b");
+    EXPECT_EQ(policy.GetStats().flushes, 0u);
+
+    ASSERT_TRUE(policy.FlushAll().is_ok());
+    EXPECT_EQ(policy.GetStats().flushes, 1u);  // both targets share a filesystem
+
+    // Nothing left deferred.
+    ASSERT_TRUE(policy.FlushAll().is_ok());
+    EXPECT_EQ(policy.GetStats().flushes, 1u);
+}
+
+TEST_F(DurabilityTests, FinalModeSyncsFileComponentsBeforeTheRename) {
+    flash::DurabilityPolicy policy(flash::DurabilityMode::Final);
+    flash::Component comp;
+    comp.name = "conf";
+    comp.type = "file";
+    comp.path = tmp.Path() + "/conf";
+
+    flash::UpdateModule::Options opt;
+    opt.progress = false;
+    opt.durability = &policy;
+    const auto res = flash::UpdateModule::Execute(comp, std::make_unique<StringReader>("new contents"), opt);
+    ASSERT_TRUE(res.is_ok()) << res.msg;
+    EXPECT_EQ(policy.GetStats().flushes, 1u);
+}
+
+TEST_F(DurabilityTests, ArchiveExtractionSyncsItsFilesystem) {
+    const std::string dir = tmp.Path() + "/tree";
+    flash::ArchiveInstaller::Options aopt;
+    aopt.progress = false;
+
+    // An empty tar: two 512-byte zero blocks.
+    for (auto mode : {flash::DurabilityMode::Component, flash::DurabilityMode::Final}) {
+        flash::DurabilityPolicy policy(mode);
+        aopt.durability = &policy;
+        StringReader in(std::string(1024, '\0'));
+        flash::ArchiveInstaller installer(aopt);
+        ASSERT_TRUE(installer.InstallTarStreamToTarget(in, dir, "tree").is_ok());
+        EXPECT_EQ(policy.GetStats().flushes, mode == flash::DurabilityMode::Final ? 0u : 1u);
+        ASSERT_TRUE(policy.FlushAll().is_ok());
+        EXPECT_EQ(policy.GetStats().flushes, 1u);
+    }
+}
+
+} // namespace
@@ -0,0 +1,213 @@
+#include <gtest/gtest.h>
+
+#include "flash/archive_installer.hpp"
+#include "flash/ext4_builder.hpp"
+#include "flash/file_reader.hpp"
+
+#include "testing.hpp"
+
+#include <cstdio>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+using testutil::Pattern;
+using testutil::TarDir;
+using testutil::TarFile;
+using testutil::TarHardlink;
+using testutil::TarNode;
+using testutil::TarSymlink;
+
+// The images are checked with the e2fsprogs tools when they are installed.
+std::string Tool(const char* name) {
+    for (const char* dir : {"/usr/sbin/", "/sbin/", "/usr/bin/"}) {
+        const std::string path = std::string(dir) + name;
+        if (::access(path.c_str(), X_OK) == 0) return path;
+    }
+    return {};
+}
+
+int Shell(const std::string& cmd, std::string* out = nullptr) {
+    FILE* p = ::popen((cmd + " 2>&1").c_str(), "r");
+    if (!p) return -1;
+    char buf[4096];
+    std::string text;
+    size_t n;
+    while ((n = std::fread(buf, 1, sizeof(buf), p)) > 0) text.append(buf, n);
+    const int status = ::pclose(p);
+    if (out) *out = text;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+class Ext4BuilderTests : public ::testing::Test {
+protected:
+    testutil::TemporaryDirectory tmp;
+    std::string e2fsck = Tool("e2fsck");
+    std::string debugfs = Tool("debugfs");
+
+    void SetUp() override {
+        if (e2fsck.empty() || debugfs.empty()) GTEST_SKIP() << "e2fsprogs not installed";
+    }
+
+    std::string Image(std::uint64_t mib) {
+        const std::string path = tmp.Path() + "/fs.img";
+        std::ofstream(path, std::ios::binary).close();
+        EXPECT_EQ(::truncate(path.c_str(), static_cast<off_t>(mib * 1024 * 1024)), 0);
+        return path;
+    }
+
+    void ExpectClean(const std::string& img) {
+        std::string out;
+        EXPECT_EQ(Shell(e2fsck + " -fn " + img, &out), 0) << out;
+    }
+
+    std::string Debugfs(const std::string& img, const std::string& req) {
+        std::string out;
+        Shell(debugfs + " -R '" + req + "' " + img, &out);
+        return out;
+    }
+
+    std::string Cat(const std::string& img, const std::string& path) {
+        const std::string dump = tmp.Path() + "/dump";
+        ::unlink(dump.c_str());
+        Debugfs(img, "dump " + path + " " + dump);
+        std::ifstream is(dump, std::ios::binary);
+        return std::string((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    }
+
+    std::string MakeTar(const std::vector<testutil::TarEntry>& entries) {
+        return testutil::WriteTar(tmp.Path() + "/tree.tar", entries);
+    }
+
+    flash::Result Install(const std::string& tar, const std::string& img) {
+        flash::FileOrStdinReader in;
+        auto r = flash::FileOrStdinReader::Open(tar, in);
+        if (!r.is_ok()) return r;
+        flash::ArchiveInstaller::Options opt;
+        opt.progress = false;
+        opt.mkfs = "ext4";
+        flash::ArchiveInstaller installer(opt);
+        return installer.InstallTarStreamToTarget(in, img, "rootfs");
+    }
+};
+
+TEST_F(Ext4BuilderTests, BuildsCleanFilesystemFromArchive) {
+    std::vector<testutil::TarEntry> entries;
+    entries.push_back(TarDir("./"));
+    entries.push_back(TarDir("etc/"));
+    for (unsigned i = 0; i < 400; ++i) {
+        entries.push_back(TarFile("etc/many/f" + std::to_string(i), Pattern<std::string>(i * 53, i)));
+    }
+    entries.push_back(TarFile("usr/lib/big.bin", Pattern<std::string>(3 * 1024 * 1024 + 11, 7)));
+    entries.push_back(TarFile("usr/bin/su", "#!", 04755));
+    entries.push_back(TarFile("home/user/.profile", "x", 0600));
+    entries.back().uid = 1234;
+    entries.push_back(TarFile("etc/empty", ""));
+    entries.push_back(TarFile("etc/hostname", "old"));
+    entries.push_back(TarFile("etc/hostname", "new"));
+    entries.push_back(TarSymlink("etc/short", "many/f1"));
+    entries.push_back(TarSymlink("etc/long", std::string(100, 'l')));
+    entries.push_back(TarHardlink("etc/hard", "etc/many/f2"));
+    entries.push_back(TarNode("dev/null", AE_IFCHR, 0666, makedev(1, 3)));
+    entries.push_back(TarNode("dev/big", AE_IFBLK, 0660, makedev(259, 300)));
+    entries.push_back(TarNode("run/fifo", AE_IFIFO, 0620));
+    const std::string img = Image(64);
+
+    const auto res = Install(MakeTar(entries), img);
+    ASSERT_TRUE(res.is_ok()) << res.msg;
+    ExpectClean(img);
+
+    for (unsigned i : {0u, 1u, 199u, 399u}) {
+        EXPECT_EQ(Cat(img, "/etc/many/f" + std::to_string(i)), Pattern<std::string>(i * 53, i)) << i;
+    }
+    EXPECT_TRUE(Cat(img, "/usr/lib/big.bin") == Pattern<std::string>(3 * 1024 * 1024 + 11, 7));
+    EXPECT_EQ(Cat(img, "/etc/hostname"), "new");
+    EXPECT_EQ(Cat(img, "/etc/hard"), Pattern<std::string>(2 * 53, 2));
+
+    std::string st = Debugfs(img, "stat /usr/bin/su");
+    EXPECT_NE(st.find("Mode:  04755"), std::string::npos) << st;
+    st = Debugfs(img, "stat /home/user/.profile");
+    EXPECT_NE(st.find("User:  1234"), std::string::npos) << st;
+    EXPECT_NE(st.find("Group:  1234"), std::string::npos) << st;
+    st = Debugfs(img, "stat /etc/many/f2");
+    EXPECT_NE(st.find("Links: 2"), std::string::npos) << st;
+    st = Debugfs(img, "stat /etc/short");
+    EXPECT_NE(st.find("Fast link dest: \"many/f1\""), std::string::npos) << st;
+    EXPECT_EQ(Cat(img, "/etc/long"), std::string(100, 'l'));
+    st = Debugfs(img, "stat /dev/big");
+    EXPECT_NE(st.find("Device major/minor number: 259:300"), std::string::npos) << st;
+    st = Debugfs(img, "stat /run/fifo");
+    EXPECT_NE(st.find("Type: FIFO"), std::string::npos) << st;
+    EXPECT_NE(Debugfs(img, "ls /lost+found").find(".."), std::string::npos);
+}
+
+TEST_F(Ext4BuilderTests, SparseAndMultiGroupFiles) {
+    // Three block groups with a backup superblock in group 1; the big file
+    // runs across it and the sparse one needs an extent leaf block.
+    const std::string img = Image(300);
+    std::unique_ptr<flash::Ext4Builder> fs;
+    ASSERT_TRUE(flash::Ext4Builder::Open(img, {}, fs).is_ok());
+
+    flash::TreeEntryMeta m;
+    m.mode = S_IFREG | 0644;
+    const std::string chunk = Pattern<std::string>(5000, 3);
+    m.size = 20 * 1024 * 1024;
+    ASSERT_TRUE(fs->BeginFile("sparse", m).is_ok());
+    for (int i = 0; i < 12; ++i) {
+        ASSERT_TRUE(fs->FileData({reinterpret_cast<const std::uint8_t*>(chunk.data()), chunk.size()},
+                                 std::int64_t{i} * 1024 * 1024 + 100)
+                        .is_ok());
+    }
+    ASSERT_TRUE(fs->EndFile().is_ok());
+
+    const std::string big = Pattern<std::string>(150 * 1024 * 1024, 9);
+    m.size = static_cast<std::int64_t>(big.size());
+    ASSERT_TRUE(fs->BeginFile("data/big", m).is_ok());
+    for (std::size_t off = 0; off < big.size(); off += 1000 * 1000) {
+        const std::size_t n = std::min<std::size_t>(1000 * 1000, big.size() - off);
+        ASSERT_TRUE(fs->FileData({reinterpret_cast<const std::uint8_t*>(big.data()) + off, n},
+                                 static_cast<std::int64_t>(off))
+                        .is_ok());
+    }
+    ASSERT_TRUE(fs->EndFile().is_ok());
+    ASSERT_TRUE(fs->Finish().is_ok());
+    ASSERT_TRUE(fs->Sync().is_ok());
+    fs.reset();
+
+    ExpectClean(img);
+    EXPECT_TRUE(Cat(img, "/data/big") == big);
+
+    std::string expected(20 * 1024 * 1024, '\0');
+    for (int i = 0; i < 12; ++i) expected.replace(std::size_t(i) * 1024 * 1024 + 100, chunk.size(), chunk);
+    EXPECT_TRUE(Cat(img, "/sparse") == expected);
+    EXPECT_NE(Debugfs(img, "stat /sparse").find("(ETB0)"), std::string::npos);
+}
+
+TEST_F(Ext4BuilderTests, RebuildLeavesNoStaleState) {
+    const std::string img = Image(64);
+    std::vector<testutil::TarEntry> first;
+    for (unsigned i = 0; i < 200; ++i) first.push_back(TarFile("old/f" + std::to_string(i), Pattern<std::string>(9000, i)));
+    ASSERT_TRUE(Install(MakeTar(first), img).is_ok());
+
+    ASSERT_TRUE(Install(MakeTar({TarFile("new/file", "fresh")}), img).is_ok());
+    ExpectClean(img);
+    EXPECT_EQ(Cat(img, "/new/file"), "fresh");
+    EXPECT_NE(Debugfs(img, "stat /old").find("not found"), std::string::npos);
+}
+
+TEST_F(Ext4BuilderTests, ReportsFullFilesystem) {
+    const std::string img = Image(8);
+    const auto res = Install(MakeTar({TarFile("huge", Pattern<std::string>(16 * 1024 * 1024, 1))}), img);
+    ASSERT_FALSE(res.is_ok());
+    EXPECT_EQ(res.err, ENOSPC) << res.msg;
+}
+
+} // namespace
@@ -6,11 +6,14 @@
 #include "testing.hpp"
 
 #include <cstdint>
+#include <cerrno>
 #include <cstdio>
 #include <fstream>
 #include <string>
 #include <vector>
 
+#include <unistd.h>
+
 namespace {
 
 class FileReaderTests : public ::testing::Test {
@@ -77,4 +80,36 @@ TEST_F(FileReaderTests, ReadAllBytes_EqualsInput) {
     EXPECT_EQ(out, data);
 }
 
+TEST_F(FileReaderTests, RegularFileSeeks_PipeDoesNot) {
+    const std::string p = MakePath("seek.bin");
+    std::vector<std::uint8_t> data(4096);
+    for (size_t i = 0; i < data.size(); ++i) data[i] = static_cast<std::uint8_t>(i * 7);
+    WriteFile(p, data);
+
+    flash::FileOrStdinReader r;
+    ASSERT_TRUE(flash::FileOrStdinReader::Open(p, r).ok);
+    ASSERT_TRUE(r.Seekable());
+    EXPECT_EQ(r.Seek(1000, SEEK_SET), 1000);
+    EXPECT_EQ(r.Seek(24, SEEK_CUR), 1024);
+    std::uint8_t b = 0;
+    ASSERT_EQ(r.Read({&b, 1}), 1);
+    EXPECT_EQ(b, data[1024]);
+
+    int fds[2];
+    ASSERT_EQ(::pipe(fds), 0);
+    const int saved = ::dup(STDIN_FILENO);
+    ::dup2(fds[0], STDIN_FILENO);
+    {
+        flash::FileOrStdinReader in;
+        ASSERT_TRUE(flash::FileOrStdinReader::Open("-", in).ok);
+        EXPECT_FALSE(in.Seekable());
+        EXPECT_EQ(in.Seek(10, SEEK_CUR), -1);
+        EXPECT_EQ(errno, ESPIPE);
+    }  // closes fd 0; restored below
+    ::dup2(saved, STDIN_FILENO);
+    ::close(saved);
+    ::close(fds[0]);
+    ::close(fds[1]);
+}
+
 } // namespace
@@ -1,7 +1,13 @@
 #include <gtest/gtest.h>
 #include <vector>
 #include <string>
+#include <cerrno>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "flash/crc32.hpp"
 #include "flash/gzip_reader.hpp"
+#include "testing.hpp"
 
 namespace flash {
 
@@ -54,4 +60,223 @@ TEST(GzipReaderTest, HandlesInvalidGzipHeader) {
     EXPECT_LT(n, 0);
 }
 
-}
\ No newline at end of file
+namespace {
+
+std::vector<uint8_t> Gzip(const std::vector<uint8_t>& in) {
+    z_stream s{};
+    deflateInit2(&s, 6, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    std::vector<uint8_t> out(deflateBound(&s, in.size()));
+    s.next_in = const_cast<Bytef*>(in.data());
+    s.avail_in = static_cast<uInt>(in.size());
+    s.next_out = out.data();
+    s.avail_out = static_cast<uInt>(out.size());
+    deflate(&s, Z_FINISH);
+    out.resize(s.total_out);
+    deflateEnd(&s);
+    return out;
+}
+
+// Small alphabet: compresses, but not to nothing.
+std::vector<uint8_t> Pattern(size_t n, uint32_t seed) { return testutil::Pattern(n, seed, 11, 23); }
+
+// Pattern() repeats, so deflate covers megabytes per block; this does not.
+std::vector<uint8_t> Noise(size_t n, uint32_t seed) {
+    std::vector<uint8_t> v(n);
+    uint32_t x = seed | 1;
+    for (auto& b : v) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        b = static_cast<uint8_t>(x % 23);
+    }
+    return v;
+}
+
+// Seekable, and counts the bytes handed out.
+class FileLikeReader : public IReader {
+public:
+    explicit FileLikeReader(std::vector<uint8_t> data) : data_(std::move(data)) {}
+
+    ssize_t Read(std::span<std::uint8_t> out) override {
+        const size_t n = std::min(out.size(), data_.size() - std::min(pos_, data_.size()));
+        std::copy_n(data_.begin() + static_cast<std::ptrdiff_t>(pos_), n, out.begin());
+        pos_ += n;
+        read_ += n;
+        return static_cast<ssize_t>(n);
+    }
+    bool Seekable() const override { return true; }
+    std::int64_t Seek(std::int64_t offset, int whence) override {
+        if (whence == SEEK_CUR) offset += static_cast<std::int64_t>(pos_);
+        pos_ = static_cast<size_t>(offset);
+        return offset;
+    }
+    size_t BytesRead() const { return read_; }
+
+private:
+    std::vector<uint8_t> data_;
+    size_t pos_ = 0;
+    size_t read_ = 0;
+};
+
+ssize_t ReadAll(IReader& r, std::vector<uint8_t>& out) {
+    std::vector<uint8_t> buf(100000);
+    while (true) {
+        ssize_t n = r.Read(buf);
+        if (n <= 0) return n;
+        out.insert(out.end(), buf.begin(), buf.begin() + n);
+    }
+}
+
+} // namespace
+
+TEST(Crc32Test, MatchesZlib) {
+    const auto data = Pattern(70000, 5);
+    for (size_t off : {0, 1, 7}) {
+        for (size_t len : {0, 1, 15, 16, 63, 64, 65, 127, 128, 1000, 4096, 65536}) {
+            const std::span<const uint8_t> s(data.data() + off, len);
+            const uint32_t want = static_cast<uint32_t>(crc32(0L, s.data(), static_cast<uInt>(len)));
+            EXPECT_EQ(Crc32(0, s), want) << Crc32Backend() << " off=" << off << " len=" << len;
+            // Chaining matches a single pass.
+            EXPECT_EQ(Crc32(Crc32(0, s.first(len / 3)), s.subspan(len / 3)), want);
+        }
+    }
+}
+
+TEST(GzipReaderTest, DecodesConcatenatedMembersWithEveryBackend) {
+    const auto a = Pattern(300000, 1);
+    const auto b = Pattern(5000, 2);
+    auto payload = Gzip(a);
+    const auto second = Gzip(b);
+    payload.insert(payload.end(), second.begin(), second.end());
+    payload.resize(payload.size() + 512, 0);  // block padding after the last member
+
+    auto expect = a;
+    expect.insert(expect.end(), b.begin(), b.end());
+    for (InflateBackend backend : AvailableInflateBackends()) {
+        GzipReader reader(std::make_unique<BufferReader>(payload), backend);
+        std::vector<uint8_t> out;
+        ASSERT_EQ(ReadAll(reader, out), 0) << reader.Backend();
+        EXPECT_EQ(out, expect) << reader.Backend();
+        EXPECT_EQ(reader.Members(), 2u);
+    }
+}
+
+TEST(GzipReaderTest, TruncatedStreamFails) {
+    auto payload = Gzip(Pattern(200000, 3));
+    payload.resize(payload.size() - 3);  // cut into the trailer
+
+    GzipReader reader(std::make_unique<BufferReader>(payload));
+    std::vector<uint8_t> out;
+    EXPECT_EQ(ReadAll(reader, out), -1);
+    EXPECT_EQ(errno, EBADMSG);
+}
+
+TEST(GzipReaderTest, CrcMismatchFails) {
+    auto payload = Gzip(Pattern(10000, 4));
+    payload[payload.size() - 8] ^= 0x01;
+
+    GzipReader reader(std::make_unique<BufferReader>(payload));
+    std::vector<uint8_t> out;
+    EXPECT_EQ(ReadAll(reader, out), -1);
+    EXPECT_EQ(errno, EBADMSG);
+}
+
+TEST(GzipIndexTest, SeeksFromRecordedAccessPoints) {
+    testutil::TemporaryDirectory tmp;
+    const std::string path = tmp.Path() + "/index";
+    const auto a = Noise(6 << 20, 6);
+    const auto b = Noise(2 << 20, 7);
+    auto payload = Gzip(a);
+    const auto second = Gzip(b);
+    payload.insert(payload.end(), second.begin(), second.end());
+    auto expect = a;
+    expect.insert(expect.end(), b.begin(), b.end());
+
+    // Record while decoding, saving the points in two batches.
+    {
+        GzipReader reader(std::make_unique<BufferReader>(payload));
+        reader.RecordAccessPoints(1 << 20);
+        EXPECT_STREQ(reader.Backend(), "zlib");
+        std::vector<uint8_t> buf(3 << 20), out;
+        ssize_t n = reader.Read(buf);
+        ASSERT_GT(n, 0);
+        out.insert(out.end(), buf.begin(), buf.begin() + n);
+        const size_t first = reader.AccessPointCount();
+        ASSERT_TRUE(GzipIndex::Append(path, reader.AccessPoints()).is_ok());
+        ASSERT_EQ(ReadAll(reader, out), 0);
+        EXPECT_EQ(out, expect);
+        ASSERT_TRUE(GzipIndex::Append(path, reader.AccessPoints(first)).is_ok());
+    }
+
+    GzipIndex index;
+    ASSERT_TRUE(GzipIndex::Load(path, index).is_ok());
+    ASSERT_GE(index.points.size(), 6u);
+    for (size_t i = 1; i < index.points.size(); ++i) {
+        EXPECT_GT(index.points[i].out, index.points[i - 1].out);
+        EXPECT_GT(index.points[i].in, index.points[i - 1].in);
+    }
+    EXPECT_EQ(index.points.back().members, 1u);
+    EXPECT_LT(index.points[0].out, (1u << 20) + (256u << 10));
+
+    // A seek inflates from the point before the target, not from the start,
+    // and the member CRCs are still checked at the end.
+    const uint64_t target = (7 << 20) + 12345;
+    auto source = std::make_unique<FileLikeReader>(payload);
+    FileLikeReader* counted = source.get();
+    GzipReader reader(std::move(source));
+    reader.UseIndex(index);
+    ASSERT_EQ(reader.Seek(static_cast<std::int64_t>(target), SEEK_SET), static_cast<std::int64_t>(target));
+    std::vector<uint8_t> out;
+    ASSERT_EQ(ReadAll(reader, out), 0);
+    EXPECT_TRUE(std::equal(out.begin(), out.end(), expect.begin() + target, expect.end()));
+    EXPECT_EQ(out.size(), expect.size() - target);
+    EXPECT_LT(counted->BytesRead(), payload.size() / 2);
+    EXPECT_EQ(reader.Members(), 2u);
+
+    // Backwards, into the first member.
+    ASSERT_EQ(reader.Seek(2 << 20, SEEK_SET), 2 << 20);
+    std::vector<uint8_t> buf(1000);
+    ASSERT_EQ(reader.Read(buf), 1000);
+    EXPECT_TRUE(std::equal(buf.begin(), buf.end(), expect.begin() + (2 << 20)));
+
+    // Without points, a forward seek inflates its way there and a backward
+    // one cannot be done.
+    GzipReader plain(std::make_unique<BufferReader>(payload));
+    ASSERT_EQ(plain.Seek(3 << 20, SEEK_SET), 3 << 20);
+    ASSERT_EQ(plain.Read(buf), 1000);
+    EXPECT_TRUE(std::equal(buf.begin(), buf.end(), expect.begin() + (3 << 20)));
+    EXPECT_EQ(plain.Seek(0, SEEK_SET), -1);
+    EXPECT_EQ(errno, ESPIPE);
+}
+
+TEST(GzipIndexTest, DropsTornTail) {
+    testutil::TemporaryDirectory tmp;
+    const std::string path = tmp.Path() + "/index";
+    const auto payload = Gzip(Noise(4 << 20, 8));
+    GzipReader reader(std::make_unique<BufferReader>(payload));
+    reader.RecordAccessPoints(1 << 20);
+    std::vector<uint8_t> out;
+    ASSERT_EQ(ReadAll(reader, out), 0);
+    const auto points = reader.AccessPoints();
+    ASSERT_GE(points.size(), 3u);
+    ASSERT_TRUE(GzipIndex::Append(path, std::span(points).first(2)).is_ok());
+
+    // A record cut short by a crash is dropped, and the next append
+    // replaces it.
+    struct stat st{};
+    ASSERT_EQ(::stat(path.c_str(), &st), 0);
+    ASSERT_EQ(::truncate(path.c_str(), st.st_size - 100), 0);
+    GzipIndex index;
+    ASSERT_TRUE(GzipIndex::Load(path, index).is_ok());
+    EXPECT_EQ(index.points.size(), 1u);
+    ASSERT_TRUE(GzipIndex::Append(path, std::span(points).subspan(1)).is_ok());
+    ASSERT_TRUE(GzipIndex::Load(path, index).is_ok());
+    ASSERT_EQ(index.points.size(), points.size());
+    EXPECT_EQ(index.points.back().out, points.back().out);
+    EXPECT_EQ(index.points.back().window, points.back().window);
+
+    GzipIndex none;
+    EXPECT_FALSE(GzipIndex::Load(tmp.Path() + "/missing", none).is_ok());
+}
+
+}
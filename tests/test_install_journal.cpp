@@ -0,0 +1,259 @@
+#include <gtest/gtest.h>
+
+#include "flash/bundle_index.hpp"
+#include "flash/install_journal.hpp"
+#include "flash/ota_installer.hpp"
+#include "flash/sha256.hpp"
+
+#include "testing.hpp"
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+class InstallJournalTests : public ::testing::Test {
+protected:
+    testutil::TemporaryDirectory tmp;
+
+    std::string Path(const std::string& name) { return tmp.Path() + "/" + name; }
+
+    static void WriteFile(const std::string& path, const std::string& data) {
+        std::ofstream os(path, std::ios::binary | std::ios::trunc);
+        os << data;
+    }
+
+    static std::string ReadFile(const std::string& path) {
+        std::ifstream is(path, std::ios::binary);
+        std::stringstream ss;
+        ss << is.rdbuf();
+        return ss.str();
+    }
+
+    // Mostly incompressible, with a zero run for the zero-skipping writer.
+    static std::string Image(std::size_t mib) {
+        auto s = testutil::Pattern<std::string>(mib * 1024 * 1024, 0, 11);
+        std::fill(s.begin() + 1024 * 1024, s.begin() + 2 * 1024 * 1024, '\0');
+        return s;
+    }
+
+    static std::string Sha256Hex(const std::string& data) {
+        flash::Sha256 h;
+        h.Update({reinterpret_cast<const std::uint8_t*>(data.data()), data.size()});
+        return flash::Sha256::ToHex(h.Final());
+    }
+
+    // A "boot" file component followed by a hashed "rootfs" raw image.
+    std::string Manifest(const std::string& image) {
+        return R"({"version":"1.0","components":[
+                   {"name":"boot","type":"file","filename":"boot.bin","path":")" + Path("out/boot") + R"("},
+                   {"name":"rootfs","type":"raw","filename":"rootfs.img","install_to":")" + Path("out/rootfs") +
+               R"(","sha256":")" + Sha256Hex(image) + R"("}]})";
+    }
+
+    static std::string Gzip(const std::string& data) {
+        z_stream s{};
+        deflateInit2(&s, 1, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+        std::string out(deflateBound(&s, data.size()), '\0');
+        s.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        s.avail_in = static_cast<uInt>(data.size());
+        s.next_out = reinterpret_cast<Bytef*>(out.data());
+        s.avail_out = static_cast<uInt>(out.size());
+        deflate(&s, Z_FINISH);
+        out.resize(s.total_out);
+        deflateEnd(&s);
+        return out;
+    }
+
+    std::string MakeBundle(const std::string& image, bool indexed) {
+        std::filesystem::create_directories(Path("out"));
+        const std::string manifest = Manifest(image);
+        WriteFile(Path("manifest.json"), manifest);
+        WriteFile(Path("boot.bin"), "kernel");
+        WriteFile(Path("rootfs.img"), image);
+        const std::string bundle = Path("ota.tar");
+        if (indexed) {
+            auto r = flash::WriteIndexedBundle(bundle, Path("manifest.json"), {Path("boot.bin"), Path("rootfs.img")});
+            EXPECT_TRUE(r.is_ok()) << r.message();
+            return bundle;
+        }
+        return testutil::WriteTar(bundle, {testutil::TarFile("manifest.json", manifest),
+                                           testutil::TarFile("boot.bin", "kernel"),
+                                           testutil::TarFile("rootfs.img", image)});
+    }
+
+    flash::OtaInstaller::Options JournalOptions() {
+        flash::OtaInstaller::Options opt;
+        opt.journal_path = Path("journal.json");
+        opt.journal_interval_bytes = 1024 * 1024;
+        return opt;
+    }
+};
+
+TEST_F(InstallJournalTests, KeepsProgressOfItsOwnBundleOnly) {
+    const std::string path = Path("journal.json");
+    {
+        flash::InstallJournal j;
+        ASSERT_TRUE(flash::InstallJournal::Open(path, "bundle-a", j).is_ok());
+        EXPECT_FALSE(j.Resuming());
+        ASSERT_TRUE(j.RecordRawOffset("rootfs", 1 << 20).is_ok());
+        ASSERT_TRUE(j.MarkDone("boot").is_ok());
+    }
+
+    flash::InstallJournal j;
+    ASSERT_TRUE(flash::InstallJournal::Open(path, "bundle-a", j).is_ok());
+    EXPECT_TRUE(j.Resuming());
+    EXPECT_TRUE(j.Done("boot"));
+    EXPECT_FALSE(j.Done("rootfs"));
+    EXPECT_EQ(j.RawOffset("rootfs"), 1u << 20);
+    ASSERT_TRUE(j.MarkDone("rootfs").is_ok());
+    EXPECT_EQ(j.RawOffset("rootfs"), 0u);
+
+    flash::InstallJournal other;
+    ASSERT_TRUE(flash::InstallJournal::Open(path, "bundle-b", other).is_ok());
+    EXPECT_FALSE(other.Resuming());
+
+    ASSERT_TRUE(j.Remove().is_ok());
+    EXPECT_FALSE(std::filesystem::exists(path));
+
+    WriteFile(path, "{not json");
+    EXPECT_EQ(flash::InstallJournal::Open(path, "bundle-a", j).err, EBADMSG);
+}
+
+TEST_F(InstallJournalTests, ResumesFromRecordedProgress) {
+    const std::string image = Image(8);
+    const std::uint64_t resume = 4 * 1024 * 1024;
+    // Indexed bundles seek over the done part of the payload; streamed ones
+    // read it (and still hash it), here through the in-kernel copy path.
+    for (bool indexed : {true, false}) {
+        SCOPED_TRACE(indexed ? "indexed" : "streamed");
+        const std::string bundle = MakeBundle(image, indexed);
+        std::filesystem::remove(Path("out/boot"));
+
+        auto opt = JournalOptions();
+        opt.skip_zero_blocks = indexed;
+        flash::InstallJournal j;
+        ASSERT_TRUE(flash::InstallJournal::Open(opt.journal_path,
+                                                flash::InstallJournal::BundleId(ReadFile(Path("manifest.json"))), j)
+                        .is_ok());
+        ASSERT_TRUE(j.MarkDone("boot").is_ok());
+        ASSERT_TRUE(j.RecordRawOffset("rootfs", resume).is_ok());
+        // Marks what must not be written again.
+        WriteFile(Path("out/rootfs"), std::string(resume, 'X'));
+
+        auto r = flash::OtaInstaller(opt).Run(bundle);
+        ASSERT_TRUE(r.is_ok()) << r.message();
+        EXPECT_FALSE(std::filesystem::exists(Path("out/boot")));
+        const std::string got = ReadFile(Path("out/rootfs"));
+        ASSERT_EQ(got.size(), image.size());
+        EXPECT_TRUE(got.compare(0, resume, std::string(resume, 'X')) == 0);
+        EXPECT_TRUE(got.compare(resume, std::string::npos, image, resume) == 0);
+        EXPECT_FALSE(std::filesystem::exists(opt.journal_path));
+    }
+}
+
+TEST_F(InstallJournalTests, ResumesGzipImageFromAccessPoint) {
+    std::string image(8 * 1024 * 1024, '\0');
+    std::mt19937 rng(7);
+    for (auto& c : image) c = static_cast<char>(rng() % 23);
+    const std::string payload = Gzip(image);
+    std::filesystem::create_directories(Path("out"));
+    // No sha256, so the cut-off bundle and the full one are the same bundle.
+    const std::string manifest = R"({"version":"1.0","components":[
+        {"name":"rootfs","type":"raw","filename":"rootfs.img.gz","install_to":")" + Path("out/rootfs") + R"("}]})";
+    WriteFile(Path("manifest.json"), manifest);
+    auto bundle = [&](const std::string& body) {
+        WriteFile(Path("rootfs.img.gz"), body);
+        const std::string path = Path("ota.tar");
+        auto r = flash::WriteIndexedBundle(path, Path("manifest.json"), {Path("rootfs.img.gz")});
+        EXPECT_TRUE(r.is_ok()) << r.message();
+        return path;
+    };
+    const auto opt = JournalOptions();
+    const std::string id = flash::InstallJournal::BundleId(manifest);
+
+    // The first run stops when the payload gives out, with the image flushed
+    // up to the last recorded offset and the access points beside it.
+    EXPECT_FALSE(flash::OtaInstaller(opt).Run(bundle(payload.substr(0, payload.size() * 3 / 4))).is_ok());
+    std::uint64_t off = 0;
+    {
+        flash::InstallJournal j;
+        ASSERT_TRUE(flash::InstallJournal::Open(opt.journal_path, id, j).is_ok());
+        off = j.RawOffset("rootfs");
+        ASSERT_GE(off, 2u * 1024 * 1024);
+        EXPECT_TRUE(std::filesystem::exists(j.SidecarPath("rootfs")));
+    }
+    WriteFile(Path("out/rootfs"), std::string(off, 'X'));
+
+    auto r = flash::OtaInstaller(opt).Run(bundle(payload));
+    ASSERT_TRUE(r.is_ok()) << r.message();
+    const std::string got = ReadFile(Path("out/rootfs"));
+    ASSERT_EQ(got.size(), image.size());
+    EXPECT_TRUE(got.compare(0, off, std::string(off, 'X')) == 0);
+    EXPECT_TRUE(got.compare(off, std::string::npos, image, off) == 0);
+    EXPECT_FALSE(std::filesystem::exists(opt.journal_path));
+    EXPECT_FALSE(std::filesystem::exists(opt.journal_path + ".rootfs"));
+}
+
+TEST_F(InstallJournalTests, SurvivesBeingKilledAtRandomPoints) {
+    const std::string image = Image(48);
+    const std::string bundle = MakeBundle(image, false);
+    const auto opt = JournalOptions();
+    const std::string id = flash::InstallJournal::BundleId(ReadFile(Path("manifest.json")));
+
+    std::mt19937 rng(20240917);
+    std::uniform_int_distribution<int> delay_us(0, 150000);
+    std::uint64_t last = 0;
+    for (int round = 0; round < 12; ++round) {
+        const pid_t pid = ::fork();
+        ASSERT_GE(pid, 0);
+        if (pid == 0) {
+            const auto r = flash::OtaInstaller(opt).Run(bundle);
+            ::_exit(r.is_ok() ? 0 : 1);
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(delay_us(rng)));
+        ::kill(pid, SIGKILL);
+        int status = 0;
+        ASSERT_EQ(::waitpid(pid, &status, 0), pid);
+        if (WIFEXITED(status)) {
+            ASSERT_EQ(WEXITSTATUS(status), 0) << "round " << round;
+            break;  // finished before the kill
+        }
+
+        // Whatever the journal claims must be on the target.
+        flash::InstallJournal j;
+        ASSERT_TRUE(flash::InstallJournal::Open(opt.journal_path, id, j).is_ok());
+        if (!j.Resuming()) last = 0;  // killed after the journal was removed
+        if (j.Done("boot")) {
+            EXPECT_EQ(ReadFile(Path("out/boot")), "kernel");
+        }
+        const std::string got = ReadFile(Path("out/rootfs"));
+        if (j.Done("rootfs")) {
+            EXPECT_TRUE(got == image) << "round " << round;
+        } else if (const std::uint64_t off = j.RawOffset("rootfs"); off > 0) {
+            ASSERT_GE(got.size(), off);
+            EXPECT_TRUE(got.compare(0, off, image, 0, off) == 0) << "round " << round << " offset " << off;
+            EXPECT_GE(off, last);
+            last = off;
+        }
+    }
+
+    auto r = flash::OtaInstaller(opt).Run(bundle);
+    ASSERT_TRUE(r.is_ok()) << r.message();
+    EXPECT_EQ(ReadFile(Path("out/boot")), "kernel");
+    EXPECT_TRUE(ReadFile(Path("out/rootfs")) == image);
+    EXPECT_FALSE(std::filesystem::exists(opt.journal_path));
+}
+
+} // namespace
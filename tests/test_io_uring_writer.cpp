@@ -0,0 +1,65 @@
+#include <gtest/gtest.h>
+
+#include "flash/io_uring_writer.hpp"
+
+#include "testing.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+class IoUringWriterTests : public ::testing::Test {
+protected:
+    testutil::TemporaryDirectory tmp;
+
+    std::vector<std::uint8_t> ReadFile(const std::string &path) {
+        std::ifstream is(path, std::ios::binary);
+        return std::vector<std::uint8_t>((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    }
+};
+
+TEST_F(IoUringWriterTests, QueuedWritesLandInOrder) {
+    const std::string out_path = tmp.Path() + "/out.bin";
+
+    flash::IoUringWriter::Options opt;
+    opt.queue_depth = 3;
+    opt.buffer_bytes = 64 * 1024;
+
+    flash::IoUringWriter w;
+    auto res = flash::IoUringWriter::Open(out_path, opt, w);
+    if (!res.ok && (res.err == ENOSYS || res.err == EPERM)) {
+        GTEST_SKIP() << "io_uring not available: " << res.msg;
+    }
+    ASSERT_TRUE(res.ok) << res.msg;
+
+    std::vector<std::uint8_t> data(1024 * 1024 + 4321);
+    for (size_t i = 0; i < data.size(); ++i) data[i] = static_cast<std::uint8_t>((i * 7) ^ (i >> 11));
+
+    // Uneven chunk sizes so buffers are flushed both full and partial.
+    size_t pos = 0, step = 1000;
+    while (pos < data.size()) {
+        const size_t n = std::min(step, data.size() - pos);
+        ASSERT_TRUE(w.WriteAll({data.data() + pos, n}).ok);
+        pos += n;
+        step = (step * 5) % 150001 + 1;
+        if (pos > data.size() / 2 && pos - n <= data.size() / 2) {
+            ASSERT_TRUE(w.FsyncAsync().ok);
+        }
+    }
+    auto fs = w.FsyncNow();
+    ASSERT_TRUE(fs.ok) << fs.msg;
+
+    EXPECT_EQ(ReadFile(out_path), data);
+}
+
+TEST_F(IoUringWriterTests, OpenNonexistentPath_Fails) {
+    flash::IoUringWriter w;
+    auto res = flash::IoUringWriter::Open(tmp.Path() + "/no_such_dir/out.bin", w);
+    ASSERT_FALSE(res.ok);
+}
+
+} // namespace
@@ -67,4 +67,25 @@ TEST(ManifestTest, FullParseTest) {
     auto m = ManifestHandler::Parse(raw);
     ASSERT_TRUE(m.has_value());
     EXPECT_EQ(m->components[0].version, "1.1");
-}
\ No newline at end of file
+    EXPECT_TRUE(m->components[0].format.empty());
+
+    m = ManifestHandler::Parse(R"({"components":[{"name":"rootfs","type":"raw","format":"raw"}]})");
+    ASSERT_TRUE(m.has_value());
+    EXPECT_EQ(m->components[0].format, "raw");
+}
+TEST(ManifestTest, DeclaredSizesGiveBundleTotal) {
+    std::string raw = R"({"version":"1.0","components":[
+        {"name":"rootfs","filename":"rootfs.img.zst","size":1000,"installed_size":4096},
+        {"name":"boot","filename":"boot.tar.gz","size":24},
+        {"name":"meta"}]})";
+    auto m = ManifestHandler::Parse(raw);
+    ASSERT_TRUE(m.has_value());
+    EXPECT_EQ(m->components[0].size, 1000u);
+    EXPECT_EQ(m->components[0].installed_size, 4096u);
+    EXPECT_EQ(m->components[1].installed_size, 0u);
+    EXPECT_EQ(ManifestHandler::DeclaredBundleBytes(*m), 1024u);
+
+    // One entry without a size => unknown; the installer falls back to a pre-scan.
+    m->components[1].size = 0;
+    EXPECT_EQ(ManifestHandler::DeclaredBundleBytes(*m), 0u);
+}
@@ -0,0 +1,110 @@
+#include <gtest/gtest.h>
+
+#include "flash/mapped_file_reader.hpp"
+#include "flash/ota_bundle_reader.hpp"
+
+#include "testing.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+class MappedFileReaderTests : public ::testing::Test {
+protected:
+    testutil::TemporaryDirectory tmp;
+
+    std::string MakePath(const std::string& name) { return tmp.Path() + "/" + name; }
+
+    static std::vector<std::uint8_t> Pattern(std::size_t n) {
+        std::vector<std::uint8_t> v(n);
+        for (std::size_t i = 0; i < n; ++i) v[i] = static_cast<std::uint8_t>((i * 131) >> 3);
+        return v;
+    }
+
+    static void WriteFile(const std::string& path, const std::vector<std::uint8_t>& data) {
+        std::ofstream os(path, std::ios::binary | std::ios::trunc);
+        os.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+    }
+};
+
+TEST_F(MappedFileReaderTests, ReadAndViewsMatchFile) {
+    const std::string p = MakePath("in.bin");
+    const auto data = Pattern(20 * 1024 * 1024 + 77);  // crosses the DONTNEED window
+    WriteFile(p, data);
+
+    flash::MappedFileReader r;
+    ASSERT_TRUE(flash::MappedFileReader::Open(p, r).is_ok());
+    EXPECT_EQ(r.TotalSize(), data.size());
+
+    std::vector<std::uint8_t> got;
+    std::span<const std::uint8_t> view;
+    ssize_t n;
+    while ((n = r.ReadView(3 * 1024 * 1024 + 5, view)) > 0) got.insert(got.end(), view.begin(), view.end());
+    ASSERT_EQ(n, 0);
+    EXPECT_EQ(got, data);
+
+    ASSERT_EQ(r.Seek(100, SEEK_SET), 100);
+    std::uint8_t buf[64];
+    ASSERT_EQ(r.Read(buf), 64);
+    EXPECT_TRUE(std::equal(buf, buf + 64, data.begin() + 100));
+    EXPECT_LT(r.Seek(1, SEEK_END), 0);
+}
+
+TEST_F(MappedFileReaderTests, RejectsNonRegularInput) {
+    flash::MappedFileReader r;
+    EXPECT_FALSE(flash::MappedFileReader::Open(tmp.Path(), r).is_ok());
+    WriteFile(MakePath("empty"), {});
+    EXPECT_FALSE(flash::MappedFileReader::Open(MakePath("empty"), r).is_ok());
+}
+
+TEST_F(MappedFileReaderTests, TruncatedFileFailsInsteadOfCrashing) {
+    const std::string p = MakePath("in.bin");
+    WriteFile(p, Pattern(1024 * 1024));
+
+    flash::MappedFileReader r;
+    ASSERT_TRUE(flash::MappedFileReader::Open(p, r).is_ok());
+    std::span<const std::uint8_t> view;
+    ASSERT_EQ(r.ReadView(1024 * 1024, view), 1024 * 1024);
+
+    // The view outlives the file's pages: touching them raises SIGBUS,
+    // which must leave zeros behind and poison the reader.
+    ASSERT_EQ(::truncate(p.c_str(), 4096), 0);
+    volatile std::uint8_t sink = 0;
+    for (std::size_t i = 8192; i < view.size(); i += 4096) sink = sink ^ view[i];
+    EXPECT_EQ(view[view.size() - 1], 0);
+
+    ASSERT_EQ(r.Seek(0, SEEK_SET), 0);
+    std::uint8_t buf[16];
+    EXPECT_EQ(r.Read(buf), -1);
+    EXPECT_EQ(errno, EIO);
+}
+
+TEST_F(MappedFileReaderTests, TarBundleReadsThroughViews) {
+    const std::string p = MakePath("ota.tar");
+    const auto body = Pattern(3 * 1024 * 1024 + 11);
+    testutil::WriteTar(p, {testutil::TarFile("rootfs.img", std::string(body.begin(), body.end()))});
+
+    flash::MappedFileReader in;
+    ASSERT_TRUE(flash::MappedFileReader::Open(p, in).is_ok());
+    flash::OtaTarBundleReader bundle;
+    ASSERT_TRUE(bundle.Open(in).is_ok());
+    flash::BundleEntryInfo ent;
+    bool eof = false;
+    ASSERT_TRUE(bundle.Next(ent, eof).is_ok());
+    std::unique_ptr<flash::IReader> entry;
+    ASSERT_TRUE(bundle.OpenCurrentEntryReader(entry).is_ok());
+
+    std::vector<std::uint8_t> got, buf(1024 * 1024);
+    ssize_t n;
+    while ((n = entry->Read(buf)) > 0) got.insert(got.end(), buf.begin(), buf.begin() + n);
+    ASSERT_EQ(n, 0);
+    EXPECT_EQ(got, body);
+}
+
+} // namespace
@@ -0,0 +1,176 @@
+#include <gtest/gtest.h>
+
+#include "flash/file_reader.hpp"
+#include "flash/ota_bundle_reader.hpp"
+#include "flash/sha256.hpp"
+#include "flash/update_module.hpp"
+
+#include "testing.hpp"
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+// Forwards to a file reader, counting bytes actually read; `seekable`
+// false makes it behave like a pipe.
+class CountingFileReader final : public flash::IReader {
+public:
+    CountingFileReader(flash::IReader& inner, bool seekable) : inner_(inner), seekable_(seekable) {}
+    ssize_t Read(std::span<std::uint8_t> out) override {
+        const ssize_t n = inner_.Read(out);
+        if (n > 0) read_ += static_cast<std::uint64_t>(n);
+        return n;
+    }
+    std::optional<std::uint64_t> TotalSize() const override { return inner_.TotalSize(); }
+    bool Seekable() const override { return seekable_ && inner_.Seekable(); }
+    std::int64_t Seek(std::int64_t off, int whence) override {
+        return seekable_ ? inner_.Seek(off, whence) : flash::IReader::Seek(off, whence);
+    }
+    std::uint64_t BytesRead() const { return read_; }
+
+private:
+    flash::IReader& inner_;
+    bool seekable_;
+    std::uint64_t read_ = 0;
+};
+
+class OtaBundleReaderTests : public ::testing::Test {
+protected:
+    testutil::TemporaryDirectory tmp;
+
+    // manifest.json, a 32 MiB entry we skip, then a small entry we read.
+    std::string MakeBundle() {
+        return testutil::WriteTar(tmp.Path() + "/ota.tar",
+                                  {testutil::TarFile("manifest.json", "{}"),
+                                   testutil::TarFile("rootfs.img", std::string(32 * 1024 * 1024, '\xA5')),
+                                   testutil::TarFile("boot.img", "boot")});
+    }
+
+    // Skips manifest and rootfs, returns boot.img's contents.
+    std::string SkipToBoot(flash::IReader& src) {
+        flash::OtaTarBundleReader bundle;
+        EXPECT_TRUE(bundle.Open(src).is_ok());
+        flash::BundleEntryInfo ent;
+        bool eof = false;
+        for (const char* want : {"manifest.json", "rootfs.img"}) {
+            EXPECT_TRUE(bundle.Next(ent, eof).is_ok());
+            EXPECT_EQ(ent.name, want);
+            EXPECT_TRUE(bundle.SkipCurrent().is_ok());
+        }
+        EXPECT_TRUE(bundle.Next(ent, eof).is_ok());
+        EXPECT_EQ(ent.name, "boot.img");
+        std::string body;
+        EXPECT_TRUE(bundle.ReadCurrentToString(body).is_ok());
+        EXPECT_TRUE(bundle.Next(ent, eof).is_ok());
+        EXPECT_TRUE(eof);
+        return body;
+    }
+
+    // Installs rootfs.img as a file component straight from the bundle
+    // stream, then returns boot.img's contents.
+    std::string InstallRootfsThenBoot(flash::IReader& src) {
+        flash::OtaTarBundleReader bundle;
+        EXPECT_TRUE(bundle.Open(src).is_ok());
+        flash::BundleEntryInfo ent;
+        bool eof = false;
+        EXPECT_TRUE(bundle.Next(ent, eof).is_ok());
+        EXPECT_TRUE(bundle.SkipCurrent().is_ok());
+        EXPECT_TRUE(bundle.Next(ent, eof).is_ok());
+        EXPECT_EQ(ent.name, "rootfs.img");
+
+        const std::vector<std::uint8_t> rootfs(32 * 1024 * 1024, 0xA5);
+        flash::Sha256 h;
+        h.Update(rootfs);
+        flash::Component comp;
+        comp.name = "rootfs";
+        comp.type = "file";
+        comp.path = tmp.Path() + "/rootfs.out";
+        comp.sha256 = flash::Sha256::ToHex(h.Final());
+
+        std::unique_ptr<flash::IReader> entry;
+        EXPECT_TRUE(bundle.OpenCurrentEntryReader(entry).is_ok());
+        flash::UpdateModule::Options opt;
+        opt.progress = false;
+        const flash::Result res = flash::UpdateModule::Execute(comp, std::move(entry), opt);
+        EXPECT_TRUE(res.is_ok()) << res.msg;
+
+        std::ifstream is(comp.path, std::ios::binary);
+        EXPECT_TRUE(std::vector<std::uint8_t>((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>()) ==
+                    rootfs);
+
+        EXPECT_TRUE(bundle.Next(ent, eof).is_ok());
+        EXPECT_EQ(ent.name, "boot.img");
+        std::string body;
+        EXPECT_TRUE(bundle.ReadCurrentToString(body).is_ok());
+        EXPECT_TRUE(bundle.Next(ent, eof).is_ok());
+        EXPECT_TRUE(eof);
+        return body;
+    }
+};
+
+TEST_F(OtaBundleReaderTests, SkipSeeksOverFileEntries) {
+    const std::string path = MakeBundle();
+    flash::FileOrStdinReader file;
+    ASSERT_TRUE(flash::FileOrStdinReader::Open(path, file).ok);
+    CountingFileReader src(file, true);
+
+    EXPECT_EQ(SkipToBoot(src), "boot");
+    EXPECT_LT(src.BytesRead(), 1024u * 1024);
+}
+
+TEST_F(OtaBundleReaderTests, SkipReadsThroughPipes) {
+    const std::string path = MakeBundle();
+    flash::FileOrStdinReader file;
+    ASSERT_TRUE(flash::FileOrStdinReader::Open(path, file).ok);
+    CountingFileReader src(file, false);
+
+    EXPECT_EQ(SkipToBoot(src), "boot");
+    EXPECT_GE(src.BytesRead(), 32u * 1024 * 1024);
+}
+
+TEST_F(OtaBundleReaderTests, StoredEntryCopiedFromFileKeepsStreamInSync) {
+    const std::string path = MakeBundle();
+    flash::FileOrStdinReader file;
+    ASSERT_TRUE(flash::FileOrStdinReader::Open(path, file).ok);
+    EXPECT_EQ(InstallRootfsThenBoot(file), "boot");
+}
+
+TEST_F(OtaBundleReaderTests, StoredEntrySplicedFromPipeKeepsStreamInSync) {
+    const std::string path = MakeBundle();
+    int p[2];
+    ASSERT_EQ(::pipe2(p, O_CLOEXEC), 0);
+    std::thread feeder([&] {
+        std::ifstream is(path, std::ios::binary);
+        std::vector<char> buf(300000);
+        while (is.read(buf.data(), static_cast<std::streamsize>(buf.size())) || is.gcount() > 0) {
+            const char* q = buf.data();
+            for (auto left = static_cast<std::size_t>(is.gcount()); left > 0;) {
+                const ssize_t n = ::write(p[1], q, left);
+                if (n <= 0) break;
+                q += n;
+                left -= static_cast<std::size_t>(n);
+            }
+        }
+        ::close(p[1]);
+    });
+
+    flash::FileOrStdinReader pipe;
+    const flash::Result opened = flash::FileOrStdinReader::Open("/proc/self/fd/" + std::to_string(p[0]), pipe);
+    ::close(p[0]);
+    ASSERT_TRUE(opened.ok) << opened.msg;
+    EXPECT_EQ(InstallRootfsThenBoot(pipe), "boot");
+
+    // Drain whatever libarchive did not need so the feeder can finish.
+    std::vector<std::uint8_t> sink(65536);
+    while (pipe.Read(sink) > 0) {}
+    feeder.join();
+}
+
+} // namespace
@@ -0,0 +1,171 @@
+#include <gtest/gtest.h>
+
+#include "flash/decompress.hpp"
+#include "flash/parallel_gzip_reader.hpp"
+#include "flash/peek_reader.hpp"
+#include "flash/thread_pool.hpp"
+
+#include "testing.hpp"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <vector>
+
+namespace {
+
+class VecReader final : public flash::IReader {
+public:
+    explicit VecReader(std::vector<std::uint8_t> data) : data_(std::move(data)) {}
+    ssize_t Read(std::span<std::uint8_t> out) override {
+        const std::size_t n = std::min({out.size(), data_.size() - pos_, std::size_t{3001}});
+        std::copy_n(data_.begin() + static_cast<std::ptrdiff_t>(pos_), n, out.begin());
+        pos_ += n;
+        return static_cast<ssize_t>(n);
+    }
+
+private:
+    std::vector<std::uint8_t> data_;
+    std::size_t pos_ = 0;
+};
+
+void Put16(std::vector<std::uint8_t>& v, std::uint32_t x) {
+    v.push_back(static_cast<std::uint8_t>(x));
+    v.push_back(static_cast<std::uint8_t>(x >> 8));
+}
+
+void Put32(std::vector<std::uint8_t>& v, std::uint32_t x) {
+    Put16(v, x & 0xFFFF);
+    Put16(v, x >> 16);
+}
+
+// bgzip layout: one gzip member per <= 64 KiB of input, each with a "BC"
+// extra subfield holding the member size - 1, then an empty EOF member.
+std::vector<std::uint8_t> Bgzf(const std::vector<std::uint8_t>& in, std::size_t block = 65280) {
+    std::vector<std::uint8_t> out;
+    auto member = [&](const std::uint8_t* p, std::size_t n) {
+        z_stream s{};
+        deflateInit2(&s, 6, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+        std::vector<std::uint8_t> body(deflateBound(&s, n));
+        s.next_in = const_cast<Bytef*>(p);
+        s.avail_in = static_cast<uInt>(n);
+        s.next_out = body.data();
+        s.avail_out = static_cast<uInt>(body.size());
+        EXPECT_EQ(deflate(&s, Z_FINISH), Z_STREAM_END);
+        body.resize(s.total_out);
+        deflateEnd(&s);
+
+        const std::vector<std::uint8_t> hdr = {0x1F, 0x8B, 8, 4, 0, 0, 0, 0, 0, 0xFF, 6, 0, 'B', 'C', 2, 0};
+        out.insert(out.end(), hdr.begin(), hdr.end());
+        Put16(out, static_cast<std::uint32_t>(hdr.size() + 2 + body.size() + 8 - 1));
+        out.insert(out.end(), body.begin(), body.end());
+        Put32(out, static_cast<std::uint32_t>(crc32(0, p, static_cast<uInt>(n))));
+        Put32(out, static_cast<std::uint32_t>(n));
+    };
+    for (std::size_t off = 0; off < in.size(); off += block) member(in.data() + off, std::min(block, in.size() - off));
+    member(nullptr, 0);
+    return out;
+}
+
+// Small alphabet: compresses, but not to nothing.
+std::vector<std::uint8_t> Pattern(std::size_t n) { return testutil::Pattern(n, 0, 13, 17); }
+
+ssize_t ReadAll(flash::IReader& r, std::vector<std::uint8_t>& out) {
+    std::vector<std::uint8_t> buf(40000);
+    while (true) {
+        const ssize_t n = r.Read(buf);
+        if (n <= 0) return n;
+        out.insert(out.end(), buf.begin(), buf.begin() + n);
+    }
+}
+
+TEST(ThreadPoolTest, RunsEverySubmittedTask) {
+    std::atomic<int> ran{0};
+    {
+        flash::ThreadPool pool(3);
+        EXPECT_EQ(pool.Size(), 3u);
+        for (int i = 0; i < 100; ++i) pool.Submit([&] { ++ran; });
+    }
+    EXPECT_EQ(ran.load(), 100);
+}
+
+TEST(ParallelGzipReaderTest, DecodesMembersInOrder) {
+    const auto image = Pattern(3 * 1024 * 1024 + 123);
+    flash::ParallelGzipReader reader(std::make_unique<VecReader>(Bgzf(image)), {4, 256 * 1024});
+    EXPECT_EQ(reader.Threads(), 4u);
+
+    std::vector<std::uint8_t> out;
+    ASSERT_EQ(ReadAll(reader, out), 0);
+    EXPECT_EQ(out, image);
+}
+
+TEST(ParallelGzipReaderTest, SelectedOnlyForBgzf) {
+    const auto image = Pattern(500 * 1000);
+    std::unique_ptr<flash::IReader> r = std::make_unique<VecReader>(Bgzf(image));
+    ASSERT_TRUE(flash::OpenDecompressor(r).ok);
+    EXPECT_NE(dynamic_cast<flash::ParallelGzipReader*>(r.get()), nullptr);
+    std::vector<std::uint8_t> out;
+    ASSERT_EQ(ReadAll(*r, out), 0);
+    EXPECT_EQ(out, image);
+
+    // threads = 1 keeps BGZF on the single-threaded reader.
+    r = std::make_unique<VecReader>(Bgzf(image));
+    flash::DecompressOptions one;
+    one.threads = 1;
+    ASSERT_TRUE(flash::OpenDecompressor(r, one).ok);
+    EXPECT_EQ(dynamic_cast<flash::ParallelGzipReader*>(r.get()), nullptr);
+
+    // echo -n "hello" | gzip -c: no extra field, ordinary gzip.
+    const std::vector<std::uint8_t> gz = {0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+                                          0x03, 0xcb, 0x48, 0xcd, 0xc9, 0xc9, 0x07, 0x00, 0x86,
+                                          0xa6, 0x10, 0x36, 0x05, 0x00, 0x00, 0x00};
+    flash::PeekReader peek(std::make_unique<VecReader>(gz));
+    EXPECT_FALSE(flash::ParallelGzipReader::Detect(peek));
+}
+
+TEST(ParallelGzipReaderTest, CorruptMemberFails) {
+    auto payload = Bgzf(Pattern(400 * 1000));
+    const std::size_t second = (payload[16] | (payload[17] << 8)) + 1;
+    const std::size_t second_size = (payload[second + 16] | (payload[second + 17] << 8)) + 1;
+    payload[second + second_size - 8] ^= 0x40;  // second member's CRC32
+
+    flash::ParallelGzipReader reader(std::make_unique<VecReader>(payload), {2, 1024 * 1024});
+    std::vector<std::uint8_t> out;
+    EXPECT_EQ(ReadAll(reader, out), -1);
+    EXPECT_EQ(errno, EBADMSG);
+    EXPECT_EQ(reader.Read(std::span<std::uint8_t>(out.data(), 1)), -1);
+}
+
+TEST(ParallelGzipReaderTest, TruncatedMemberFails) {
+    auto payload = Bgzf(Pattern(200 * 1000));
+    payload.resize(payload.size() - 40);
+
+    flash::ParallelGzipReader reader(std::make_unique<VecReader>(payload), {2, 1024 * 1024});
+    std::vector<std::uint8_t> out;
+    EXPECT_EQ(ReadAll(reader, out), -1);
+    EXPECT_EQ(errno, EBADMSG);
+}
+
+// Zeros after the last member are padding, as for GzipReader; anything
+// else there is not.
+TEST(ParallelGzipReaderTest, ZeroPaddingAfterLastMemberIsAccepted) {
+    const auto image = Pattern(200 * 1000);
+    auto payload = Bgzf(image);
+    payload.resize(payload.size() + 10000, 0);
+
+    flash::ParallelGzipReader padded(std::make_unique<VecReader>(payload), {2, 1024 * 1024});
+    std::vector<std::uint8_t> out;
+    ASSERT_EQ(ReadAll(padded, out), 0);
+    EXPECT_EQ(out, image);
+
+    payload[payload.size() - 100] = 1;
+    flash::ParallelGzipReader garbage(std::make_unique<VecReader>(payload), {2, 1024 * 1024});
+    out.clear();
+    EXPECT_EQ(ReadAll(garbage, out), -1);
+    EXPECT_EQ(errno, EBADMSG);
+}
+
+} // namespace
@@ -10,6 +10,8 @@
 #include <string>
 #include <vector>
 
+#include <sys/stat.h>
+
 namespace {
 
 class PartitionWriterTests : public ::testing::Test {
@@ -60,4 +62,80 @@ TEST_F(PartitionWriterTests, WriteAll_WritesExactBytes) {
     EXPECT_EQ(read_back, data);
 }
 
+TEST_F(PartitionWriterTests, DirectMode_HandlesUnalignedTailAndMidStreamFsync) {
+    const std::string out_path = MakePath("direct.bin");
+
+    flash::PartitionWriter::Options opt;
+    opt.direct = true;
+    opt.direct_buffer_bytes = 64 * 1024;
+
+    flash::PartitionWriter w;
+    auto res = flash::PartitionWriter::Open(out_path, opt, w);
+    ASSERT_TRUE(res.ok) << res.msg;
+
+    std::vector<std::uint8_t> data(300 * 1024 + 77);
+    for (size_t i = 0; i < data.size(); ++i) data[i] = static_cast<std::uint8_t>((i * 31) ^ (i >> 9));
+
+    // Odd chunk sizes, plus an fsync that leaves a partial block staged.
+    size_t pos = 0;
+    const size_t steps[] = {1000, 70000, 4096, 3, 100000};
+    for (size_t k = 0; pos < data.size(); ++k) {
+        const size_t n = std::min(steps[k % 5], data.size() - pos);
+        ASSERT_TRUE(w.WriteAll({data.data() + pos, n}).ok);
+        pos += n;
+        if (k == 2) {
+            ASSERT_TRUE(w.FsyncNow().ok);
+        }
+    }
+    auto fs = w.FsyncNow();
+    ASSERT_TRUE(fs.ok) << fs.msg;
+
+    EXPECT_EQ(ReadFile(out_path), data);
+}
+
+TEST_F(PartitionWriterTests, DirectMode_AlignedBuffersBypassStaging) {
+    const std::string out_path = MakePath("direct_aligned.bin");
+
+    flash::PartitionWriter::Options opt;
+    opt.direct = true;
+
+    flash::PartitionWriter w;
+    ASSERT_TRUE(flash::PartitionWriter::Open(out_path, opt, w).ok);
+
+    flash::AlignedBuffer buf(256 * 1024);
+    for (size_t i = 0; i < buf.size(); ++i) buf.data()[i] = static_cast<std::uint8_t>(i * 3);
+
+    ASSERT_TRUE(w.WriteAll({buf.data(), buf.size()}).ok);
+    ASSERT_TRUE(w.WriteAll({buf.data(), 1234}).ok);
+    ASSERT_TRUE(w.FsyncNow().ok);
+
+    std::vector<std::uint8_t> expected(buf.data(), buf.data() + buf.size());
+    expected.insert(expected.end(), buf.data(), buf.data() + 1234);
+    EXPECT_EQ(ReadFile(out_path), expected);
+}
+
+TEST_F(PartitionWriterTests, PreallocationKeepsSizeAndTrimsShortPayloads) {
+    const std::string out_path = MakePath("prealloc.bin");
+    flash::PartitionWriter::Options opt;
+    opt.preallocate_bytes = 8 * 1024 * 1024;
+    flash::PartitionWriter w;
+    ASSERT_TRUE(flash::PartitionWriter::Open(out_path, opt, w).ok);
+
+    std::vector<std::uint8_t> data(100000, 0x5a);
+    ASSERT_TRUE(w.WriteAll(data).ok);
+    ASSERT_TRUE(w.FsyncNow().ok);
+
+    struct stat st {};
+    ASSERT_EQ(::stat(out_path.c_str(), &st), 0);
+    EXPECT_EQ(st.st_size, 100000);  // the reservation does not show as content
+    const auto reserved = st.st_blocks;
+
+    ASSERT_TRUE(w.TrimPreallocation().ok);
+    ASSERT_EQ(::stat(out_path.c_str(), &st), 0);
+    EXPECT_EQ(st.st_size, 100000);
+    EXPECT_LE(st.st_blocks, reserved);
+    EXPECT_LT(static_cast<std::uint64_t>(st.st_blocks) * 512, opt.preallocate_bytes);
+    EXPECT_EQ(ReadFile(out_path), data);
+}
+
 } // namespace
@@ -0,0 +1,106 @@
+#include <gtest/gtest.h>
+
+#include "flash/sha256.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace flash {
+
+namespace {
+
+std::string HexOf(std::string_view s) {
+    Sha256 h;
+    h.Update({reinterpret_cast<const std::uint8_t*>(s.data()), s.size()});
+    return Sha256::ToHex(h.Final());
+}
+
+class VectorReader : public IReader {
+public:
+    explicit VectorReader(std::vector<std::uint8_t> data) : data_(std::move(data)) {}
+    ssize_t Read(std::span<std::uint8_t> out) override {
+        if (pos_ >= data_.size()) return 0;
+        const size_t n = std::min(out.size(), data_.size() - pos_);
+        std::copy(data_.begin() + pos_, data_.begin() + pos_ + n, out.begin());
+        pos_ += n;
+        return static_cast<ssize_t>(n);
+    }
+private:
+    std::vector<std::uint8_t> data_;
+    size_t pos_ = 0;
+};
+
+} // namespace
+
+TEST(Sha256Test, KnownVectors) {
+    EXPECT_EQ(HexOf(""), "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    EXPECT_EQ(HexOf("abc"), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    EXPECT_EQ(HexOf("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"),
+              "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+    EXPECT_EQ(HexOf(std::string(1000000, 'a')),
+              "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+TEST(Sha256Test, SplitUpdatesMatchOneShot) {
+    std::vector<std::uint8_t> data(300000);
+    for (size_t i = 0; i < data.size(); ++i) data[i] = static_cast<std::uint8_t>((i * 131) ^ (i >> 7));
+
+    Sha256 one;
+    one.Update(data);
+    const auto expected = one.Final();
+
+    Sha256 split;
+    size_t pos = 0, step = 1;
+    while (pos < data.size()) {
+        const size_t n = std::min(step, data.size() - pos);
+        split.Update({data.data() + pos, n});
+        pos += n;
+        step = step * 3 + 1;
+    }
+    EXPECT_EQ(split.Final(), expected);
+
+    AsyncSha256 async(4096, 3);
+    for (pos = 0; pos < data.size(); pos += 1000) {
+        async.Update({data.data() + pos, std::min<size_t>(1000, data.size() - pos)});
+    }
+    EXPECT_EQ(async.Finish(), expected);
+}
+
+TEST(Sha256Test, PortableMatchesRuntimeBackend) {
+    std::vector<std::uint8_t> data(100003);
+    for (size_t i = 0; i < data.size(); ++i) data[i] = static_cast<std::uint8_t>((i * 167) ^ (i >> 5));
+
+    for (size_t len : {size_t{0}, size_t{55}, size_t{64}, size_t{119}, size_t{4096}, data.size()}) {
+        Sha256 runtime;
+        runtime.Update({data.data(), len});
+        Sha256 portable = Sha256::Portable();
+        portable.Update({data.data(), len});
+        EXPECT_EQ(portable.Final(), runtime.Final()) << "len " << len << ", backend " << Sha256::Backend();
+    }
+}
+
+TEST(Sha256Test, ParseHexRejectsMalformed) {
+    Sha256Digest d{};
+    EXPECT_TRUE(Sha256::ParseHex("BA7816BF8F01CFEA414140DE5DAE2223B00361A396177A9CB410FF61F20015AD", d));
+    EXPECT_EQ(Sha256::ToHex(d), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    EXPECT_FALSE(Sha256::ParseHex("...", d));
+    EXPECT_FALSE(Sha256::ParseHex(std::string(64, 'g'), d));
+}
+
+TEST(Sha256Test, ReaderVerifyDrainsUnreadTail) {
+    std::vector<std::uint8_t> data(10000, 0x5A);
+    Sha256 h;
+    h.Update(data);
+
+    Sha256Reader r(std::make_unique<VectorReader>(data), h.Final());
+    std::vector<std::uint8_t> buf(100);
+    ASSERT_EQ(r.Read(buf), 100);
+    EXPECT_TRUE(r.Verify().is_ok());
+
+    Sha256Digest wrong{};
+    Sha256Reader bad(std::make_unique<VectorReader>(data), wrong);
+    EXPECT_FALSE(bad.Verify().is_ok());
+}
+
+} // namespace flash
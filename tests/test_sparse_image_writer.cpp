@@ -0,0 +1,254 @@
+#include <gtest/gtest.h>
+
+#include "flash/file_reader.hpp"
+#include "flash/manifest.hpp"
+#include "flash/partition_writer.hpp"
+#include "flash/sparse_image_writer.hpp"
+#include "flash/update_module.hpp"
+
+#include "testing.hpp"
+
+#include <zlib.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+namespace {
+
+using testutil::Pattern;
+
+constexpr std::uint32_t kBlk = 4096;
+
+struct VecWriter final : flash::IWriter {
+    std::vector<std::uint8_t> data;
+    std::uint64_t skipped = 0;
+    flash::Result WriteAll(std::span<const std::uint8_t> in) override {
+        data.insert(data.end(), in.begin(), in.end());
+        return flash::Result::Ok();
+    }
+    flash::Result Skip(std::uint64_t len) override {
+        skipped += len;
+        return flash::IWriter::Skip(len);
+    }
+    flash::Result FsyncNow() override { return flash::Result::Ok(); }
+};
+
+// Minimal sparse image encoder mirroring libsparse's on-disk layout.
+class SparseBuilder {
+public:
+    explicit SparseBuilder(std::uint16_t file_hdr_sz = 28, std::uint16_t chunk_hdr_sz = 12)
+        : file_hdr_sz_(file_hdr_sz), chunk_hdr_sz_(chunk_hdr_sz) {}
+
+    void Raw(const std::vector<std::uint8_t>& blocks) {
+        Chunk(0xCAC1, static_cast<std::uint32_t>(blocks.size() / kBlk), blocks);
+        expected.insert(expected.end(), blocks.begin(), blocks.end());
+    }
+    void Fill(std::uint32_t value, std::uint32_t blocks) {
+        std::vector<std::uint8_t> v(4);
+        Put32(v.data(), value);
+        Chunk(0xCAC2, blocks, v);
+        for (std::uint32_t i = 0; i < blocks * kBlk / 4; ++i) expected.insert(expected.end(), v.begin(), v.end());
+    }
+    void DontCare(std::uint32_t blocks) {
+        Chunk(0xCAC3, blocks, {});
+        expected.resize(expected.size() + static_cast<size_t>(blocks) * kBlk, 0);
+    }
+    void Crc(std::uint32_t corrupt = 0) {
+        std::vector<std::uint8_t> v(4);
+        Put32(v.data(), static_cast<std::uint32_t>(::crc32(0L, expected.data(), static_cast<uInt>(expected.size()))) ^ corrupt);
+        Chunk(0xCAC4, 0, v);
+    }
+
+    std::vector<std::uint8_t> Image() const {
+        std::vector<std::uint8_t> out(file_hdr_sz_, 0);
+        Put32(out.data(), flash::SparseImageWriter::kMagic);
+        Put16(out.data() + 4, 1);
+        Put16(out.data() + 8, file_hdr_sz_);
+        Put16(out.data() + 10, chunk_hdr_sz_);
+        Put32(out.data() + 12, kBlk);
+        Put32(out.data() + 16, blocks_);
+        Put32(out.data() + 20, chunks_);
+        out.insert(out.end(), body_.begin(), body_.end());
+        return out;
+    }
+
+    std::vector<std::uint8_t> expected;
+
+private:
+    static void Put16(std::uint8_t* p, std::uint16_t v) { p[0] = v & 0xFF; p[1] = v >> 8; }
+    static void Put32(std::uint8_t* p, std::uint32_t v) {
+        for (int i = 0; i < 4; ++i) p[i] = static_cast<std::uint8_t>(v >> (8 * i));
+    }
+
+    void Chunk(std::uint16_t type, std::uint32_t blocks, const std::vector<std::uint8_t>& payload) {
+        std::vector<std::uint8_t> h(chunk_hdr_sz_, 0);
+        Put16(h.data(), type);
+        Put32(h.data() + 4, blocks);
+        Put32(h.data() + 8, static_cast<std::uint32_t>(chunk_hdr_sz_ + payload.size()));
+        body_.insert(body_.end(), h.begin(), h.end());
+        body_.insert(body_.end(), payload.begin(), payload.end());
+        if (type != 0xCAC4) blocks_ += blocks;
+        ++chunks_;
+    }
+
+    std::uint16_t file_hdr_sz_;
+    std::uint16_t chunk_hdr_sz_;
+    std::uint32_t blocks_ = 0;
+    std::uint32_t chunks_ = 0;
+    std::vector<std::uint8_t> body_;
+};
+
+SparseBuilder MakeImage(std::uint16_t file_hdr_sz = 28, std::uint16_t chunk_hdr_sz = 12) {
+    SparseBuilder b(file_hdr_sz, chunk_hdr_sz);
+    b.Raw(Pattern(2 * kBlk, 1));
+    b.Fill(0xDEADBEEF, 3);
+    b.Fill(0, 20);
+    b.Crc();
+    b.DontCare(30);
+    b.Raw(Pattern(kBlk, 2));
+    b.Crc();
+    return b;
+}
+
+// Feeds `img` in small, uneven pieces so records straddle WriteAll() calls.
+flash::Result Feed(flash::SparseImageWriter& w, const std::vector<std::uint8_t>& img) {
+    size_t off = 0;
+    size_t step = 5;
+    while (off < img.size()) {
+        const size_t n = std::min(step, img.size() - off);
+        auto r = w.WriteAll({img.data() + off, n});
+        if (!r.ok) return r;
+        off += n;
+        step = step * 7 % 5003 + 1;
+    }
+    auto r = w.FsyncNow();
+    if (!r.ok) return r;
+    return w.Finish();
+}
+
+TEST(SparseImageWriterTests, DecodesAllChunkTypes) {
+    const auto b = MakeImage();
+    VecWriter out;
+    flash::SparseImageWriter w(out);
+
+    auto r = Feed(w, b.Image());
+    ASSERT_TRUE(r.ok) << r.msg;
+    EXPECT_TRUE(w.IsSparse());
+    EXPECT_EQ(w.TotalBlocks(), 56u);
+    EXPECT_EQ(out.skipped, 30u * kBlk);
+    EXPECT_EQ(out.data, b.expected);
+}
+
+TEST(SparseImageWriterTests, HonoursLargerHeaders) {
+    const auto b = MakeImage(/*file_hdr_sz=*/40, /*chunk_hdr_sz=*/20);
+    VecWriter out;
+    flash::SparseImageWriter w(out);
+
+    auto r = Feed(w, b.Image());
+    ASSERT_TRUE(r.ok) << r.msg;
+    EXPECT_EQ(out.data, b.expected);
+}
+
+TEST(SparseImageWriterTests, NonSparseStreamPassesThrough) {
+    for (size_t n : {0u, 3u, 4u, 100000u}) {
+        const auto data = Pattern(n, 7);
+        VecWriter out;
+        flash::SparseImageWriter w(out);
+        auto r = Feed(w, data);
+        ASSERT_TRUE(r.ok) << r.msg;
+        EXPECT_FALSE(w.IsSparse());
+        EXPECT_EQ(out.data, data) << n;
+    }
+}
+
+TEST(SparseImageWriterTests, CrcMismatchFails) {
+    SparseBuilder b;
+    b.Raw(Pattern(kBlk, 3));
+    b.Crc(/*corrupt=*/1);
+
+    VecWriter out;
+    flash::SparseImageWriter w(out);
+    auto r = Feed(w, b.Image());
+    ASSERT_FALSE(r.ok);
+    EXPECT_EQ(r.err, EBADMSG);
+}
+
+TEST(SparseImageWriterTests, TruncatedImageFails) {
+    auto img = MakeImage().Image();
+    img.resize(img.size() - 100);
+
+    VecWriter out;
+    flash::SparseImageWriter w(out);
+    auto r = Feed(w, img);
+    ASSERT_FALSE(r.ok);
+    EXPECT_EQ(r.err, EBADMSG);
+}
+
+TEST(SparseImageWriterTests, DontCareLeavesHoleInFile) {
+    testutil::TemporaryDirectory tmp;
+    const std::string out_path = tmp.Path() + "/rootfs.img";
+
+    SparseBuilder b;
+    b.Raw(Pattern(kBlk, 4));
+    b.DontCare(1024);
+    b.Raw(Pattern(kBlk, 5));
+    b.DontCare(1024);
+
+    flash::PartitionWriter pw;
+    auto res = flash::PartitionWriter::Open(out_path, pw);
+    ASSERT_TRUE(res.ok) << res.msg;
+    flash::SparseImageWriter w(pw);
+    res = Feed(w, b.Image());
+    ASSERT_TRUE(res.ok) << res.msg;
+
+    std::ifstream is(out_path, std::ios::binary);
+    std::vector<std::uint8_t> actual((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(actual, b.expected);
+
+    // 8 MiB of DONT_CARE must not have been written out.
+    struct stat st {};
+    ASSERT_EQ(::stat(out_path.c_str(), &st), 0);
+    EXPECT_LT(static_cast<std::uint64_t>(st.st_blocks) * 512, 1024u * 1024);
+}
+
+// "format": "raw" writes a payload that looks like a sparse image verbatim.
+TEST(SparseImageWriterTests, RawFormatComponentSkipsDetection) {
+    testutil::TemporaryDirectory tmp;
+    const auto b = MakeImage();
+    const auto img = b.Image();
+    const std::string payload = tmp.Path() + "/payload.img";
+    {
+        std::ofstream os(payload, std::ios::binary);
+        os.write(reinterpret_cast<const char*>(img.data()), static_cast<std::streamsize>(img.size()));
+    }
+
+    for (const char* format : {"", "raw", "sparse"}) {
+        flash::Component comp;
+        comp.name = "rootfs";
+        comp.type = "raw";
+        comp.format = format;
+        comp.install_to = tmp.Path() + "/slot";
+
+        auto reader = std::make_unique<flash::FileOrStdinReader>();
+        ASSERT_TRUE(flash::FileOrStdinReader::Open(payload, *reader).ok);
+        flash::UpdateModule::Options opt;
+        opt.progress = false;
+        auto res = flash::UpdateModule::Execute(comp, std::move(reader), opt);
+        if (std::string(format) == "sparse") {
+            EXPECT_EQ(res.err, EINVAL);
+            continue;
+        }
+        ASSERT_TRUE(res.ok) << res.msg;
+
+        std::ifstream is(comp.install_to, std::ios::binary);
+        std::vector<std::uint8_t> actual((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+        EXPECT_EQ(actual, comp.format.empty() ? b.expected : img) << format;
+    }
+}
+
+} // namespace
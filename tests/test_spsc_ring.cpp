@@ -0,0 +1,55 @@
+#include <gtest/gtest.h>
+
+#include "flash/spsc_ring.hpp"
+
+#include <cstdint>
+#include <thread>
+
+namespace flash {
+
+TEST(SpscRingTest, TryPushFailsWhenFull) {
+    SpscRing<int> ring(2);
+    EXPECT_TRUE(ring.TryPush(1));
+    EXPECT_TRUE(ring.TryPush(2));
+    EXPECT_FALSE(ring.TryPush(3));
+
+    int v = 0;
+    ASSERT_TRUE(ring.TryPop(v));
+    EXPECT_EQ(v, 1);
+    EXPECT_TRUE(ring.TryPush(3));
+}
+
+TEST(SpscRingTest, PreservesOrderAcrossThreads) {
+    SpscRing<std::uint64_t> ring(3);
+    constexpr std::uint64_t kCount = 200000;
+
+    std::thread producer([&] {
+        for (std::uint64_t i = 0; i < kCount; ++i) ASSERT_TRUE(ring.Push(i));
+        ring.Close();
+    });
+
+    std::uint64_t expected = 0, v = 0;
+    while (ring.Pop(v)) {
+        ASSERT_EQ(v, expected);
+        ++expected;
+    }
+    producer.join();
+    EXPECT_EQ(expected, kCount);
+}
+
+TEST(SpscRingTest, CloseWakesBlockedProducer) {
+    SpscRing<int> ring(1);
+    ASSERT_TRUE(ring.Push(1));
+
+    bool pushed = true;
+    std::thread producer([&] { pushed = ring.Push(2); });
+    ring.Close();
+    producer.join();
+    EXPECT_FALSE(pushed);
+
+    int v = 0;
+    EXPECT_TRUE(ring.Pop(v));
+    EXPECT_FALSE(ring.Pop(v));
+}
+
+} // namespace flash
@@ -1,6 +1,14 @@
 #include <gtest/gtest.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <fstream>
+#include <thread>
 #include <vector>
+#include "flash/bundle_index.hpp"
+#include "flash/file_reader.hpp"
+#include "flash/sha256.hpp"
+#include "flash/signals.hpp"
 #include "flash/update_module.hpp"
 #include "testing.hpp"
 
@@ -28,6 +36,19 @@ protected:
     std::string GetTestPath(const std::string& filename) {
         return temp_dir.Path() + "/" + filename;
     }
+
+    static std::string Pattern(size_t n) { return testutil::Pattern<std::string>(n, 0, 11); }
+
+    static std::string HexSha(const std::string& s) {
+        Sha256 h;
+        h.Update({reinterpret_cast<const std::uint8_t*>(s.data()), s.size()});
+        return Sha256::ToHex(h.Final());
+    }
+
+    static std::string Slurp(const std::string& path) {
+        std::ifstream ifs(path, std::ios::binary);
+        return std::string((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    }
 };
 
 TEST_F(UpdateModuleTest, ExecuteAtomicFile) {
@@ -86,4 +107,241 @@ TEST_F(UpdateModuleTest, ExecuteGzippedRaw) {
     EXPECT_EQ(actual, "hello");
 }
 
-} // namespace flash
\ No newline at end of file
+TEST_F(UpdateModuleTest, AtomicFileSha256MismatchKeepsOldFile) {
+    UpdateModule module;
+    std::string target_path = GetTestPath("capsule.bin");
+    {
+        std::ofstream os(target_path);
+        os << "OLD";
+    }
+
+    Component comp;
+    comp.name = "capsule";
+    comp.type = "file";
+    comp.path = target_path;
+    // sha256("hello")
+    comp.sha256 = "2cf24dba5fb0a30e26e83b2ac5b9e29e1b161e5c1fa7425e73043362938b9824";
+
+    Result res = module.Execute(comp, std::make_unique<MemoryReader>("hellp"));
+    ASSERT_FALSE(res.is_ok());
+    EXPECT_NE(res.msg.find("sha256 mismatch"), std::string::npos) << res.msg;
+
+    std::ifstream ifs(target_path);
+    std::string actual;
+    ifs >> actual;
+    EXPECT_EQ(actual, "OLD");
+    EXPECT_FALSE(std::ifstream(target_path + ".tmp").good());
+
+    res = module.Execute(comp, std::make_unique<MemoryReader>("hello"));
+    ASSERT_TRUE(res.is_ok()) << res.msg;
+}
+
+TEST_F(UpdateModuleTest, GzippedRawSha256CoversCompressedEntry) {
+    UpdateModule module;
+    std::string partition_path = GetTestPath("fake_part");
+
+    Component comp;
+    comp.name = "kernel";
+    comp.type = "raw";
+    comp.filename = "image.gz";
+    comp.install_to = partition_path;
+
+    std::vector<uint8_t> gz_data = {
+        0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03,
+        0xcb, 0x48, 0xcd, 0xc9, 0xc9, 0x07, 0x00, 0x86, 0xa6, 0x10, 0x36, 0x05, 0x00, 0x00, 0x00
+    };
+    const std::string entry(gz_data.begin(), gz_data.end());
+
+    Sha256 h;
+    h.Update(gz_data);
+    comp.sha256 = Sha256::ToHex(h.Final());
+    ASSERT_TRUE(module.Execute(comp, std::make_unique<MemoryReader>(entry)).is_ok());
+
+    comp.sha256 = std::string(64, '0');
+    EXPECT_FALSE(module.Execute(comp, std::make_unique<MemoryReader>(entry)).is_ok());
+
+    comp.sha256 = "...";
+    EXPECT_FALSE(module.Execute(comp, std::make_unique<MemoryReader>(entry)).is_ok());
+}
+
+TEST_F(UpdateModuleTest, RawPipelineCopiesAllBytesInOrder) {
+    std::string partition_path = GetTestPath("big_part");
+
+    Component comp;
+    comp.name = "rootfs";
+    comp.type = "raw";
+    comp.install_to = partition_path;
+
+    const std::string data = testutil::Pattern<std::string>(5 * 1024 * 1024 + 321);
+
+    UpdateModule::Options opt;
+    opt.progress = false;
+    opt.pipeline_depth = 3;
+    opt.pipeline_buffer_bytes = 64 * 1024;
+    opt.fsync_interval_bytes = 1024 * 1024;
+
+    Result res = UpdateModule::Execute(comp, std::make_unique<MemoryReader>(data), opt);
+    ASSERT_TRUE(res.is_ok()) << res.msg;
+
+    std::ifstream ifs(partition_path, std::ios::binary);
+    std::string actual((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    EXPECT_TRUE(actual == data);
+}
+
+TEST_F(UpdateModuleTest, RawPipelineHonoursCancel) {
+    Component comp;
+    comp.name = "rootfs";
+    comp.type = "raw";
+    comp.install_to = GetTestPath("cancel_part");
+
+    g_cancel.store(true);
+    Result res = UpdateModule::Execute(comp, std::make_unique<MemoryReader>(std::string(1 << 20, 'x')));
+    g_cancel.store(false);
+
+    ASSERT_FALSE(res.is_ok());
+    EXPECT_EQ(res.err, ECANCELED);
+}
+
+TEST_F(UpdateModuleTest, RawCompareModeRewritesChangedImage) {
+    std::string partition_path = GetTestPath("slot_b");
+
+    Component comp;
+    comp.name = "kernel";
+    comp.type = "raw";
+    comp.install_to = partition_path;
+
+    std::string v1(2 * 1024 * 1024, '\0');
+    for (size_t i = 0; i < v1.size(); ++i) v1[i] = static_cast<char>((i * 40503u) >> 7);
+    std::string v2 = v1;
+    v2[4096 * 10 + 1] ^= 0x55;
+    v2.resize(v2.size() - 1000);
+
+    UpdateModule::Options opt;
+    opt.progress = false;
+    opt.compare_before_write = true;
+
+    ASSERT_TRUE(UpdateModule::Execute(comp, std::make_unique<MemoryReader>(v1), opt).is_ok());
+    Result res = UpdateModule::Execute(comp, std::make_unique<MemoryReader>(v2), opt);
+    ASSERT_TRUE(res.is_ok()) << res.msg;
+
+    // A regular-file slot loses the stale tail of the longer old image.
+    std::ifstream ifs(partition_path, std::ios::binary);
+    std::string actual((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    EXPECT_TRUE(actual == v2);
+}
+
+TEST_F(UpdateModuleTest, AtomicFileOverDeclaredSizeKeepsWrittenLength) {
+    // installed-size larger than the payload: the reservation must not leak
+    // into the file.
+    const std::string payload = Pattern(2 * 1024 * 1024 + 5);
+    Component comp;
+    comp.name = "model";
+    comp.type = "file";
+    comp.path = GetTestPath("model.bin");
+    comp.installed_size = 16 * 1024 * 1024;
+
+    UpdateModule::Options opt;
+    opt.progress = false;
+    Result res = UpdateModule::Execute(comp, std::make_unique<MemoryReader>(payload), opt);
+    ASSERT_TRUE(res.is_ok()) << res.msg;
+    EXPECT_TRUE(Slurp(comp.path) == payload);
+
+    struct stat st {};
+    ASSERT_EQ(::stat(comp.path.c_str(), &st), 0);
+    EXPECT_LT(static_cast<std::uint64_t>(st.st_blocks) * 512, comp.installed_size);
+}
+
+TEST_F(UpdateModuleTest, KernelCopyOfFileRangeVerifiesSha256) {
+    // The payload sits inside a larger file, as it would in a bundle.
+    const std::string payload = Pattern(3 * 1024 * 1024 + 77);
+    const std::string bundle = GetTestPath("bundle.bin");
+    {
+        std::ofstream os(bundle, std::ios::binary);
+        os << std::string(1536, 'h') << payload << std::string(512, 't');
+    }
+
+    Component comp;
+    comp.name = "blob";
+    comp.type = "file";
+    comp.path = GetTestPath("blob.bin");
+    comp.sha256 = HexSha(payload);
+
+    UpdateModule::Options opt;
+    opt.progress = false;
+    opt.pipeline_buffer_bytes = 256 * 1024;
+
+    auto range = std::make_unique<RangeReader>();
+    ASSERT_TRUE(RangeReader::Open(bundle, 1536, payload.size(), *range).is_ok());
+    Result res = UpdateModule::Execute(comp, std::move(range), opt);
+    ASSERT_TRUE(res.is_ok()) << res.msg;
+    EXPECT_TRUE(Slurp(comp.path) == payload);
+
+    comp.sha256 = std::string(64, '0');
+    range = std::make_unique<RangeReader>();
+    ASSERT_TRUE(RangeReader::Open(bundle, 1536, payload.size(), *range).is_ok());
+    res = UpdateModule::Execute(comp, std::move(range), opt);
+    ASSERT_FALSE(res.is_ok());
+    EXPECT_NE(res.msg.find("sha256 mismatch"), std::string::npos) << res.msg;
+}
+
+TEST_F(UpdateModuleTest, KernelCopyFromPipeHashesTeedBytes) {
+    const std::string payload = Pattern(2 * 1024 * 1024 + 5);
+
+    int p[2];
+    ASSERT_EQ(::pipe2(p, O_CLOEXEC), 0);
+    std::thread feeder([&] {
+        for (size_t off = 0; off < payload.size();) {
+            const ssize_t n = ::write(p[1], payload.data() + off, std::min<size_t>(payload.size() - off, 100000));
+            if (n <= 0) break;
+            off += static_cast<size_t>(n);
+        }
+        ::close(p[1]);
+    });
+
+    auto in = std::make_unique<FileOrStdinReader>();
+    const Result opened = FileOrStdinReader::Open("/proc/self/fd/" + std::to_string(p[0]), *in);
+    ::close(p[0]);
+    ASSERT_TRUE(opened.is_ok()) << opened.msg;
+
+    Component comp;
+    comp.name = "blob";
+    comp.type = "file";
+    comp.path = GetTestPath("piped.bin");
+    comp.sha256 = HexSha(payload);
+
+    UpdateModule::Options opt;
+    opt.progress = false;
+    Result res = UpdateModule::Execute(comp, std::move(in), opt);
+    feeder.join();
+    ASSERT_TRUE(res.is_ok()) << res.msg;
+    EXPECT_TRUE(Slurp(comp.path) == payload);
+}
+
+TEST_F(UpdateModuleTest, KernelCopyOfRawImageWithoutZeroSkip) {
+    std::string image = Pattern(4 * 1024 * 1024 + 1000);
+    std::fill_n(image.begin() + 8192, 64 * 1024, '\0');
+    const std::string src = GetTestPath("image.img");
+    {
+        std::ofstream os(src, std::ios::binary);
+        os << image;
+    }
+
+    Component comp;
+    comp.name = "rootfs";
+    comp.type = "raw";
+    comp.install_to = GetTestPath("slot");
+    comp.sha256 = HexSha(image);
+
+    UpdateModule::Options opt;
+    opt.progress = false;
+    opt.skip_zero_blocks = false;
+    opt.fsync_interval_bytes = 1024 * 1024;
+
+    auto in = std::make_unique<FileOrStdinReader>();
+    ASSERT_TRUE(FileOrStdinReader::Open(src, *in).is_ok());
+    Result res = UpdateModule::Execute(comp, std::move(in), opt);
+    ASSERT_TRUE(res.is_ok()) << res.msg;
+    EXPECT_TRUE(Slurp(comp.install_to) == image);
+}
+
+} // namespace flash
@@ -0,0 +1,143 @@
+#include <gtest/gtest.h>
+
+#include "flash/decompress.hpp"
+#include "flash/update_module.hpp"
+#include "flash/xz_reader.hpp"
+
+#include "testing.hpp"
+
+#include <lzma.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+class VecReader final : public flash::IReader {
+public:
+    explicit VecReader(std::vector<std::uint8_t> data) : data_(std::move(data)) {}
+    ssize_t Read(std::span<std::uint8_t> out) override {
+        const std::size_t n = std::min({out.size(), data_.size() - pos_, std::size_t{50000}});
+        std::copy_n(data_.begin() + static_cast<std::ptrdiff_t>(pos_), n, out.begin());
+        pos_ += n;
+        return static_cast<ssize_t>(n);
+    }
+
+private:
+    std::vector<std::uint8_t> data_;
+    std::size_t pos_ = 0;
+};
+
+// Small alphabet: compresses, but not to nothing.
+std::vector<std::uint8_t> Pattern(std::size_t n, std::uint32_t seed) { return testutil::Pattern(n, seed, 9, 29); }
+
+// xz -T2 --block-size=<block>: independent blocks with sizes in their headers.
+std::vector<std::uint8_t> Xz(const std::vector<std::uint8_t>& in, std::uint64_t block = 256 * 1024) {
+    lzma_stream s = LZMA_STREAM_INIT;
+    lzma_mt mt{};
+    mt.threads = 2;
+    mt.block_size = block;
+    mt.preset = 1;
+    mt.check = LZMA_CHECK_CRC64;
+    EXPECT_EQ(lzma_stream_encoder_mt(&s, &mt), LZMA_OK);
+
+    std::vector<std::uint8_t> out(lzma_stream_buffer_bound(in.size()));
+    s.next_in = in.data();
+    s.avail_in = in.size();
+    s.next_out = out.data();
+    s.avail_out = out.size();
+    lzma_ret ret;
+    while ((ret = lzma_code(&s, LZMA_FINISH)) == LZMA_OK) {}
+    EXPECT_EQ(ret, LZMA_STREAM_END);
+    out.resize(s.total_out);
+    lzma_end(&s);
+    return out;
+}
+
+ssize_t ReadAll(flash::IReader& r, std::vector<std::uint8_t>& out) {
+    std::vector<std::uint8_t> buf(64 * 1024);
+    while (true) {
+        const ssize_t n = r.Read(buf);
+        if (n <= 0) return n;
+        out.insert(out.end(), buf.begin(), buf.begin() + n);
+    }
+}
+
+TEST(XzReaderTest, DecodesMultiBlockStreamOnThreads) {
+    const auto image = Pattern(3 * 1024 * 1024 + 17, 1);
+    const auto payload = Xz(image);
+
+    for (unsigned threads : {1u, 4u}) {
+        flash::XzReader reader(std::make_unique<VecReader>(payload), {threads, 0, 0});
+        std::vector<std::uint8_t> out;
+        ASSERT_EQ(ReadAll(reader, out), 0) << threads;
+        EXPECT_EQ(out, image) << threads;
+        EXPECT_GT(reader.PeakMemory(), 0u);
+    }
+}
+
+TEST(XzReaderTest, ConcatenatedStreamsAndSniffing) {
+    const auto a = Pattern(100000, 2);
+    const auto b = Pattern(70000, 3);
+    auto payload = Xz(a);
+    const auto second = Xz(b);
+    payload.insert(payload.end(), second.begin(), second.end());
+
+    std::unique_ptr<flash::IReader> r = std::make_unique<VecReader>(payload);
+    flash::Compression c{};
+    ASSERT_TRUE(flash::OpenDecompressor(r, {}, nullptr, &c).ok);
+    EXPECT_EQ(c, flash::Compression::Xz);
+    std::vector<std::uint8_t> out;
+    ASSERT_EQ(ReadAll(*r, out), 0);
+    auto expect = a;
+    expect.insert(expect.end(), b.begin(), b.end());
+    EXPECT_EQ(out, expect);
+}
+
+TEST(XzReaderTest, TruncatedAndOverLimitFail) {
+    auto payload = Xz(Pattern(600000, 4));
+    auto truncated = payload;
+    truncated.resize(truncated.size() - 20);
+
+    flash::XzReader reader(std::make_unique<VecReader>(truncated), {2, 0, 0});
+    std::vector<std::uint8_t> out;
+    EXPECT_EQ(ReadAll(reader, out), -1);
+    EXPECT_EQ(errno, EBADMSG);
+
+    // A hard limit below the dictionary size stops the decoder.
+    flash::XzReader capped(std::make_unique<VecReader>(payload), {1, 0, 64 * 1024});
+    out.clear();
+    EXPECT_EQ(ReadAll(capped, out), -1);
+    EXPECT_EQ(errno, ENOMEM);
+}
+
+TEST(XzReaderTest, UpdateModuleInstallsXzArchive) {
+    testutil::TemporaryDirectory tmp;
+
+    const auto body = Pattern(300000, 5);
+    std::ifstream tar_file(testutil::WriteTar(tmp.Path() + "/overlay.tar",
+                                              {testutil::TarFile("etc/data.bin", std::string(body.begin(), body.end()))}),
+                           std::ios::binary);
+    const std::vector<std::uint8_t> tar((std::istreambuf_iterator<char>(tar_file)), std::istreambuf_iterator<char>());
+
+    flash::Component comp;
+    comp.name = "overlay";
+    comp.type = "archive";
+    comp.filename = "overlay.tar.xz";
+    comp.path = tmp.Path() + "/root";
+
+    flash::UpdateModule::Options opt;
+    opt.progress = false;
+    auto res = flash::UpdateModule::Execute(comp, std::make_unique<VecReader>(Xz(tar, 64 * 1024)), opt);
+    ASSERT_TRUE(res.ok) << res.msg;
+
+    std::ifstream is(comp.path + "/etc/data.bin", std::ios::binary);
+    const std::vector<std::uint8_t> got((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(got, body);
+}
+
+} // namespace
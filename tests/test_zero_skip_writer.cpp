@@ -0,0 +1,146 @@
+#include <gtest/gtest.h>
+
+#include "flash/block_scan.hpp"
+#include "flash/io_uring_writer.hpp"
+#include "flash/partition_writer.hpp"
+#include "flash/zero_skip_writer.hpp"
+
+#include "testing.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+namespace {
+
+class ZeroSkipWriterTests : public ::testing::Test {
+protected:
+    testutil::TemporaryDirectory tmp;
+
+    std::vector<std::uint8_t> ReadFile(const std::string &path) {
+        std::ifstream is(path, std::ios::binary);
+        return std::vector<std::uint8_t>((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    }
+
+    // 4 MiB image: data, a 1 MiB zero run, a lone zero block, data, and a
+    // trailing 512 KiB of zeros so the file has to end in a hole.
+    static std::vector<std::uint8_t> MakeImage() {
+        std::vector<std::uint8_t> img(4 * 1024 * 1024, 0);
+        auto fill = [&](size_t from, size_t to) {
+            for (size_t i = from; i < to; ++i) img[i] = static_cast<std::uint8_t>(((i * 131) ^ (i >> 9)) | 1);
+        };
+        fill(0, 1024 * 1024 + 100);
+        fill(2 * 1024 * 1024 + 4096, 2 * 1024 * 1024 + 8192);
+        fill(2 * 1024 * 1024 + 12288, 3 * 1024 * 1024 + 512 * 1024 + 7);
+        return img;
+    }
+
+    // Feeds `img` in odd-sized pieces so blocks straddle WriteAll() calls.
+    static void Feed(flash::IWriter &w, const std::vector<std::uint8_t> &img) {
+        size_t off = 0;
+        size_t step = 777;
+        while (off < img.size()) {
+            const size_t n = std::min(step, img.size() - off);
+            auto r = w.WriteAll({img.data() + off, n});
+            ASSERT_TRUE(r.ok) << r.msg;
+            off += n;
+            step = step * 3 % 300007 + 1;
+        }
+        auto r = w.FsyncNow();
+        ASSERT_TRUE(r.ok) << r.msg;
+    }
+};
+
+TEST(BlockScanTests, IsAllZeroFindsAnyNonZeroByte) {
+    std::vector<std::uint8_t> buf(1000, 0);
+    EXPECT_TRUE(flash::IsAllZero(buf));
+    EXPECT_TRUE(flash::IsAllZero({}));
+    for (size_t i = 0; i < buf.size(); ++i) {
+        buf[i] = 0x80;
+        EXPECT_FALSE(flash::IsAllZero(buf)) << "byte " << i;
+        EXPECT_TRUE(flash::IsAllZero(std::span<const std::uint8_t>(buf).first(i)));
+        buf[i] = 0;
+    }
+}
+
+TEST_F(ZeroSkipWriterTests, FileReadsBackIdenticalAndSparse) {
+    const std::string out_path = tmp.Path() + "/img.bin";
+    const auto img = MakeImage();
+
+    flash::PartitionWriter pw;
+    auto res = flash::PartitionWriter::Open(out_path, pw);
+    ASSERT_TRUE(res.ok) << res.msg;
+
+    flash::ZeroSkipWriter w(pw);
+    Feed(w, img);
+
+    EXPECT_EQ(ReadFile(out_path), img);
+    // The 1 MiB run plus the 512 KiB tail (minus its partial first block);
+    // the lone 4 KiB block is below the minimum run and gets written.
+    EXPECT_EQ(w.SkippedBytes(), 1024u * 1024 + (512u * 1024 - 4096));
+
+    struct stat st {};
+    ASSERT_EQ(::stat(out_path.c_str(), &st), 0);
+    EXPECT_EQ(static_cast<size_t>(st.st_size), img.size());
+}
+
+TEST_F(ZeroSkipWriterTests, DirectModeReadsBackIdentical) {
+    const std::string out_path = tmp.Path() + "/img_direct.bin";
+    const auto img = MakeImage();
+
+    flash::PartitionWriter::Options popt;
+    popt.direct = true;
+    popt.direct_buffer_bytes = 64 * 1024;
+    flash::PartitionWriter pw;
+    auto res = flash::PartitionWriter::Open(out_path, popt, pw);
+    ASSERT_TRUE(res.ok) << res.msg;
+
+    flash::ZeroSkipWriter w(pw);
+    Feed(w, img);
+
+    EXPECT_EQ(ReadFile(out_path), img);
+    EXPECT_GT(w.SkippedBytes(), 0u);
+}
+
+TEST_F(ZeroSkipWriterTests, IoUringReadsBackIdentical) {
+    const std::string out_path = tmp.Path() + "/img_uring.bin";
+    const auto img = MakeImage();
+
+    flash::IoUringWriter::Options uopt;
+    uopt.queue_depth = 3;
+    uopt.buffer_bytes = 64 * 1024;
+    flash::IoUringWriter uw;
+    auto res = flash::IoUringWriter::Open(out_path, uopt, uw);
+    if (!res.ok && (res.err == ENOSYS || res.err == EPERM)) {
+        GTEST_SKIP() << "io_uring not available: " << res.msg;
+    }
+    ASSERT_TRUE(res.ok) << res.msg;
+
+    flash::ZeroSkipWriter w(uw);
+    Feed(w, img);
+
+    EXPECT_EQ(ReadFile(out_path), img);
+    EXPECT_GT(w.SkippedBytes(), 0u);
+}
+
+TEST_F(ZeroSkipWriterTests, DefaultWriteZeroesWritesRealZeros) {
+    // A writer without a zeroing shortcut still gets the bytes.
+    struct VecWriter final : flash::IWriter {
+        std::vector<std::uint8_t> data;
+        flash::Result WriteAll(std::span<const std::uint8_t> in) override {
+            data.insert(data.end(), in.begin(), in.end());
+            return flash::Result::Ok();
+        }
+        flash::Result FsyncNow() override { return flash::Result::Ok(); }
+    } vw;
+
+    const auto img = MakeImage();
+    flash::ZeroSkipWriter w(vw);
+    Feed(w, img);
+    EXPECT_EQ(vw.data, img);
+}
+
+} // namespace
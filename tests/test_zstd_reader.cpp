@@ -0,0 +1,105 @@
+#include <gtest/gtest.h>
+
+#include "flash/decompress.hpp"
+#include "flash/zstd_reader.hpp"
+
+#include "testing.hpp"
+
+#include <zstd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <vector>
+
+namespace {
+
+using testutil::Pattern;
+
+class VecReader final : public flash::IReader {
+public:
+    explicit VecReader(std::vector<std::uint8_t> data) : data_(std::move(data)) {}
+    ssize_t Read(std::span<std::uint8_t> out) override {
+        const std::size_t n = std::min({out.size(), data_.size() - pos_, std::size_t{4099}});
+        std::copy_n(data_.begin() + static_cast<std::ptrdiff_t>(pos_), n, out.begin());
+        pos_ += n;
+        return static_cast<ssize_t>(n);
+    }
+
+private:
+    std::vector<std::uint8_t> data_;
+    std::size_t pos_ = 0;
+};
+
+std::vector<std::uint8_t> Compress(const std::vector<std::uint8_t>& in, int window_log = 0) {
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, 3);
+    if (window_log) {
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, window_log);
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1);
+    }
+    std::vector<std::uint8_t> out(ZSTD_compressBound(in.size()));
+    const size_t n = ZSTD_compress2(cctx, out.data(), out.size(), in.data(), in.size());
+    ZSTD_freeCCtx(cctx);
+    EXPECT_FALSE(ZSTD_isError(n));
+    out.resize(n);
+    return out;
+}
+
+ssize_t ReadAll(flash::IReader& r, std::vector<std::uint8_t>& out) {
+    std::vector<std::uint8_t> buf(100 * 1000);
+    while (true) {
+        const ssize_t n = r.Read(buf);
+        if (n <= 0) return n;
+        out.insert(out.end(), buf.begin(), buf.begin() + n);
+    }
+}
+
+TEST(ZstdReaderTest, DecodesConcatenatedFrames) {
+    const auto a = Pattern(300 * 1000, 1);
+    const auto b = Pattern(70 * 1000, 2);
+    auto payload = Compress(a);
+    const auto second = Compress(b);
+    payload.insert(payload.end(), second.begin(), second.end());
+
+    flash::ZstdReader reader(std::make_unique<VecReader>(payload));
+    std::vector<std::uint8_t> out;
+    ASSERT_EQ(ReadAll(reader, out), 0);
+    auto expect = a;
+    expect.insert(expect.end(), b.begin(), b.end());
+    EXPECT_EQ(out, expect);
+}
+
+TEST(ZstdReaderTest, DecodesLongWindowFrame) {
+    // A 16 MiB image whose second half repeats the first: only a window
+    // above the default 8 MiB decoder limit can reference the match.
+    auto image = Pattern(8 * 1024 * 1024, 7);
+    image.insert(image.end(), image.begin(), image.end());
+    const auto payload = Compress(image, 27);
+    EXPECT_LT(payload.size(), image.size() / 2 + 1024 * 1024);
+
+    std::unique_ptr<flash::IReader> r = std::make_unique<VecReader>(payload);
+    flash::Compression c{};
+    ASSERT_TRUE(flash::OpenDecompressor(r, {}, nullptr, &c).ok);
+    EXPECT_EQ(c, flash::Compression::Zstd);
+    std::vector<std::uint8_t> out;
+    ASSERT_EQ(ReadAll(*r, out), 0);
+    EXPECT_EQ(out, image);
+
+    // Capping the window at the zstd default rejects the same frame.
+    flash::ZstdReader capped(std::make_unique<VecReader>(payload), 23);
+    out.clear();
+    EXPECT_EQ(ReadAll(capped, out), -1);
+}
+
+TEST(ZstdReaderTest, TruncatedFrameFails) {
+    auto payload = Compress(Pattern(200 * 1000, 3));
+    payload.resize(payload.size() - 5);
+
+    flash::ZstdReader reader(std::make_unique<VecReader>(payload));
+    std::vector<std::uint8_t> out;
+    EXPECT_EQ(ReadAll(reader, out), -1);
+    EXPECT_EQ(errno, EBADMSG);
+}
+
+} // namespace
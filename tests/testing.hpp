@@ -1,8 +1,17 @@
 #pragma once
 
+#include <archive.h>
+#include <archive_entry.h>
+
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
+#include <ctime>
 #include <stdexcept>
 #include <string>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
 #include <unistd.h>
 
 namespace testutil {
@@ -35,4 +44,102 @@ private:
     std::string path_;
 };
 
+// Deterministic test data that hardly compresses: byte i is bits
+// [shift, shift + 8) of i * 2654435761 + seed, taken mod `alphabet` when
+// that is below 256 to make it compress.
+template <typename Bytes = std::vector<std::uint8_t>>
+Bytes Pattern(std::size_t n, std::uint32_t seed = 0, unsigned shift = 13, unsigned alphabet = 256) {
+    Bytes out(n, 0);
+    for (std::size_t i = 0; i < n; ++i) {
+        out[i] = static_cast<typename Bytes::value_type>(((i * 2654435761u + seed) >> shift) % alphabet);
+    }
+    return out;
+}
+
+// One entry of a tar written by WriteTar(); build them with the Tar*()
+// helpers below. The group follows the owner.
+struct TarEntry {
+    std::string name;
+    mode_t type = AE_IFREG;
+    mode_t perm = 0644;
+    std::string body;
+    std::string link;  // symlink target or hardlink source
+    bool hardlink = false;
+    std::int64_t uid = 0;
+    dev_t rdev = 0;
+    time_t mtime = 1600000000;
+};
+
+inline TarEntry TarFile(std::string name, std::string body, mode_t perm = 0644) {
+    TarEntry e;
+    e.name = std::move(name);
+    e.body = std::move(body);
+    e.perm = perm;
+    return e;
+}
+
+inline TarEntry TarDir(std::string name, mode_t perm = 0755) {
+    TarEntry e;
+    e.name = std::move(name);
+    e.type = AE_IFDIR;
+    e.perm = perm;
+    return e;
+}
+
+inline TarEntry TarSymlink(std::string name, std::string target) {
+    TarEntry e;
+    e.name = std::move(name);
+    e.type = AE_IFLNK;
+    e.perm = 0777;
+    e.link = std::move(target);
+    return e;
+}
+
+inline TarEntry TarHardlink(std::string name, std::string source) {
+    TarEntry e;
+    e.name = std::move(name);
+    e.link = std::move(source);
+    e.hardlink = true;
+    return e;
+}
+
+// Device node (AE_IFCHR, AE_IFBLK) or FIFO (AE_IFIFO).
+inline TarEntry TarNode(std::string name, mode_t type, mode_t perm, dev_t rdev = 0) {
+    TarEntry e;
+    e.name = std::move(name);
+    e.type = type;
+    e.perm = perm;
+    e.rdev = rdev;
+    return e;
+}
+
+// Writes `entries` in order as a pax tar at `path`, which it returns.
+inline std::string WriteTar(const std::string& path, const std::vector<TarEntry>& entries) {
+    archive* a = archive_write_new();
+    archive_write_set_format_pax_restricted(a);
+    if (archive_write_open_filename(a, path.c_str()) != ARCHIVE_OK) {
+        archive_write_free(a);
+        throw std::runtime_error("cannot create " + path);
+    }
+    for (const TarEntry& en : entries) {
+        archive_entry* e = archive_entry_new();
+        archive_entry_set_pathname(e, en.name.c_str());
+        archive_entry_set_filetype(e, en.type);
+        archive_entry_set_perm(e, en.perm);
+        archive_entry_set_uid(e, en.uid);
+        archive_entry_set_gid(e, en.uid);
+        archive_entry_set_mtime(e, en.mtime, 0);
+        archive_entry_set_rdev(e, en.rdev);
+        if (en.hardlink) archive_entry_set_hardlink(e, en.link.c_str());
+        if (en.type == AE_IFLNK) archive_entry_set_symlink(e, en.link.c_str());
+        archive_entry_set_size(e, static_cast<la_int64_t>(en.body.size()));
+        archive_write_header(a, e);
+        if (!en.body.empty()) archive_write_data(a, en.body.data(), en.body.size());
+        archive_entry_free(e);
+    }
+    archive_write_close(a);
+    archive_write_free(a);
+    return path;
+}
+
 } // namespace testutil
@@ -0,0 +1,145 @@
+// inflate_bench - compares the gzip decode backends on real payloads
+// (e.g. rootfs .tar.gz) held in memory, plus the CRC32 implementations.
+
+#include "flash/crc32.hpp"
+#include "flash/gzip_reader.hpp"
+#include "flash/inflater.hpp"
+#include "flash/logger.hpp"
+#include "flash/parallel_gzip_reader.hpp"
+#include "flash/peek_reader.hpp"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <getopt.h>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+namespace {
+
+void PrintUsage(const char* argv0) {
+    flash::LogError("Usage: %s [-n <iterations>] <payload.gz>...", argv0);
+}
+
+class MemReader final : public flash::IReader {
+public:
+    explicit MemReader(const std::vector<std::uint8_t>& data) : data_(data) {}
+    ssize_t Read(std::span<std::uint8_t> out) override {
+        const std::size_t n = std::min(out.size(), data_.size() - pos_);
+        std::copy_n(data_.begin() + static_cast<std::ptrdiff_t>(pos_), n, out.begin());
+        pos_ += n;
+        return static_cast<ssize_t>(n);
+    }
+    std::optional<std::uint64_t> TotalSize() const override { return data_.size(); }
+
+private:
+    const std::vector<std::uint8_t>& data_;
+    std::size_t pos_ = 0;
+};
+
+// Best-of-`iters` wall time of `fn`, which returns the bytes it produced
+// (negative on failure).
+double BestSeconds(int iters, const std::function<long long()>& fn, long long& bytes) {
+    double best = 1e30;
+    for (int i = 0; i < iters; ++i) {
+        const auto t0 = std::chrono::steady_clock::now();
+        bytes = fn();
+        const std::chrono::duration<double> dt = std::chrono::steady_clock::now() - t0;
+        if (bytes < 0) return -1;
+        best = std::min(best, dt.count());
+    }
+    return best;
+}
+
+long long Drain(flash::IReader& r) {
+    static std::vector<std::uint8_t> buf(1024 * 1024);
+    long long total = 0;
+    while (true) {
+        const ssize_t n = r.Read(buf);
+        if (n < 0) return -1;
+        if (n == 0) return total;
+        total += n;
+    }
+}
+
+void Report(const char* file, const char* what, double secs, long long bytes) {
+    if (secs < 0) {
+        std::printf("%-32s %-18s FAILED\n", file, what);
+        return;
+    }
+    std::printf("%-32s %-18s %10.1f MiB/s  (%lld bytes, %.3f s)\n", file, what,
+                static_cast<double>(bytes) / secs / (1024.0 * 1024.0), bytes, secs);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    flash::Logger::Instance().SetLevel(flash::LogLevel::Info);
+
+    int iters = 3;
+
+    static option long_opts[] = {
+        {"iterations", required_argument, nullptr, 'n'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int idx = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "hn:", long_opts, &idx)) != -1) {
+        switch (c) {
+            case 'h': PrintUsage(argv[0]); return 0;
+            case 'n': iters = std::max(1, std::atoi(optarg)); break;
+            default:  PrintUsage(argv[0]); return 2;
+        }
+    }
+    if (optind >= argc) { PrintUsage(argv[0]); return 2; }
+
+    for (int i = optind; i < argc; ++i) {
+        const char* file = argv[i];
+        std::ifstream is(file, std::ios::binary);
+        if (!is) {
+            flash::LogError("Cannot open %s", file);
+            return 1;
+        }
+        const std::vector<std::uint8_t> data((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+        long long bytes = 0;
+
+        for (flash::InflateBackend b : flash::AvailableInflateBackends()) {
+            const double s = BestSeconds(iters, [&] {
+                flash::GzipReader gz(std::make_unique<MemReader>(data), b);
+                return Drain(gz);
+            }, bytes);
+            Report(file, (std::string("inflate ") + flash::InflateBackendName(b)).c_str(), s, bytes);
+        }
+
+        flash::PeekReader probe(std::make_unique<MemReader>(data));
+        if (flash::ParallelGzipReader::Detect(probe)) {
+            const double s = BestSeconds(iters, [&] {
+                flash::ParallelGzipReader gz(std::make_unique<MemReader>(data), {});
+                return Drain(gz);
+            }, bytes);
+            Report(file, "inflate bgzf-mt", s, bytes);
+        }
+
+        std::uint32_t sink = 0;
+        double s = BestSeconds(iters, [&] {
+            sink ^= static_cast<std::uint32_t>(::crc32(0L, data.data(), static_cast<uInt>(data.size())));
+            return static_cast<long long>(data.size());
+        }, bytes);
+        Report(file, "crc32 zlib", s, bytes);
+        s = BestSeconds(iters, [&] {
+            sink ^= flash::Crc32(0, data);
+            return static_cast<long long>(data.size());
+        }, bytes);
+        Report(file, (std::string("crc32 ") + flash::Crc32Backend()).c_str(), s, bytes);
+        if (sink == 0xFFFFFFFFu) std::printf("\n");  // keep the checksums observable
+    }
+    return 0;
+}
@@ -0,0 +1,141 @@
+// prealloc_bench - effect of extent preallocation on writing files the way
+// parallel installs do (several files growing at once in small writes) and
+// on reading them back afterwards. Run it on the filesystem in question,
+// e.g. the ext4 data partition.
+
+#include "flash/fd.hpp"
+#include "flash/logger.hpp"
+#include "flash/partition_writer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+namespace {
+
+void PrintUsage(const char* argv0) {
+    flash::LogError("Usage: %s [-n <files>] [-s <MiB per file>] [-c <KiB per write>] <directory>", argv0);
+}
+
+double Seconds(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// Number of extents backing `fd`, -1 if the filesystem cannot tell.
+long Extents(int fd) {
+    fiemap fm{};
+    fm.fm_length = FIEMAP_MAX_OFFSET;
+    fm.fm_flags = FIEMAP_FLAG_SYNC;
+    if (::ioctl(fd, FS_IOC_FIEMAP, &fm) != 0) return -1;
+    return static_cast<long>(fm.fm_mapped_extents);
+}
+
+struct Run {
+    double write_secs = 0;
+    double read_secs = 0;
+    long extents = 0;
+};
+
+// Writes `files` files round-robin in `chunk`-byte pieces, flushes them and
+// drops them from the page cache, then reads each back sequentially.
+bool Measure(const std::string& dir, unsigned files, std::uint64_t size, std::size_t chunk, bool preallocate,
+             Run& out) {
+    std::vector<std::uint8_t> buf(chunk);
+    for (std::size_t i = 0; i < chunk; ++i) buf[i] = static_cast<std::uint8_t>(i * 2654435761u >> 13);
+
+    std::vector<flash::PartitionWriter> writers(files);
+    std::vector<std::string> paths;
+    auto t0 = std::chrono::steady_clock::now();
+    for (unsigned f = 0; f < files; ++f) {
+        paths.push_back(dir + "/f" + std::to_string(f));
+        flash::PartitionWriter::Options opt;
+        opt.sync = false;
+        opt.preallocate_bytes = preallocate ? size : 0;
+        auto r = flash::PartitionWriter::Open(paths.back(), opt, writers[f]);
+        if (!r.is_ok()) {
+            flash::LogError("%s", r.msg.c_str());
+            return false;
+        }
+    }
+    for (std::uint64_t done = 0; done < size; done += chunk) {
+        const std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(chunk, size - done));
+        for (auto& w : writers) {
+            auto r = w.WriteAll({buf.data(), n});
+            if (!r.is_ok()) {
+                flash::LogError("write: %s", r.msg.c_str());
+                return false;
+            }
+        }
+    }
+    writers.clear();
+    ::sync();
+    out.write_secs = Seconds(t0);
+
+    out.extents = 0;
+    for (const auto& p : paths) {
+        flash::Fd fd(::open(p.c_str(), O_RDONLY | O_CLOEXEC));
+        if (!fd.Valid()) return false;
+        const long e = Extents(fd.Get());
+        out.extents = (e < 0 || out.extents < 0) ? -1 : out.extents + e;
+        ::posix_fadvise(fd.Get(), 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+    t0 = std::chrono::steady_clock::now();
+    std::vector<std::uint8_t> rbuf(1024 * 1024);
+    for (const auto& p : paths) {
+        flash::Fd fd(::open(p.c_str(), O_RDONLY | O_CLOEXEC));
+        if (!fd.Valid()) return false;
+        while (::read(fd.Get(), rbuf.data(), rbuf.size()) > 0) {
+        }
+    }
+    out.read_secs = Seconds(t0);
+
+    for (const auto& p : paths) ::unlink(p.c_str());
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    unsigned files = 4;
+    std::uint64_t size_mib = 256;
+    std::size_t chunk_kib = 64;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:s:c:h")) != -1) {
+        switch (c) {
+            case 'n': files = static_cast<unsigned>(std::strtoul(optarg, nullptr, 10)); break;
+            case 's': size_mib = std::strtoull(optarg, nullptr, 10); break;
+            case 'c': chunk_kib = static_cast<std::size_t>(std::strtoul(optarg, nullptr, 10)); break;
+            default: PrintUsage(argv[0]); return 2;
+        }
+    }
+    if (optind != argc - 1 || files == 0 || size_mib == 0 || chunk_kib == 0) {
+        PrintUsage(argv[0]);
+        return 2;
+    }
+    const std::string dir = argv[optind];
+    const std::uint64_t size = size_mib * 1024 * 1024;
+    const double total_mib = static_cast<double>(files) * static_cast<double>(size_mib);
+
+    std::printf("%u files x %llu MiB, %zu KiB writes, interleaved\n", files,
+                static_cast<unsigned long long>(size_mib), chunk_kib);
+    for (bool prealloc : {false, true}) {
+        Run run;
+        if (!Measure(dir, files, size, chunk_kib * 1024, prealloc, run)) return 1;
+        std::printf("%-12s write %8.1f MiB/s   read %8.1f MiB/s   extents %ld\n",
+                    prealloc ? "preallocate" : "append", total_mib / run.write_secs, total_mib / run.read_secs,
+                    run.extents);
+    }
+    return 0;
+}